@@ -0,0 +1,621 @@
+
+/**
+* bench_database.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Database service benchmark over the simulated serial flash.
+*
+* Drives database_service_core through eKey, session and preference
+* workloads and reports, per operation, the flash transactions and bytes,
+* the erases and the time the real device would have spent (the simulator
+* models the SPI clock and the program and erase latencies).  Operations
+* per second are from the device time.  The background task runs after
+* every operation with the simulated clock advanced by the management
+* thread period.  Records are read back and checked, so a failure exits
+* with a non-zero status.  Lookups through the block index are compared
+* with the scan of every block header that find_block used to do.  The wear
+* test rewrites a few eKeys for years of use and checks the erase count
+* spread and that the background task goes quiet afterwards.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <aef/embedded/service/database/database_service.h>
+#include "database_service_core.h"
+#include "database_core/serial_flash.h"
+#include "host_system.h"
+
+#define BENCH_EKEYS					64		// eKey records
+#define BENCH_SESSIONS				4		// Session headers
+#define BENCH_PREFERENCES			8		// User preference records
+#define BENCH_UPDATES				8		// Updates of each record per round
+#define BENCH_TASK_PERIOD			100		// Management thread period (ms)
+#define BENCH_POWER_LOSSES			16		// Power loss points tried
+#define BENCH_HOT_EKEYS				8		// eKeys rewritten by the wear test
+#define BENCH_WEAR_DAYS				(3 * 365)	// Days simulated by the wear test
+#define BENCH_WEAR_DAILY			50		// Updates per day in the wear test
+#define BENCH_IDLE_TICKS			1000	// Task passes with no writes after the wear test
+
+/**
+* Benchmark measurement
+*/
+typedef struct _bench_mark_def
+{
+	uint64_t	device_us;					// Simulated device time at the start
+	uint64_t	host_ns;					// Host time at the start
+} bench_mark_t;
+
+static service_ctx_t bench_db = { "DATABASE", 0, SERVICE_UNINITIALIZED, NULL, NULL };
+static uint32_t bench_failures = 0;
+
+/**
+* Check a condition and count a failure.
+*
+* \param    ok			Condition
+* \param	what		Description of the check
+*
+* \returns  None
+*/
+static void bench_check ( bool ok, const char* what )
+{
+	if ( ! ok )
+	{
+		printf ( "  FAILED: %s\n", what );
+		bench_failures++;
+	}
+}
+
+/**
+* Send a command to the database service.
+*
+* \returns  Service status.
+*/
+static service_status_t bench_ioctl ( uint32_t code, void* input, uint32_t input_size, void* output, uint32_t output_size )
+{
+	uint32_t bytes;
+
+	return database_core_ioctl ( &bench_db, code, input, input_size, output, output_size, &bytes );
+}
+
+/**
+* Run the background task as the management thread would after an operation.
+*
+* \param    None
+*
+* \returns  None
+*/
+static void bench_tick ( void )
+{
+	host_clock_advance ( BENCH_TASK_PERIOD );
+	host_system_management_run ();
+}
+
+/**
+* Build the key of a record.
+*
+* \param    uuid		Pointer to storage for the key
+* \param	type		Record type
+* \param	id			Record number
+*
+* \returns  None
+*/
+static void bench_uuid ( uint8_t* uuid, uint8_t type, uint32_t id )
+{
+	memset ( uuid, 0, DATABASE_UUID_SIZE );
+	uuid[0] = type;
+	memcpy ( &uuid[1], &id, sizeof(id) );
+	uuid[DATABASE_UUID_SIZE - 1] = 0xA5;
+}
+
+/**
+* Build a record.
+* The body is filled from the key and a version, so a read back can be checked.
+*
+* \param    record		Pointer to storage for the record
+* \param	size		Size of the record
+* \param	type		Record type
+* \param	id			Record number
+* \param	version		Version of the record contents
+*
+* \returns  None
+*/
+static void bench_record ( uint8_t* record, uint32_t size, uint8_t type, uint32_t id, uint32_t version )
+{
+	EntryHeader_t* header = (EntryHeader_t*)record;
+
+	memset ( record, 0xFF, sizeof(EntryHeader_t) );
+	bench_uuid ( header->block_entry.UUID, type, id );
+	header->block_entry.fillInd    = 0x00;
+	header->block_entry.recordType = type;
+	header->block_entry.uuidSize   = DATABASE_UUID_SIZE;
+	header->encBytes               = size;
+
+	for ( uint32_t index = sizeof(EntryHeader_t); index < size; index++ )
+		record[index] = (uint8_t)( id * 31 + version * 7 + index );
+}
+
+/**
+* Size of a record of a type.
+*
+* \param    type		Record type
+*
+* \returns  Record size.
+*/
+static uint32_t bench_record_size ( uint8_t type )
+{
+	switch ( type )
+	{
+		case RecordTypeSessionHeader:	return sizeof(SessionHeader_t);
+		case RecordTypeUserPreferences:	return sizeof(UserPreferences_t);
+		default:						return sizeof(EKeyEntry_t);
+	}
+}
+
+/**
+* Read a record back and compare it with what was written.
+*
+* \param    type		Record type
+* \param	id			Record number
+* \param	version		Version of the record contents expected
+*
+* \returns  true if the record matches.
+*/
+static bool bench_verify ( uint8_t type, uint32_t id, uint32_t version )
+{
+	uint8_t  expected[DATABASE_MAX_RECORD_SIZE];
+	uint8_t  record[DATABASE_MAX_RECORD_SIZE];
+	uint8_t  uuid[DATABASE_UUID_SIZE];
+	uint32_t size = bench_record_size ( type );
+
+	bench_uuid ( uuid, type, id );
+	bench_record ( expected, size, type, id, version );
+	memset ( record, 0, sizeof(record) );
+	if ( bench_ioctl ( IOCTL_DATABASE_READ_RECORD, uuid, sizeof(uuid), record, size ) != SERVICE_STATUS_SUCCESS )
+		return false;
+
+	return memcmp ( &record[sizeof(EntryHeader_t)], &expected[sizeof(EntryHeader_t)], size - sizeof(EntryHeader_t) ) == 0;
+}
+
+/**
+* Write or update a record.
+*
+* \returns  Service status.
+*/
+static service_status_t bench_store ( uint32_t code, uint8_t type, uint32_t id, uint32_t version )
+{
+	uint8_t  record[DATABASE_MAX_RECORD_SIZE];
+	uint32_t size = bench_record_size ( type );
+
+	bench_record ( record, size, type, id, version );
+	return bench_ioctl ( code, record, size, NULL, 0 );
+}
+
+/**
+* Get the database statistics.
+*
+* \param    statistics	Pointer to storage for the statistics
+*
+* \returns  None
+*/
+static void bench_statistics ( database_statistics_t* statistics )
+{
+	memset ( statistics, 0, sizeof(database_statistics_t) );
+	bench_ioctl ( IOCTL_DATABASE_GET_STATISTICS, NULL, 0, statistics, sizeof(database_statistics_t) );
+}
+
+/**
+* Start a measurement.
+*
+* \param    mark		Pointer to the measurement
+*
+* \returns  None
+*/
+static void bench_begin ( bench_mark_t* mark )
+{
+	bench_ioctl ( IOCTL_DATABASE_RESET_STATISTICS, NULL, 0, NULL, 0 );
+	mark->device_us = serial_flash_sim_get_elapsed_us ();
+	mark->host_ns   = host_time_ns ();
+}
+
+/**
+* End a measurement and print it.
+*
+* \param    name		Workload name
+* \param	ops			Operations run
+* \param	mark		Pointer to the measurement
+*
+* \returns  None
+*/
+static void bench_report ( const char* name, uint32_t ops, const bench_mark_t* mark )
+{
+	database_statistics_t statistics;
+	uint64_t device_us = serial_flash_sim_get_elapsed_us () - mark->device_us;
+	uint64_t host_ns   = host_time_ns () - mark->host_ns;
+	char	 rate[16] = "-";
+
+	/*
+	 * Operations that never reach the device have no rate
+	 */
+	if ( device_us != 0 )
+		snprintf ( rate, sizeof(rate), "%.0f", (double)ops * 1e6 / (double)device_us );
+
+	bench_statistics ( &statistics );
+	printf ( "  %-24s %6u ops %9s ops/s %7.2f reads %8.1f rd B %8.1f wr B %6.3f erases %8.2f host us  (per op)\n",
+			 name, ops, rate,
+			 (double)statistics.flash_reads / ops,
+			 (double)statistics.flash_read_bytes / ops,
+			 (double)statistics.flash_program_bytes / ops,
+			 (double)statistics.flash_erases / ops,
+			 (double)host_ns / 1000.0 / ops );
+}
+
+/**
+* Stop and start the service, as after a reset.
+*
+* \returns  Service status of the start.
+*/
+static service_status_t bench_restart ( void )
+{
+	bench_ioctl ( IOCTL_SERVICE_STOP, NULL, 0, NULL, 0 );
+	return bench_ioctl ( IOCTL_SERVICE_START, NULL, 0, NULL, 0 );
+}
+
+/**
+* eKey, session and preference workloads.
+*
+* \param    None
+*
+* \returns  None
+*/
+static void bench_workloads ( void )
+{
+	bench_mark_t mark;
+	uint32_t	 ops;
+	bool		 ok;
+
+	printf ( "workloads\n" );
+
+	bench_begin ( &mark );
+	ok = true;
+	for ( uint32_t id = 0; id < BENCH_EKEYS; id++ )
+	{
+		ok &= bench_store ( IOCTL_DATABASE_WRITE_RECORD, RecordTypeEKeyEntry, id, 0 ) == SERVICE_STATUS_SUCCESS;
+		bench_tick ();
+	}
+	bench_report ( "ekey write", BENCH_EKEYS, &mark );
+	bench_check ( ok, "ekey write" );
+
+	bench_begin ( &mark );
+	ok = true;
+	for ( uint32_t id = 0; id < BENCH_EKEYS; id++ )
+		ok &= bench_verify ( RecordTypeEKeyEntry, id, 0 );
+	bench_report ( "ekey read", BENCH_EKEYS, &mark );
+	bench_check ( ok, "ekey read" );
+
+	bench_begin ( &mark );
+	ok = true;
+	for ( uint32_t id = 0; id < BENCH_EKEYS; id++ )
+	{
+		ok &= bench_store ( IOCTL_DATABASE_UPDATE_RECORD, RecordTypeEKeyEntry, id, 1 ) == SERVICE_STATUS_SUCCESS;
+		bench_tick ();
+	}
+	bench_report ( "ekey update", BENCH_EKEYS, &mark );
+	bench_check ( ok, "ekey update" );
+
+	bench_begin ( &mark );
+	ok  = true;
+	ops = 0;
+	for ( uint32_t id = 0; id < BENCH_SESSIONS; id++, ops++ )
+		ok &= bench_store ( IOCTL_DATABASE_WRITE_RECORD, RecordTypeSessionHeader, id, 0 ) == SERVICE_STATUS_SUCCESS;
+	for ( uint32_t version = 1; version <= BENCH_UPDATES; version++ )
+	{
+		for ( uint32_t id = 0; id < BENCH_SESSIONS; id++, ops++ )
+			ok &= bench_store ( IOCTL_DATABASE_UPDATE_RECORD, RecordTypeSessionHeader, id, version ) == SERVICE_STATUS_SUCCESS;
+		bench_tick ();
+	}
+	ok &= bench_ioctl ( IOCTL_DATABASE_SYNC, NULL, 0, NULL, 0 ) == SERVICE_STATUS_SUCCESS;
+	bench_report ( "session write/update", ops, &mark );
+	bench_check ( ok, "session write/update" );
+
+	bench_begin ( &mark );
+	ok  = true;
+	ops = 0;
+	for ( uint32_t id = 0; id < BENCH_PREFERENCES; id++, ops++ )
+		ok &= bench_store ( IOCTL_DATABASE_WRITE_RECORD, RecordTypeUserPreferences, id, 0 ) == SERVICE_STATUS_SUCCESS;
+	for ( uint32_t version = 1; version <= BENCH_UPDATES; version++ )
+	{
+		for ( uint32_t id = 0; id < BENCH_PREFERENCES; id++, ops++ )
+			ok &= bench_store ( IOCTL_DATABASE_UPDATE_RECORD, RecordTypeUserPreferences, id, version ) == SERVICE_STATUS_SUCCESS;
+		bench_tick ();
+	}
+	ok &= bench_ioctl ( IOCTL_DATABASE_SYNC, NULL, 0, NULL, 0 ) == SERVICE_STATUS_SUCCESS;
+	bench_report ( "preference write/update", ops, &mark );
+	bench_check ( ok, "preference write/update" );
+
+	bench_begin ( &mark );
+	ok = true;
+	for ( uint32_t id = 0; id < BENCH_SESSIONS; id++ )
+		ok &= bench_verify ( RecordTypeSessionHeader, id, BENCH_UPDATES );
+	for ( uint32_t id = 0; id < BENCH_PREFERENCES; id++ )
+		ok &= bench_verify ( RecordTypeUserPreferences, id, BENCH_UPDATES );
+	bench_report ( "session/preference read", BENCH_SESSIONS + BENCH_PREFERENCES, &mark );
+	bench_check ( ok, "session/preference read" );
+
+	bench_begin ( &mark );
+	ok = bench_restart () == SERVICE_STATUS_SUCCESS;
+	bench_report ( "restart", 1, &mark );
+	bench_check ( ok, "restart" );
+
+	ok = true;
+	for ( uint32_t id = 0; id < BENCH_EKEYS; id++ )
+		ok &= bench_verify ( RecordTypeEKeyEntry, id, 1 );
+	for ( uint32_t id = 0; id < BENCH_PREFERENCES; id++ )
+		ok &= bench_verify ( RecordTypeUserPreferences, id, BENCH_UPDATES );
+	bench_check ( ok, "records after restart" );
+}
+
+/**
+* Find a record by reading the header of every block in turn, as find_block
+* did before the block index.
+*
+* \param    uuid		Key of the record
+*
+* \returns  true if the record was found.
+*/
+static bool bench_scan ( const uint8_t* uuid )
+{
+	BlockEntry_t entry;
+
+	for ( uint32_t addr = 0; addr < SERIAL_FLASH_SIM_SIZE; addr += DATABASE_MAX_RECORD_SIZE )
+	{
+		serial_flash_read_data ( addr, sizeof(entry), (uint8_t*)&entry );
+		if ( entry.fillInd == 0x00 && entry.deleteInd == 0xFF && memcmp ( entry.UUID, uuid, DATABASE_UUID_SIZE ) == 0 )
+			return true;
+	}
+	return false;
+}
+
+/**
+* Lookups through the block index against a scan of the block headers.
+* A lookup through the index reads nothing but the record itself, a miss
+* reads nothing at all.
+*
+* \param    None
+*
+* \returns  None
+*/
+static void bench_lookup ( void )
+{
+	bench_mark_t mark;
+	uint8_t		 record[DATABASE_MAX_RECORD_SIZE];
+	uint8_t		 uuid[DATABASE_UUID_SIZE];
+	uint32_t	 found;
+
+	printf ( "lookup\n" );
+
+	bench_begin ( &mark );
+	found = 0;
+	for ( uint32_t id = 0; id < BENCH_EKEYS; id++ )
+	{
+		bench_uuid ( uuid, RecordTypeEKeyEntry, id );
+		if ( bench_ioctl ( IOCTL_DATABASE_READ_RECORD, uuid, sizeof(uuid), record, sizeof(EKeyEntry_t) ) == SERVICE_STATUS_SUCCESS )
+			found++;
+	}
+	bench_report ( "hit, index", BENCH_EKEYS, &mark );
+	bench_check ( found == BENCH_EKEYS, "index hits" );
+
+	bench_begin ( &mark );
+	found = 0;
+	for ( uint32_t id = 0; id < BENCH_EKEYS; id++ )
+	{
+		bench_uuid ( uuid, RecordTypeEKeyEntry, BENCH_EKEYS + id );
+		if ( bench_ioctl ( IOCTL_DATABASE_READ_RECORD, uuid, sizeof(uuid), record, sizeof(EKeyEntry_t) ) == SERVICE_STATUS_SUCCESS )
+			found++;
+	}
+	bench_report ( "miss, index", BENCH_EKEYS, &mark );
+	bench_check ( found == 0, "index misses" );
+
+	bench_begin ( &mark );
+	found = 0;
+	for ( uint32_t id = 0; id < BENCH_EKEYS; id++ )
+	{
+		bench_uuid ( uuid, RecordTypeEKeyEntry, id );
+		if ( bench_scan ( uuid ) )
+			found++;
+	}
+	bench_report ( "hit, header scan", BENCH_EKEYS, &mark );
+	bench_check ( found == BENCH_EKEYS, "scan hits" );
+
+	bench_begin ( &mark );
+	for ( uint32_t id = 0; id < BENCH_EKEYS; id++ )
+	{
+		bench_uuid ( uuid, RecordTypeEKeyEntry, BENCH_EKEYS + id );
+		bench_scan ( uuid );
+	}
+	bench_report ( "miss, header scan", BENCH_EKEYS, &mark );
+}
+
+/**
+* Read throughput of a full cursor scan and of the index rebuild.
+* Build with SPI_SERIAL_FLASH_READ_AHEAD set to compare with the read-ahead
+* buffer enabled.
+*
+* \param    None
+*
+* \returns  None
+*/
+static void bench_read ( void )
+{
+	database_cursor_fetch_t fetch;
+	database_statistics_t statistics;
+	bench_mark_t mark;
+	uint8_t		 records[4 * DATABASE_MAX_RECORD_SIZE];
+	uint8_t		 type = RecordTypeInvalid;
+	uint32_t	 bytes;
+	uint32_t	 total = 0;
+	uint64_t	 device_us;
+
+	printf ( "read (read-ahead %u bytes, fast read %s)\n", SPI_SERIAL_FLASH_READ_AHEAD,
+			 ( SPI_SERIAL_FLASH_FAST_READ_ENABLE ) ? "on" : "off" );
+
+	bench_begin ( &mark );
+	bench_check ( database_core_ioctl ( &bench_db, IOCTL_DATABASE_OPEN_CURSOR, &type, sizeof(type),
+										&fetch.cursor, sizeof(fetch.cursor), &bytes ) == SERVICE_STATUS_SUCCESS, "open cursor" );
+	fetch.count = 4;
+	do
+	{
+		bytes = 0;
+		database_core_ioctl ( &bench_db, IOCTL_DATABASE_FETCH_CURSOR, &fetch, sizeof(fetch), records, sizeof(records), &bytes );
+		total += bytes;
+	} while ( bytes != 0 );
+	bench_ioctl ( IOCTL_DATABASE_CLOSE_CURSOR, &fetch.cursor, sizeof(fetch.cursor), NULL, 0 );
+
+	device_us = serial_flash_sim_get_elapsed_us () - mark.device_us;
+	bench_statistics ( &statistics );
+	printf ( "  %-24s %6u B %9.1f KB/s %6u reads %6u read-ahead hits %6u fills\n", "cursor scan", total,
+			 ( device_us != 0 ) ? (double)total * 1e6 / 1024.0 / (double)device_us : 0.0,
+			 statistics.flash_reads, statistics.flash_read_ahead_hits, statistics.flash_read_ahead_fills );
+	bench_check ( total != 0, "cursor scan" );
+
+	bench_begin ( &mark );
+	bench_check ( bench_restart () == SERVICE_STATUS_SUCCESS, "restart" );
+	device_us = serial_flash_sim_get_elapsed_us () - mark.device_us;
+	bench_statistics ( &statistics );
+	printf ( "  %-24s %6.1f ms %9.1f KB/s %6u reads %6u read-ahead hits %6u fills\n", "index rebuild",
+			 (double)device_us / 1000.0,
+			 ( device_us != 0 ) ? (double)statistics.flash_read_bytes * 1e6 / 1024.0 / (double)device_us : 0.0,
+			 statistics.flash_reads, statistics.flash_read_ahead_hits, statistics.flash_read_ahead_fills );
+}
+
+/**
+* Years of updates to a few hot eKeys while the rest stay cold.
+* The erase counts must stay within the wear leveling threshold and the
+* background task must go quiet once the writes stop.
+*
+* \param    None
+*
+* \returns  None
+*/
+static void bench_wear ( void )
+{
+	database_statistics_t before;
+	database_statistics_t after;
+	database_statistics_t idle;
+	bench_mark_t mark;
+	uint32_t	 updates = BENCH_WEAR_DAYS * BENCH_WEAR_DAILY;
+	bool		 ok = true;
+
+	printf ( "wear (%u days, %u updates)\n", BENCH_WEAR_DAYS, updates );
+
+	bench_begin ( &mark );
+	bench_statistics ( &before );
+	for ( uint32_t update = 0; update < updates; update++ )
+	{
+		ok &= bench_store ( IOCTL_DATABASE_UPDATE_RECORD, RecordTypeEKeyEntry, update % BENCH_HOT_EKEYS, 3 + update / BENCH_HOT_EKEYS ) == SERVICE_STATUS_SUCCESS;
+		bench_tick ();
+	}
+	bench_statistics ( &after );
+	bench_report ( "hot ekey update", updates, &mark );
+	printf ( "  erases per sector min %u max %u total %u, %u sectors compacted, %u wear levelings\n",
+			 after.wear_min_erases, after.wear_max_erases, after.wear_total_erases,
+			 after.gc_compactions - before.gc_compactions, after.wear_levelings );
+	bench_check ( ok, "hot ekey update" );
+	bench_check ( after.wear_max_erases - after.wear_min_erases <= DATABASE_WEAR_LEVEL_THRESHOLD + DATABASE_WEAR_LEVEL_HYSTERESIS, "erase count spread" );
+
+	/*
+	 * Let a compaction in progress finish, then nothing more may run
+	 */
+	for ( uint32_t tick = 0; tick < BENCH_IDLE_TICKS; tick++ )
+		bench_tick ();
+	bench_statistics ( &idle );
+	for ( uint32_t tick = 0; tick < BENCH_IDLE_TICKS; tick++ )
+		bench_tick ();
+	bench_statistics ( &after );
+	printf ( "  idle: %u sectors compacted, %u erases\n", after.gc_compactions - idle.gc_compactions, after.flash_erases - idle.flash_erases );
+	bench_check ( after.gc_compactions == idle.gc_compactions && after.flash_erases == idle.flash_erases, "background task quiet when idle" );
+
+	ok = true;
+	for ( uint32_t id = 0; id < BENCH_EKEYS; id++ )
+		ok &= bench_verify ( RecordTypeEKeyEntry, id, ( id < BENCH_HOT_EKEYS ) ? 3 + ( updates - 1 - id ) / BENCH_HOT_EKEYS : 1 );
+	bench_check ( ok, "records after wear test" );
+}
+
+/**
+* Cut the power part way through eKey updates.
+* After the restart every record must read back whole, either the old or the
+* new version of the record being written.
+*
+* \param    None
+*
+* \returns  None
+*/
+static void bench_power_loss ( void )
+{
+	uint32_t survived = 0;
+	uint32_t updated  = 0;
+
+	printf ( "power loss\n" );
+
+	for ( uint32_t point = 0; point < BENCH_POWER_LOSSES; point++ )
+	{
+		uint32_t id = point % BENCH_EKEYS;
+		bool	 ok = true;
+
+		/*
+		 * Spread the cut over the header, the body and the commit of the
+		 * record, the last points fall after the update is complete
+		 */
+		serial_flash_sim_power_loss ( 1 + ( point * 11 ) % ( sizeof(EKeyEntry_t) + 16 ) );
+		bench_store ( IOCTL_DATABASE_UPDATE_RECORD, RecordTypeEKeyEntry, id, 2 );
+		serial_flash_sim_power_loss ( 0 );
+		serial_flash_sim_power_cycle ();
+		ok &= bench_restart () == SERVICE_STATUS_SUCCESS;
+
+		for ( uint32_t other = 0; other < BENCH_EKEYS; other++ )
+		{
+			if ( other == id && bench_verify ( RecordTypeEKeyEntry, other, 2 ) )
+				updated++;
+			else if ( other == id )
+				ok &= bench_verify ( RecordTypeEKeyEntry, other, 1 );
+			else
+				ok &= bench_verify ( RecordTypeEKeyEntry, other, 1 );
+		}
+
+		/*
+		 * Put the record back to the version the others have
+		 */
+		ok &= bench_store ( IOCTL_DATABASE_UPDATE_RECORD, RecordTypeEKeyEntry, id, 1 ) == SERVICE_STATUS_SUCCESS;
+		bench_tick ();
+		if ( ok )
+			survived++;
+	}
+	printf ( "  %u of %u power losses recovered, %u kept the update\n", survived, BENCH_POWER_LOSSES, updated );
+	bench_check ( survived == BENCH_POWER_LOSSES, "power loss recovery" );
+}
+
+int main ( void )
+{
+	bench_check ( database_core_init ( &bench_db ) == SERVICE_STATUS_SUCCESS, "init" );
+	bench_check ( bench_ioctl ( IOCTL_SERVICE_START, NULL, 0, NULL, 0 ) == SERVICE_STATUS_SUCCESS, "start" );
+	bench_check ( bench_ioctl ( IOCTL_DATABASE_FORMAT, NULL, 0, NULL, 0 ) == SERVICE_STATUS_SUCCESS, "format" );
+	if ( bench_failures != 0 )
+		return 1;
+
+	bench_workloads ();
+	bench_lookup ();
+	bench_read ();
+	bench_power_loss ();
+	bench_wear ();
+
+	bench_ioctl ( IOCTL_SERVICE_STOP, NULL, 0, NULL, 0 );
+	database_core_deinit ( &bench_db );
+
+	printf ( ( bench_failures == 0 ) ? "PASS\n" : "FAIL (%u)\n", bench_failures );
+	return ( bench_failures == 0 ) ? 0 : 1;
+}
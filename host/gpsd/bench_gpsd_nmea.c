@@ -0,0 +1,349 @@
+
+/**
+* bench_gpsd_nmea.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  NMEA0183 tokenizer benchmark.
+*
+* Runs a log of GGA and RMC sentences, as a receiver outputs them along a
+* drive, through the one pass tokenizer and through the GetField rescan the
+* GPSD core used before, and reports the sentences per second of each.
+* Both read the same fields, the tokenizer also checks the checksum.  The
+* fixes are then decoded into integer units and, as before, with atof into
+* doubles, and the positions of the two are checked to agree to 1e-7
+* degrees.  On target the double path runs in soft float, so the host
+* times understate the gap.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <aef/embedded/service/gpsd/gpsd_service.h>
+#include "gpsd_nmea.h"
+#include "host_system.h"
+
+#define BENCH_FIXES					1000	// Fixes in the log, one GGA and one RMC sentence each
+#define BENCH_ROUNDS				50		// Passes over the log
+
+static char bench_log[BENCH_FIXES * 2][NMEA_MAX_SENTENCE + 1];
+static uint32_t bench_length[BENCH_FIXES * 2];
+
+/**
+* Build a sentence with its checksum and line ending.
+*
+* \param    sentence	Pointer to storage for the sentence, NMEA_MAX_SENTENCE + 1 bytes
+* \param	body		Pointer to the characters between '$' and '*'
+*
+* \returns  Size of the sentence.
+*/
+static uint32_t bench_sentence ( char* sentence, const char* body )
+{
+	uint8_t checksum = 0;
+
+	for ( const char* c = body; *c != '\0'; c++ )
+		checksum ^= (uint8_t)*c;
+	return (uint32_t)snprintf ( sentence, NMEA_MAX_SENTENCE + 1, "$%s*%02X\r\n", body, checksum );
+}
+
+/**
+* Build the log, one fix a second heading north east from 48N 11E.
+*
+* \returns  None
+*/
+static void bench_build_log ( void )
+{
+	char body[NMEA_MAX_SENTENCE];
+
+	for ( uint32_t fix = 0; fix < BENCH_FIXES; fix++ )
+	{
+		uint32_t seconds = 12 * 3600 + fix;
+		uint32_t hhmmss  = ( seconds / 3600 ) * 10000 + ( seconds / 60 % 60 ) * 100 + seconds % 60;
+		uint32_t north   = 7038 + fix * 3;			// Minutes of latitude past 48 degrees, 1e-3
+		uint32_t east    = 31000 + fix * 4;			// Minutes of longitude past 11 degrees, 1e-3
+
+		snprintf ( body, sizeof(body), "GPGGA,%06u.00,48%02u.%03u,N,011%02u.%03u,E,1,%02u,0.9,%u.%u,M,46.9,M,,",
+				   hhmmss, north / 1000, north % 1000, east / 1000, east % 1000, 6 + fix % 6, 545 + fix % 20, fix % 10 );
+		bench_length[fix * 2] = bench_sentence ( bench_log[fix * 2], body );
+
+		snprintf ( body, sizeof(body), "GPRMC,%06u.00,A,48%02u.%03u,N,011%02u.%03u,E,%03u.%u,045.%u,230394,003.1,W",
+				   hhmmss, north / 1000, north % 1000, east / 1000, east % 1000, 20 + fix % 5, fix % 10, fix % 10 );
+		bench_length[fix * 2 + 1] = bench_sentence ( bench_log[fix * 2 + 1], body );
+	}
+}
+
+/**
+* Copy a field of a sentence, as the GPSD core did before the tokenizer.
+* Every call scans the sentence from its start.
+*
+* \param    pData		Pointer to the sentence
+* \param	pField		Pointer to storage for the field
+* \param	nFieldNum	Field number
+* \param	nMaxFieldLen	Size of the field storage
+*
+* \returns  true if the field is not empty.
+*/
+static bool GetField ( const uint8_t *pData, uint8_t *pField, int nFieldNum, int nMaxFieldLen )
+{
+	int i  = 0;
+	int i2 = 0;
+	int nField = 0;
+
+	if ( pData == NULL || pField == NULL || nMaxFieldLen <= 0 )
+		return false;
+
+	while ( nField != nFieldNum && pData[i] )
+	{
+		if ( pData[i] == ',' )
+			nField++;
+		i++;
+		if ( pData[i] == '\0' )
+		{
+			pField[0] = '\0';
+			return false;
+		}
+	}
+
+	if ( pData[i] == ',' || pData[i] == '*' )
+	{
+		pField[0] = '\0';
+		return false;
+	}
+
+	while ( pData[i] != ',' && pData[i] != '*' && pData[i] )
+	{
+		pField[i2] = pData[i];
+		i2++; i++;
+		if ( i2 >= nMaxFieldLen )
+		{
+			i2 = nMaxFieldLen - 1;
+			break;
+		}
+	}
+	pField[i2] = '\0';
+	return true;
+}
+
+/**
+* Fields read from each sentence, by sentence type
+*/
+static const uint32_t bench_gga_fields[] = { 6, 1, 2, 3, 4, 5, 9, 7 };
+static const uint32_t bench_rmc_fields[] = { 2, 1, 7, 8 };
+
+/**
+* Read the fields of the log with the tokenizer.
+*
+* \returns  Fields read.
+*/
+static uint32_t bench_tokenizer ( void )
+{
+	nmea_sentence_t tokens;
+	uint32_t fields = 0;
+
+	for ( uint32_t index = 0; index < BENCH_FIXES * 2; index++ )
+	{
+		if ( ! nmea_tokenize ( bench_log[index], bench_length[index], &tokens ) )
+			continue;
+
+		if ( nmea_is_sentence ( &tokens, "GPGGA" ) )
+		{
+			for ( uint32_t field = 0; field < sizeof(bench_gga_fields) / sizeof(bench_gga_fields[0]); field++ )
+				fields += ( tokens.field[bench_gga_fields[field]].length != 0 );
+		}
+		else if ( nmea_is_sentence ( &tokens, "GPRMC" ) )
+		{
+			for ( uint32_t field = 0; field < sizeof(bench_rmc_fields) / sizeof(bench_rmc_fields[0]); field++ )
+				fields += ( tokens.field[bench_rmc_fields[field]].length != 0 );
+		}
+	}
+	return fields;
+}
+
+/**
+* Read the fields of the log with GetField.
+*
+* \returns  Fields read.
+*/
+static uint32_t bench_getfield ( void )
+{
+	uint8_t  data[32];
+	uint32_t fields = 0;
+
+	for ( uint32_t index = 0; index < BENCH_FIXES * 2; index++ )
+	{
+		const uint8_t* sentence = (const uint8_t*)bench_log[index];
+
+		if ( strncmp ( bench_log[index], "$GPGGA", 6 ) == 0 )
+		{
+			for ( uint32_t field = 0; field < sizeof(bench_gga_fields) / sizeof(bench_gga_fields[0]); field++ )
+				fields += GetField ( sentence, data, bench_gga_fields[field], sizeof(data) );
+		}
+		else if ( strncmp ( bench_log[index], "$GPRMC", 6 ) == 0 )
+		{
+			for ( uint32_t field = 0; field < sizeof(bench_rmc_fields) / sizeof(bench_rmc_fields[0]); field++ )
+				fields += GetField ( sentence, data, bench_rmc_fields[field], sizeof(data) );
+		}
+	}
+	return fields;
+}
+
+static gps_fix_int_t bench_fix_int[BENCH_FIXES];
+static gps_fix_t bench_fix_double[BENCH_FIXES];
+
+/**
+* Decode the log into integer fixes, as the GPSD core does.
+*
+* \returns  Fixes decoded.
+*/
+static uint32_t bench_decode_int ( void )
+{
+	nmea_sentence_t tokens;
+	int32_t  knots;
+	uint32_t fixes = 0;
+
+	for ( uint32_t index = 0; index < BENCH_FIXES * 2; index++ )
+	{
+		gps_fix_int_t* fix = &bench_fix_int[index / 2];
+
+		if ( ! nmea_tokenize ( bench_log[index], bench_length[index], &tokens ) )
+			continue;
+
+		if ( nmea_is_sentence ( &tokens, "GPGGA" ) )
+		{
+			fix->mode = ( nmea_field_char ( &tokens, 6 ) == '1' ) ? MODE_2D : MODE_NO_FIX;
+			nmea_field_time ( &tokens, 1, &fix->time );
+			nmea_field_coordinate ( &tokens, 2, &fix->latitude );
+			nmea_field_coordinate ( &tokens, 4, &fix->longitude );
+			nmea_field_fixed ( &tokens, 9, 3, &fix->altitude );
+			nmea_field_fixed ( &tokens, 7, 0, &fix->satellites_used );
+		}
+		else if ( nmea_is_sentence ( &tokens, "GPRMC" ) )
+		{
+			if ( nmea_field_fixed ( &tokens, 7, 3, &knots ) )
+				fix->speed = (int32_t)( ( (int64_t)knots * 1852 + 1800 ) / 3600 );
+			nmea_field_fixed ( &tokens, 8, 2, &fix->track );
+			fixes++;
+		}
+	}
+	return fixes;
+}
+
+/**
+* Decode the log into double fixes with GetField and atof, as the GPSD core
+* did before the integer fix.
+*
+* \returns  Fixes decoded.
+*/
+static uint32_t bench_decode_double ( void )
+{
+	uint8_t  data[32];
+	uint32_t fixes = 0;
+	char	 north = 'N', east = 'E';
+
+	for ( uint32_t index = 0; index < BENCH_FIXES * 2; index++ )
+	{
+		const uint8_t* sentence = (const uint8_t*)bench_log[index];
+		gps_fix_t* fix = &bench_fix_double[index / 2];
+
+		if ( strncmp ( bench_log[index], "$GPGGA", 6 ) == 0 )
+		{
+			GetField ( sentence, data, 6, sizeof(data) );
+			fix->mode = 1 + data[0] - '0';
+			if ( GetField ( sentence, data, 3, sizeof(data) ) )
+				north = data[0];
+			if ( GetField ( sentence, data, 5, sizeof(data) ) )
+				east = data[0];
+			if ( GetField ( sentence, data, 1, sizeof(data) ) )
+				fix->time = atof ( (const char*)data );
+			if ( GetField ( sentence, data, 2, sizeof(data) ) )
+				fix->latitude = atof ( (const char*)data );
+			if ( GetField ( sentence, data, 4, sizeof(data) ) )
+				fix->longitude = atof ( (const char*)data );
+			if ( GetField ( sentence, data, 9, sizeof(data) ) )
+				fix->altitude = atof ( (const char*)data );
+
+			int degrees = (int)( fix->latitude / 100.0 );
+			fix->latitude = degrees + ( fix->latitude - degrees * 100.0 ) / 60.0;
+			degrees = (int)( fix->longitude / 100.0 );
+			fix->longitude = degrees + ( fix->longitude - degrees * 100.0 ) / 60.0;
+			if ( north == 'S' )
+				fix->latitude = -fix->latitude;
+			if ( east == 'W' )
+				fix->longitude = -fix->longitude;
+		}
+		else if ( strncmp ( bench_log[index], "$GPRMC", 6 ) == 0 )
+		{
+			if ( GetField ( sentence, data, 7, sizeof(data) ) )
+				fix->speed = atof ( (const char*)data );
+			if ( GetField ( sentence, data, 8, sizeof(data) ) )
+				fix->track = atof ( (const char*)data );
+			fixes++;
+		}
+	}
+	return fixes;
+}
+
+/**
+* Check the integer fixes against the double fixes.
+*
+* \returns  true if every position agrees to 1e-7 degrees.
+*/
+static bool bench_decode_agree ( void )
+{
+	for ( uint32_t index = 0; index < BENCH_FIXES; index++ )
+	{
+		double latitude  = bench_fix_double[index].latitude * 1e7 - bench_fix_int[index].latitude;
+		double longitude = bench_fix_double[index].longitude * 1e7 - bench_fix_int[index].longitude;
+
+		if ( latitude > 1.0 || latitude < -1.0 || longitude > 1.0 || longitude < -1.0 ||
+			 bench_fix_int[index].mode != bench_fix_double[index].mode ||
+			 bench_fix_int[index].altitude != (int32_t)( bench_fix_double[index].altitude * 1000.0 + 0.5 ) ||
+			 bench_fix_int[index].track != (int32_t)( bench_fix_double[index].track * 100.0 + 0.5 ) )
+			return false;
+	}
+	return true;
+}
+
+/**
+* Time a reader over the log and print its rate.
+*
+* \param    name		Reader name
+* \param	reader		Reader
+*
+* \returns  Fields read in the last pass.
+*/
+static uint32_t bench_run ( const char* name, uint32_t (*reader) ( void ) )
+{
+	uint32_t fields = 0;
+	uint64_t start  = host_time_ns ();
+
+	for ( uint32_t round = 0; round < BENCH_ROUNDS; round++ )
+		fields = reader ();
+
+	uint64_t elapsed = host_time_ns () - start;
+	uint32_t count   = BENCH_FIXES * 2 * BENCH_ROUNDS;
+	printf ( "  %-24s %8u sentences %10.0f sentences/s %8.1f host ns (per sentence)\n",
+			 name, count, (double)count * 1e9 / (double)elapsed, (double)elapsed / count );
+	return fields;
+}
+
+int main ( void )
+{
+	uint32_t expected = BENCH_FIXES * ( sizeof(bench_gga_fields) / sizeof(bench_gga_fields[0]) + sizeof(bench_rmc_fields) / sizeof(bench_rmc_fields[0]) );
+	bool ok;
+
+	bench_build_log ();
+
+	ok  = ( bench_run ( "tokenizer", bench_tokenizer ) == expected );
+	ok &= ( bench_run ( "GetField rescan", bench_getfield ) == expected );
+	ok &= ( bench_run ( "integer decode", bench_decode_int ) == BENCH_FIXES );
+	ok &= ( bench_run ( "atof decode", bench_decode_double ) == BENCH_FIXES );
+	ok &= bench_decode_agree ();
+
+	printf ( ( ok ) ? "PASS\n" : "FAIL\n" );
+	return ( ok ) ? 0 : 1;
+}
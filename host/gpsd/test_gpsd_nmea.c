@@ -0,0 +1,262 @@
+
+/**
+* test_gpsd_nmea.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Tests of the NMEA0183 sentence tokenizer.
+*
+* Sentences are built with their checksum computed here, so a test can
+* change one character and expect the sentence to be rejected.  The integer
+* field readers are checked against values worked out by hand, including
+* the rounding of the last digit kept.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "gpsd_nmea.h"
+#include "host_test.h"
+
+/**
+* Build a sentence with its checksum and line ending.
+*
+* \param    sentence	Pointer to storage for the sentence, NMEA_MAX_SENTENCE + 1 bytes
+* \param	body		Pointer to the characters between '$' and '*'
+*
+* \returns  Size of the sentence.
+*/
+static uint32_t test_sentence ( char* sentence, const char* body )
+{
+	uint8_t checksum = 0;
+
+	for ( const char* c = body; *c != '\0'; c++ )
+		checksum ^= (uint8_t)*c;
+	return (uint32_t)snprintf ( sentence, NMEA_MAX_SENTENCE + 1, "$%s*%02X\r\n", body, checksum );
+}
+
+/**
+* Check a field view against the expected text.
+*
+* \param    tokens		Pointer to the tokenized sentence
+* \param	index		Field number
+* \param	text		Pointer to the expected text
+*
+* \returns  true if the field holds the text.
+*/
+static bool test_field ( const nmea_sentence_t* tokens, uint32_t index, const char* text )
+{
+	return ( index < tokens->count && tokens->field[index].length == strlen ( text ) &&
+			 memcmp ( tokens->sentence + tokens->field[index].offset, text, strlen ( text ) ) == 0 );
+}
+
+/**
+* Well formed sentences are split into their fields.
+*
+* \returns  None
+*/
+static void test_tokenize ( void )
+{
+	const char* gga = "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47\r\n";
+	char sentence[NMEA_MAX_SENTENCE + 1];
+	nmea_sentence_t tokens;
+	uint32_t length;
+
+	test_check ( nmea_tokenize ( gga, strlen ( gga ), &tokens ), "GGA accepted" );
+	test_check ( tokens.count == 15, "GGA field count" );
+	test_check ( nmea_is_sentence ( &tokens, "GPGGA" ), "GGA address" );
+	test_check ( ! nmea_is_sentence ( &tokens, "GPRMC" ), "GGA is not RMC" );
+	test_check ( ! nmea_is_sentence ( &tokens, "GPGG" ), "address prefix does not match" );
+	test_check ( test_field ( &tokens, 1, "123519" ), "GGA time field" );
+	test_check ( test_field ( &tokens, 4, "01131.000" ), "GGA longitude field" );
+	test_check ( test_field ( &tokens, 13, "" ) && test_field ( &tokens, 14, "" ), "GGA empty last fields" );
+	test_check ( nmea_field_char ( &tokens, 3 ) == 'N', "GGA hemisphere" );
+	test_check ( nmea_field_char ( &tokens, 13 ) == 0, "empty field has no character" );
+	test_check ( nmea_field_char ( &tokens, 15 ) == 0, "missing field has no character" );
+
+	/*
+	 * The line ending is optional and the checksum may be lower case
+	 */
+	test_check ( nmea_tokenize ( gga, strlen ( gga ) - 2, &tokens ), "sentence without line ending" );
+	length = test_sentence ( sentence, "GPRMC,123519,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W" );
+	test_check ( strcmp ( sentence + length - 5, "*6A\r\n" ) == 0, "RMC checksum" );
+	sentence[length - 3] = 'a';
+	test_check ( nmea_tokenize ( sentence, length, &tokens ) && tokens.count == 12, "lower case checksum" );
+
+	/*
+	 * Every field up to NMEA_MAX_FIELDS
+	 */
+	char body[NMEA_MAX_SENTENCE];
+	strcpy ( body, "GPXXX" );
+	for ( uint32_t index = 1; index < NMEA_MAX_FIELDS; index++ )
+		strcat ( body, ",1" );
+	length = test_sentence ( sentence, body );
+	test_check ( nmea_tokenize ( sentence, length, &tokens ) && tokens.count == NMEA_MAX_FIELDS, "most fields" );
+}
+
+/**
+* Corrupted and malformed sentences are rejected.
+*
+* \returns  None
+*/
+static void test_reject ( void )
+{
+	char sentence[NMEA_MAX_SENTENCE + 1];
+	char body[NMEA_MAX_SENTENCE];
+	nmea_sentence_t tokens;
+	uint32_t length;
+
+	length = test_sentence ( sentence, "GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,," );
+	test_check ( nmea_tokenize ( sentence, length, &tokens ), "reference sentence" );
+
+	/*
+	 * One character changed anywhere in the checked part, or in the checksum
+	 */
+	sentence[10] = '6';
+	test_check ( ! nmea_tokenize ( sentence, length, &tokens ), "corrupted field" );
+	sentence[10] = '5';
+	sentence[length - 3] ^= 0x01;
+	test_check ( ! nmea_tokenize ( sentence, length, &tokens ), "corrupted checksum" );
+	sentence[length - 3] ^= 0x01;
+	sentence[length - 4] = 'G';
+	test_check ( ! nmea_tokenize ( sentence, length, &tokens ), "checksum not hex" );
+
+	/*
+	 * Missing or cut short checksum, missing start, stray line endings
+	 */
+	test_check ( ! nmea_tokenize ( "$GPGGA,1,2\r\n", 12, &tokens ), "no checksum" );
+	test_check ( ! nmea_tokenize ( "$GPGGA,1,2*4", 12, &tokens ), "checksum cut short" );
+	test_check ( ! nmea_tokenize ( "GPGGA,1,2*00", 12, &tokens ), "no '$'" );
+	test_check ( ! nmea_tokenize ( "$GPGGA,1\r,2*00", 14, &tokens ), "line ending inside the sentence" );
+	test_check ( ! nmea_tokenize ( "$GPGGA,$GPRMC*00", 16, &tokens ), "second '$' inside the sentence" );
+	test_check ( ! nmea_tokenize ( "$", 1, &tokens ), "too short" );
+	test_check ( ! nmea_tokenize ( NULL, 12, &tokens ), "no sentence" );
+
+	/*
+	 * One field more than NMEA_MAX_FIELDS, and a sentence that is too long
+	 */
+	strcpy ( body, "GPXXX" );
+	for ( uint32_t index = 0; index < NMEA_MAX_FIELDS; index++ )
+		strcat ( body, ",1" );
+	length = test_sentence ( sentence, body );
+	test_check ( ! nmea_tokenize ( sentence, length, &tokens ), "too many fields" );
+	test_check ( ! nmea_tokenize ( sentence, NMEA_MAX_SENTENCE + 1, &tokens ), "too long" );
+}
+
+/**
+* Tokenize a sentence of fields for the field reader tests.
+*
+* \param    sentence	Pointer to storage for the sentence, NMEA_MAX_SENTENCE + 1 bytes
+* \param	body		Pointer to the characters between '$' and '*'
+* \param	tokens		Pointer to storage for the fields
+*
+* \returns  None
+*/
+static void test_fields ( char* sentence, const char* body, nmea_sentence_t* tokens )
+{
+	uint32_t length = test_sentence ( sentence, body );
+
+	test_check ( nmea_tokenize ( sentence, length, tokens ), body );
+}
+
+/**
+* Decimal fields are read as scaled integers.
+*
+* \returns  None
+*/
+static void test_fixed ( void )
+{
+	char sentence[NMEA_MAX_SENTENCE + 1];
+	nmea_sentence_t tokens;
+	int32_t value;
+
+	test_fields ( sentence, "GPXXX,545.4,12.3456,-0.0005,+7,022.4,,1.2.3,12a,2147483.647,2147483.648,0.99999999999", &tokens );
+
+	test_check ( nmea_field_fixed ( &tokens, 1, 3, &value ) && value == 545400, "545.4 in thousandths" );
+	test_check ( nmea_field_fixed ( &tokens, 2, 3, &value ) && value == 12346, "12.3456 rounds up" );
+	test_check ( nmea_field_fixed ( &tokens, 2, 0, &value ) && value == 12, "12.3456 to a whole number" );
+	test_check ( nmea_field_fixed ( &tokens, 3, 3, &value ) && value == -1, "-0.0005 rounds away from zero" );
+	test_check ( nmea_field_fixed ( &tokens, 4, 2, &value ) && value == 700, "+7 in hundredths" );
+	test_check ( nmea_field_fixed ( &tokens, 5, 3, &value ) && value == 22400, "leading zero" );
+	test_check ( nmea_field_fixed ( &tokens, 11, 9, &value ) && value == 1000000000, "nine digits kept, rounded up" );
+
+	/*
+	 * A field that is not a number, or does not fit, leaves the value alone
+	 */
+	value = 42;
+	test_check ( ! nmea_field_fixed ( &tokens, 6, 3, &value ), "empty field" );
+	test_check ( ! nmea_field_fixed ( &tokens, 7, 3, &value ), "two decimal points" );
+	test_check ( ! nmea_field_fixed ( &tokens, 8, 3, &value ), "letter in a number" );
+	test_check ( ! nmea_field_fixed ( &tokens, 12, 3, &value ), "missing field" );
+	test_check ( ! nmea_field_fixed ( &tokens, 1, 10, &value ), "more than nine digits" );
+	test_check ( value == 42, "value unchanged" );
+	test_check ( ! nmea_field_fixed ( &tokens, 10, 3, &value ) && value == 42, "value past INT32_MAX" );
+	test_check ( nmea_field_fixed ( &tokens, 9, 3, &value ) && value == INT32_MAX, "largest value" );
+}
+
+/**
+* Coordinates are read in 1e-7 degrees.
+*
+* \returns  None
+*/
+static void test_coordinate ( void )
+{
+	char sentence[NMEA_MAX_SENTENCE + 1];
+	nmea_sentence_t tokens;
+	int32_t value;
+
+	test_fields ( sentence, "GPXXX,4807.038,N,01131.000,E,3345.6789,S,11800.5,W,0000.0000,N,9000.0000,N,17959.99999,E,4807.038,,48x7.0,N,-100.0,N", &tokens );
+
+	test_check ( nmea_field_coordinate ( &tokens, 1, &value ) && value == 481173000, "48 07.038 N" );
+	test_check ( nmea_field_coordinate ( &tokens, 3, &value ) && value == 115166667, "011 31.000 E rounds" );
+	test_check ( nmea_field_coordinate ( &tokens, 5, &value ) && value == -337613150, "33 45.6789 S" );
+	test_check ( nmea_field_coordinate ( &tokens, 7, &value ) && value == -1180083333, "118 00.5 W" );
+	test_check ( nmea_field_coordinate ( &tokens, 9, &value ) && value == 0, "equator" );
+	test_check ( nmea_field_coordinate ( &tokens, 11, &value ) && value == 900000000, "pole" );
+	test_check ( nmea_field_coordinate ( &tokens, 13, &value ) && value == 1799999998, "179 59.99999 E" );
+	test_check ( nmea_field_coordinate ( &tokens, 15, &value ) && value == 481173000, "no hemisphere is north or east" );
+
+	value = 42;
+	test_check ( ! nmea_field_coordinate ( &tokens, 17, &value ) && value == 42, "letter in a coordinate" );
+	test_check ( ! nmea_field_coordinate ( &tokens, 19, &value ) && value == 42, "negative coordinate" );
+	test_check ( ! nmea_field_coordinate ( &tokens, 21, &value ) && value == 42, "missing coordinate" );
+}
+
+/**
+* Times are read in milliseconds since midnight.
+*
+* \returns  None
+*/
+static void test_time ( void )
+{
+	char sentence[NMEA_MAX_SENTENCE + 1];
+	nmea_sentence_t tokens;
+	uint32_t value;
+
+	test_fields ( sentence, "GPXXX,123519,000000.00,235960.999,092750.0005,240000,126000,,12:35", &tokens );
+
+	test_check ( nmea_field_time ( &tokens, 1, &value ) && value == 45319000, "12:35:19" );
+	test_check ( nmea_field_time ( &tokens, 2, &value ) && value == 0, "midnight" );
+	test_check ( nmea_field_time ( &tokens, 3, &value ) && value == 86400999, "leap second" );
+	test_check ( nmea_field_time ( &tokens, 4, &value ) && value == 34070001, "milliseconds round" );
+
+	value = 42;
+	test_check ( ! nmea_field_time ( &tokens, 5, &value ) && value == 42, "hour 24" );
+	test_check ( ! nmea_field_time ( &tokens, 6, &value ) && value == 42, "minute 60" );
+	test_check ( ! nmea_field_time ( &tokens, 7, &value ) && value == 42, "empty time" );
+	test_check ( ! nmea_field_time ( &tokens, 8, &value ) && value == 42, "time with separators" );
+}
+
+int main ( void )
+{
+	test_tokenize ();
+	test_reject ();
+	test_fixed ();
+	test_coordinate ();
+	test_time ();
+
+	return test_exit ();
+}
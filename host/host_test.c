@@ -0,0 +1,45 @@
+/**
+* host_test.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the checks shared by the host tests.
+*
+*/
+
+#include <stdio.h>
+#include "host_test.h"
+
+static uint32_t test_failures = 0;
+
+/**
+* Check a condition and count a failure.
+*
+* \param    ok			Condition
+* \param	what		Description of the check
+*
+* \returns  None
+*/
+void test_check ( bool ok, const char* what )
+{
+	if ( ! ok )
+	{
+		printf ( "  FAILED: %s\n", what );
+		test_failures++;
+	}
+}
+
+/**
+* Print the result of the test.
+*
+* \returns  Exit status, 0 if every check passed.
+*/
+int test_exit ( void )
+{
+	printf ( ( test_failures == 0 ) ? "PASS\n" : "FAIL (%u)\n", test_failures );
+	return ( test_failures == 0 ) ? 0 : 1;
+}
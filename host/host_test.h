@@ -0,0 +1,47 @@
+/**
+* host_test.h
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the checks shared by the host tests.
+*
+* A test counts the checks that fail with test_check and returns the status
+* of test_exit from main, so make test stops at the first failing test.
+*/
+
+#ifndef HOST_HOST_TEST_H_
+#define HOST_HOST_TEST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+/**
+* Check a condition and count a failure.
+*
+* \param    ok			Condition
+* \param	what		Description of the check
+*
+* \returns  None
+*/
+void test_check ( bool ok, const char* what );
+
+/**
+* Print the result of the test.
+*
+* \returns  Exit status, 0 if every check passed.
+*/
+int test_exit ( void );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* HOST_HOST_TEST_H_ */
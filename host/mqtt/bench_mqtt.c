@@ -0,0 +1,366 @@
+/**
+* bench_mqtt.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  MQTT service publish benchmark.
+*
+* Publishes a run of messages through the MQTT service to the broker stub
+* over the loopback network, for each QoS and payload size, on a clean
+* link and on a lossy one that also drops the connection every few hundred
+* publishes.  Every payload carries its sequence number and the tick it was
+* published, the broker stub records the latency of the first copy of each.
+*
+* Each combination runs twice.  The paced run offers BENCH_PACED_RATE
+* messages a second, below what the slowest run can carry, so its latency
+* percentiles are those of the service and the link rather than of a full
+* offline queue; the clean link has a fixed latency, the spread of the lossy
+* one comes from retransmissions and reconnects.  The saturated run offers BENCH_BURST publishes a tick and
+* reports the throughput the service sustains; the loopback has no
+* bandwidth limit, so at QoS 1 and 2 that is the inflight window's capacity
+* whatever the payload size.  Reported per run:
+*
+*   msg/s       Messages that reached the broker per simulated second
+*   p50/p90/p99 Publish to broker latency percentiles (simulated ms, paced)
+*   ns/msg      Host time spent in the service per message
+*   heap        Heap high-water of the service, broker context included
+*   inflight    Retransmission copy high-water (statistics)
+*   queue       Offline queue high-water (statistics)
+*
+* The simulated clock runs one tick per step, so latencies are multiples of
+* the tick.  QoS 1 and 2 runs must deliver every message, a clean QoS 0 run
+* too, and the heap must return to where it started.
+*/
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <aef/embedded/system/system_core.h>
+#include <aef/embedded/service/mqtt/mqtt_service.h>
+#include <aef/embedded/osal/time.h>
+#include <OsConfig.h>
+#include "host_network.h"
+#include "host_system.h"
+#include "mqtt_broker_stub.h"
+
+#define BENCH_MESSAGES				2000	// Messages published per run
+#define BENCH_PORT					1883	// Broker stub port
+#define BENCH_BURST					16		// Publishes offered per tick, saturated runs
+#define BENCH_PACED_RATE			20		// Publishes offered per second, paced runs
+#define BENCH_TICK_LIMIT			( 3600 * CFG_SYSTICK_FREQ )	// Simulated time a run may take
+#define BENCH_TOPIC					"bench/data"
+#define BENCH_QUEUE_BUDGET			16384	// Offline queue RAM budget (bytes)
+
+/**
+* Link profile
+*/
+typedef struct
+{
+	const char*	name;
+	uint32_t	latency;						// Broker latency (ms)
+	uint32_t	loss;							// Publishes lost per 1000
+	uint32_t	disconnectEvery;				// Publishes per connection, 0 never
+} bench_profile_t;
+
+static const bench_profile_t bench_profiles[] =
+{
+	{ "clean", 20,  0,   0 },
+	{ "lossy", 50, 10, 500 },
+};
+static const uint8_t  bench_qos[]  = { MQTT_QOS0, MQTT_QOS1, MQTT_QOS2 };
+static const uint32_t bench_size[] = { 16, 256, 1024 };
+
+extern const service_vtable_t system_mqtt_srv_vtable;
+static const service_vtable_t* bench_mqtt = &system_mqtt_srv_vtable;
+
+static mqtt_broker_stub_t bench_stub;
+
+/**
+* Run state
+*/
+static uint8_t  bench_seen[BENCH_MESSAGES];
+static uint32_t bench_latency[BENCH_MESSAGES];
+static uint32_t bench_unique;
+static uint32_t bench_delivered;
+static uint32_t bench_failed;
+static bool		bench_connected;
+
+/**
+* Heap use of the code linked with --wrap=malloc,--wrap=calloc,--wrap=free,
+* the compiler turns a malloc and memset into calloc
+*/
+static size_t bench_heap;
+static size_t bench_heap_max;
+
+void* __real_malloc ( size_t size );
+void* __real_calloc ( size_t count, size_t size );
+void  __real_free ( void* ptr );
+
+static void* bench_heap_add ( void* ptr )
+{
+	if ( ptr != NULL )
+	{
+		bench_heap += malloc_usable_size ( ptr );
+		if ( bench_heap > bench_heap_max )
+			bench_heap_max = bench_heap;
+	}
+	return ptr;
+}
+
+void* __wrap_malloc ( size_t size )
+{
+	return bench_heap_add ( __real_malloc ( size ) );
+}
+
+void* __wrap_calloc ( size_t count, size_t size )
+{
+	return bench_heap_add ( __real_calloc ( count, size ) );
+}
+
+void __wrap_free ( void* ptr )
+{
+	if ( ptr != NULL )
+		bench_heap -= malloc_usable_size ( ptr );
+	__real_free ( ptr );
+}
+
+/**
+* Broker stub publish handler, records the latency of the first copy
+*/
+static void bench_on_publish ( void* ctx, const uint8_t* topic, uint16_t topicLen,
+							   const uint8_t* payload, uint32_t length, uint8_t qos, bool dup )
+{
+	uint32_t sequence;
+	uint64_t stamp;
+
+	if ( length < sizeof(sequence) + sizeof(stamp) )
+		return;
+	memcpy ( &sequence, payload, sizeof(sequence) );
+	memcpy ( &stamp, payload + sizeof(sequence), sizeof(stamp) );
+	if ( sequence < BENCH_MESSAGES && ! bench_seen[sequence] )
+	{
+		bench_seen[sequence] = 1;
+		bench_latency[bench_unique++] = (uint32_t)( ( time_get_ticks(NULL) - stamp ) * 1000 / CFG_SYSTICK_FREQ );
+	}
+}
+
+static void bench_on_event ( void* ctx, uint32_t evt, const void* buf, uint32_t len )
+{
+	if ( evt == MQTT_CL_EVT_CONNACK )
+		bench_connected = true;
+}
+
+static void bench_on_delivered ( void* ctx, uint16_t messageId, uint32_t status )
+{
+	if ( status == MQTT_DELIVERY_COMPLETE )
+		bench_delivered++;
+	else
+		bench_failed++;
+}
+
+static int bench_compare ( const void* a, const void* b )
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return ( x > y ) - ( x < y );
+}
+
+static uint32_t bench_percentile ( uint32_t percent )
+{
+	if ( bench_unique == 0 )
+		return 0;
+	return bench_latency[( (uint64_t)( bench_unique - 1 ) * percent ) / 100];
+}
+
+/**
+* Run the service and the broker one tick.
+*
+* \param    client_ns	Pointer to the host time spent in the service
+*
+* \returns  None
+*/
+static void bench_step ( uint64_t* client_ns )
+{
+	mqtt_broker_stub_run ( &bench_stub );
+
+	uint64_t start = host_time_ns ();
+	host_system_management_run ();
+	*client_ns += host_time_ns () - start;
+
+	host_clock_advance ( 1000 / CFG_SYSTICK_FREQ );
+}
+
+/**
+* Publish a run of messages and print its results.
+*
+* \param    profile		Link profile
+* \param	qos			Quality of service
+* \param	size		Payload size, at least 12 bytes
+* \param	paced		Offer BENCH_PACED_RATE publishes a second, else BENCH_BURST a tick
+*
+* \returns  true if the run delivered what it must.
+*/
+static bool bench_run ( const bench_profile_t* profile, uint8_t qos, uint32_t size, bool paced )
+{
+	static uint8_t payload[1024];
+	void*    broker    = NULL;
+	uint32_t sent      = 0;
+	uint64_t client_ns = 0;
+	uint64_t start;
+	uint64_t ticks;
+	size_t   heap_base = bench_heap;
+	bool     ok        = true;
+	mqtt_statistics_t statistics;
+
+	memset ( bench_seen, 0, sizeof(bench_seen) );
+	bench_unique    = 0;
+	bench_delivered = 0;
+	bench_failed    = 0;
+	bench_connected = false;
+	bench_heap_max  = bench_heap;
+
+	mqtt_broker_stub_init ( &bench_stub, BENCH_PORT );
+	bench_stub.latency         = profile->latency;
+	bench_stub.loss            = profile->loss;
+	bench_stub.disconnectEvery = profile->disconnectEvery;
+	bench_stub.onPublish       = bench_on_publish;
+
+	mqtt_init_parms_t init = { .socket = { FNET_ERR }, .clientid = (char*)"bench", .topicSize = 64, .bufferSize = 2048 };
+	bench_mqtt->iocontrol ( IOCTL_MQTT_INITIALIZE, &init, sizeof(init), &broker, sizeof(broker), NULL );
+
+	mqtt_connection_parms_t connection =
+	{
+		.broker     = broker,
+		.serverAddr = (char*)"127.0.0.1",
+		.addrType   = MQTT_ADDR_IP,
+		.serverPort = BENCH_PORT,
+		.keepAlive  = 60,
+		.clean      = 0,
+		.cbs        = { .svcMqttEvent = bench_on_event, .svcMqttDelivered = bench_on_delivered },
+	};
+	mqtt_reconnect_parms_t reconnect = { broker, 1, 4 };
+	mqtt_offline_queue_parms_t queue = { .broker = broker, .budget = BENCH_QUEUE_BUDGET, .dropPolicy = MQTT_DROP_NEWEST };
+	mqtt_connect_parms_t connect     = { broker };
+	mqtt_statistics_parms_t stats    = { broker };
+	bench_mqtt->iocontrol ( IOCTL_MQTT_SET_CONNECTION, &connection, sizeof(connection), NULL, 0, NULL );
+	bench_mqtt->iocontrol ( IOCTL_MQTT_SET_RECONNECT, &reconnect, sizeof(reconnect), NULL, 0, NULL );
+	bench_mqtt->iocontrol ( IOCTL_MQTT_SET_OFFLINE_QUEUE, &queue, sizeof(queue), NULL, 0, NULL );
+	bench_mqtt->iocontrol ( IOCTL_MQTT_CONNECT_EX, &connect, sizeof(connect), NULL, 0, NULL );
+
+	for ( ticks = 0; ! bench_connected && ticks < BENCH_TICK_LIMIT; ticks++ )
+		bench_step ( &client_ns );
+
+	/**
+	* Offer the load until every message is out and settled
+	*/
+	client_ns = 0;
+	start     = time_get_ticks(NULL);
+	for ( ticks = 0; ticks < BENCH_TICK_LIMIT; ticks++ )
+	{
+		uint32_t offer = ( ! paced ) ? BENCH_BURST : ( ( ticks % ( CFG_SYSTICK_FREQ / BENCH_PACED_RATE ) ) == 0 );
+
+		for ( uint32_t burst = 0; burst < offer && sent < BENCH_MESSAGES; burst++ )
+		{
+			uint64_t stamp = time_get_ticks(NULL);
+			memcpy ( payload, &sent, sizeof(sent) );
+			memcpy ( payload + sizeof(sent), &stamp, sizeof(stamp) );
+
+			mqtt_iovec_t segment = { payload, size };
+			mqtt_publish_ex_parms_t publish =
+			{
+				.broker       = broker,
+				.topic        = BENCH_TOPIC,
+				.topicLength  = sizeof(BENCH_TOPIC) - 1,
+				.payload      = &segment,
+				.payloadCount = 1,
+				.qos          = qos,
+			};
+			uint64_t begin = host_time_ns ();
+			service_status_t status = bench_mqtt->iocontrol ( IOCTL_MQTT_PUBLISH_EX, &publish, sizeof(publish), NULL, 0, NULL );
+			client_ns += host_time_ns () - begin;
+			if ( status != SERVICE_STATUS_SUCCESS )
+				break;
+			sent++;
+		}
+		bench_step ( &client_ns );
+
+		if ( sent == BENCH_MESSAGES && mqtt_broker_stub_idle ( &bench_stub ) )
+		{
+			bench_mqtt->iocontrol ( IOCTL_MQTT_GET_STATISTICS, &stats, sizeof(stats), &statistics, sizeof(statistics), NULL );
+			if ( ( qos == MQTT_QOS0 && statistics.queue_bytes == 0 ) ||
+				 ( qos != MQTT_QOS0 && bench_delivered + bench_failed == BENCH_MESSAGES ) )
+				break;
+		}
+	}
+	ticks = time_get_ticks(NULL) - start;
+
+	bench_mqtt->iocontrol ( IOCTL_MQTT_GET_STATISTICS, &stats, sizeof(stats), &statistics, sizeof(statistics), NULL );
+	mqtt_disconnect_parms_t disconnect = { broker };
+	mqtt_deinitialize_parms_t deinit   = { broker };
+	bench_mqtt->iocontrol ( IOCTL_MQTT_DISCONNECT_EX, &disconnect, sizeof(disconnect), NULL, 0, NULL );
+	bench_step ( &client_ns );
+	bench_mqtt->iocontrol ( IOCTL_MQTT_DEINITIALIZE, &deinit, sizeof(deinit), NULL, 0, NULL );
+	mqtt_broker_stub_run ( &bench_stub );
+	mqtt_broker_stub_stop ( &bench_stub );
+
+	qsort ( bench_latency, bench_unique, sizeof(bench_latency[0]), bench_compare );
+	printf ( "  %-5s QoS %u %5u B %9.1f msg/s ", profile->name, qos, size,
+			 (double)bench_unique * CFG_SYSTICK_FREQ / (double)( ( ticks != 0 ) ? ticks : 1 ) );
+	if ( paced )
+		printf ( "%6u %6u %6u ms", bench_percentile ( 50 ), bench_percentile ( 90 ), bench_percentile ( 99 ) );
+	else
+		printf ( "%6s %6s %6s   ", "-", "-", "-" );
+	printf ( " %8.1f ns/msg %7zu %6u %6u B  %4u lost %3u drops %4u retx\n",
+			 (double)client_ns / BENCH_MESSAGES,
+			 bench_heap_max - heap_base, statistics.inflight_bytes_max, statistics.queue_bytes_max,
+			 BENCH_MESSAGES - bench_unique, bench_stub.drops, statistics.retransmits );
+
+	if ( qos != MQTT_QOS0 || profile->loss == 0 )
+		ok &= ( bench_unique == BENCH_MESSAGES && bench_failed == 0 );
+	if ( qos != MQTT_QOS0 )
+		ok &= ( bench_delivered == BENCH_MESSAGES );
+	ok &= ( bench_heap == heap_base );
+	if ( ! ok )
+		printf ( "  FAILED: %u of %u reached the broker, %u delivered, %u failed, heap %zd\n",
+				 bench_unique, BENCH_MESSAGES, bench_delivered, bench_failed, (ssize_t)( bench_heap - heap_base ) );
+	return ok;
+}
+
+int main ( void )
+{
+	service_manager_vtable_t* service_manager = system_get_service_manager ();
+	bool ok = true;
+
+	service_manager->addservice ( &host_network_srv_vtable );
+	host_network_srv_vtable.init ( 0 );
+	service_manager->addservice ( bench_mqtt );
+	ok &= ( bench_mqtt->init ( 0 ) == SERVICE_STATUS_SUCCESS );
+	ok &= ( bench_mqtt->iocontrol ( IOCTL_SERVICE_START, NULL, 0, NULL, 0, NULL ) == SERVICE_STATUS_SUCCESS );
+
+	for ( uint32_t paced = 2; ok && paced-- > 0; )
+	{
+		if ( paced )
+			printf ( "  paced, %u msg/s offered\n", BENCH_PACED_RATE );
+		else
+			printf ( "  saturated, %u msg offered a tick\n", BENCH_BURST );
+		printf ( "  link  QoS   payload      rate    p50    p90    p99          host     heap inflight queue\n" );
+		for ( uint32_t profile = 0; ok && profile < sizeof(bench_profiles) / sizeof(bench_profiles[0]); profile++ )
+		{
+			for ( uint32_t qos = 0; qos < sizeof(bench_qos); qos++ )
+			{
+				for ( uint32_t size = 0; size < sizeof(bench_size) / sizeof(bench_size[0]); size++ )
+				{
+					ok &= bench_run ( &bench_profiles[profile], bench_qos[qos], bench_size[size], paced );
+				}
+			}
+		}
+	}
+
+	printf ( ( ok ) ? "PASS\n" : "FAIL\n" );
+	return ( ok ) ? 0 : 1;
+}
@@ -0,0 +1,339 @@
+/**
+* mqtt_broker_stub.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the host MQTT broker stub.
+*
+*/
+
+#include <string.h>
+#include <aef/embedded/osal/time.h>
+#include <aef/embedded/service/mqtt/mqtt_service.h>
+#include <OsConfig.h>
+#include "host_network.h"
+#include "mqtt_broker_stub.h"
+
+/**
+* Internal routines.
+*/
+static int32_t mqtt_broker_stub_packet_size ( const uint8_t* data, uint32_t size, uint32_t* header );
+static void    mqtt_broker_stub_reply ( mqtt_broker_stub_t* stub, uint8_t type, const uint8_t* body, uint32_t length );
+static void    mqtt_broker_stub_act ( mqtt_broker_stub_t* stub, const uint8_t* packet, uint32_t size );
+static bool    mqtt_broker_stub_lose ( mqtt_broker_stub_t* stub );
+static void    mqtt_broker_stub_reset ( mqtt_broker_stub_t* stub );
+
+/**
+* Initialize a broker and listen on its port.
+*
+* \param    stub		Pointer to the broker
+* \param	port		Port (host byte order)
+*
+* \returns  None
+*/
+void mqtt_broker_stub_init ( mqtt_broker_stub_t* stub, uint16_t port )
+{
+	memset ( stub, 0, sizeof(mqtt_broker_stub_t) );
+	stub->port       = port;
+	stub->seed       = port;
+	stub->connection = -1;
+	host_network_listen ( port, true );
+}
+
+/**
+* Run the broker once: accept a connection, read packets and act on those
+* whose latency has passed.
+*
+* \param    stub		Pointer to the broker
+*
+* \returns  None
+*/
+void mqtt_broker_stub_run ( mqtt_broker_stub_t* stub )
+{
+	uint64_t now = time_get_ticks(NULL);
+
+	host_network_listen ( stub->port, ! stub->down );
+	if ( stub->down )
+	{
+		mqtt_broker_stub_drop ( stub );
+		return;
+	}
+
+	if ( stub->connection < 0 )
+	{
+		stub->connection = host_network_accept ( stub->port );
+		if ( stub->connection < 0 )
+			return;
+		stub->connections++;
+	}
+	if ( stub->stall )
+		return;
+
+	/**
+	* Read the bytes the client sent, whole packets wait out the latency
+	*/
+	while ( stub->pendingCount < MQTT_BROKER_STUB_PENDING )
+	{
+		int32_t count = host_network_peer_recv ( stub->connection, stub->rx + stub->rxUsed, sizeof(stub->rx) - stub->rxUsed );
+		if ( count < 0 )
+		{
+			host_network_peer_close ( stub->connection );
+			mqtt_broker_stub_reset ( stub );
+			return;
+		}
+		if ( count == 0 )
+			break;
+		stub->rxUsed += count;
+
+		uint32_t offset = 0;
+		uint32_t header = 0;
+		int32_t  size   = 0;
+		while ( stub->pendingCount < MQTT_BROKER_STUB_PENDING &&
+				( size = mqtt_broker_stub_packet_size ( stub->rx + offset, stub->rxUsed - offset, &header ) ) > 0 )
+		{
+			if ( ! stub->mute )
+			{
+				mqtt_broker_stub_packet_t* packet = &stub->pending[( stub->pendingHead + stub->pendingCount ) % MQTT_BROKER_STUB_PENDING];
+				packet->due  = now + ( (uint64_t)stub->latency * CFG_SYSTICK_FREQ ) / 1000;
+				packet->size = size;
+				memcpy ( packet->data, stub->rx + offset, size );
+				stub->pendingCount++;
+			}
+			offset += size;
+		}
+		if ( size < 0 )
+		{
+			/**
+			* Malformed or larger than the broker accepts
+			*/
+			mqtt_broker_stub_drop ( stub );
+			return;
+		}
+		memmove ( stub->rx, stub->rx + offset, stub->rxUsed - offset );
+		stub->rxUsed -= offset;
+	}
+
+	/**
+	* Act on the packets whose latency has passed
+	*/
+	while ( stub->pendingCount != 0 && stub->connection >= 0 )
+	{
+		mqtt_broker_stub_packet_t* packet = &stub->pending[stub->pendingHead];
+		if ( packet->due > now )
+			break;
+		stub->pendingHead = ( stub->pendingHead + 1 ) % MQTT_BROKER_STUB_PENDING;
+		stub->pendingCount--;
+		mqtt_broker_stub_act ( stub, packet->data, packet->size );
+	}
+}
+
+/**
+* Drop the connection of a broker.
+*
+* \param    stub		Pointer to the broker
+*
+* \returns  None
+*/
+void mqtt_broker_stub_drop ( mqtt_broker_stub_t* stub )
+{
+	if ( stub->connection >= 0 )
+	{
+		host_network_peer_close ( stub->connection );
+		mqtt_broker_stub_reset ( stub );
+		stub->drops++;
+	}
+}
+
+/**
+* Check a broker has no packet waiting.
+*
+* \param    stub		Pointer to the broker
+*
+* \returns  true if every packet read has been acted on.
+*/
+bool mqtt_broker_stub_idle ( const mqtt_broker_stub_t* stub )
+{
+	return stub->pendingCount == 0 && stub->rxUsed == 0;
+}
+
+/**
+* Stop a broker and close its connection.
+*
+* \param    stub		Pointer to the broker
+*
+* \returns  None
+*/
+void mqtt_broker_stub_stop ( mqtt_broker_stub_t* stub )
+{
+	host_network_listen ( stub->port, false );
+	if ( stub->connection >= 0 )
+	{
+		host_network_peer_close ( stub->connection );
+		mqtt_broker_stub_reset ( stub );
+	}
+}
+
+/**
+* Forget the connection state
+*/
+void mqtt_broker_stub_reset ( mqtt_broker_stub_t* stub )
+{
+	stub->connection          = -1;
+	stub->connectionPublishes = 0;
+	stub->rxUsed              = 0;
+	stub->pendingHead         = 0;
+	stub->pendingCount        = 0;
+}
+
+/**
+* Decode the size of the packet at the start of the bytes read
+*
+* \param	data			Pointer to the bytes
+* \param	size			Number of bytes
+* \param	header			Pointer to storage for the fixed header size
+*
+* \returns	Size of the packet, 0 if it has not fully arrived, -1 if it is
+*			malformed or too large.
+*/
+int32_t mqtt_broker_stub_packet_size ( const uint8_t* data, uint32_t size, uint32_t* header )
+{
+	uint32_t length = 0;
+
+	for ( uint32_t index = 1; index <= 4; index++ )
+	{
+		if ( index >= size )
+			return 0;
+		length |= (uint32_t)( data[index] & 0x7F ) << ( 7 * ( index - 1 ) );
+		if ( ( data[index] & 0x80 ) == 0 )
+		{
+			*header = index + 1;
+			if ( *header + length > MQTT_BROKER_STUB_PACKET_SIZE )
+				return -1;
+			return ( *header + length <= size ) ? (int32_t)( *header + length ) : 0;
+		}
+	}
+	return -1;
+}
+
+/**
+* Send a packet to the client
+*/
+void mqtt_broker_stub_reply ( mqtt_broker_stub_t* stub, uint8_t type, const uint8_t* body, uint32_t length )
+{
+	uint8_t packet[2 + 16];
+
+	if ( length > sizeof(packet) - 2 )
+		return;
+	packet[0] = type;
+	packet[1] = (uint8_t)length;
+	if ( length != 0 )
+		memcpy ( packet + 2, body, length );
+	host_network_peer_send ( stub->connection, packet, 2 + length );
+}
+
+/**
+* Roll the loss rate
+*/
+bool mqtt_broker_stub_lose ( mqtt_broker_stub_t* stub )
+{
+	if ( stub->loss == 0 )
+		return false;
+	stub->seed = stub->seed * 1103515245U + 12345U;
+	return ( ( stub->seed >> 16 ) % 1000 ) < stub->loss;
+}
+
+/**
+* Act on a packet
+*/
+void mqtt_broker_stub_act ( mqtt_broker_stub_t* stub, const uint8_t* packet, uint32_t size )
+{
+	uint32_t header = 0;
+	mqtt_broker_stub_packet_size ( packet, size, &header );
+	const uint8_t* body = packet + header;
+	uint32_t length     = size - header;
+
+	switch ( packet[0] & 0xF0 )
+	{
+		case MQTT_MSG_CONNECT:
+		{
+			static const uint8_t accepted[] = { 0x00, MQTT_CONNACK_ACCEPTED };
+			mqtt_broker_stub_reply ( stub, MQTT_MSG_CONNACK, accepted, sizeof(accepted) );
+		}
+			break;
+		case MQTT_MSG_PUBLISH:
+		{
+			uint8_t  qos       = ( packet[0] >> 1 ) & 0x03;
+			uint16_t topicLen  = ( length >= 2 ) ? ( body[0] << 8 ) | body[1] : 0;
+			uint32_t idSize    = ( qos != MQTT_QOS0 ) ? 2 : 0;
+
+			stub->publishes++;
+			if ( packet[0] & MQTT_DUP_FLAG )
+				stub->duplicates++;
+			if ( length < 2 + topicLen + idSize )
+				break;
+			if ( mqtt_broker_stub_lose ( stub ) )
+			{
+				stub->lost++;
+			}
+			else
+			{
+				if ( stub->onPublish )
+				{
+					stub->onPublish ( stub->ctx, body + 2, topicLen, body + 2 + topicLen + idSize,
+									  length - 2 - topicLen - idSize, qos, ( packet[0] & MQTT_DUP_FLAG ) != 0 );
+				}
+				if ( qos == MQTT_QOS1 )
+					mqtt_broker_stub_reply ( stub, MQTT_MSG_PUBACK, body + 2 + topicLen, 2 );
+				else if ( qos == MQTT_QOS2 )
+					mqtt_broker_stub_reply ( stub, MQTT_MSG_PUBREC, body + 2 + topicLen, 2 );
+			}
+			if ( stub->disconnectEvery != 0 && ++stub->connectionPublishes >= stub->disconnectEvery )
+			{
+				mqtt_broker_stub_drop ( stub );
+			}
+		}
+			break;
+		case MQTT_MSG_PUBREL:
+			if ( length >= 2 )
+				mqtt_broker_stub_reply ( stub, MQTT_MSG_PUBCOMP, body, 2 );
+			break;
+		case MQTT_MSG_SUBSCRIBE:
+		{
+			uint8_t  suback[16];
+			uint32_t count  = 0;
+			uint32_t offset = 2;
+
+			if ( length < 2 )
+				break;
+			suback[count++] = body[0];
+			suback[count++] = body[1];
+			while ( offset + 2 < length && count < sizeof(suback) )
+			{
+				offset += 2 + ( ( body[offset] << 8 ) | body[offset + 1] );
+				if ( offset >= length )
+					break;
+				suback[count++] = body[offset++] & 0x03;
+			}
+			mqtt_broker_stub_reply ( stub, MQTT_MSG_SUBACK, suback, count );
+		}
+			break;
+		case MQTT_MSG_UNSUBSCRIBE:
+			if ( length >= 2 )
+				mqtt_broker_stub_reply ( stub, MQTT_MSG_UNSUBACK, body, 2 );
+			break;
+		case MQTT_MSG_PINGREQ:
+			stub->pings++;
+			mqtt_broker_stub_reply ( stub, MQTT_MSG_PINGRESP, NULL, 0 );
+			break;
+		case MQTT_MSG_DISCONNECT:
+			host_network_peer_close ( stub->connection );
+			mqtt_broker_stub_reset ( stub );
+			break;
+		default:
+			break;
+	}
+}
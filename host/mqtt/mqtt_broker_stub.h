@@ -0,0 +1,148 @@
+/**
+* mqtt_broker_stub.h
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the host MQTT broker stub.
+*
+* A broker listening on a port of the host loopback network, driven by the
+* test calling mqtt_broker_stub_run on the simulated clock.  It accepts one
+* client connection at a time, acknowledges CONNECT, PUBLISH, PUBREL,
+* SUBSCRIBE, UNSUBSCRIBE and PINGREQ, and hands every publish it accepts to
+* the test.  Each packet is acted on latency ms after it was read, publishes
+* are dropped unacknowledged at the loss rate, the connection is dropped
+* after a number of publishes, and the broker can be taken down, muted to
+* hold the connection without answering, or stalled to stop reading it.
+*/
+
+#ifndef HOST_MQTT_MQTT_BROKER_STUB_H_
+#define HOST_MQTT_MQTT_BROKER_STUB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+#ifndef MQTT_BROKER_STUB_PACKET_SIZE
+	#define MQTT_BROKER_STUB_PACKET_SIZE	2048	// Largest packet the broker accepts (bytes)
+#endif
+
+#ifndef MQTT_BROKER_STUB_PENDING
+	#define MQTT_BROKER_STUB_PENDING		256		// Packets waiting out the latency
+#endif
+
+/**
+* Publish handler, called for every publish the broker accepts.
+*
+* \param	ctx			Handler context
+* \param	topic		Topic, not NUL terminated
+* \param	topicLen	Length of the topic
+* \param	payload		Payload
+* \param	length		Length of the payload
+* \param	qos			Quality of service
+* \param	dup			DUP flag of the publish
+*/
+typedef void (*mqtt_broker_stub_publish_t)(void* ctx, const uint8_t* topic, uint16_t topicLen,
+                                           const uint8_t* payload, uint32_t length, uint8_t qos, bool dup);
+
+/**
+* Packet waiting out the latency
+*/
+typedef struct _mqtt_broker_stub_packet_def
+{
+	uint64_t	due;							// Tick count the broker acts on the packet
+	uint32_t	size;							// Size of the packet
+	uint8_t		data[MQTT_BROKER_STUB_PACKET_SIZE];	// Packet
+} mqtt_broker_stub_packet_t;
+
+/**
+* MQTT broker stub structure definition
+*/
+typedef struct _mqtt_broker_stub_def
+{
+	// Settings, changed by the test at any time
+	uint16_t	port;							// Port listened on
+	uint32_t	latency;						// Delay before a packet is acted on (ms)
+	uint32_t	loss;							// Publishes dropped unacknowledged per 1000
+	uint32_t	disconnectEvery;				// Publishes read before the connection is dropped, 0 never
+	bool		down;							// Refuse connections, drop the current one
+	bool		mute;							// Hold the connection, discard every packet
+	bool		stall;							// Hold the connection, read nothing
+	uint32_t	seed;							// Loss random number generator state
+	mqtt_broker_stub_publish_t onPublish;		// Publish handler, NULL for none
+	void*		ctx;							// Publish handler context
+	// Counters
+	uint32_t	connections;					// Connections accepted
+	uint32_t	drops;							// Connections dropped by the broker
+	uint32_t	publishes;						// Publishes read
+	uint32_t	lost;							// Publishes dropped by the loss rate
+	uint32_t	duplicates;						// Publishes read with the DUP flag
+	uint32_t	pings;							// PINGREQs answered
+	// Connection
+	int32_t		connection;						// Loopback connection, -1 if none
+	uint32_t	connectionPublishes;			// Publishes read on the connection
+	uint8_t		rx[MQTT_BROKER_STUB_PACKET_SIZE * 2];	// Bytes read, not yet a whole packet
+	uint32_t	rxUsed;							// Bytes in rx
+	mqtt_broker_stub_packet_t pending[MQTT_BROKER_STUB_PENDING];	// Packets waiting out the latency
+	uint32_t	pendingHead;					// Oldest waiting packet
+	uint32_t	pendingCount;					// Packets waiting
+} mqtt_broker_stub_t;
+
+/**
+* Initialize a broker and listen on its port.
+*
+* \param    stub		Pointer to the broker
+* \param	port		Port (host byte order)
+*
+* \returns  None
+*/
+void mqtt_broker_stub_init ( mqtt_broker_stub_t* stub, uint16_t port );
+
+/**
+* Run the broker once: accept a connection, read packets and act on those
+* whose latency has passed.
+*
+* \param    stub		Pointer to the broker
+*
+* \returns  None
+*/
+void mqtt_broker_stub_run ( mqtt_broker_stub_t* stub );
+
+/**
+* Drop the connection of a broker.
+*
+* \param    stub		Pointer to the broker
+*
+* \returns  None
+*/
+void mqtt_broker_stub_drop ( mqtt_broker_stub_t* stub );
+
+/**
+* Check a broker has no packet waiting.
+*
+* \param    stub		Pointer to the broker
+*
+* \returns  true if every packet read has been acted on.
+*/
+bool mqtt_broker_stub_idle ( const mqtt_broker_stub_t* stub );
+
+/**
+* Stop a broker and close its connection.
+*
+* \param    stub		Pointer to the broker
+*
+* \returns  None
+*/
+void mqtt_broker_stub_stop ( mqtt_broker_stub_t* stub );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* HOST_MQTT_MQTT_BROKER_STUB_H_ */
@@ -0,0 +1,324 @@
+/**
+* test_mqtt_keepalive.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Tests of the per broker keep-alive, ping and reconnect of the MQTT
+*         service.
+*
+* Several brokers connect to their own broker stub over the loopback
+* network and are run together on the simulated clock.  One stub is muted
+* and another taken down and brought back, the broker of each must lose its
+* connection after the ping or connect timeout and reconnect on its own
+* backoff, while the healthy brokers keep pinging on their keep-alive period
+* without a single loss.  A stub that stops reading makes a publisher cut
+* a packet short, which the service task of that broker must act on.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <aef/embedded/system/system_core.h>
+#include <aef/embedded/service/mqtt/mqtt_service.h>
+#include <aef/embedded/osal/time.h>
+#include <OsConfig.h>
+#include "host_network.h"
+#include "host_system.h"
+#include "host_test.h"
+#include "mqtt_broker_stub.h"
+
+#define TEST_BROKERS				3		// Brokers run together
+#define TEST_PORT					1883	// Port of the first broker stub
+#define TEST_KEEPALIVE				2		// Keep alive time (seconds)
+#define TEST_LATENCY				20		// Broker stub latency (ms)
+#define TEST_RECONNECT_MIN			1		// First reconnect delay (seconds)
+#define TEST_RECONNECT_MAX			8		// Reconnect delay limit (seconds)
+
+extern const service_vtable_t system_mqtt_srv_vtable;
+static const service_vtable_t* test_mqtt = &system_mqtt_srv_vtable;
+
+/**
+* Broker under test
+*/
+typedef struct
+{
+	void*				broker;					// MQTT broker context
+	mqtt_broker_stub_t	stub;					// Broker stub it connects to
+	uint32_t			connacks;				// CONNACKs received
+	uint32_t			disconnects;			// Connections closed
+} test_broker_t;
+
+static test_broker_t test_brokers[TEST_BROKERS];
+
+/**
+* Find the broker under test of a broker context
+*/
+static test_broker_t* test_find ( void* broker )
+{
+	for ( uint32_t index = 0; index < TEST_BROKERS; index++ )
+	{
+		if ( test_brokers[index].broker == broker )
+			return &test_brokers[index];
+	}
+	return NULL;
+}
+
+static void test_on_event ( void* ctx, uint32_t evt, const void* buf, uint32_t len )
+{
+	test_broker_t* test = test_find ( ctx );
+
+	if ( test != NULL && evt == MQTT_CL_EVT_CONNACK )
+		test->connacks++;
+}
+
+static void test_on_disconnect ( void* ctx )
+{
+	test_broker_t* test = test_find ( ctx );
+
+	if ( test != NULL )
+		test->disconnects++;
+}
+
+/**
+* Run the service and every broker stub for a time.
+*
+* \param    seconds		Simulated time to run (seconds)
+*
+* \returns  None
+*/
+static void test_run ( uint32_t seconds )
+{
+	for ( uint32_t tick = 0; tick < seconds * CFG_SYSTICK_FREQ; tick++ )
+	{
+		for ( uint32_t index = 0; index < TEST_BROKERS; index++ )
+			mqtt_broker_stub_run ( &test_brokers[index].stub );
+		host_system_management_run ();
+		host_clock_advance ( 1000 / CFG_SYSTICK_FREQ );
+	}
+}
+
+/**
+* Check a healthy broker kept its connection and pinged on its keep-alive
+* period.
+*
+* \param    test		Pointer to the broker under test
+* \param	pings		Stub ping count at the start of the run
+* \param	disconnects	Close count at the start of the run
+* \param	seconds		Length of the run (seconds)
+* \param	what		Description of the check
+*
+* \returns  None
+*/
+static void test_check_healthy ( const test_broker_t* test, uint32_t pings, uint32_t disconnects,
+								 uint32_t seconds, const char* what )
+{
+	uint32_t expected = seconds / TEST_KEEPALIVE;
+	uint32_t count    = test->stub.pings - pings;
+	char     message[96];
+
+	snprintf ( message, sizeof(message), "%s: %u pings in %u s", what, count, seconds );
+	test_check ( count + 1 >= expected && count <= expected + 1, message );
+	snprintf ( message, sizeof(message), "%s: connection kept", what );
+	test_check ( test->disconnects == disconnects && test->stub.drops == 0, message );
+}
+
+/**
+* Connect every broker to its stub.
+*/
+static void test_connect ( void )
+{
+	for ( uint32_t index = 0; index < TEST_BROKERS; index++ )
+	{
+		test_broker_t* test = &test_brokers[index];
+		char clientid[16];
+
+		memset ( test, 0, sizeof(test_broker_t) );
+		mqtt_broker_stub_init ( &test->stub, TEST_PORT + index );
+		test->stub.latency = TEST_LATENCY;
+
+		snprintf ( clientid, sizeof(clientid), "keepalive%u", index );
+		mqtt_init_parms_t init = { .socket = { FNET_ERR }, .clientid = clientid, .topicSize = 64, .bufferSize = 256 };
+		test_check ( test_mqtt->iocontrol ( IOCTL_MQTT_INITIALIZE, &init, sizeof(init), &test->broker, sizeof(test->broker), NULL ) == SERVICE_STATUS_SUCCESS,
+					 "initialize" );
+
+		mqtt_connection_parms_t connection =
+		{
+			.broker     = test->broker,
+			.serverAddr = (char*)"127.0.0.1",
+			.addrType   = MQTT_ADDR_IP,
+			.serverPort = TEST_PORT + index,
+			.keepAlive  = TEST_KEEPALIVE,
+			.clean      = 1,
+			.cbs        = { .svcMqttEvent = test_on_event, .svcMqttDisconn = test_on_disconnect },
+		};
+		mqtt_reconnect_parms_t reconnect = { test->broker, TEST_RECONNECT_MIN, TEST_RECONNECT_MAX };
+		mqtt_connect_parms_t connect     = { test->broker };
+		test_mqtt->iocontrol ( IOCTL_MQTT_SET_CONNECTION, &connection, sizeof(connection), NULL, 0, NULL );
+		test_mqtt->iocontrol ( IOCTL_MQTT_SET_RECONNECT, &reconnect, sizeof(reconnect), NULL, 0, NULL );
+		test_check ( test_mqtt->iocontrol ( IOCTL_MQTT_CONNECT_EX, &connect, sizeof(connect), NULL, 0, NULL ) == SERVICE_STATUS_SUCCESS,
+					 "connect" );
+	}
+
+	test_run ( 1 );
+	for ( uint32_t index = 0; index < TEST_BROKERS; index++ )
+		test_check ( test_brokers[index].connacks == 1 && test_brokers[index].stub.connections == 1, "every broker connected" );
+}
+
+/**
+* Run the brokers healthy, then mute one, then take another down and bring
+* both back.
+*/
+static void test_keepalive ( void )
+{
+	test_broker_t* healthy = &test_brokers[0];
+	test_broker_t* muted   = &test_brokers[1];
+	test_broker_t* down    = &test_brokers[2];
+	uint32_t pings[TEST_BROKERS];
+	uint32_t disconnects[TEST_BROKERS];
+	uint32_t connacks[TEST_BROKERS];
+
+#define TEST_MARK()		for ( uint32_t index = 0; index < TEST_BROKERS; index++ ) { \
+							pings[index]       = test_brokers[index].stub.pings; \
+							disconnects[index] = test_brokers[index].disconnects; \
+							connacks[index]    = test_brokers[index].connacks; }
+
+	/**
+	* Every broker pings on its own period
+	*/
+	TEST_MARK ();
+	test_run ( 20 );
+	for ( uint32_t index = 0; index < TEST_BROKERS; index++ )
+		test_check_healthy ( &test_brokers[index], pings[index], disconnects[index], 20, "all healthy" );
+
+	/**
+	* A muted broker is dropped once the ping timeout runs out after its next
+	* ping, then cannot connect again, the others are not disturbed
+	*/
+	TEST_MARK ();
+	muted->stub.mute = true;
+	test_run ( MQTT_PING_TIMEOUT );
+	test_check ( muted->disconnects == disconnects[1], "muted broker kept within the ping timeout" );
+	test_run ( TEST_KEEPALIVE + 1 );
+	test_check ( muted->disconnects == disconnects[1] + 1, "muted broker lost after the ping timeout" );
+	test_run ( 30 - MQTT_PING_TIMEOUT - TEST_KEEPALIVE - 1 );
+	test_check_healthy ( healthy, pings[0], disconnects[0], 30, "muted neighbour" );
+	test_check_healthy ( down, pings[2], disconnects[2], 30, "muted neighbour" );
+	test_check ( muted->stub.pings == pings[1], "muted broker answered no ping" );
+	test_check ( muted->disconnects >= disconnects[1] + 2, "muted broker lost on ping and connect timeout" );
+	test_check ( muted->connacks == connacks[1], "muted broker not connected" );
+	test_check ( muted->stub.connections > 1, "muted broker reconnected" );
+	muted->stub.mute = false;
+
+	TEST_MARK ();
+	test_run ( TEST_RECONNECT_MAX + 2 );
+	test_check ( muted->connacks == connacks[1] + 1, "unmuted broker connected" );
+
+	/**
+	* A broker that is down refuses the connection, its client backs off
+	* and connects once it is back up
+	*/
+	TEST_MARK ();
+	down->stub.down = true;
+	test_run ( 30 );
+	test_check_healthy ( healthy, pings[0], disconnects[0], 30, "down neighbour" );
+	test_check ( down->disconnects >= disconnects[2] + 1, "down broker lost" );
+	test_check ( down->connacks == connacks[2], "down broker not connected" );
+	down->stub.down = false;
+
+	TEST_MARK ();
+	test_run ( TEST_RECONNECT_MAX + 2 );
+	test_check ( down->connacks == connacks[2] + 1, "broker back up connected" );
+
+	/**
+	* All healthy again
+	*/
+	TEST_MARK ();
+	test_run ( 20 );
+	test_check_healthy ( healthy, pings[0], disconnects[0], 20, "all recovered" );
+	test_check ( muted->stub.pings - pings[1] + 1 >= 20 / TEST_KEEPALIVE && muted->disconnects == disconnects[1],
+				 "recovered muted broker pings" );
+	test_check ( down->stub.pings - pings[2] + 1 >= 20 / TEST_KEEPALIVE && down->disconnects == disconnects[2],
+				 "recovered down broker pings" );
+
+#undef TEST_MARK
+}
+
+/**
+* A broker that stops reading fills the loopback, the publish that is cut
+* short fails in the publisher and the service task drops the session.
+*/
+static void test_stall ( void )
+{
+	static uint8_t payload[1024];
+	test_broker_t* stalled = &test_brokers[0];
+	uint32_t disconnects   = stalled->disconnects;
+	uint32_t connacks      = stalled->connacks;
+	uint32_t others        = test_brokers[1].disconnects + test_brokers[2].disconnects;
+	uint32_t published     = 0;
+	mqtt_iovec_t segment   = { payload, sizeof(payload) };
+	mqtt_publish_ex_parms_t publish =
+	{
+		.broker       = stalled->broker,
+		.topic        = "stall",
+		.topicLength  = 5,
+		.payload      = &segment,
+		.payloadCount = 1,
+		.qos          = MQTT_QOS0,
+	};
+
+	stalled->stub.stall = true;
+	while ( published < 2 * HOST_NETWORK_BUFFER_SIZE / sizeof(payload) &&
+			test_mqtt->iocontrol ( IOCTL_MQTT_PUBLISH_EX, &publish, sizeof(publish), NULL, 0, NULL ) == SERVICE_STATUS_SUCCESS )
+		published++;
+	test_check ( published < 2 * HOST_NETWORK_BUFFER_SIZE / sizeof(payload), "publish fails once the loopback is full" );
+	test_check ( stalled->disconnects == disconnects, "session left to the service task" );
+	test_check ( test_mqtt->iocontrol ( IOCTL_MQTT_PUBLISH_EX, &publish, sizeof(publish), NULL, 0, NULL ) != SERVICE_STATUS_SUCCESS,
+				 "nothing sent after a packet was cut short" );
+
+	test_run ( 1 );
+	test_check ( stalled->disconnects == disconnects + 1, "stalled broker dropped by the service task" );
+	stalled->stub.stall = false;
+	test_run ( TEST_RECONNECT_MIN + 2 );
+	test_check ( stalled->connacks == connacks + 1, "stalled broker connected again" );
+	test_check ( test_brokers[1].disconnects + test_brokers[2].disconnects == others, "other brokers kept" );
+}
+
+/**
+* Disconnect and release every broker.
+*/
+static void test_release ( void )
+{
+	for ( uint32_t index = 0; index < TEST_BROKERS; index++ )
+	{
+		mqtt_disconnect_parms_t disconnect = { test_brokers[index].broker };
+		test_mqtt->iocontrol ( IOCTL_MQTT_DISCONNECT_EX, &disconnect, sizeof(disconnect), NULL, 0, NULL );
+	}
+	test_run ( 1 );
+	for ( uint32_t index = 0; index < TEST_BROKERS; index++ )
+	{
+		mqtt_deinitialize_parms_t deinit = { test_brokers[index].broker };
+		test_mqtt->iocontrol ( IOCTL_MQTT_DEINITIALIZE, &deinit, sizeof(deinit), NULL, 0, NULL );
+		mqtt_broker_stub_stop ( &test_brokers[index].stub );
+	}
+}
+
+int main ( void )
+{
+	service_manager_vtable_t* service_manager = system_get_service_manager ();
+
+	service_manager->addservice ( &host_network_srv_vtable );
+	host_network_srv_vtable.init ( 0 );
+	service_manager->addservice ( test_mqtt );
+	test_check ( test_mqtt->init ( 0 ) == SERVICE_STATUS_SUCCESS, "service init" );
+	test_check ( test_mqtt->iocontrol ( IOCTL_SERVICE_START, NULL, 0, NULL, 0, NULL ) == SERVICE_STATUS_SUCCESS, "service start" );
+
+	test_connect ();
+	test_keepalive ();
+	test_stall ();
+	test_release ();
+
+	return test_exit ();
+}
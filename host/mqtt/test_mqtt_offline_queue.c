@@ -0,0 +1,392 @@
+/**
+* test_mqtt_offline_queue.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Tests of the MQTT offline publish queue.
+*
+* The flash tier is kept by a database stub in RAM, which checks the queue
+* released the lock of its caller before every database call and can fail
+* the writes.  The queue is driven with the lock held, as the MQTT core
+* does.  Publishes must come out oldest first across both tiers, a failed
+* write must cost only the new publish, and the lowest QoS drop policy must
+* find its victim in flash as well as in RAM, also after a restart.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <aef/embedded/system/system_core.h>
+#include <aef/embedded/osal/critical_section.h>
+#include "mqtt_offline_queue.h"
+#include "host_system.h"
+#include "host_test.h"
+
+#define TEST_DB_RECORDS				16		// Records the database stub holds
+#define TEST_FLASH_RECORDS			4		// Flash tier record limit
+#define TEST_RAM_PUBLISHES			3		// Publishes the RAM tier budget holds
+#define TEST_TOPIC					"t"
+#define TEST_CHARGE					( sizeof(mqtt_queue_entry_t) + sizeof(TEST_TOPIC) - 1 + sizeof(uint32_t) )
+
+/**
+* Database stub record
+*/
+typedef struct
+{
+	bool		used;
+	uint32_t	size;
+	uint8_t		data[DATABASE_MAX_RECORD_SIZE];
+} test_record_t;
+
+static test_record_t test_db[TEST_DB_RECORDS];
+static bool     test_db_fail_writes;
+static uint32_t test_db_calls;
+static uint32_t test_db_locked;
+static uint32_t test_db_unordered;
+static uint8_t  test_db_cursor[16];
+static bool     test_db_cursor_started;
+
+static critical_section_ctx_t test_lock;
+static mqtt_queue_t test_queue;
+
+static const uint8_t* test_uuid ( const test_record_t* record )
+{
+	return ((const EntryHeader_t*)record->data)->block_entry.UUID;
+}
+
+static test_record_t* test_db_find ( const uint8_t* uuid )
+{
+	for ( uint32_t index = 0; index < TEST_DB_RECORDS; index++ )
+	{
+		if ( test_db[index].used && memcmp ( test_uuid ( &test_db[index] ), uuid, 16 ) == 0 )
+			return &test_db[index];
+	}
+	return NULL;
+}
+
+static uint32_t test_db_count ( void )
+{
+	uint32_t count = 0;
+
+	for ( uint32_t index = 0; index < TEST_DB_RECORDS; index++ )
+		count += test_db[index].used;
+	return count;
+}
+
+/**
+* The calls made while a database call runs with the lock released, as
+* another broker or the drain would: nothing may be taken out of the queue
+* and it must not look empty, or later publishes would overtake the one in
+* the database call.  A call made with the lock held is counted by the
+* caller.
+*/
+static void test_db_overtake ( void )
+{
+	if ( critical_section_try_acquire ( &test_lock ) != SYSTEM_STATUS_SUCCESS )
+		return;
+	if ( mqtt_queue_pop ( &test_queue ) != NULL || mqtt_queue_empty ( &test_queue ) )
+		test_db_unordered++;
+	critical_section_release ( &test_lock );
+}
+
+static service_id_t test_db_getid ( void )
+{
+	return SRV_SYSTEM_DATABASE;
+}
+
+static char* test_db_getname ( void )
+{
+	return (char*)"DATABASE";
+}
+
+static service_runlevel_t test_db_runlevel ( void )
+{
+	return SRV_RUNLEVEL2;
+}
+
+static service_status_t test_db_init ( uint32_t init_parameters )
+{
+	return SERVICE_STATUS_SUCCESS;
+}
+
+static service_status_t test_db_deinit ( void )
+{
+	return SERVICE_STATUS_SUCCESS;
+}
+
+/**
+* Database stub commands: write, read, delete and the cursor scan, records
+* come back from the cursor in key order.
+*/
+static service_status_t test_db_iocontrol ( uint32_t code, void* input_buffer, uint32_t input_size, void* output_buffer, uint32_t output_size, uint32_t* bytes_transferred )
+{
+	test_record_t* record;
+
+	test_db_calls++;
+	if ( critical_section_try_acquire ( &test_lock ) == SYSTEM_STATUS_SUCCESS )
+		critical_section_release ( &test_lock );
+	else
+		test_db_locked++;
+
+	switch ( code )
+	{
+		case IOCTL_DATABASE_WRITE_RECORD:
+			test_db_overtake ();
+			if ( test_db_fail_writes || input_size > DATABASE_MAX_RECORD_SIZE )
+				return SERVICE_FAILURE_GENERAL;
+			record = test_db_find ( ((const EntryHeader_t*)input_buffer)->block_entry.UUID );
+			for ( uint32_t index = 0; record == NULL && index < TEST_DB_RECORDS; index++ )
+			{
+				if ( ! test_db[index].used )
+					record = &test_db[index];
+			}
+			if ( record == NULL )
+				return SERVICE_FAILURE_GENERAL;
+			record->used = true;
+			record->size = input_size;
+			memcpy ( record->data, input_buffer, input_size );
+			return SERVICE_STATUS_SUCCESS;
+
+		case IOCTL_DATABASE_READ_RECORD:
+			test_db_overtake ();
+			record = test_db_find ( input_buffer );
+			if ( record == NULL || record->size > output_size )
+				return SERVICE_FAILURE_GENERAL;
+			memcpy ( output_buffer, record->data, record->size );
+			if ( bytes_transferred )
+				*bytes_transferred = record->size;
+			return SERVICE_STATUS_SUCCESS;
+
+		case IOCTL_DATABASE_DELETE_RECORD:
+			record = test_db_find ( input_buffer );
+			if ( record == NULL )
+				return SERVICE_FAILURE_GENERAL;
+			record->used = false;
+			return SERVICE_STATUS_SUCCESS;
+
+		case IOCTL_DATABASE_OPEN_CURSOR:
+			test_db_cursor_started = false;
+			*(uint32_t*)output_buffer = 1;
+			return SERVICE_STATUS_SUCCESS;
+
+		case IOCTL_DATABASE_FETCH_CURSOR:
+			record = NULL;
+			for ( uint32_t index = 0; index < TEST_DB_RECORDS; index++ )
+			{
+				if ( test_db[index].used &&
+					 ( ! test_db_cursor_started || memcmp ( test_uuid ( &test_db[index] ), test_db_cursor, 16 ) > 0 ) &&
+					 ( record == NULL || memcmp ( test_uuid ( &test_db[index] ), test_uuid ( record ), 16 ) < 0 ) )
+					record = &test_db[index];
+			}
+			*bytes_transferred = 0;
+			if ( record != NULL && record->size <= output_size )
+			{
+				memcpy ( test_db_cursor, test_uuid ( record ), 16 );
+				test_db_cursor_started = true;
+				memcpy ( output_buffer, record->data, record->size );
+				*bytes_transferred = record->size;
+			}
+			return SERVICE_STATUS_SUCCESS;
+
+		case IOCTL_DATABASE_CLOSE_CURSOR:
+			return SERVICE_STATUS_SUCCESS;
+
+		default:
+			return SERVICE_FAILURE_GENERAL;
+	}
+}
+
+static const service_vtable_t test_db_srv_vtable =
+{
+	.getid     = test_db_getid,
+	.getname   = test_db_getname,
+	.runlevel  = test_db_runlevel,
+	.init      = test_db_init,
+	.deinit    = test_db_deinit,
+	.iocontrol = test_db_iocontrol,
+};
+
+/**
+* Configure the queue with a flash tier under the lock.
+*/
+static bool test_configure ( uint8_t dropPolicy )
+{
+	mqtt_offline_queue_parms_t parms =
+	{
+		.budget       = TEST_RAM_PUBLISHES * TEST_CHARGE,
+		.dropPolicy   = dropPolicy,
+		.flash        = 1,
+		.flashRecords = TEST_FLASH_RECORDS,
+		.flashKey     = 0x51554555,
+	};
+	bool result;
+
+	critical_section_acquire ( &test_lock );
+	result = mqtt_queue_configure ( &test_queue, &parms, &test_lock );
+	critical_section_release ( &test_lock );
+	return result;
+}
+
+/**
+* Queue a publish carrying a number under the lock.
+*/
+static bool test_push ( uint32_t number, uint8_t qos )
+{
+	mqtt_iovec_t payload = { &number, sizeof(number) };
+	bool result;
+
+	critical_section_acquire ( &test_lock );
+	result = mqtt_queue_push ( &test_queue, TEST_TOPIC, sizeof(TEST_TOPIC) - 1, &payload, 1, qos, 0 );
+	critical_section_release ( &test_lock );
+	return result;
+}
+
+/**
+* Send every queued publish and collect their numbers, oldest first.
+*
+* \param    numbers		Pointer to storage for the numbers
+* \param	size		Size of the storage
+*
+* \returns  Number of publishes sent.
+*/
+static uint32_t test_drain ( uint32_t* numbers, uint32_t size )
+{
+	mqtt_queue_entry_t* entry;
+	uint32_t count = 0;
+
+	critical_section_acquire ( &test_lock );
+	while ( ( entry = mqtt_queue_pop ( &test_queue ) ) != NULL )
+	{
+		if ( count < size && entry->length == entry->topicLength + sizeof(uint32_t) )
+			memcpy ( &numbers[count], &entry->data[entry->topicLength], sizeof(uint32_t) );
+		count++;
+		mqtt_queue_complete ( &test_queue, entry, true );
+	}
+	test_check ( mqtt_queue_empty ( &test_queue ), "queue empty after the drain" );
+	critical_section_release ( &test_lock );
+	return count;
+}
+
+static void test_release ( void )
+{
+	critical_section_acquire ( &test_lock );
+	mqtt_queue_reset ( &test_queue );
+	critical_section_release ( &test_lock );
+	memset ( &test_queue, 0, sizeof(test_queue) );
+}
+
+/**
+* Publishes spill to flash and come back oldest first, with every database
+* call made without the lock.
+*/
+static void test_order ( void )
+{
+	uint32_t numbers[16];
+	uint32_t count = TEST_FLASH_RECORDS + TEST_RAM_PUBLISHES;
+	bool     ordered = true;
+
+	test_check ( test_configure ( MQTT_DROP_NEWEST ), "configure" );
+	for ( uint32_t number = 0; number < count; number++ )
+		test_check ( test_push ( number, MQTT_QOS1 ), "push while there is room" );
+	test_check ( test_db_count () == TEST_FLASH_RECORDS && test_queue.spilled == TEST_FLASH_RECORDS, "oldest publishes spilled" );
+	test_check ( ! test_push ( count, MQTT_QOS1 ), "newest dropped when both tiers are full" );
+
+	test_check ( test_drain ( numbers, 16 ) == count, "every publish drained" );
+	for ( uint32_t number = 0; number < count; number++ )
+		ordered &= ( numbers[number] == number );
+	test_check ( ordered, "drained oldest first" );
+	test_check ( test_db_count () == 0, "flash records deleted once sent" );
+	test_check ( test_db_calls != 0 && test_db_locked == 0, "database called without the lock" );
+	test_check ( test_db_unordered == 0, "nothing overtakes a database call" );
+	test_release ();
+}
+
+/**
+* A database that fails every write costs the new publish only.
+*/
+static void test_write_failure ( void )
+{
+	uint32_t numbers[16];
+	uint32_t dropped;
+
+	test_check ( test_configure ( MQTT_DROP_OLDEST ), "configure" );
+	for ( uint32_t number = 0; number < TEST_RAM_PUBLISHES + 2; number++ )
+		test_push ( number, MQTT_QOS1 );
+	test_check ( test_db_count () == 2, "two publishes spilled" );
+
+	test_db_fail_writes = true;
+	dropped = test_queue.dropped;
+	for ( uint32_t number = TEST_RAM_PUBLISHES + 2; number < TEST_RAM_PUBLISHES + 2 + 8; number++ )
+		test_check ( ! test_push ( number, MQTT_QOS1 ), "push fails while the database fails" );
+	test_check ( test_db_count () == 2, "flash tier kept on write errors" );
+	test_check ( test_queue.dropped == dropped + 8, "only the new publishes dropped" );
+	test_db_fail_writes = false;
+
+	test_check ( test_drain ( numbers, 16 ) == TEST_RAM_PUBLISHES + 2, "queued publishes kept" );
+	test_check ( numbers[0] == 0 && numbers[TEST_RAM_PUBLISHES + 1] == TEST_RAM_PUBLISHES + 1, "kept in order" );
+	test_release ();
+}
+
+/**
+* The lowest QoS drop policy finds QoS 0 publishes held in flash, before
+* and after a restart.
+*/
+static void test_lowest_qos ( void )
+{
+	uint32_t numbers[16];
+	uint32_t count;
+	bool     kept = true;
+
+	/*
+	 * QoS 0 publishes spill first, QoS 1 publishes fill the rest of flash
+	 * and the RAM tier
+	 */
+	test_check ( test_configure ( MQTT_DROP_LOWEST_QOS ), "configure" );
+	test_push ( 0, MQTT_QOS0 );
+	test_push ( 1, MQTT_QOS0 );
+	for ( uint32_t number = 2; number < TEST_FLASH_RECORDS + TEST_RAM_PUBLISHES; number++ )
+		test_push ( number, MQTT_QOS1 );
+	test_check ( test_db_count () == TEST_FLASH_RECORDS, "flash tier full" );
+
+	test_check ( test_push ( 100, MQTT_QOS1 ), "QoS 1 publish makes room" );
+	test_check ( test_db_count () == TEST_FLASH_RECORDS, "flash tier full again" );
+
+	/*
+	 * Restart, the QoS of the flash records comes back with them
+	 */
+	critical_section_acquire ( &test_lock );
+	mqtt_queue_reset ( &test_queue );
+	critical_section_release ( &test_lock );
+	memset ( &test_queue, 0, sizeof(test_queue) );
+	test_check ( test_configure ( MQTT_DROP_LOWEST_QOS ), "configure after the restart" );
+	test_check ( test_queue.flashCount == TEST_FLASH_RECORDS, "flash tier recovered" );
+	for ( uint32_t number = 101; number < 101 + TEST_RAM_PUBLISHES; number++ )
+		test_push ( number, MQTT_QOS1 );
+	test_check ( test_push ( 200, MQTT_QOS1 ), "recovered QoS 0 publish makes room" );
+	test_check ( ! test_push ( 201, MQTT_QOS0 ), "no QoS 0 publish left to drop" );
+
+	count = test_drain ( numbers, 16 );
+	test_check ( count == TEST_FLASH_RECORDS + TEST_RAM_PUBLISHES, "both tiers drained" );
+	for ( uint32_t index = 0; index < count && index < 16; index++ )
+		kept &= ( numbers[index] >= 2 );
+	test_check ( kept, "only the QoS 0 publishes dropped" );
+	test_check ( test_db_locked == 0, "database called without the lock" );
+	test_release ();
+}
+
+int main ( void )
+{
+	service_manager_vtable_t* service_manager = system_get_service_manager ();
+
+	service_manager->addservice ( &test_db_srv_vtable );
+	critical_section_create ( &test_lock );
+
+	test_order ();
+	test_write_failure ();
+	test_lowest_qos ();
+
+	return test_exit ();
+}
@@ -0,0 +1,154 @@
+
+/**
+* test_mqtt_sn.c
+*
+* \copyright
+* Copyright 2017 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Tests of the MQTT-SN packet encoding and topic table.
+*
+* The length header is checked on both sides of the switch from the one
+* byte to the three byte form, and the topic table through registration,
+* predefined ids, short topic names and a full table.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "mqtt_sn.h"
+#include "host_test.h"
+
+/**
+* Packet headers are written and read back for every body size.
+*
+* \returns  None
+*/
+static void test_header ( void )
+{
+	uint8_t  packet[1024];
+	uint32_t failures = 0;
+	uint8_t  type;
+
+	for ( uint32_t length = 0; length + 4 <= sizeof(packet); length++ )
+	{
+		uint32_t header = mqtt_sn_encode_header ( packet, length, MQTT_SN_MSG_PUBLISH );
+
+		type = 0;
+		if ( header != ( ( length + 2 <= 0xFF ) ? 2 : 4 ) ||
+			 mqtt_sn_parse_header ( packet, header + length, &type ) != header || type != MQTT_SN_MSG_PUBLISH ||
+			 mqtt_sn_parse_header ( packet, header + length + 1, &type ) != 0 ||
+			 mqtt_sn_parse_header ( packet, header + length - 1, &type ) != 0 )
+			failures++;
+	}
+	test_check ( failures == 0, "header round trip" );
+
+	/*
+	 * The edges of the one byte length
+	 */
+	test_check ( mqtt_sn_encode_header ( packet, 253, MQTT_SN_MSG_PUBLISH ) == 2 && packet[0] == 0xFF, "longest one byte length" );
+	test_check ( mqtt_sn_encode_header ( packet, 254, MQTT_SN_MSG_PUBLISH ) == 4 && packet[0] == 0x01 &&
+				 packet[1] == 0x01 && packet[2] == 0x02 && packet[3] == MQTT_SN_MSG_PUBLISH, "shortest three byte length" );
+
+	/*
+	 * Datagrams too short for their header
+	 */
+	packet[0] = 0x02;
+	test_check ( mqtt_sn_parse_header ( packet, 1, &type ) == 0, "one byte datagram" );
+	packet[0] = 0x01; packet[1] = 0x00; packet[2] = 0x03;
+	test_check ( mqtt_sn_parse_header ( packet, 3, &type ) == 0, "three byte length in three bytes" );
+	packet[0] = 0x00;
+	test_check ( mqtt_sn_parse_header ( packet, 0, &type ) == 0, "empty datagram" );
+}
+
+/**
+* The DUP flag is set in the flags byte of either header form.
+*
+* \returns  None
+*/
+static void test_dup ( void )
+{
+	uint8_t packet[512];
+	uint32_t header;
+
+	memset ( packet, 0, sizeof(packet) );
+	header = mqtt_sn_encode_header ( packet, 5, MQTT_SN_MSG_PUBLISH );
+	packet[header] = MQTT_SN_FLAG_QOS1;
+	mqtt_sn_set_dup ( packet );
+	test_check ( packet[header] == ( MQTT_SN_FLAG_QOS1 | MQTT_SN_FLAG_DUP ) && packet[header - 1] == MQTT_SN_MSG_PUBLISH, "DUP, one byte length" );
+
+	memset ( packet, 0, sizeof(packet) );
+	header = mqtt_sn_encode_header ( packet, 300, MQTT_SN_MSG_PUBLISH );
+	packet[header] = MQTT_SN_FLAG_QOS1;
+	mqtt_sn_set_dup ( packet );
+	test_check ( packet[header] == ( MQTT_SN_FLAG_QOS1 | MQTT_SN_FLAG_DUP ) && packet[header - 1] == MQTT_SN_MSG_PUBLISH, "DUP, three byte length" );
+}
+
+/**
+* Topic names are mapped to the ids they are published and subscribed with.
+*
+* \returns  None
+*/
+static void test_topics ( void )
+{
+	mqtt_sn_topic_t table[MQTT_SN_MAX_TOPICS];
+	mqtt_sn_topic_t* entry;
+	char	 name[MQTT_SN_TOPIC_LENGTH + 1];
+	uint8_t  type;
+	uint16_t id;
+
+	memset ( table, 0, sizeof(table) );
+
+	/*
+	 * A predefined id, a registration pending its SUBACK, and a short name
+	 */
+	test_check ( mqtt_sn_topic_add ( table, "fleet/pos", 9, MQTT_SN_TOPIC_PREDEFINED, 7 ) != NULL, "add predefined" );
+	test_check ( mqtt_sn_topic_resolve ( table, "fleet/pos", 9, &type, &id ) && type == MQTT_SN_TOPIC_PREDEFINED && id == 7, "resolve predefined" );
+	test_check ( mqtt_sn_topic_by_id ( table, MQTT_SN_TOPIC_PREDEFINED, 7 ) == mqtt_sn_topic_by_name ( table, "fleet/pos", 9 ), "predefined by id" );
+	test_check ( mqtt_sn_topic_by_id ( table, MQTT_SN_TOPIC_NORMAL, 7 ) == NULL, "id type must match" );
+
+	entry = mqtt_sn_topic_add ( table, "fleet/cmd", 9, MQTT_SN_TOPIC_NORMAL, 0 );
+	test_check ( entry != NULL, "add pending" );
+	if ( entry != NULL )
+		entry->pending = 0x1234;
+	test_check ( ! mqtt_sn_topic_resolve ( table, "fleet/cmd", 9, &type, &id ), "pending topic has no id" );
+	test_check ( mqtt_sn_topic_by_pending ( table, 0x1234 ) == entry, "pending by message id" );
+	test_check ( mqtt_sn_topic_add ( table, "fleet/cmd", 9, MQTT_SN_TOPIC_NORMAL, 42 ) == entry, "SUBACK updates the entry" );
+	test_check ( mqtt_sn_topic_by_pending ( table, 0x1234 ) == NULL, "SUBACK clears the pending id" );
+	test_check ( mqtt_sn_topic_resolve ( table, "fleet/cmd", 9, &type, &id ) && type == MQTT_SN_TOPIC_NORMAL && id == 42, "resolve registered" );
+
+	test_check ( mqtt_sn_topic_resolve ( table, "ab", 2, &type, &id ) && type == MQTT_SN_TOPIC_SHORT && id == 0x6162, "short topic name" );
+	test_check ( ! mqtt_sn_topic_resolve ( table, "abc", 3, &type, &id ), "unknown topic" );
+	test_check ( ! mqtt_sn_topic_resolve ( table, "fleet/po", 8, &type, &id ), "name prefix does not match" );
+
+	/*
+	 * The gateway does not replace a predefined id
+	 */
+	test_check ( mqtt_sn_topic_add ( table, "fleet/pos", 9, MQTT_SN_TOPIC_NORMAL, 99 ) != NULL &&
+				 mqtt_sn_topic_resolve ( table, "fleet/pos", 9, &type, &id ) && type == MQTT_SN_TOPIC_PREDEFINED && id == 7, "predefined id kept" );
+
+	/*
+	 * Names that do not fit, and a full table
+	 */
+	memset ( name, 'x', sizeof(name) );
+	test_check ( mqtt_sn_topic_add ( table, name, MQTT_SN_TOPIC_LENGTH + 1, MQTT_SN_TOPIC_NORMAL, 1 ) == NULL, "name too long" );
+	test_check ( mqtt_sn_topic_add ( table, name, MQTT_SN_TOPIC_LENGTH, MQTT_SN_TOPIC_NORMAL, 1 ) != NULL, "longest name" );
+	test_check ( mqtt_sn_topic_add ( table, name, 0, MQTT_SN_TOPIC_NORMAL, 1 ) == NULL, "empty name" );
+	for ( uint32_t index = 3; index < MQTT_SN_MAX_TOPICS; index++ )
+	{
+		snprintf ( name, sizeof(name), "topic/%u", index );
+		test_check ( mqtt_sn_topic_add ( table, name, strlen ( name ), MQTT_SN_TOPIC_NORMAL, 100 + index ) != NULL, "fill the table" );
+	}
+	test_check ( mqtt_sn_topic_add ( table, "one/more", 8, MQTT_SN_TOPIC_NORMAL, 1 ) == NULL, "table full" );
+	test_check ( mqtt_sn_topic_add ( table, "fleet/cmd", 9, MQTT_SN_TOPIC_NORMAL, 43 ) != NULL, "update in a full table" );
+}
+
+int main ( void )
+{
+	test_header ();
+	test_dup ();
+	test_topics ();
+
+	return test_exit ();
+}
@@ -0,0 +1,246 @@
+
+/**
+* test_mqtt_topic_trie.c
+*
+* \copyright
+* Copyright 2017 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Tests of the MQTT topic filter trie.
+*
+* Every filter of up to three levels over a small alphabet, with and
+* without a trailing '#', is added to one trie.  Each topic of up to three
+* levels is then matched through the trie and against every filter one by
+* one with the matching rules of the MQTT specification, and the two must
+* find the same filters.  Invalid filters, removal and the match limit are
+* checked on their own.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "mqtt_topic_trie.h"
+#include "host_test.h"
+
+#define TEST_MAX_FILTERS			64		// Filters in the trie
+#define TEST_NAME_LENGTH			32		// Longest filter or topic built
+
+static char test_filter[TEST_MAX_FILTERS][TEST_NAME_LENGTH];
+static uint32_t test_filter_count = 0;
+
+/**
+* Topic handler, never called, the handler context tells the filters apart.
+*/
+static void test_handler ( void *handlerCtx, void *ctx, const char *topStr, uint32_t topLen,
+						   const char *payload, uint32_t pay_len,
+						   uint8_t dup, uint8_t qos, uint8_t retain, uint16_t messageId )
+{
+}
+
+/**
+* Match a topic against a filter one level at a time, as the MQTT
+* specification words it.
+*
+* \param    filter		Pointer to the NUL terminated topic filter
+* \param	topic		Pointer to the NUL terminated topic
+*
+* \returns  true if the filter matches the topic.
+*/
+static bool test_reference_match ( const char* filter, const char* topic )
+{
+	if ( topic[0] == '$' && ( filter[0] == '+' || filter[0] == '#' ) )
+		return false;
+
+	for ( ;; )
+	{
+		const char* filter_end = strchr ( filter, '/' );
+		const char* topic_end  = strchr ( topic, '/' );
+		size_t filter_level = ( filter_end != NULL ) ? (size_t)( filter_end - filter ) : strlen ( filter );
+		size_t topic_level  = ( topic_end != NULL ) ? (size_t)( topic_end - topic ) : strlen ( topic );
+
+		if ( strcmp ( filter, "#" ) == 0 )
+			return true;
+		if ( ! ( filter_level == 1 && filter[0] == '+' ) &&
+			 ( filter_level != topic_level || memcmp ( filter, topic, filter_level ) != 0 ) )
+			return false;
+
+		/*
+		 * The topic ends here, "x/#" also matches "x"
+		 */
+		if ( topic_end == NULL )
+			return ( filter_end == NULL || strcmp ( filter_end, "/#" ) == 0 );
+		if ( filter_end == NULL )
+			return false;
+
+		filter = filter_end + 1;
+		topic  = topic_end + 1;
+	}
+}
+
+/**
+* Build every name of up to three levels over an alphabet.
+*
+* \param    alphabet	Pointer to the level names
+* \param	count		Level names in the alphabet
+* \param	prefix		Pointer to the name built so far
+* \param	depth		Levels left to add
+* \param	visit		Called with each name built
+*
+* \returns  None
+*/
+static void test_names ( const char* const* alphabet, uint32_t count, const char* prefix, uint32_t depth, void (*visit) ( const char* name ) )
+{
+	char name[TEST_NAME_LENGTH];
+
+	if ( depth == 0 )
+		return;
+
+	for ( uint32_t index = 0; index < count; index++ )
+	{
+		snprintf ( name, sizeof(name), "%s%s%s", prefix, ( prefix[0] != '\0' ) ? "/" : "", alphabet[index] );
+		visit ( name );
+		test_names ( alphabet, count, name, depth - 1, visit );
+	}
+}
+
+/**
+* Keep a filter, and the filter with a trailing '#'.
+*
+* \param    name		Pointer to the filter
+*
+* \returns  None
+*/
+static void test_add_filter ( const char* name )
+{
+	if ( test_filter_count + 2 <= TEST_MAX_FILTERS && strlen ( name ) + 3 <= TEST_NAME_LENGTH )
+	{
+		strcpy ( test_filter[test_filter_count++], name );
+		snprintf ( test_filter[test_filter_count++], TEST_NAME_LENGTH, "%s/#", name );
+	}
+}
+
+static mqtt_topic_node_t* test_trie = NULL;
+static uint32_t test_mismatches = 0;
+static uint32_t test_topics = 0;
+
+/**
+* Match a topic through the trie and against every filter.
+*
+* \param    topic		Pointer to the topic
+*
+* \returns  None
+*/
+static void test_match_topic ( const char* topic )
+{
+	mqtt_topic_matches_t matches;
+	uint64_t expected = 0;
+	uint64_t found    = 0;
+	uint32_t count    = 0;
+
+	for ( uint32_t index = 0; index < test_filter_count; index++ )
+	{
+		if ( test_reference_match ( test_filter[index], topic ) )
+		{
+			expected |= 1ULL << index;
+			count++;
+		}
+	}
+
+	mqtt_topic_trie_match ( test_trie, topic, strlen ( topic ), &matches );
+	for ( uint32_t index = 0; index < matches.count; index++ )
+		found |= 1ULL << (uintptr_t)matches.match[index].handlerCtx;
+
+	/*
+	 * Past MQTT_MAX_TOPIC_MATCHES the handlers are counted, not kept
+	 */
+	if ( matches.count + matches.dropped != count || ( found & ~expected ) != 0 ||
+		 ( count <= MQTT_MAX_TOPIC_MATCHES && found != expected ) )
+	{
+		if ( test_mismatches++ < 8 )
+			printf ( "  topic \"%s\": %u + %u dropped found, %u expected\n", topic, matches.count, matches.dropped, count );
+	}
+	test_topics++;
+}
+
+/**
+* The trie finds the filters the specification matches.
+*
+* \returns  None
+*/
+static void test_match ( void )
+{
+	static const char* const filter_levels[] = { "a", "+" };
+	static const char* const topic_levels[]  = { "a", "b", "", "$SYS" };
+
+	/*
+	 * Filters, "#" and "$SYS/#" on top
+	 */
+	strcpy ( test_filter[test_filter_count++], "#" );
+	strcpy ( test_filter[test_filter_count++], "$SYS/#" );
+	strcpy ( test_filter[test_filter_count++], "$SYS/+" );
+	test_names ( filter_levels, 2, "", 3, test_add_filter );
+	test_check ( test_filter_count == 3 + 2 * ( 2 + 4 + 8 ), "filter count" );
+
+	for ( uint32_t index = 0; index < test_filter_count; index++ )
+		test_check ( mqtt_topic_trie_add ( &test_trie, test_filter[index], test_handler, (void*)(uintptr_t)index ), test_filter[index] );
+
+	test_names ( topic_levels, 4, "", 3, test_match_topic );
+	test_check ( test_mismatches == 0, "trie and specification agree" );
+	printf ( "  %u filters, %u topics matched\n", test_filter_count, test_topics );
+
+	/*
+	 * Removing every filter releases every level
+	 */
+	for ( uint32_t index = 0; index < test_filter_count; index++ )
+		test_check ( mqtt_topic_trie_remove ( &test_trie, test_filter[index], test_handler, (void*)(uintptr_t)index ), "remove" );
+	test_check ( test_trie == NULL, "empty trie released" );
+}
+
+/**
+* Invalid filters are refused, handlers are removed one at a time.
+*
+* \returns  None
+*/
+static void test_edit ( void )
+{
+	static const char* const invalid[] = { "", "a#", "a/#/b", "a+", "+a", "a/b+/c", "##", "#/" };
+	mqtt_topic_node_t* trie = NULL;
+	mqtt_topic_matches_t matches;
+
+	for ( uint32_t index = 0; index < sizeof(invalid) / sizeof(invalid[0]); index++ )
+		test_check ( ! mqtt_topic_trie_add ( &trie, invalid[index], test_handler, NULL ), invalid[index] );
+	test_check ( trie == NULL, "nothing added" );
+	test_check ( ! mqtt_topic_trie_add ( &trie, "a/b", NULL, NULL ), "no handler" );
+
+	/*
+	 * Two handlers on one filter, removed one after the other
+	 */
+	test_check ( mqtt_topic_trie_add ( &trie, "a/+", test_handler, (void*)1 ), "add first handler" );
+	test_check ( mqtt_topic_trie_add ( &trie, "a/+", test_handler, (void*)2 ), "add second handler" );
+	test_check ( mqtt_topic_trie_match ( trie, "a/x", 3, &matches ) == 2, "both handlers match" );
+	test_check ( ! mqtt_topic_trie_remove ( &trie, "a/+", test_handler, (void*)3 ), "unknown handler" );
+	test_check ( ! mqtt_topic_trie_remove ( &trie, "a/b", test_handler, (void*)1 ), "unknown filter" );
+	test_check ( mqtt_topic_trie_remove ( &trie, "a/+", test_handler, (void*)1 ), "remove first handler" );
+	test_check ( mqtt_topic_trie_match ( trie, "a/x", 3, &matches ) == 1 && matches.match[0].handlerCtx == (void*)2, "second handler left" );
+	test_check ( mqtt_topic_trie_remove ( &trie, "a/+", test_handler, (void*)2 ) && trie == NULL, "remove second handler" );
+
+	/*
+	 * Handlers over MQTT_MAX_TOPIC_MATCHES are counted as dropped
+	 */
+	for ( uintptr_t index = 0; index < MQTT_MAX_TOPIC_MATCHES + 2; index++ )
+		mqtt_topic_trie_add ( &trie, "x/#", test_handler, (void*)index );
+	test_check ( mqtt_topic_trie_match ( trie, "x/y", 3, &matches ) == MQTT_MAX_TOPIC_MATCHES && matches.dropped == 2, "match limit" );
+	test_check ( mqtt_topic_trie_match ( trie, "y", 1, &matches ) == 0 && matches.dropped == 0, "no match" );
+	test_check ( mqtt_topic_trie_match ( NULL, "x", 1, &matches ) == 0, "empty trie" );
+	mqtt_topic_trie_free ( &trie );
+	test_check ( trie == NULL, "trie released" );
+}
+
+int main ( void )
+{
+	test_match ();
+	test_edit ();
+
+	return test_exit ();
+}
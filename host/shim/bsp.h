@@ -0,0 +1,37 @@
+
+/**
+* bsp.h
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief Board support definitions for the host build.
+*
+* Stands in for lib_bspMK64FN/include/bsp.h, memory comes from the C library
+* instead of the CoOS kernel heap.
+*/
+
+#ifndef INCLUDE_BSP_H_
+#define INCLUDE_BSP_H_
+
+#include <stdlib.h>
+#include <CoOS.h>
+
+#define BOARD_CORE_CLOCK		120000000U
+
+#ifndef NULL
+#define NULL					Co_NULL
+#endif
+
+#ifndef TRUE
+#define TRUE					Co_TRUE
+#endif
+
+#ifndef FALSE
+#define FALSE					Co_FALSE
+#endif
+
+#endif /* INCLUDE_BSP_H_ */
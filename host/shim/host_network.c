@@ -0,0 +1,488 @@
+/**
+* host_network.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the host loopback network.
+*
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <aef/embedded/service/service_id.h>
+#include <aef/embedded/service/service_runlevel.h>
+#include <aef/embedded/service/fnet_stack/fnet_stack_service.h>
+#include "host_network.h"
+
+#define HOST_NETWORK_LISTENERS		16
+
+/**
+* Bytes travelling one way on a connection
+*/
+typedef struct _host_pipe_def
+{
+	uint8_t		data[HOST_NETWORK_BUFFER_SIZE];
+	uint32_t	head;							// Offset of the oldest byte
+	uint32_t	used;							// Bytes waiting
+} host_pipe_t;
+
+/**
+* Loopback connection
+*/
+typedef struct _host_socket_def
+{
+	bool		open;							// Socket held by the service
+	bool		peer;							// Connection held by the peer
+	fnet_socket_state_t state;					// TCP state seen by the service
+	uint16_t	port;							// Port connected to
+	host_pipe_t	up;								// Service to peer
+	host_pipe_t	down;							// Peer to service
+} host_socket_t;
+
+static host_socket_t	host_sockets[HOST_NETWORK_SOCKETS];
+static uint16_t			host_listeners[HOST_NETWORK_LISTENERS];
+static pthread_mutex_t	host_network_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+* Copy bytes into a pipe
+*
+* \returns  Bytes copied.
+*/
+static uint32_t host_pipe_write ( host_pipe_t* pipe, const uint8_t* buffer, uint32_t length )
+{
+	uint32_t count = HOST_NETWORK_BUFFER_SIZE - pipe->used;
+
+	if ( count > length )
+		count = length;
+	for ( uint32_t index = 0; index < count; index++ )
+	{
+		pipe->data[( pipe->head + pipe->used + index ) % HOST_NETWORK_BUFFER_SIZE] = buffer[index];
+	}
+	pipe->used += count;
+	return count;
+}
+
+/**
+* Copy bytes out of a pipe
+*
+* \returns  Bytes copied.
+*/
+static uint32_t host_pipe_read ( host_pipe_t* pipe, uint8_t* buffer, uint32_t length )
+{
+	uint32_t count = ( pipe->used < length ) ? pipe->used : length;
+
+	for ( uint32_t index = 0; index < count; index++ )
+	{
+		buffer[index] = pipe->data[( pipe->head + index ) % HOST_NETWORK_BUFFER_SIZE];
+	}
+	pipe->head  = ( pipe->head + count ) % HOST_NETWORK_BUFFER_SIZE;
+	pipe->used -= count;
+	return count;
+}
+
+/**
+* Check a port has a listener, the caller holds the network lock
+*/
+static bool host_listening ( uint16_t port )
+{
+	for ( uint32_t index = 0; index < HOST_NETWORK_LISTENERS; index++ )
+	{
+		if ( host_listeners[index] == port && port != 0 )
+			return true;
+	}
+	return false;
+}
+
+/**
+* Get the socket of a service descriptor, the caller holds the network lock
+*/
+static host_socket_t* host_socket ( fnet_socket_t socket )
+{
+	if ( socket >= 0 && socket < HOST_NETWORK_SOCKETS && host_sockets[socket].open )
+		return &host_sockets[socket];
+	return NULL;
+}
+
+/**
+* Get the socket of a peer connection, the caller holds the network lock
+*/
+static host_socket_t* host_connection ( int32_t connection )
+{
+	if ( connection >= 0 && connection < HOST_NETWORK_SOCKETS && host_sockets[connection].peer )
+		return &host_sockets[connection];
+	return NULL;
+}
+
+/**
+* Open a socket
+*/
+static service_status_t host_network_socket ( socket_parms_t* parms, socket_desc_t* desc )
+{
+	if ( parms->type != SOCK_STREAM )
+		return SERVICE_FAILURE_GENERAL;
+
+	for ( fnet_socket_t index = 0; index < HOST_NETWORK_SOCKETS; index++ )
+	{
+		host_socket_t* socket = &host_sockets[index];
+		if ( ! socket->open && ! socket->peer )
+		{
+			memset ( socket, 0, sizeof(host_socket_t) );
+			socket->open  = true;
+			socket->state = SS_UNCONNECTED;
+			desc->socket  = index;
+			return SERVICE_STATUS_SUCCESS;
+		}
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Start connecting a socket, a port nobody listens on refuses it
+*/
+static service_status_t host_network_connect ( connect_parms_t* parms )
+{
+	host_socket_t* socket = host_socket ( parms->socket );
+
+	if ( socket == NULL || parms->name == NULL || socket->state != SS_UNCONNECTED || socket->port != 0 )
+		return SERVICE_FAILURE_GENERAL;
+
+	socket->port  = FNET_NTOHS(parms->name->sa_port);
+	socket->state = ( host_listening ( socket->port ) ) ? SS_CONNECTING : SS_UNCONNECTED;
+	return SERVICE_STATUS_SUCCESS;
+}
+
+/**
+* Send on a connected socket
+*/
+static service_status_t host_network_send ( send_parms_t* parms, uint32_t* bytes_transferred )
+{
+	host_socket_t* socket = host_socket ( parms->socket );
+
+	if ( socket == NULL || socket->state != SS_CONNECTED || ! socket->peer )
+		return SERVICE_FAILURE_GENERAL;
+
+	uint32_t count = host_pipe_write ( &socket->up, parms->buffer, parms->length );
+	if ( bytes_transferred != NULL )
+		*bytes_transferred = count;
+	return SERVICE_STATUS_SUCCESS;
+}
+
+/**
+* Receive on a connected socket, the bytes sent before the peer closed the
+* connection are read before the socket fails
+*/
+static service_status_t host_network_recv ( recv_parms_t* parms, uint32_t* bytes_transferred )
+{
+	host_socket_t* socket = host_socket ( parms->socket );
+
+	if ( socket == NULL || socket->state != SS_CONNECTED || ( ! socket->peer && socket->down.used == 0 ) )
+		return SERVICE_FAILURE_GENERAL;
+
+	uint32_t count = host_pipe_read ( &socket->down, parms->buffer, parms->length );
+	if ( bytes_transferred != NULL )
+		*bytes_transferred = count;
+	return SERVICE_STATUS_SUCCESS;
+}
+
+/**
+* Read a socket option, only SO_STATE is known
+*/
+static service_status_t host_network_getopt ( getopt_parms_t* parms )
+{
+	host_socket_t* socket = host_socket ( parms->socket );
+
+	if ( socket == NULL || parms->level != SOL_SOCKET || parms->optname != SO_STATE ||
+		 parms->optval == NULL || parms->optvallen == NULL || *parms->optvallen < sizeof(fnet_socket_state_t) )
+		return SERVICE_FAILURE_GENERAL;
+
+	*(fnet_socket_state_t*)parms->optval = ( socket->state == SS_CONNECTED && ! socket->peer ) ? SS_UNCONNECTED : socket->state;
+	*parms->optvallen = sizeof(fnet_socket_state_t);
+	return SERVICE_STATUS_SUCCESS;
+}
+
+/**
+* Close a socket, the peer sees the connection end
+*/
+static service_status_t host_network_close ( close_parms_t* parms )
+{
+	host_socket_t* socket = host_socket ( parms->socket );
+
+	if ( socket == NULL )
+		return SERVICE_FAILURE_GENERAL;
+
+	socket->open  = false;
+	socket->state = SS_UNCONNECTED;
+	return SERVICE_STATUS_SUCCESS;
+}
+
+static service_id_t host_network_getid ( void )
+{
+	return SRV_FNET_NETWORK;
+}
+
+static char* host_network_getname ( void )
+{
+	return (char*)"FNET";
+}
+
+static service_runlevel_t host_network_runlevel ( void )
+{
+	return SRV_RUNLEVEL2;
+}
+
+static service_status_t host_network_init ( uint32_t init_parameters )
+{
+	pthread_mutex_lock ( &host_network_lock );
+	memset ( host_sockets, 0, sizeof(host_sockets) );
+	memset ( host_listeners, 0, sizeof(host_listeners) );
+	pthread_mutex_unlock ( &host_network_lock );
+	return SERVICE_STATUS_SUCCESS;
+}
+
+static service_status_t host_network_deinit ( void )
+{
+	return SERVICE_STATUS_SUCCESS;
+}
+
+/**
+* Send a command to the loopback network.
+* The socket, connect, send, receive, option, shutdown and close commands of
+* the FNET stack service are supported.
+*
+* \param    code				I/O control code to perform
+* \param    input_buffer		Pointer to the input buffer
+* \param    input_size			Input buffer size
+* \param    output_buffer		Pointer to the output buffer
+* \param    output_size			Output buffer size
+* \param    bytes_transferred	Pointer to the actual bytes read or written
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_GENERAL if unable perform the command.
+*           SERVICE_FAILURE_INVALID_PARAMETER if a buffer is invalid.
+*/
+static service_status_t host_network_iocontrol ( uint32_t code, void* input_buffer, uint32_t input_size, void* output_buffer, uint32_t output_size, uint32_t* bytes_transferred )
+{
+	service_status_t status = SERVICE_FAILURE_GENERAL;
+
+	if ( bytes_transferred != NULL )
+		*bytes_transferred = 0;
+	if ( input_buffer == NULL )
+		return SERVICE_FAILURE_INVALID_PARAMETER;
+
+	pthread_mutex_lock ( &host_network_lock );
+	switch ( code )
+	{
+		case IOCTL_FNET_STACK_SOCKET:
+			if ( input_size == sizeof(socket_parms_t) && output_buffer != NULL && output_size == sizeof(socket_desc_t) )
+			{
+				status = host_network_socket ( (socket_parms_t*)input_buffer, (socket_desc_t*)output_buffer );
+				if ( status == SERVICE_STATUS_SUCCESS && bytes_transferred != NULL )
+					*bytes_transferred = sizeof(socket_desc_t);
+			}
+			break;
+		case IOCTL_FNET_STACK_SOCKET_CONNECT:
+			if ( input_size == sizeof(connect_parms_t) )
+				status = host_network_connect ( (connect_parms_t*)input_buffer );
+			break;
+		case IOCTL_FNET_STACK_SOCKET_SEND:
+			if ( input_size == sizeof(send_parms_t) )
+				status = host_network_send ( (send_parms_t*)input_buffer, bytes_transferred );
+			break;
+		case IOCTL_FNET_STACK_SOCKET_RECV:
+			if ( input_size == sizeof(recv_parms_t) )
+				status = host_network_recv ( (recv_parms_t*)input_buffer, bytes_transferred );
+			break;
+		case IOCTL_FNET_STACK_SOCKET_GETOPT:
+			if ( input_size == sizeof(getopt_parms_t) )
+				status = host_network_getopt ( (getopt_parms_t*)input_buffer );
+			break;
+		case IOCTL_FNET_STACK_SOCKET_SHUTDOWN:
+			if ( input_size == sizeof(shutdown_parms_t) && host_socket ( ((shutdown_parms_t*)input_buffer)->socket ) != NULL )
+				status = SERVICE_STATUS_SUCCESS;
+			break;
+		case IOCTL_FNET_STACK_SOCKET_CLOSE:
+			if ( input_size == sizeof(close_parms_t) )
+				status = host_network_close ( (close_parms_t*)input_buffer );
+			break;
+		default:
+			break;
+	}
+	pthread_mutex_unlock ( &host_network_lock );
+	return status;
+}
+
+/**
+* The loopback network service vtable
+*/
+const service_vtable_t host_network_srv_vtable =
+{
+	.getid     = host_network_getid,
+	.getname   = host_network_getname,
+	.runlevel  = host_network_runlevel,
+	.init      = host_network_init,
+	.deinit    = host_network_deinit,
+	.iocontrol = host_network_iocontrol,
+};
+
+/**
+* Start or stop listening on a port.
+* Connections already accepted are not affected.
+*
+* \param    port		Port (host byte order)
+* \param	listen		true to accept connections on the port
+*
+* \returns  None
+*/
+void host_network_listen ( uint16_t port, bool listen )
+{
+	pthread_mutex_lock ( &host_network_lock );
+	for ( uint32_t index = 0; index < HOST_NETWORK_LISTENERS; index++ )
+	{
+		if ( host_listeners[index] == port )
+			host_listeners[index] = 0;
+	}
+	for ( uint32_t index = 0; index < HOST_NETWORK_LISTENERS && listen; index++ )
+	{
+		if ( host_listeners[index] == 0 )
+		{
+			host_listeners[index] = port;
+			break;
+		}
+	}
+	pthread_mutex_unlock ( &host_network_lock );
+}
+
+/**
+* Accept a connection made to a port.
+*
+* \param    port		Port (host byte order)
+*
+* \returns  Connection, -1 if no connection is waiting.
+*/
+int32_t host_network_accept ( uint16_t port )
+{
+	int32_t connection = -1;
+
+	pthread_mutex_lock ( &host_network_lock );
+	if ( host_listening ( port ) )
+	{
+		for ( int32_t index = 0; index < HOST_NETWORK_SOCKETS; index++ )
+		{
+			host_socket_t* socket = &host_sockets[index];
+			if ( socket->open && socket->state == SS_CONNECTING && socket->port == port )
+			{
+				socket->state = SS_CONNECTED;
+				socket->peer  = true;
+				connection    = index;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock ( &host_network_lock );
+	return connection;
+}
+
+/**
+* Read the bytes the service sent on a connection.
+*
+* \param    connection	Connection
+* \param	buffer		Pointer to storage for the bytes
+* \param	length		Size of the storage
+*
+* \returns  Bytes read, -1 once the service closed the connection.
+*/
+int32_t host_network_peer_recv ( int32_t connection, uint8_t* buffer, uint32_t length )
+{
+	int32_t count = -1;
+
+	pthread_mutex_lock ( &host_network_lock );
+	host_socket_t* socket = host_connection ( connection );
+	if ( socket != NULL && ( socket->open || socket->up.used != 0 ) )
+	{
+		count = (int32_t)host_pipe_read ( &socket->up, buffer, length );
+	}
+	pthread_mutex_unlock ( &host_network_lock );
+	return count;
+}
+
+/**
+* Send bytes to the service on a connection.
+*
+* \param    connection	Connection
+* \param	buffer		Pointer to the bytes
+* \param	length		Number of bytes
+*
+* \returns  Bytes sent, less than length if the loopback is full, -1 once
+*			the service closed the connection.
+*/
+int32_t host_network_peer_send ( int32_t connection, const uint8_t* buffer, uint32_t length )
+{
+	int32_t count = -1;
+
+	pthread_mutex_lock ( &host_network_lock );
+	host_socket_t* socket = host_connection ( connection );
+	if ( socket != NULL && socket->open )
+	{
+		count = (int32_t)host_pipe_write ( &socket->down, buffer, length );
+	}
+	pthread_mutex_unlock ( &host_network_lock );
+	return count;
+}
+
+/**
+* Close a connection.
+* The service reads the bytes already sent, then its socket fails.
+*
+* \param    connection	Connection
+*
+* \returns  None
+*/
+void host_network_peer_close ( int32_t connection )
+{
+	pthread_mutex_lock ( &host_network_lock );
+	host_socket_t* socket = host_connection ( connection );
+	if ( socket != NULL )
+	{
+		socket->peer    = false;
+		socket->up.used = 0;
+	}
+	pthread_mutex_unlock ( &host_network_lock );
+}
+
+/**
+* Convert an IPv4 address literal to a socket address.
+* Stands in for the FNET routine, IPv6 literals are not supported.
+*
+* \param    str			Address literal
+* \param	addr		Pointer to the socket address
+*
+* \returns  FNET_OK if successful, FNET_ERR if the literal is invalid.
+*/
+fnet_return_t fnet_inet_ptos ( const fnet_char_t *str, struct sockaddr *addr )
+{
+	struct sockaddr_in* in = (struct sockaddr_in*)addr;
+	fnet_ip4_addr_t address = 0;
+	const char* next = (const char*)str;
+
+	if ( str == NULL || addr == NULL )
+		return FNET_ERR;
+
+	for ( uint32_t index = 0; index < 4; index++ )
+	{
+		char* end;
+		unsigned long value = strtoul ( next, &end, 10 );
+		if ( end == next || value > 255 || *end != ( ( index < 3 ) ? '.' : '\0' ) )
+			return FNET_ERR;
+		address = ( address << 8 ) | value;
+		next    = end + 1;
+	}
+	memset ( addr, 0, sizeof(struct sockaddr) );
+	in->sin_family      = AF_INET;
+	in->sin_addr.s_addr = FNET_HTONL(address);
+	return FNET_OK;
+}
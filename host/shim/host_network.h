@@ -0,0 +1,103 @@
+/**
+* host_network.h
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the host loopback network.
+*
+* Stands in for the FNET stack service.  A TCP socket opened by the service
+* under test connects over an in-memory loopback to a port a peer in the
+* test listens on, the peer reads and writes the connection through the
+* host_network_peer routines.  The connection completes when the peer
+* accepts it, is refused when nothing listens on the port, and fails on the
+* service side once the peer closes it.  Only IPv4 address literals are
+* known, there is no DNS and no UDP.
+*/
+
+#ifndef HOST_SHIM_HOST_NETWORK_H_
+#define HOST_SHIM_HOST_NETWORK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <aef/embedded/service/service_interface.h>
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+#ifndef HOST_NETWORK_SOCKETS
+	#define HOST_NETWORK_SOCKETS		16		// Loopback connections
+#endif
+
+#ifndef HOST_NETWORK_BUFFER_SIZE
+	#define HOST_NETWORK_BUFFER_SIZE	(64U * 1024U)	// Bytes in flight each way, the send buffer and the path to the peer
+#endif
+
+/**
+* The loopback network service vtable, added to the service manager by the
+* test in place of the FNET stack service.
+*/
+extern const service_vtable_t host_network_srv_vtable;
+
+/**
+* Start or stop listening on a port.
+* Connections already accepted are not affected.
+*
+* \param    port		Port (host byte order)
+* \param	listen		true to accept connections on the port
+*
+* \returns  None
+*/
+void host_network_listen ( uint16_t port, bool listen );
+
+/**
+* Accept a connection made to a port.
+*
+* \param    port		Port (host byte order)
+*
+* \returns  Connection, -1 if no connection is waiting.
+*/
+int32_t host_network_accept ( uint16_t port );
+
+/**
+* Read the bytes the service sent on a connection.
+*
+* \param    connection	Connection
+* \param	buffer		Pointer to storage for the bytes
+* \param	length		Size of the storage
+*
+* \returns  Bytes read, -1 once the service closed the connection.
+*/
+int32_t host_network_peer_recv ( int32_t connection, uint8_t* buffer, uint32_t length );
+
+/**
+* Send bytes to the service on a connection.
+*
+* \param    connection	Connection
+* \param	buffer		Pointer to the bytes
+* \param	length		Number of bytes
+*
+* \returns  Bytes sent, less than length if the loopback is full, -1 once
+*			the service closed the connection.
+*/
+int32_t host_network_peer_send ( int32_t connection, const uint8_t* buffer, uint32_t length );
+
+/**
+* Close a connection.
+* The service reads the bytes already sent, then its socket fails.
+*
+* \param    connection	Connection
+*
+* \returns  None
+*/
+void host_network_peer_close ( int32_t connection );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* HOST_SHIM_HOST_NETWORK_H_ */
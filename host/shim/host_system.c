@@ -0,0 +1,589 @@
+
+/**
+* host_system.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the host system shim.
+*
+*/
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <aef/embedded/osal/critical_section.h>
+#include <aef/embedded/osal/event.h>
+#include <aef/embedded/osal/thread.h>
+#include <aef/embedded/osal/time.h>
+#include <aef/embedded/osal/time_delay.h>
+#include <aef/embedded/system/system_core.h>
+#include <aef/embedded/system/system_management.h>
+#include <OsConfig.h>
+#include "host_system.h"
+
+#define HOST_MAX_MUTEX				CFG_MAX_MUTEX
+#define HOST_MAX_FUNCS				MAX_SYS_MANAGEMENT_FUNCS
+#define HOST_MAX_SERVICES			16
+
+/**
+* Critical sections
+*/
+static pthread_mutex_t host_mutex[HOST_MAX_MUTEX];
+static bool			   host_mutex_used[HOST_MAX_MUTEX];
+static pthread_mutex_t host_mutex_table = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+* Simulated clock, in OS ticks
+*/
+static uint64_t		   host_ticks = 0;
+
+/**
+* System management functions
+*/
+typedef struct _host_func_def
+{
+	void*					 instance;
+	system_management_func_t func;
+} host_func_t;
+
+static host_func_t	   host_funcs[HOST_MAX_FUNCS];
+static pthread_mutex_t host_funcs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+* Stub stream driver handed out by the device manager
+*/
+static char					host_driver_name[] = "HOST";
+static stream_driver_ctx_t	host_driver_ctx = { host_driver_name, NULL, 0 };
+
+static char* host_driver_getname ( void )
+{
+	return host_driver_name;
+}
+
+static stream_driver_ctx_t* host_driver_open ( char* name, uint32_t mode, uint32_t options )
+{
+	host_driver_ctx.ref_count++;
+	return &host_driver_ctx;
+}
+
+static driver_status_t host_driver_close ( stream_driver_ctx_t* ctx )
+{
+	if ( ctx->ref_count != 0 )
+		ctx->ref_count--;
+	return DRIVER_STATUS_SUCCESS;
+}
+
+static stream_driver_vtable_t host_driver =
+{
+	.getname = host_driver_getname,
+	.open    = host_driver_open,
+	.close   = host_driver_close,
+};
+
+static stream_driver_vtable_t* host_getdevice ( device_driver_id_t device_id )
+{
+	return &host_driver;
+}
+
+static device_manager_vtable_t host_device_manager =
+{
+	.getdevice   = host_getdevice,
+	.checkdevice = host_getdevice,
+};
+
+/**
+* Services added to the service manager
+*/
+static const service_vtable_t* host_services[HOST_MAX_SERVICES];
+static pthread_mutex_t host_services_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static service_vtable_t* host_getservice ( service_id_t service_id )
+{
+	service_vtable_t* service = NULL;
+
+	pthread_mutex_lock ( &host_services_lock );
+	for ( uint32_t index = 0; index < HOST_MAX_SERVICES && service == NULL; index++ )
+	{
+		if ( host_services[index] != NULL && host_services[index]->getid () == service_id )
+		{
+			service = (service_vtable_t*)host_services[index];
+		}
+	}
+	pthread_mutex_unlock ( &host_services_lock );
+	return service;
+}
+
+static service_status_t host_addservice ( const service_vtable_t* service_ptr )
+{
+	if ( service_ptr == NULL )
+		return SERVICE_FAILURE_INVALID_PARAMETER;
+
+	pthread_mutex_lock ( &host_services_lock );
+	for ( uint32_t index = 0; index < HOST_MAX_SERVICES; index++ )
+	{
+		if ( host_services[index] == NULL || host_services[index] == service_ptr )
+		{
+			host_services[index] = service_ptr;
+			pthread_mutex_unlock ( &host_services_lock );
+			return SERVICE_STATUS_SUCCESS;
+		}
+	}
+	pthread_mutex_unlock ( &host_services_lock );
+	return SERVICE_FAILURE_GENERAL;
+}
+
+static service_manager_vtable_t host_service_manager =
+{
+	.getservice   = host_getservice,
+	.checkservice = host_getservice,
+	.addservice   = host_addservice,
+};
+
+/**
+* Create and initialize a critical section
+*
+* \param    ctx		Pointer to a critical section context
+*
+* \returns  SYSTEM_STATUS_SUCCESS if successful.
+* 			SYSTEM_FAILURE_GENERAL if every mutex is in use.
+* 			SYSTEM_FAILURE_INVALID_PARAMETER on a null context pointer
+*/
+system_status_t critical_section_create (critical_section_ctx_t* ctx)
+{
+	if ( ctx == NULL )
+		return SYSTEM_FAILURE_INVALID_PARAMETER;
+
+	pthread_mutex_lock ( &host_mutex_table );
+	for ( uint32_t index = 0; index < HOST_MAX_MUTEX; index++ )
+	{
+		if ( ! host_mutex_used[index] )
+		{
+			host_mutex_used[index] = true;
+			pthread_mutex_init ( &host_mutex[index], NULL );
+			pthread_mutex_unlock ( &host_mutex_table );
+			ctx->mutex     = (OS_MutexID)index;
+			ctx->ref_count = 0;
+			return SYSTEM_STATUS_SUCCESS;
+		}
+	}
+	pthread_mutex_unlock ( &host_mutex_table );
+	return SYSTEM_FAILURE_GENERAL;
+}
+
+/**
+* Destroy a critical section
+*
+* \param    ctx		Pointer to a critical section context
+*
+* \returns  SYSTEM_STATUS_SUCCESS if successful.
+* 			SYSTEM_FAILURE_INVALID_PARAMETER on a null context pointer
+*/
+system_status_t critical_section_destroy (critical_section_ctx_t* ctx)
+{
+	if ( ctx == NULL || ctx->mutex >= HOST_MAX_MUTEX )
+		return SYSTEM_FAILURE_INVALID_PARAMETER;
+
+	pthread_mutex_lock ( &host_mutex_table );
+	pthread_mutex_destroy ( &host_mutex[ctx->mutex] );
+	host_mutex_used[ctx->mutex] = false;
+	pthread_mutex_unlock ( &host_mutex_table );
+	return SYSTEM_STATUS_SUCCESS;
+}
+
+/**
+* Enter the critical section.  This is blocking call.
+*
+* \param    ctx		Pointer to a critical section context
+*
+* \returns  SYSTEM_STATUS_SUCCESS if successful.
+* 			SYSTEM_FAILURE_INVALID_PARAMETER on a null context pointer
+*/
+system_status_t critical_section_acquire (critical_section_ctx_t* ctx)
+{
+	if ( ctx == NULL || ctx->mutex >= HOST_MAX_MUTEX )
+		return SYSTEM_FAILURE_INVALID_PARAMETER;
+
+	pthread_mutex_lock ( &host_mutex[ctx->mutex] );
+	return SYSTEM_STATUS_SUCCESS;
+}
+
+/**
+* Try to enter the critical section without blocking.
+*
+* \param    ctx		Pointer to a critical section context
+*
+* \returns  SYSTEM_STATUS_SUCCESS if the critical section was entered.
+* 			SYSTEM_FAILURE_GENERAL if another thread holds it.
+* 			SYSTEM_FAILURE_INVALID_PARAMETER on a null context pointer
+*/
+system_status_t critical_section_try_acquire (critical_section_ctx_t* ctx)
+{
+	if ( ctx == NULL || ctx->mutex >= HOST_MAX_MUTEX )
+		return SYSTEM_FAILURE_INVALID_PARAMETER;
+
+	return ( pthread_mutex_trylock ( &host_mutex[ctx->mutex] ) == 0 ) ? SYSTEM_STATUS_SUCCESS : SYSTEM_FAILURE_GENERAL;
+}
+
+/**
+* Leave the critical section.
+*
+* \param    ctx		Pointer to a critical section context
+*
+* \returns  SYSTEM_STATUS_SUCCESS if successful.
+* 			SYSTEM_FAILURE_INVALID_PARAMETER on a null context pointer
+*/
+system_status_t critical_section_release (critical_section_ctx_t* ctx)
+{
+	if ( ctx == NULL || ctx->mutex >= HOST_MAX_MUTEX )
+		return SYSTEM_FAILURE_INVALID_PARAMETER;
+
+	pthread_mutex_unlock ( &host_mutex[ctx->mutex] );
+	return SYSTEM_STATUS_SUCCESS;
+}
+
+/**
+* Get the current tick count of the simulated clock
+*
+* \param    time_ctx	Unused
+*
+* \returns  Tick count.
+*/
+uint64_t time_get_ticks (void* time_ctx)
+{
+	return __atomic_load_n ( &host_ticks, __ATOMIC_SEQ_CST );
+}
+
+/**
+* Delay the calling thread.
+* The simulated clock is advanced by the delay, at least one tick, and the
+* thread yields.
+*
+* \param    ms			Delay (ms)
+*
+* \returns  None
+*/
+void time_delay (uint32_t ms)
+{
+	uint64_t ticks = ( (uint64_t)ms * CFG_SYSTICK_FREQ ) / 1000;
+
+	__atomic_add_fetch ( &host_ticks, ( ticks != 0 ) ? ticks : 1, __ATOMIC_SEQ_CST );
+	sched_yield ();
+}
+
+/**
+* Delay the calling thread a number of ticks.
+*
+* \param    ticks		Delay (ticks)
+*
+* \returns  None
+*/
+void time_delay_ticks (uint32_t ticks)
+{
+	__atomic_add_fetch ( &host_ticks, ticks, __ATOMIC_SEQ_CST );
+	sched_yield ();
+}
+
+/**
+* Advance the simulated clock.
+*
+* \param    ms			Time to advance (ms)
+*
+* \returns  None
+*/
+void host_clock_advance ( uint32_t ms )
+{
+	__atomic_add_fetch ( &host_ticks, ( (uint64_t)ms * CFG_SYSTICK_FREQ ) / 1000, __ATOMIC_SEQ_CST );
+}
+
+/**
+* Get the wall clock time.
+*
+* \param    None
+*
+* \returns  Monotonic time in ns.
+*/
+uint64_t host_time_ns ( void )
+{
+	struct timespec now;
+
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/**
+* Retrieve the device manager vtable pointer
+*
+* \param    None
+*
+* \returns  device_manager_vtable_t pointer for the device manager.
+*/
+device_manager_vtable_t* system_get_device_manager (void)
+{
+	return &host_device_manager;
+}
+
+/**
+* Retrieve the service manager vtable pointer
+* The services are not started by the shim, the test initializes and
+* starts the services it adds.
+*
+* \param    None
+*
+* \returns  service_manager_vtable_t pointer for the service manager.
+*/
+service_manager_vtable_t* system_get_service_manager (void)
+{
+	return &host_service_manager;
+}
+
+/**
+* Create a thread.
+* The host build runs the service tasks from host_system_management_run,
+* threads are not supported.
+*
+* \returns  SYSTEM_FAILURE_UNSUPPORTED_OPERATION
+*/
+system_status_t
+thread_create(thread_ctx_t* ctx, uint32_t stack_size, uint32_t quantum, uint32_t priority, uint32_t attributes, FUNCPtr address, uint32_t parameter)
+{
+	return SYSTEM_FAILURE_UNSUPPORTED_OPERATION;
+}
+
+/**
+* Destroy a thread.
+*
+* \returns  SYSTEM_FAILURE_UNSUPPORTED_OPERATION
+*/
+system_status_t
+thread_destroy(thread_ctx_t* ctx)
+{
+	return SYSTEM_FAILURE_UNSUPPORTED_OPERATION;
+}
+
+/**
+* Start a thread.
+*
+* \returns  SYSTEM_FAILURE_UNSUPPORTED_OPERATION
+*/
+system_status_t
+thread_start(thread_ctx_t* ctx)
+{
+	return SYSTEM_FAILURE_UNSUPPORTED_OPERATION;
+}
+
+/**
+* Suspend a thread.
+*
+* \returns  None
+*/
+void
+thread_suspend(thread_ctx_t* ctx)
+{
+	sched_yield ();
+}
+
+/**
+* Create an event.
+* Events never block on the host, a wait takes the event if it is set and
+* times out otherwise.
+*
+* \param    ctx				Pointer to an event context
+* \param    name			Event name
+* \param    manual_reset	true if a wait leaves the event set
+* \param    initial_state	true to create the event set
+*
+* \returns  SYSTEM_STATUS_SUCCESS if successful.
+* 			SYSTEM_FAILURE_INVALID_PARAMETER on a null context pointer
+*/
+system_status_t event_create (event_ctx_t* ctx, char* name, bool manual_reset, bool initial_state)
+{
+	if ( ctx == NULL )
+		return SYSTEM_FAILURE_INVALID_PARAMETER;
+
+	ctx->name         = name;
+	ctx->manual_reset = manual_reset;
+	ctx->event_mask   = ( initial_state ) ? 1 : 0;
+	return SYSTEM_STATUS_SUCCESS;
+}
+
+/**
+* Destroy an event.
+*
+* \param    ctx				Pointer to an event context
+*
+* \returns  SYSTEM_STATUS_SUCCESS if successful.
+* 			SYSTEM_FAILURE_INVALID_PARAMETER on a null context pointer
+*/
+system_status_t event_destroy (event_ctx_t* ctx)
+{
+	if ( ctx == NULL )
+		return SYSTEM_FAILURE_INVALID_PARAMETER;
+
+	ctx->event_mask = 0;
+	return SYSTEM_STATUS_SUCCESS;
+}
+
+/**
+* Wait for an event.
+*
+* \param    ctx				Pointer to an event context
+* \param    timeout			Unused, the wait does not block
+*
+* \returns  SYSTEM_STATUS_SUCCESS if the event was set.
+* 			SYSTEM_FAILURE_TIMEOUT if the event was not set.
+* 			SYSTEM_FAILURE_INVALID_PARAMETER on a null context pointer
+*/
+system_status_t event_wait_single (event_ctx_t* ctx, uint32_t timeout)
+{
+	if ( ctx == NULL )
+		return SYSTEM_FAILURE_INVALID_PARAMETER;
+
+	if ( __atomic_load_n ( &ctx->event_mask, __ATOMIC_SEQ_CST ) == 0 )
+	{
+		sched_yield ();
+		return SYSTEM_FAILURE_TIMEOUT;
+	}
+	if ( ! ctx->manual_reset )
+	{
+		__atomic_store_n ( &ctx->event_mask, 0, __ATOMIC_SEQ_CST );
+	}
+	return SYSTEM_STATUS_SUCCESS;
+}
+
+/**
+* Set an event.
+*
+* \param    ctx				Pointer to an event context
+*
+* \returns  SYSTEM_STATUS_SUCCESS if successful.
+* 			SYSTEM_FAILURE_INVALID_PARAMETER on a null context pointer
+*/
+system_status_t event_signal(event_ctx_t* ctx)
+{
+	if ( ctx == NULL )
+		return SYSTEM_FAILURE_INVALID_PARAMETER;
+
+	__atomic_store_n ( &ctx->event_mask, 1, __ATOMIC_SEQ_CST );
+	return SYSTEM_STATUS_SUCCESS;
+}
+
+/**
+* Attach a system management function
+*
+* \param	name		System management function name
+* \param 	instance	System management function instance data
+* \param	func		System management function pointer
+*
+* \returns  SYSTEM_STATUS_SUCCESS if successful.
+*           SYSTEM_FAILURE_GENERAL if every entry is taken.
+*           SYSTEM_FAILURE_INVALID_PARAMETER if an invalid parameter.
+*/
+system_status_t system_management_func_attach (char* name, void* instance, system_management_func_t func)
+{
+	if ( func == NULL )
+		return SYSTEM_FAILURE_INVALID_PARAMETER;
+
+	pthread_mutex_lock ( &host_funcs_lock );
+	for ( uint32_t index = 0; index < HOST_MAX_FUNCS; index++ )
+	{
+		if ( host_funcs[index].func == NULL )
+		{
+			host_funcs[index].instance = instance;
+			host_funcs[index].func     = func;
+			pthread_mutex_unlock ( &host_funcs_lock );
+			return SYSTEM_STATUS_SUCCESS;
+		}
+	}
+	pthread_mutex_unlock ( &host_funcs_lock );
+	return SYSTEM_FAILURE_GENERAL;
+}
+
+/**
+* Detach a system management function
+*
+* \param	func		System management function pointer
+*
+* \returns  SYSTEM_STATUS_SUCCESS if successful.
+*           SYSTEM_FAILURE_GENERAL if the function is not attached.
+*           SYSTEM_FAILURE_INVALID_PARAMETER if an invalid parameter.
+*/
+system_status_t system_management_func_detach (system_management_func_t func)
+{
+	system_status_t status = SYSTEM_FAILURE_GENERAL;
+
+	if ( func == NULL )
+		return SYSTEM_FAILURE_INVALID_PARAMETER;
+
+	pthread_mutex_lock ( &host_funcs_lock );
+	for ( uint32_t index = 0; index < HOST_MAX_FUNCS; index++ )
+	{
+		if ( host_funcs[index].func == func )
+		{
+			memset ( &host_funcs[index], 0, sizeof(host_func_t) );
+			status = SYSTEM_STATUS_SUCCESS;
+		}
+	}
+	pthread_mutex_unlock ( &host_funcs_lock );
+	return status;
+}
+
+/**
+* Detach the system management function of an instance
+*
+* \param 	instance	System management function instance data
+*
+* \returns  SYSTEM_STATUS_SUCCESS if successful.
+*           SYSTEM_FAILURE_GENERAL if no function of the instance is attached.
+*           SYSTEM_FAILURE_INVALID_PARAMETER if the instance is NULL.
+*/
+system_status_t system_management_instance_detach (void* instance)
+{
+	if ( instance == NULL )
+		return SYSTEM_FAILURE_INVALID_PARAMETER;
+
+	pthread_mutex_lock ( &host_funcs_lock );
+	for ( uint32_t index = 0; index < HOST_MAX_FUNCS; index++ )
+	{
+		if ( host_funcs[index].instance == instance )
+		{
+			memset ( &host_funcs[index], 0, sizeof(host_func_t) );
+			pthread_mutex_unlock ( &host_funcs_lock );
+			return SYSTEM_STATUS_SUCCESS;
+		}
+	}
+	pthread_mutex_unlock ( &host_funcs_lock );
+	return SYSTEM_FAILURE_GENERAL;
+}
+
+/**
+* Run every attached system management function once.
+*
+* \param    None
+*
+* \returns  Number of functions run.
+*/
+uint32_t host_system_management_run ( void )
+{
+	host_func_t funcs[HOST_MAX_FUNCS];
+	uint32_t	run = 0;
+
+	pthread_mutex_lock ( &host_funcs_lock );
+	memcpy ( funcs, host_funcs, sizeof(funcs) );
+	pthread_mutex_unlock ( &host_funcs_lock );
+
+	for ( uint32_t index = 0; index < HOST_MAX_FUNCS; index++ )
+	{
+		if ( funcs[index].func != NULL )
+		{
+			funcs[index].func ( funcs[index].instance );
+			run++;
+		}
+	}
+	return run;
+}
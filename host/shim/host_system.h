@@ -0,0 +1,63 @@
+
+/**
+* host_system.h
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the host system shim.
+*
+* The host build links the services against this shim instead of the CoOS
+* kernel, the OSAL and the system core.  Critical sections are pthread
+* mutexes, the tick count is a simulated clock advanced by time_delay and
+* by the test, and the system management functions attached by a service
+* run when the test calls host_system_management_run.  The device manager
+* hands out a stub stream driver for every device, the service manager
+* hands out the services the test added.  Threads are not supported and
+* events never block, so services run from system management.
+*/
+
+#ifndef HOST_SHIM_HOST_SYSTEM_H_
+#define HOST_SHIM_HOST_SYSTEM_H_
+
+#include <stdint.h>
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+/**
+* Advance the simulated clock.
+*
+* \param    ms			Time to advance (ms)
+*
+* \returns  None
+*/
+void host_clock_advance ( uint32_t ms );
+
+/**
+* Run every attached system management function once.
+*
+* \param    None
+*
+* \returns  Number of functions run.
+*/
+uint32_t host_system_management_run ( void );
+
+/**
+* Get the wall clock time.
+*
+* \param    None
+*
+* \returns  Monotonic time in ns.
+*/
+uint64_t host_time_ns ( void );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* HOST_SHIM_HOST_SYSTEM_H_ */
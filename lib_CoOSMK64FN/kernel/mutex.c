@@ -204,6 +204,64 @@ StatusType CoEnterMutexSection(OS_MutexID mutexID)
 }
 
 
+/**	
+ *******************************************************************************		 	
+ * @brief      Enter a critical area if it is free  
+ * @param[in]  mutexID    Specify mutex. 	 
+ * @param[out] None   
+ * @retval     E_INVALID_ID  Invalid mutex id. 	
+ * @retval     E_CALL        Error call in ISR.
+ * @retval     E_OS_IN_LOCK  OS is locked.
+ * @retval     E_TIMEOUT     Mutex is occupied, the caller was not blocked.
+ * @retval     E_OK          Enter critical area successful.
+ *
+ * @par Description
+ * @details    This function is called to enter a critical area without
+ *             waiting for it.  The owner of an occupied mutex is left alone.
+ * @note 
+ *******************************************************************************
+ */
+StatusType CoTryEnterMutexSection(OS_MutexID mutexID)
+{
+    P_OSTCB pCurTcb;
+    P_MUTEX pMutex;
+
+    if(OSIntNesting > 0)                /* If the caller is ISR               */
+    {
+        return E_CALL;
+    }
+    if(OSSchedLock != 0)                /* Is OS lock?                        */
+    {								 
+        return E_OS_IN_LOCK;            /* Yes,error return                   */
+    }	
+
+#if CFG_PAR_CHECKOUT_EN >0
+    if(mutexID >= MutexFreeID)          /* Invalid 'mutexID'                  */
+    {
+        return E_INVALID_ID;	
+    }
+#endif
+
+    OsSchedLock();
+    pCurTcb = TCBRunning;
+    pMutex  = &MutexTbl[mutexID];
+    
+    if(pMutex->mutexFlag != MUTEX_FREE)       /* If mutex is occupied         */
+    {
+        OsSchedUnlock();
+        return E_TIMEOUT;
+    }
+    
+    pCurTcb->mutexID     = mutexID;
+    pMutex->originalPrio = pCurTcb->prio;     /* Save priority of owning task */   
+    pMutex->taskID       = pCurTcb->taskID;   /* Acquire the resource         */
+    pMutex->hipriTaskID  = pCurTcb->taskID;
+    pMutex->mutexFlag    = MUTEX_OCCUPY;      /* Occupy the mutex resource    */
+    OsSchedUnlock();
+    return E_OK;			
+}
+
+
 /**
  *******************************************************************************
  * @brief      Leave from a critical area	 
@@ -41,6 +41,7 @@
 #define UART_FLUSH				0x804
 #define UART_WAITFORDONE		0x805
 #define UART_SETMODE			0x806
+#define UART_READAVAIL			0x807
 
 /*
 * UART device driver I/O Control codes
@@ -52,6 +53,7 @@
 #define IOCTL_UART_FLUSH		DEVIOCTLCODE(DEVICE_TYPE_UART,UART_FLUSH,METHOD_DIRECT,DEVICE_ANY_ACCESS)
 #define IOCTL_UART_WAITFORDONE	DEVIOCTLCODE(DEVICE_TYPE_UART,UART_WAITFORDONE,METHOD_DIRECT,DEVICE_ANY_ACCESS)
 #define IOCTL_UART_SETMODE		DEVIOCTLCODE(DEVICE_TYPE_UART,UART_SETMODE,METHOD_DIRECT,DEVICE_ANY_ACCESS)
+#define IOCTL_UART_READAVAIL	DEVIOCTLCODE(DEVICE_TYPE_UART,UART_READAVAIL,METHOD_DIRECT,DEVICE_ANY_ACCESS)
 
 #define	UARTMODE_RAW			0x00000000
 #define	UARTMODE_LINE			0x00000001
@@ -66,12 +66,12 @@ system_status_t critical_section_destroy (critical_section_ctx_t* ctx);
 system_status_t critical_section_acquire (critical_section_ctx_t* ctx);
 
 /**
-* Try to enter the critical critical section
+* Try to enter the critical critical section without blocking
 *
 * \param    ctx		Pointer to a critical section context
 *
 * \returns  SYSTEM_STATUS_SUCCESS if successful.
-* 			SYSTEM_FAILURE_GENERAL on failure to enter the critical section
+* 			An error value if the critical section is held by another task
 */
 system_status_t critical_section_try_acquire (critical_section_ctx_t* ctx);
 
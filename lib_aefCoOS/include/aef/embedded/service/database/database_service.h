@@ -40,6 +40,13 @@
 #define DATABASE_UPDATE_RECORD				0x805
 #define	DATABASE_DELETE_RECORD				0x806
 #define DATABASE_GARBAGE_COLLECTION			0x807
+#define DATABASE_GET_STATISTICS				0x808
+#define DATABASE_RESET_STATISTICS			0x809
+#define DATABASE_SYNC						0x80A
+#define DATABASE_GET_SPARE_SECTORS			0x80B
+#define DATABASE_OPEN_CURSOR				0x80C
+#define DATABASE_FETCH_CURSOR				0x80D
+#define DATABASE_CLOSE_CURSOR				0x80E
 
 /*
 * Database service I/O Control codes
@@ -52,6 +59,111 @@
 #define IOCTL_DATABASE_UPDATE_RECORD		SRVIOCTLCODE(SERVICE_TYPE_DATABASE,DATABASE_UPDATE_RECORD,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
 #define IOCTL_DATABASE_DELETE_RECORD		SRVIOCTLCODE(SERVICE_TYPE_DATABASE,DATABASE_DELETE_RECORD,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
 #define IOCTL_DATABASE_GARBAGE_COLLECTION	SRVIOCTLCODE(SERVICE_TYPE_DATABASE,DATABASE_GARBAGE_COLLECTION,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_DATABASE_GET_STATISTICS		SRVIOCTLCODE(SERVICE_TYPE_DATABASE,DATABASE_GET_STATISTICS,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_DATABASE_RESET_STATISTICS		SRVIOCTLCODE(SERVICE_TYPE_DATABASE,DATABASE_RESET_STATISTICS,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_DATABASE_SYNC					SRVIOCTLCODE(SERVICE_TYPE_DATABASE,DATABASE_SYNC,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_DATABASE_GET_SPARE_SECTORS	SRVIOCTLCODE(SERVICE_TYPE_DATABASE,DATABASE_GET_SPARE_SECTORS,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_DATABASE_OPEN_CURSOR			SRVIOCTLCODE(SERVICE_TYPE_DATABASE,DATABASE_OPEN_CURSOR,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_DATABASE_FETCH_CURSOR			SRVIOCTLCODE(SERVICE_TYPE_DATABASE,DATABASE_FETCH_CURSOR,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_DATABASE_CLOSE_CURSOR			SRVIOCTLCODE(SERVICE_TYPE_DATABASE,DATABASE_CLOSE_CURSOR,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+
+/**
+* Database definitions
+*/
+#ifndef DATABASE_GC_SLICE_BLOCKS
+	#define DATABASE_GC_SLICE_BLOCKS		2		// Live blocks relocated per garbage collection slice
+#endif
+
+#ifndef DATABASE_GC_FREE_THRESHOLD
+	#define DATABASE_GC_FREE_THRESHOLD		32		// Free block count below which background garbage collection runs
+#endif
+
+#ifndef DATABASE_SPARE_SECTORS
+	#define DATABASE_SPARE_SECTORS			1		// Erased sectors kept in reserve by background garbage collection
+#endif
+
+#ifndef DATABASE_MAX_CURSORS
+	#define DATABASE_MAX_CURSORS			2		// Record cursors that can be open at the same time
+#endif
+
+#ifndef DATABASE_WEAR_LEVEL_THRESHOLD
+	#define DATABASE_WEAR_LEVEL_THRESHOLD	64		// Erase count spread at which cold sectors are relocated
+#endif
+
+#ifndef DATABASE_WEAR_LEVEL_HYSTERESIS
+	#define DATABASE_WEAR_LEVEL_HYSTERESIS	16		// Spread drop that ends wear leveling, and rise before a stalled one is retried
+#endif
+
+#ifndef DATABASE_CACHE_SIZE
+	#define DATABASE_CACHE_SIZE				2048	// RAM budget of the write-back record cache in bytes, 0 to disable
+#endif
+
+#ifndef DATABASE_CACHE_FLUSH_INTERVAL
+	#define DATABASE_CACHE_FLUSH_INTERVAL	1000	// Maximum time in ms a cached update waits for its group commit
+#endif
+
+#define DATABASE_MAX_RECORD_SIZE			1024	// Largest record, one database block
+
+/**
+* Database configuration structure definition.
+* Passed to IOCTL_DATABASE_INITIALIZE to enable record protection.  The nonce
+* must be fresh on every boot, for example read from the crypto manager PRNG.
+*/
+typedef struct _database_config_def
+{
+	uint8_t		encryption_key[16];		// AES-128-CTR record encryption key
+	uint8_t		authentication_key[32];	// HMAC-SHA256 record authentication key
+	uint8_t		nonce[8];				// Per-boot part of the record IVs
+} database_config_t;
+
+/**
+* Database cursor fetch structure definition.
+* Passed to IOCTL_DATABASE_FETCH_CURSOR.  The records are returned back to
+* back in the output buffer, each starting with its EntryHeader_t, whose
+* encBytes field holds the record length, and padded to a multiple of 4
+* bytes.  No bytes are returned once the cursor has passed the last record.
+*/
+typedef struct _database_cursor_fetch_def
+{
+	uint32_t	cursor;					// Cursor returned by IOCTL_DATABASE_OPEN_CURSOR
+	uint32_t	count;					// Maximum number of records to return
+} database_cursor_fetch_t;
+
+/**
+* Database statistics structure definition.
+* Returned by IOCTL_DATABASE_GET_STATISTICS.
+*/
+typedef struct _database_statistics_def
+{
+	uint32_t	flash_reads;			// Serial flash read transactions
+	uint32_t	flash_read_bytes;		// Serial flash bytes read
+	uint32_t	flash_programs;			// Serial flash page program transactions
+	uint32_t	flash_program_bytes;	// Serial flash bytes programmed
+	uint32_t	flash_erases;			// Serial flash erase transactions
+	uint32_t	flash_busy_polls;		// Serial flash status polls while busy
+	uint32_t	flash_program_max_polls;// Longest serial flash page program in status polls
+	uint32_t	flash_program_ticks;	// OS ticks spent programming the serial flash
+	uint32_t	flash_erase_ticks;		// OS ticks spent erasing the serial flash
+	uint32_t	flash_read_ahead_hits;	// Serial flash reads served from the read-ahead buffer
+	uint32_t	flash_read_ahead_fills;	// Serial flash read-ahead buffer fills
+	uint32_t	flash_read_cycles;		// CPU cycles spent in serial flash reads
+	uint32_t	flash_erase_suspends;	// Background erases suspended for a foreground access
+	uint32_t	index_entries;			// Records held in the block index
+	uint32_t	free_blocks;			// Free blocks available for allocation
+	uint32_t	gc_relocations;			// Live blocks relocated by garbage collection
+	uint32_t	gc_compactions;			// Sectors compacted by garbage collection
+	uint32_t	spare_sectors;			// Erased sectors held in reserve
+	uint32_t	wear_min_erases;		// Erase count of the least worn sector in use
+	uint32_t	wear_max_erases;		// Erase count of the most worn sector
+	uint32_t	wear_total_erases;		// Erase count of all sectors
+	uint32_t	wear_levelings;			// Cold sectors relocated to even out wear
+	uint32_t	cache_hits;				// Record reads served from the write-back cache
+	uint32_t	cache_misses;			// Cacheable record reads served from flash
+	uint32_t	cache_coalesced;		// Record updates merged into a pending write
+	uint32_t	cache_commits;			// Group commits of the write-back cache
+	uint32_t	cache_committed;		// Records written to flash by group commits
+	uint32_t	auth_failures;			// Protected records that failed authentication
+} database_statistics_t;
 
 /**
 * Record types.
@@ -63,6 +175,7 @@ enum RecordType
     RecordTypeEKeyEntry                         =    0x02,	// eKey entry
     RecordTypeUserPreferences                   =    0x03,	// User preferences
     RecordTypeSuperBlock                        =    0x04,	// Super block
+    RecordTypeMqttMessage                       =    0x05,	// Queued MQTT publish
     RecordTypeInvalid                           =    0xFF	// Invalid record type
 };
 
@@ -113,9 +226,12 @@ struct _BlockEntry_def
     //Record type.  See RecordType.
     uint8_t recordType;
 
-    //Two reserved bytes that must be 0xFF, 0xFF
+    //Protection indicator.  Is this entry encrypted and authenticated?
+    uint8_t protInd;
+
+    //One reserved byte that must be 0xFF
     //Used to round this structure to 24 bytes.
-    uint8_t reserved[2];
+    uint8_t reserved[1];
 
     //size of this UUID.  Typically 6 or 16.
     uint8_t uuidSize;
@@ -132,11 +248,11 @@ struct _EntryHeader_def
 {
 	BlockEntry_t block_entry;
 
-    //The encryption IV for this field.  AES-128-CBC.
+    //The encryption IV for this field.  AES-128-CTR initial counter block.
     uint8_t IV[16];
 
-    //This is the first set of bytes encrypted in each record.  Needed for
-    //CBC-MAC to be secure.
+    //This is the first set of bytes encrypted in each record.  Total size of
+    //the record, so the MAC covers the record length.
     uint16_t encBytes;
 } __attribute__((__packed__));
 typedef struct _EntryHeader_def EntryHeader_t;
@@ -146,7 +262,7 @@ typedef struct _EntryHeader_def EntryHeader_t;
  */
 struct _EntryFooter_def
 {
-    //The CBC-MAC of this entry.
+    //The HMAC-SHA256 of this entry, computed over the ciphertext.
     uint8_t mac[32];
 } __attribute__((__packed__));
 typedef struct _EntryFooter_def EntryFooter_t;
@@ -175,8 +291,12 @@ struct _SuperBlockHeader_def
     //Generation of this block.  Used for garbage collection.
     uint32_t generation;
 
+    //Number of times the sector holding this superblock has been erased.
+    //Used for wear leveling.  0xFFFFFFFF in databases that predate it.
+    uint32_t eraseCount;
+
     //Reserved for future use.  Round the structure out to 32 bytes.
-    uint8_t reserved[23];
+    uint8_t reserved[19];
 } __attribute__((__packed__));
 typedef struct _SuperBlockHeader_def SuperBlockHeader_t;
 
@@ -368,10 +488,10 @@ _Static_assert(((sizeof(UserPreferences_t) - sizeof(EntryHeader_t) + 2) % 16) ==
 
 //The record management bytes include all bytes up to and including the IV.
 //There are only two bytes after the IV -- the encrypted bytes -- which must be
-//part of the encrypted payload and the AES-CBC-MAC payload as per proper
+//part of the encrypted payload and the HMAC payload as per proper
 //cryptographic use of these algorithms.  Therefore, this size should be
 //sizeof(EntryHeader) - sizeof(EntryHeader::encBytes)
-#define RECORD_MANAGEMENT_BYTES_SIZE (sizeof(EntryHeader_t) - sizeof(EntryHeader_t::encBytes))
+#define RECORD_MANAGEMENT_BYTES_SIZE (sizeof(EntryHeader_t) - sizeof(((EntryHeader_t*)0)->encBytes))
 
 //The PROTECTED region covers all of the record EXCEPT the footer and the first two bytes
 #define HEADER_PROTECTED_SIZE ((sizeof(DatabaseHeader_t) - RECORD_MANAGEMENT_BYTES_SIZE) - sizeof(EntryFooter_t))
@@ -385,4 +505,8 @@ _Static_assert(((sizeof(UserPreferences_t) - sizeof(EntryHeader_t) + 2) % 16) ==
 #define EKEY_PROTECTED_SIZE ((sizeof(EKeyEntry_t) - RECORD_MANAGEMENT_BYTES_SIZE) - sizeof(EntryFooter_t))
 #define EKEY_PROTECTED_OFFSET RECORD_MANAGEMENT_BYTES_SIZE
 
+//The PROTECTED region covers all of the user preferences EXCEPT the footer and the first two bytes
+#define PREFERENCES_PROTECTED_SIZE ((sizeof(UserPreferences_t) - RECORD_MANAGEMENT_BYTES_SIZE) - sizeof(EntryFooter_t))
+#define PREFERENCES_PROTECTED_OFFSET RECORD_MANAGEMENT_BYTES_SIZE
+
 #endif /* INCLUDE_AEF_EMBEDDED_SERVICE_DATABASE_DATABASE_SERVICE_H_ */
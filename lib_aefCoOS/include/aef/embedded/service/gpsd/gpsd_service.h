@@ -41,6 +41,11 @@ extern "C" {
 #define GPSD_ENABLE_CALLBACK		0x801
 #define GPSD_DISABLE_CALLBACK		0x802
 #define GPSD_POLL					0x803
+#define GPSD_POLL_FIX				0x804
+#define GPSD_SET_PROTOCOL			0x805
+#define GPSD_SUBSCRIBE				0x806
+#define GPSD_UNSUBSCRIBE			0x807
+#define GPSD_READ_FIXES				0x808
 
 /**
 * GPSD service I/O Control codes
@@ -49,6 +54,56 @@ extern "C" {
 #define IOCTL_GPSD_ENABLE_CALLBACK	SRVIOCTLCODE(SERVICE_TYPE_GPSD,GPSD_ENABLE_CALLBACK,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
 #define IOCTL_GPSD_DISABLE_CALLBACK	SRVIOCTLCODE(SERVICE_TYPE_GPSD,GPSD_DISABLE_CALLBACK,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
 #define IOCTL_GPSD_POLL				SRVIOCTLCODE(SERVICE_TYPE_GPSD,GPSD_POLL,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_GPSD_POLL_FIX			SRVIOCTLCODE(SERVICE_TYPE_GPSD,GPSD_POLL_FIX,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_GPSD_SET_PROTOCOL		SRVIOCTLCODE(SERVICE_TYPE_GPSD,GPSD_SET_PROTOCOL,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_GPSD_SUBSCRIBE		SRVIOCTLCODE(SERVICE_TYPE_GPSD,GPSD_SUBSCRIBE,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_GPSD_UNSUBSCRIBE		SRVIOCTLCODE(SERVICE_TYPE_GPSD,GPSD_UNSUBSCRIBE,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_GPSD_READ_FIXES		SRVIOCTLCODE(SERVICE_TYPE_GPSD,GPSD_READ_FIXES,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+
+/**
+* GPSD service configuration
+*/
+#ifndef GPSD_READER_THREAD
+	#define GPSD_READER_THREAD			1		// 1 to read the GPS device on its own task, 0 to poll it from the system management task
+#endif
+
+#ifndef GPSD_READER_STACK_SIZE
+	#define GPSD_READER_STACK_SIZE		512		// Reader task stack size (words)
+#endif
+
+#ifndef GPSD_READER_PRIORITY
+	#define GPSD_READER_PRIORITY		TASK_PRIORITY_ABOVE_NORMAL	// Reader task priority
+#endif
+
+#ifndef GPSD_READER_TIMEOUT
+	#define GPSD_READER_TIMEOUT			100		// Longest sleep of the reader task without a complete sentence (ms)
+#endif
+
+#ifndef GPSD_READ_SIZE
+	#define GPSD_READ_SIZE				64		// Bytes taken from the UART per driver call
+#endif
+
+#ifndef GPSD_UBX_POLL
+	#define GPSD_UBX_POLL				10		// Sleep of the reader task while the receiver outputs UBX, frames carry no line end (ms)
+#endif
+
+#ifndef GPSD_UBX_SAT_RATE
+	#define GPSD_UBX_SAT_RATE			10		// Navigation solutions per NAV-SAT report, 0 to disable NAV-SAT
+#endif
+
+#ifndef GPSD_HISTORY_SIZE
+	#define GPSD_HISTORY_SIZE			32		// Fixes kept for subscribers, a power of two
+#endif
+
+#ifndef GPSD_MAX_SUBSCRIBERS
+	#define GPSD_MAX_SUBSCRIBERS		4		// Subscribers reading the fix history
+#endif
+
+/**
+* GPSD receiver protocols
+*/
+#define GPSD_PROTOCOL_NMEA			0		// NMEA0183 sentences
+#define GPSD_PROTOCOL_UBX			1		// u-blox UBX binary NAV-PVT and NAV-SAT messages
 
 /**
 * Function pointer definition for GPSD callback function
@@ -65,6 +120,18 @@ typedef struct _gpsd_init_parms_def
 	gpsd_callback_func_t cbfunc;
 } gpsd_init_parms_t;
 
+/**
+* GPSD receiver protocol parameter structure definition
+* The receiver is configured with u-blox UBX configuration messages.  Both
+* protocols are decoded whatever the receiver is set to output.
+*/
+typedef struct _gpsd_protocol_parms_def
+{
+	uint32_t protocol;				// GPSD_PROTOCOL_NMEA or GPSD_PROTOCOL_UBX
+	uint32_t period;				// Time between fixes (ms), 0 to leave unchanged
+	uint32_t baud;					// Receiver baud rate, 0 to leave unchanged
+} gpsd_protocol_parms_t;
+
 
 /**
 * The structure describing an uncertainty volume in kinematic space.
@@ -117,6 +184,66 @@ typedef struct gps_fix_def
     double epc;				/* Vertical speed uncertainty */
 } gps_fix_t;
 
+/**
+* The fix in integer units, as kept by the GPSD service and returned by
+* IOCTL_GPSD_POLL_FIX.  Reading it needs no floating point, IOCTL_GPSD_POLL
+* returns the same fix converted to a gps_fix_t.
+*/
+typedef struct gps_fix_int_def
+{
+    uint32_t time;			/* UTC time of day of the update, milliseconds */
+    int32_t  mode;			/* Mode of fix, MODE_xxx */
+    int32_t  latitude;		/* Latitude in 1e-7 degrees (valid if mode >= 2) */
+    int32_t  longitude;		/* Longitude in 1e-7 degrees (valid if mode >= 2) */
+    int32_t  altitude;		/* Altitude in millimeters (valid if mode == 3) */
+    int32_t  track;			/* Course made good (relative to true north), centidegrees */
+    int32_t  speed;			/* Speed over ground, millimeters/sec */
+    int32_t  climb;			/* Vertical speed, millimeters/sec */
+    int32_t  satellites_used;		/* Satellites used in the fix */
+    int32_t  satellites_visible;	/* Satellites tracked, 0 if not reported */
+} gps_fix_int_t;
+
+/**
+* Convert an integer fix to a gps_fix_t.
+* The time is converted to the hhmmss.sss form the NMEA sentences carry.
+*
+* \param    fix				Pointer to the integer fix
+* \param	gps_fix_data	Pointer to the gps_fix_t to fill in
+*
+* \returns  none
+*/
+void gpsd_fix_to_double ( const gps_fix_int_t* fix, gps_fix_t* gps_fix_data );
+
+/**
+* Fix history record structure definition, returned by IOCTL_GPSD_READ_FIXES.
+* Every epoch the service decodes gets the next sequence number, a gap in
+* the sequence numbers a subscriber reads is fixes it skipped or that were
+* overwritten before it read them.
+*/
+typedef struct _gpsd_fix_record_def
+{
+	uint32_t sequence;				// Fix number
+	uint64_t ticks;					// Tick count the fix was decoded
+	gps_fix_int_t fix;				// The fix
+} gpsd_fix_record_t;
+
+/**
+* GPSD subscription parameter structure definition
+* A fix passes the filter of a subscriber when it is the first one, when
+* the mode changed or when any of the thresholds set is reached against
+* the last fix the subscriber read.  Thresholds left 0 are not checked, a
+* filter with none set passes every fix.
+*/
+typedef struct _gpsd_subscribe_parms_def
+{
+	uint32_t distance;				// Movement that passes the filter (mm)
+	uint32_t heading;				// Track change that passes the filter (centidegrees)
+	uint32_t speed;					// Speed change that passes the filter (mm/s)
+	uint32_t interval;				// Shortest time between two callbacks (ms)
+	void* instance;					// Callback instance
+	gpsd_callback_func_t cbfunc;	// Called when a fix passing the filter is waiting, NULL to read without callbacks
+} gpsd_subscribe_parms_t;
+
 #ifdef __cplusplus
 }  /* End of the 'extern "C"' block */
 #endif
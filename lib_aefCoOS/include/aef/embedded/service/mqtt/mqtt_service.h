@@ -56,6 +56,18 @@ extern "C"
 #define MQTT_UNSUBSCRIBE			0x80F
 #define MQTT_PING_REQ				0x810
 #define MQTT_DEINITIALIZE			0x811
+#define MQTT_PUBLISH_EX				0x812
+#define MQTT_SET_INFLIGHT_WINDOW	0x813
+#define MQTT_SET_OFFLINE_QUEUE		0x814
+#define MQTT_SET_RECONNECT			0x815
+#define MQTT_ADD_TOPIC_HANDLER		0x816
+#define MQTT_REMOVE_TOPIC_HANDLER	0x817
+#define MQTT_GET_STATISTICS			0x818
+#define MQTT_RESET_STATISTICS		0x819
+#define MQTT_SET_COALESCING			0x81A
+#define MQTT_FLUSH					0x81B
+#define MQTT_SET_TRANSPORT			0x81C
+#define MQTT_REGISTER_TOPIC			0x81D
 
 /**
 * MQTT service I/O Control codes
@@ -78,6 +90,18 @@ extern "C"
 #define IOCTL_MQTT_UNSUBSCRIBE		SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_UNSUBSCRIBE,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
 #define IOCTL_MQTT_PING_REQ			SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_PING_REQ,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
 #define IOCTL_MQTT_DEINITIALIZE		SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_DEINITIALIZE,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_MQTT_PUBLISH_EX		SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_PUBLISH_EX,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_MQTT_SET_INFLIGHT_WINDOW	SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_SET_INFLIGHT_WINDOW,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_MQTT_SET_OFFLINE_QUEUE	SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_SET_OFFLINE_QUEUE,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_MQTT_SET_RECONNECT	SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_SET_RECONNECT,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_MQTT_ADD_TOPIC_HANDLER	SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_ADD_TOPIC_HANDLER,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_MQTT_REMOVE_TOPIC_HANDLER	SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_REMOVE_TOPIC_HANDLER,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_MQTT_GET_STATISTICS	SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_GET_STATISTICS,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_MQTT_RESET_STATISTICS	SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_RESET_STATISTICS,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_MQTT_SET_COALESCING	SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_SET_COALESCING,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_MQTT_FLUSH			SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_FLUSH,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_MQTT_SET_TRANSPORT	SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_SET_TRANSPORT,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
+#define IOCTL_MQTT_REGISTER_TOPIC	SRVIOCTLCODE(SERVICE_TYPE_MQTT,MQTT_REGISTER_TOPIC,SERVICE_METHOD_DIRECT,SERVICE_ANY_ACCESS)
 
 /**
 * MQTT definitions
@@ -102,6 +126,100 @@ extern "C"
 	#define MQTT_CONF_CLIENTID_LENGTH 	257
 #endif
 
+#ifndef MQTT_MAX_PAYLOAD_SEGMENTS
+	#define MQTT_MAX_PAYLOAD_SEGMENTS	8		// Maximum payload segments in a scatter list publish
+#endif
+
+#ifndef MQTT_SEND_RETRIES
+	#define MQTT_SEND_RETRIES			50		// Attempts to queue a segment while the socket is full
+#endif
+
+#ifndef MQTT_INFLIGHT_WINDOW
+	#define MQTT_INFLIGHT_WINDOW		8		// QoS 1 and 2 publishes awaiting acknowledgement
+#endif
+
+#ifndef MQTT_RETRY_INTERVAL
+	#define MQTT_RETRY_INTERVAL			5		// Initial retransmit interval (seconds)
+#endif
+
+#ifndef MQTT_RETRY_INTERVAL_MAX
+	#define MQTT_RETRY_INTERVAL_MAX		60		// Retransmit interval backoff limit (seconds)
+#endif
+
+#ifndef MQTT_MAX_RETRIES
+	#define MQTT_MAX_RETRIES			5		// Retransmits before a publish is abandoned
+#endif
+
+#ifndef MQTT_OFFLINE_DRAIN_RATE
+	#define MQTT_OFFLINE_DRAIN_RATE		4		// Queued publishes sent per service task run
+#endif
+
+#ifndef MQTT_OFFLINE_FLASH_RECORDS
+	#define MQTT_OFFLINE_FLASH_RECORDS	32		// Queued publishes kept in the database
+#endif
+
+#ifndef MQTT_CONNECT_TIMEOUT
+	#define MQTT_CONNECT_TIMEOUT		10		// Time allowed for address resolution, TCP connect and CONNACK (seconds)
+#endif
+
+#ifndef MQTT_PING_TIMEOUT
+	#define MQTT_PING_TIMEOUT			10		// Time allowed for a PINGRESP before the connection is dropped (seconds)
+#endif
+
+#ifndef MQTT_RECONNECT_DELAY_MAX
+	#define MQTT_RECONNECT_DELAY_MAX	300		// Default reconnect backoff limit (seconds)
+#endif
+
+#ifndef MQTT_MAX_TOPIC_MATCHES
+	#define MQTT_MAX_TOPIC_MATCHES		8		// Topic handlers invoked for one received publish
+#endif
+
+#ifndef MQTT_LATENCY_BUCKETS
+	#define MQTT_LATENCY_BUCKETS		12		// Delivery latency histogram buckets, bucket n counts latencies under 2^n ticks
+#endif
+
+#ifndef MQTT_COALESCE_SIZE_MAX
+	#define MQTT_COALESCE_SIZE_MAX		2048	// Largest coalescing threshold, the FNET socket send buffer (bytes)
+#endif
+
+#ifndef MQTT_COALESCE_DELAY
+	#define MQTT_COALESCE_DELAY			100		// Default time a coalesced publish may wait for the send (ms)
+#endif
+
+#ifndef MQTT_SN_MAX_TOPICS
+	#define MQTT_SN_MAX_TOPICS			8		// MQTT-SN predefined and gateway registered topic ids
+#endif
+
+#ifndef MQTT_SN_TOPIC_LENGTH
+	#define MQTT_SN_TOPIC_LENGTH		64		// Longest MQTT-SN topic name held in the topic table (up to 255)
+#endif
+
+#ifndef MQTT_SN_MAX_PACKET
+	#define MQTT_SN_MAX_PACKET			256		// Largest MQTT-SN PUBLISH datagram (bytes)
+#endif
+
+#ifndef MQTT_SN_AWAKE_TIME
+	#define MQTT_SN_AWAKE_TIME			2		// Idle time before a sleeping client goes back to sleep (seconds)
+#endif
+
+#ifndef MQTT_WORKER_THREAD
+	#define MQTT_WORKER_THREAD			0		// 1 to run each broker on its own task instead of the system management task
+#endif
+
+#ifndef MQTT_WORKER_STACK_SIZE
+	#define MQTT_WORKER_STACK_SIZE		1024	// Worker task stack size (words)
+#endif
+
+#ifndef MQTT_WORKER_PRIORITY
+	#define MQTT_WORKER_PRIORITY		TASK_PRIORITY_ABOVE_NORMAL	// Worker task priority
+#endif
+
+#ifndef MQTT_WORKER_RX_POLL
+	#define MQTT_WORKER_RX_POLL			10		// Socket read interval of the worker task while connected (ms)
+#endif
+
+#define MQTT_MAX_REMAINING_LENGTH		268435455L	// Largest remaining length (4 byte encoding)
+
 /**
 * MQTT protocol request identifier definitions
 */
@@ -148,6 +266,10 @@ extern "C"
 #define MQTT_QOS0          				0		// QoS 0 (use in publish/subscribe
 #define MQTT_QOS1          				1		// QoS 1 (use in publish/subscribe
 #define MQTT_QOS2          				2		// QoS 2 (use in publish/subscribe
+#define MQTT_QOS_MINUS1					3		// MQTT-SN QoS -1, publish without a session (predefined or short topics)
+
+#define MQTT_TRANSPORT_TCP				0x00	// MQTT over a TCP connection
+#define MQTT_TRANSPORT_SN				0x01	// MQTT-SN over UDP
 
 #define MQTT_CL_EVT_ERROR				0x00	// Error occurred
 #define MQTT_CL_EVT_CONNACK				0x02	// Connection acknowledgement received from the server
@@ -156,6 +278,13 @@ extern "C"
 #define MQTT_CL_EVT_SUBACK   			0x09  	// SUBACK has been received from the server
 #define MQTT_CL_EVT_UNSUBACK 			0x0B  	// UNSUBACK has been received from the server
 
+#define MQTT_DELIVERY_COMPLETE			0x00	// Publish acknowledged by the server
+#define MQTT_DELIVERY_FAILED			0x01	// Publish abandoned after retries or a clean session
+
+#define MQTT_DROP_OLDEST				0x00	// Offline queue drops its oldest publish when full
+#define MQTT_DROP_NEWEST				0x01	// Offline queue rejects the new publish when full
+#define MQTT_DROP_LOWEST_QOS			0x02	// Offline queue drops its oldest publish of the lowest QoS when full
+
 #define MQTT_ADDR_HOSTNAME				0x01	// Hostname address type
 #define MQTT_ADDR_IP					0x02	// IP address type
 
@@ -223,8 +352,33 @@ typedef struct
 	 * \return none.
 	 */
 	void (*svcMqttDisconn)(void *ctx);
+
+	/**
+	 * Notifies the client application that a QoS 1 or QoS 2 publish has left
+	 * the inflight window, either acknowledged by the server or abandoned.
+	 * The callback is invoked in the context of the MQTT service task.
+	 *
+	 * \param[in] ctx 			Application handle returned
+	 * \param[in] messageId		Message Id of the publish
+	 * \param[in] status		MQTT_DELIVERY_COMPLETE or MQTT_DELIVERY_FAILED
+	 *
+	 * \return none.
+	 */
+	void (*svcMqttDelivered)(void *ctx, uint16_t messageId, uint32_t status);
 } svcMqttClientCbs_t;
 
+/**
+* Topic handler routine
+* Invoked in the context of the MQTT service task for a PUBLISH from the
+* server whose topic matches the filter the handler was added with.  The
+* parameters after handlerCtx are those of svcMqttRecv.
+*
+* \param[in] handlerCtx		Handler context given when the handler was added
+*/
+typedef void (*mqtt_topic_handler_t)(void *handlerCtx, void *ctx, const char *topStr, uint32_t topLen,
+                                     const char *payload, uint32_t pay_len,
+                                     uint8_t dup, uint8_t qos, uint8_t retain, uint16_t messageId);
+
 /**
 * MQTT CONNACK - Acknowledge connection request structure definition
 */
@@ -329,10 +483,36 @@ typedef struct mqtt_publish_qus_parms_def
 	const char*      topic;						// Message topic
 	const char*	     msg;						// Message
 	uint8_t			 retain;					// Enable / disable retain flag
-	uint8_t			 qos;						// Quality of service (0, 1, 2)
+	uint8_t			 qos;						// Quality of service (0, 1, 2), or MQTT_QOS_MINUS1 over MQTT-SN
 	uint16_t		 messageId;					// Message ID
 } mqtt_publish_qos_parms_t;
 
+/**
+* MQTT scatter list segment structure definition
+*/
+typedef struct mqtt_iovec_def
+{
+	const void*		 base;						// Segment data
+	uint32_t		 length;					// Segment length
+} mqtt_iovec_t;
+
+/**
+* MQTT scatter list publish parameter structure definition
+* The topic and payload segments are sent straight from the caller's memory,
+* they must stay valid until the ioctl returns.
+*/
+typedef struct mqtt_publish_ex_parms_def
+{
+	void*			 	broker;					// MQTT broker context
+	const char*      	topic;					// Message topic, not NUL terminated
+	uint16_t		 	topicLength;			// Length of the topic
+	const mqtt_iovec_t*	payload;				// Payload segments
+	uint32_t		 	payloadCount;			// Number of payload segments
+	uint8_t			 	retain;					// Enable / disable retain flag
+	uint8_t			 	qos;					// Quality of service (0, 1, 2), or MQTT_QOS_MINUS1 over MQTT-SN
+	uint16_t		 	messageId;				// Message ID
+} mqtt_publish_ex_parms_t;
+
 /**
 * MQTT publish release parameter structure definition
 */
@@ -389,6 +569,152 @@ typedef struct mqtt_ping_req_parms_def
 	void*			 broker;					// MQTT broker context
 } mqtt_ping_req_parms_t;
 
+/**
+* MQTT inflight window parameter structure definition
+*/
+typedef struct mqtt_inflight_parms_def
+{
+	void*			 broker;					// MQTT broker context
+	uint8_t			 window;					// Inflight window size (1 - MQTT_INFLIGHT_WINDOW)
+} mqtt_inflight_parms_t;
+
+/**
+* MQTT offline queue parameter structure definition
+* Publishes made while the session is down are queued in RAM up to the
+* budget, the oldest spilling to the database when flash is enabled.  A
+* budget of 0 disables the queue.
+*/
+typedef struct mqtt_offline_queue_parms_def
+{
+	void*			 broker;					// MQTT broker context
+	uint32_t		 budget;					// RAM budget in bytes, 0 to disable
+	uint8_t			 dropPolicy;				// MQTT_DROP_xxx
+	uint8_t			 flash;						// Spill to the database when the RAM budget is used
+	uint16_t		 flashRecords;				// Database records, 0 for MQTT_OFFLINE_FLASH_RECORDS
+	uint32_t		 flashKey;					// Record key prefix, unique per broker
+	uint16_t		 drainRate;					// Publishes sent per service task run, 0 for MQTT_OFFLINE_DRAIN_RATE
+} mqtt_offline_queue_parms_t;
+
+/**
+* MQTT reconnect parameter structure definition
+* A lost or failed connection is retried after minDelay, the delay doubling
+* on every failed attempt up to maxDelay.  A minDelay of 0 disables it.
+*/
+typedef struct mqtt_reconnect_parms_def
+{
+	void*			 broker;					// MQTT broker context
+	uint16_t		 minDelay;					// First reconnect delay (seconds), 0 to disable
+	uint16_t		 maxDelay;					// Reconnect delay limit (seconds), 0 for MQTT_RECONNECT_DELAY_MAX
+} mqtt_reconnect_parms_t;
+
+/**
+* MQTT topic handler parameter structure definition
+* The filter may use the '+' and '#' wildcards.  Adding a handler does not
+* subscribe at the server, a PUBLISH that matches no handler goes to
+* svcMqttRecv.
+*/
+typedef struct mqtt_topic_handler_parms_def
+{
+	void*			 broker;					// MQTT broker context
+	const char*      filter;					// Topic filter
+	mqtt_topic_handler_t handler;				// Handler routine
+	void*			 handlerCtx;				// Handler context
+} mqtt_topic_handler_parms_t;
+
+/**
+* MQTT publish coalescing parameter structure definition
+* Publishes up to threshold bytes are packed into one socket send, which
+* goes out once threshold bytes are waiting, maxDelay has passed since the
+* oldest of them, or any other packet is sent.  The delay is checked by the
+* service task, so it is rounded up to the task period.  A threshold of 0
+* turns coalescing off.
+*/
+typedef struct mqtt_coalesce_parms_def
+{
+	void*			 broker;					// MQTT broker context
+	uint16_t		 threshold;					// Coalescing buffer size (bytes), 0 to disable
+	uint16_t		 maxDelay;					// Longest wait for the send (ms), 0 for MQTT_COALESCE_DELAY
+} mqtt_coalesce_parms_t;
+
+/**
+* MQTT flush parameter structure definition
+*/
+typedef struct mqtt_flush_parms_def
+{
+	void*			 broker;					// MQTT broker context
+} mqtt_flush_parms_t;
+
+/**
+* MQTT transport parameter structure definition
+* Selects MQTT or MQTT-SN for the broker, the broker must be idle.  With
+* MQTT-SN the server address and port are those of the gateway, QoS 2 is
+* not supported and received QoS 1 publishes are acknowledged by the
+* service.  A sleepDuration puts the client to sleep once it has been idle
+* for MQTT_SN_AWAKE_TIME, the gateway buffers publishes for it until it
+* wakes with a PINGREQ.  A sleeping client only sends QoS -1 publishes
+* directly, others wait in the offline queue, which wakes the client.
+*/
+typedef struct mqtt_transport_parms_def
+{
+	void*			 broker;					// MQTT broker context
+	uint8_t			 transport;					// MQTT_TRANSPORT_xxx
+	uint16_t		 sleepDuration;				// MQTT-SN sleep duration (seconds), 0 to stay active
+} mqtt_transport_parms_t;
+
+/**
+* MQTT-SN topic registration parameter structure definition
+* Names a topic id predefined with the gateway.  Publishes and subscribes on
+* the topic then carry the id.  Two character topics need no registration,
+* they are sent as short topic names.
+*/
+typedef struct mqtt_register_topic_parms_def
+{
+	void*			 broker;					// MQTT broker context
+	const char*      topic;						// Topic name
+	uint16_t		 topicId;					// Predefined topic id (1 - 0xFFFF)
+} mqtt_register_topic_parms_t;
+
+/**
+* MQTT statistics parameter structure definition
+*/
+typedef struct mqtt_statistics_parms_def
+{
+	void*			 broker;					// MQTT broker context
+} mqtt_statistics_parms_t;
+
+/**
+* MQTT statistics structure definition.
+* Returned by IOCTL_MQTT_GET_STATISTICS, counted per broker since it was
+* initialized or the statistics were last reset.  Latencies run from the
+* first transmission of a QoS 1 or 2 publish to its PUBACK or PUBCOMP, the
+* last histogram bucket also holds every longer latency.
+*/
+typedef struct _mqtt_statistics_def
+{
+	uint32_t	ticks;					// OS ticks covered by the statistics
+	uint32_t	published[3];			// Publishes sent per QoS level
+	uint32_t	published_bytes;		// Payload bytes sent
+	uint32_t	publish_failures;		// Publishes that could be neither sent nor queued
+	uint32_t	delivered;				// QoS 1 and 2 publishes acknowledged
+	uint32_t	abandoned;				// QoS 1 and 2 publishes given up unacknowledged
+	uint32_t	retransmits;			// Publishes and releases sent again
+	uint32_t	latency_max;			// Longest delivery latency in ticks
+	uint32_t	latency_total;			// Sum of the delivery latencies in ticks
+	uint32_t	latency[MQTT_LATENCY_BUCKETS];	// Delivery latency histogram
+	uint32_t	received;				// Publishes received
+	uint32_t	received_bytes;			// Payload bytes received
+	uint32_t	handler_overflows;		// Topic handlers skipped over MQTT_MAX_TOPIC_MATCHES
+	uint32_t	sessions;				// Connections accepted by the server
+	uint32_t	connection_losses;		// Connections dropped other than by request
+	uint32_t	inflight_max;			// Most publishes awaiting acknowledgement
+	uint32_t	inflight_bytes_max;		// Most memory held by retransmission copies
+	uint32_t	queued;					// Publishes queued while the session was down
+	uint32_t	queue_dropped;			// Queued publishes lost to the drop policy
+	uint32_t	queue_spilled;			// Queued publishes moved to flash
+	uint32_t	queue_bytes;			// Memory held by the offline queue
+	uint32_t	queue_bytes_max;		// Most memory held by the offline queue
+} mqtt_statistics_t;
+
 /**
 * MQTT deinitialize parameter structure definition
 */
@@ -82,6 +82,18 @@ system_status_t system_management_func_attach (char* name, void* instance, syste
 */
 system_status_t system_management_func_detach (system_management_func_t func);
 
+/**
+* Detach the system management function of an instance
+* Used when one function is attached once per instance.
+*
+* \param	instance	System management function instance data
+*
+* \returns  SYSTEM_STATUS_SUCCESS if successful.
+*           SYSTEM_FAILURE_GENERAL if no function of the instance is attached.
+*           SYSTEM_FAILURE_INVALID_PARAMETER if the instance is NULL.
+*/
+system_status_t system_management_instance_detach (void* instance);
+
 # ifdef   __cplusplus
 } /* extern "C" */
 # endif
@@ -42,6 +42,10 @@ static
 driver_status_t
 uart_core_ioctl_setmode (stream_driver_ctx_t* ctx, void* input_buffer, uint32_t input_size);
 
+static
+driver_status_t
+uart_core_ioctl_readavail (stream_driver_ctx_t* ctx, void* output_buffer, uint32_t output_size, uint32_t* bytes_read);
+
 /**
 * Open the UART device
 *
@@ -250,6 +254,9 @@ uart_core_ioctl (stream_driver_ctx_t* ctx, uint32_t code, void* input_buffer, ui
 		case IOCTL_UART_SETMODE:
 			result = uart_core_ioctl_setmode (ctx,input_buffer,input_size);
 			break;
+		case IOCTL_UART_READAVAIL:
+			result = uart_core_ioctl_readavail (ctx,output_buffer,output_size,bytes_read);
+			break;
 		default:
 			break;
 	}
@@ -258,6 +265,7 @@ uart_core_ioctl (stream_driver_ctx_t* ctx, uint32_t code, void* input_buffer, ui
 
 /**
 * Initialize the UART peripheral device
+* Sets the baud rate of an open UART.
 *
 * \param    ctx				Pointer to the device context
 * \param    input_buffer	Pointer to the input buffer
@@ -272,9 +280,13 @@ uart_core_ioctl_initialize (stream_driver_ctx_t* ctx, void* input_buffer, uint32
 {
 	if ( (ctx != NULL) && (input_buffer != NULL) && (input_size == sizeof(uart_config_parms_t)) )
 	{
-//		uart_driver_ctx_t* uart_ctx = (uart_driver_ctx_t*)ctx->ctx;
-//		uart_config_parms_t* parms = (uart_config_parms_t*)input_buffer;
+		uart_driver_ctx_t* uart_ctx = (uart_driver_ctx_t*)ctx->ctx;
+		uart_config_parms_t* parms = (uart_config_parms_t*)input_buffer;
+
+		if ( uart_ctx->ref_count == 0 || parms->baud == 0 )
+			return DRIVER_FAILURE_GENERAL;
 
+		UART_SetBaudRate(uart_ctx->base, parms->baud, CLOCK_GetFreq(uart_ctx->srcClock_Hz));
 		return DRIVER_STATUS_SUCCESS;
 	}
 	return DRIVER_FAILURE_INVALID_PARAMETER;
@@ -447,3 +459,38 @@ uart_core_ioctl_setmode (stream_driver_ctx_t* ctx, void* input_buffer, uint32_t
 	}
 	return DRIVER_FAILURE_GENERAL;
 }
+
+/**
+* Retrieve the characters already received, without waiting for more.
+*
+* \param    ctx				Pointer to the device context
+* \param    output_buffer	Pointer to the output buffer to write the characters
+* \param    output_size		Output buffer size
+* \param    bytes_read		Pointer to the actual bytes returned, 0 if none were received
+*
+* \returns  DRIVER_STATUS_SUCCESS if successful.
+*           DRIVER_FAILURE_INVALID_PARAMETER if one or more parameters are incorrect.
+*/
+driver_status_t
+uart_core_ioctl_readavail (stream_driver_ctx_t* ctx, void* output_buffer, uint32_t output_size, uint32_t* bytes_read)
+{
+	if ( (ctx != NULL) && (output_buffer != NULL) )
+	{
+		uart_driver_ctx_t* uart_ctx = (uart_driver_ctx_t*)ctx->ctx;
+		uint8_t* data = (uint8_t*)output_buffer;
+		uint32_t actual_bytes_read = 0;
+
+		while ( (actual_bytes_read < output_size) && ! buf_isempty(uart_ctx->rx_buffer) )
+		{
+			data[actual_bytes_read++] = buf_get_byte(uart_ctx->rx_buffer);
+		}
+		if ( actual_bytes_read )
+		{
+		    UART_EnableInterrupts(uart_ctx->base, kUART_RxDataRegFullInterruptEnable | kUART_RxOverrunInterruptEnable);
+		}
+		if ( bytes_read != NULL )
+			*bytes_read = actual_bytes_read;
+		return DRIVER_STATUS_SUCCESS;
+	}
+	return DRIVER_FAILURE_INVALID_PARAMETER;
+}
@@ -73,20 +73,20 @@ system_status_t critical_section_acquire (critical_section_ctx_t* ctx)
 }
 
 /**
-* Try to enter the critical section
+* Try to enter the critical section.  This call does not block, it fails
+* if another task holds the critical section.
 *
 * \param    ctx		Pointer to a critical section context
 *
 * \returns  SYSTEM_STATUS_SUCCESS if successful.
-* 			SYSTEM_FAILURE_GENERAL on failure to destroy the critical section object
 * 			SYSTEM_FAILUER_INVALID_PARAMETER on a null context pointer
-* 			CoOS error values
+* 			CoOS error values, E_TIMEOUT if the critical section is held
 */
 system_status_t critical_section_try_acquire (critical_section_ctx_t* ctx)
 {
 	if ( ctx != Co_NULL )
 	{
-		return CoEnterMutexSection ( ctx->mutex );
+		return CoTryEnterMutexSection ( ctx->mutex );
 	}
 	return SYSTEM_FAILURE_INVALID_PARAMETER;
 }
@@ -0,0 +1,384 @@
+
+/**
+* block_index.c
+*
+* \copyright
+* Copyright 2015 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the RAM resident database block index.
+*
+* Entries are kept sorted by UUID and record type so lookups are a binary
+* search.  Free and live blocks are tracked one bit per block, a live block
+* being one that holds the current version of an indexed record.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <CoOS.h>
+#include "block_index.h"
+
+/**
+* Block index storage
+*/
+static block_index_entry_t index_entries[MAX_FREE_BLOCKS];
+static uint32_t index_count = 0;
+static uint32_t free_map[BLOCK_INDEX_MAP_WORDS];
+static uint32_t free_count = 0;
+static uint32_t live_map[BLOCK_INDEX_MAP_WORDS];
+
+_Static_assert(MAX_BLOCKS % 32 == 0, "The free block bitmap must cover every block.");
+_Static_assert(MAX_BLOCKS <= 256, "A block reference must fit in a BlockRefType.");
+
+/**
+* Compare an index entry against a record key.
+*
+* \param    entry		Pointer to the index entry
+* \param	recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the record key
+*
+* \returns  <0, 0 or >0 as the entry sorts before, equal to or after the key.
+*/
+static int block_index_compare ( const block_index_entry_t* entry, uint8_t recordType, const uint8_t* uuid )
+{
+	int result = memcmp ( entry->uuid, uuid, BLOCK_INDEX_UUID_SIZE );
+	if ( result == 0 && recordType != BLOCK_INDEX_ANY_TYPE )
+	{
+		result = (int)entry->recordType - (int)recordType;
+	}
+	return result;
+}
+
+/**
+* Locate the first entry not sorting before the record key.
+*
+* \param	recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the record key
+*
+* \returns  Position of the entry, index_count if all entries sort before the key.
+*/
+static uint32_t block_index_lower_bound ( uint8_t recordType, const uint8_t* uuid )
+{
+	uint32_t low  = 0;
+	uint32_t high = index_count;
+
+	while ( low < high )
+	{
+		uint32_t mid = low + ((high - low) >> 1);
+		if ( block_index_compare ( &index_entries[mid], recordType, uuid ) < 0 )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/**
+* Reset the block index.
+* All entries are removed and every block except the superblock tables is marked free.
+*
+* \param    None
+*
+* \returns  None
+*/
+void block_index_reset ( void )
+{
+	index_count = 0;
+	free_count  = 0;
+	memset ( free_map, 0, sizeof(free_map) );
+	memset ( live_map, 0, sizeof(live_map) );
+
+	for ( uint32_t block = 0; block < MAX_BLOCKS; block++ )
+	{
+		if ( (block % ENTRIES_PER_TABLE) != 0 )
+			block_index_mark_free ( (BlockRefType)block );
+	}
+}
+
+/**
+* Mark a block as in use without adding an entry for it.
+*
+* \param    block		Block reference
+*
+* \returns  None
+*/
+void block_index_mark_used ( BlockRefType block )
+{
+	uint32_t mask = 1UL << (block & 31);
+
+	if ( free_map[block >> 5] & mask )
+	{
+		free_map[block >> 5] &= ~mask;
+		free_count--;
+	}
+}
+
+/**
+* Mark a block as free.
+*
+* \param    block		Block reference
+*
+* \returns  None
+*/
+void block_index_mark_free ( BlockRefType block )
+{
+	uint32_t mask = 1UL << (block & 31);
+
+	if ( (free_map[block >> 5] & mask) == 0 )
+	{
+		free_map[block >> 5] |= mask;
+		free_count++;
+	}
+}
+
+/**
+* Check if a block is free.
+*
+* \param    block		Block reference
+*
+* \returns  true if the block is free.
+*/
+bool block_index_is_free ( BlockRefType block )
+{
+	return ( (free_map[block >> 5] & (1UL << (block & 31))) != 0 );
+}
+
+/**
+* Add a record to the block index and mark its block as in use.
+*
+* \param    recordType	Record type
+* \param	uuid		Pointer to the record key
+* \param	block		Block holding the record
+*
+* \returns  true if successful, false if the index is full.
+*/
+bool block_index_insert ( uint8_t recordType, const uint8_t* uuid, BlockRefType block )
+{
+	uint32_t position = block_index_lower_bound ( recordType, uuid );
+
+	if ( position < index_count && block_index_compare ( &index_entries[position], recordType, uuid ) == 0 )
+	{
+		/*
+		 * Newer copy of an existing record
+		 */
+		live_map[index_entries[position].block >> 5] &= ~(1UL << (index_entries[position].block & 31));
+		index_entries[position].block = block;
+	}
+	else
+	{
+		if ( index_count >= MAX_FREE_BLOCKS )
+			return false;
+
+		memmove ( &index_entries[position + 1], &index_entries[position], (index_count - position) * sizeof(block_index_entry_t) );
+		memcpy ( index_entries[position].uuid, uuid, BLOCK_INDEX_UUID_SIZE );
+		index_entries[position].recordType = recordType;
+		index_entries[position].block      = block;
+		index_count++;
+	}
+
+	block_index_mark_used ( block );
+	live_map[block >> 5] |= (1UL << (block & 31));
+	return true;
+}
+
+/**
+* Remove a record from the block index.
+* The block remains in use until its sector is erased.
+*
+* \param    recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the record key
+* \param	block		Pointer to storage for the block of the removed record, may be NULL
+*
+* \returns  true if the record was found and removed.
+*/
+bool block_index_remove ( uint8_t recordType, const uint8_t* uuid, BlockRefType* block )
+{
+	uint32_t position = block_index_lower_bound ( recordType, uuid );
+
+	if ( position < index_count && block_index_compare ( &index_entries[position], recordType, uuid ) == 0 )
+	{
+		if ( block != NULL )
+			*block = index_entries[position].block;
+
+		live_map[index_entries[position].block >> 5] &= ~(1UL << (index_entries[position].block & 31));
+		index_count--;
+		memmove ( &index_entries[position], &index_entries[position + 1], (index_count - position) * sizeof(block_index_entry_t) );
+		return true;
+	}
+	return false;
+}
+
+/**
+* Find a record in the block index.
+*
+* \param    recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the record key
+* \param	block		Pointer to storage for the block of the record
+*
+* \returns  true if the record was found.
+*/
+bool block_index_find ( uint8_t recordType, const uint8_t* uuid, BlockRefType* block )
+{
+	uint32_t position = block_index_lower_bound ( recordType, uuid );
+
+	if ( position < index_count && block_index_compare ( &index_entries[position], recordType, uuid ) == 0 )
+	{
+		if ( block != NULL )
+			*block = index_entries[position].block;
+		return true;
+	}
+	return false;
+}
+
+/**
+* Find the next record in key order.
+* Entries of other record types are skipped, so walking every record of a
+* type visits each index entry once.
+*
+* \param	recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the last record key returned, NULL to start with the first record
+* \param	entry		Pointer to storage for the index entry
+*
+* \returns  true if a record was found.
+*/
+bool block_index_next ( uint8_t recordType, const uint8_t* uuid, block_index_entry_t* entry )
+{
+	uint32_t position = 0;
+
+	if ( uuid != NULL )
+	{
+		position = block_index_lower_bound ( BLOCK_INDEX_ANY_TYPE, uuid );
+		while ( position < index_count && memcmp ( index_entries[position].uuid, uuid, BLOCK_INDEX_UUID_SIZE ) == 0 )
+			position++;
+	}
+
+	for ( ; position < index_count; position++ )
+	{
+		if ( recordType == BLOCK_INDEX_ANY_TYPE || index_entries[position].recordType == recordType )
+		{
+			*entry = index_entries[position];
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+* Check if a block holds the current version of a record.
+*
+* \param    block		Block reference
+*
+* \returns  true if the block is live.
+*/
+bool block_index_is_live ( BlockRefType block )
+{
+	return ( (live_map[block >> 5] & (1UL << (block & 31))) != 0 );
+}
+
+/**
+* Count the live blocks in a range of blocks.
+*
+* \param    first		First block of the range
+* \param	count		Number of blocks in the range
+*
+* \returns  Number of live blocks.
+*/
+uint32_t block_index_range_live ( uint32_t first, uint32_t count )
+{
+	uint32_t live = 0;
+
+	for ( uint32_t block = first; block < (first + count) && block < MAX_BLOCKS; block++ )
+	{
+		if ( live_map[block >> 5] & (1UL << (block & 31)) )
+			live++;
+	}
+	return live;
+}
+
+/**
+* Count the free blocks in a range of blocks.
+*
+* \param    first		First block of the range
+* \param	count		Number of blocks in the range
+*
+* \returns  Number of free blocks.
+*/
+uint32_t block_index_range_free ( uint32_t first, uint32_t count )
+{
+	uint32_t free = 0;
+
+	for ( uint32_t block = first; block < (first + count) && block < MAX_BLOCKS; block++ )
+	{
+		if ( free_map[block >> 5] & (1UL << (block & 31)) )
+			free++;
+	}
+	return free;
+}
+
+/**
+* Find the lowest numbered free block.
+*
+* \param	block		Pointer to storage for the free block
+*
+* \returns  true if a free block was found.
+*/
+bool block_index_find_free ( BlockRefType* block )
+{
+	for ( uint32_t word = 0; word < BLOCK_INDEX_MAP_WORDS; word++ )
+	{
+		if ( free_map[word] != 0 )
+		{
+			*block = (BlockRefType)((word << 5) + __builtin_ctz ( free_map[word] ));
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+* Find the lowest numbered free block in a range of blocks.
+*
+* \param    first		First block of the range
+* \param	count		Number of blocks in the range
+* \param	block		Pointer to storage for the free block
+*
+* \returns  true if a free block was found.
+*/
+bool block_index_find_free_range ( uint32_t first, uint32_t count, BlockRefType* block )
+{
+	for ( uint32_t index = first; index < (first + count) && index < MAX_BLOCKS; index++ )
+	{
+		if ( free_map[index >> 5] & (1UL << (index & 31)) )
+		{
+			*block = (BlockRefType)index;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+* Get the number of records in the block index.
+*
+* \param    None
+*
+* \returns  Number of records.
+*/
+uint32_t block_index_count ( void )
+{
+	return index_count;
+}
+
+/**
+* Get the number of free blocks.
+*
+* \param    None
+*
+* \returns  Number of free blocks.
+*/
+uint32_t block_index_free_count ( void )
+{
+	return free_count;
+}
@@ -0,0 +1,198 @@
+
+/**
+* block_index.h
+*
+* \copyright
+* Copyright 2015 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the RAM resident database block index.
+*
+* The block index maps a record type and UUID to the block holding the
+* record and tracks the free and live blocks of the database in bitmaps.  It is
+* built once from the block headers in flash and then kept coherent by
+* the database core on every write and delete, so that lookups and
+* allocations do not need to touch the serial flash.
+*/
+
+#ifndef SRC_SERVICES_DATABASE_DATABASE_CORE_BLOCK_INDEX_H_
+#define SRC_SERVICES_DATABASE_DATABASE_CORE_BLOCK_INDEX_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block_allocator.h"
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+#define BLOCK_INDEX_UUID_SIZE		16				// Size of the record key
+#define BLOCK_INDEX_ANY_TYPE		0xFF			// Match any record type (RecordTypeInvalid)
+#define BLOCK_INDEX_MAP_WORDS		(MAX_BLOCKS / 32)
+
+/**
+* Block index entry structure definition
+*/
+typedef struct _block_index_entry_def
+{
+	uint8_t		 uuid[BLOCK_INDEX_UUID_SIZE];	// Record key
+	uint8_t		 recordType;					// Record type
+	BlockRefType block;							// Block holding the record
+} block_index_entry_t;
+
+/**
+* Reset the block index.
+* All entries are removed and every block except the superblock tables is marked free.
+*
+* \param    None
+*
+* \returns  None
+*/
+void block_index_reset ( void );
+
+/**
+* Mark a block as in use without adding an entry for it.
+*
+* \param    block		Block reference
+*
+* \returns  None
+*/
+void block_index_mark_used ( BlockRefType block );
+
+/**
+* Mark a block as free.
+*
+* \param    block		Block reference
+*
+* \returns  None
+*/
+void block_index_mark_free ( BlockRefType block );
+
+/**
+* Check if a block is free.
+*
+* \param    block		Block reference
+*
+* \returns  true if the block is free.
+*/
+bool block_index_is_free ( BlockRefType block );
+
+/**
+* Add a record to the block index and mark its block as in use.
+*
+* \param    recordType	Record type
+* \param	uuid		Pointer to the record key
+* \param	block		Block holding the record
+*
+* \returns  true if successful, false if the index is full.
+*/
+bool block_index_insert ( uint8_t recordType, const uint8_t* uuid, BlockRefType block );
+
+/**
+* Remove a record from the block index.
+* The block remains in use until its sector is erased.
+*
+* \param    recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the record key
+* \param	block		Pointer to storage for the block of the removed record, may be NULL
+*
+* \returns  true if the record was found and removed.
+*/
+bool block_index_remove ( uint8_t recordType, const uint8_t* uuid, BlockRefType* block );
+
+/**
+* Find a record in the block index.
+*
+* \param    recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the record key
+* \param	block		Pointer to storage for the block of the record
+*
+* \returns  true if the record was found.
+*/
+bool block_index_find ( uint8_t recordType, const uint8_t* uuid, BlockRefType* block );
+
+/**
+* Find the next record in key order.
+*
+* \param	recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the last record key returned, NULL to start with the first record
+* \param	entry		Pointer to storage for the index entry
+*
+* \returns  true if a record was found.
+*/
+bool block_index_next ( uint8_t recordType, const uint8_t* uuid, block_index_entry_t* entry );
+
+/**
+* Check if a block holds the current version of a record.
+*
+* \param    block		Block reference
+*
+* \returns  true if the block is live.
+*/
+bool block_index_is_live ( BlockRefType block );
+
+/**
+* Count the live blocks in a range of blocks.
+*
+* \param    first		First block of the range
+* \param	count		Number of blocks in the range
+*
+* \returns  Number of live blocks.
+*/
+uint32_t block_index_range_live ( uint32_t first, uint32_t count );
+
+/**
+* Count the free blocks in a range of blocks.
+*
+* \param    first		First block of the range
+* \param	count		Number of blocks in the range
+*
+* \returns  Number of free blocks.
+*/
+uint32_t block_index_range_free ( uint32_t first, uint32_t count );
+
+/**
+* Find the lowest numbered free block.
+*
+* \param	block		Pointer to storage for the free block
+*
+* \returns  true if a free block was found.
+*/
+bool block_index_find_free ( BlockRefType* block );
+
+/**
+* Find the lowest numbered free block in a range of blocks.
+*
+* \param    first		First block of the range
+* \param	count		Number of blocks in the range
+* \param	block		Pointer to storage for the free block
+*
+* \returns  true if a free block was found.
+*/
+bool block_index_find_free_range ( uint32_t first, uint32_t count, BlockRefType* block );
+
+/**
+* Get the number of records in the block index.
+*
+* \param    None
+*
+* \returns  Number of records.
+*/
+uint32_t block_index_count ( void );
+
+/**
+* Get the number of free blocks.
+*
+* \param    None
+*
+* \returns  Number of free blocks.
+*/
+uint32_t block_index_free_count ( void );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* SRC_SERVICES_DATABASE_DATABASE_CORE_BLOCK_INDEX_H_ */
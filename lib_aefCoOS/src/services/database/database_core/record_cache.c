@@ -0,0 +1,320 @@
+
+/**
+* record_cache.c
+*
+* \copyright
+* Copyright 2015 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the database write-back record cache.
+*
+* The cache is a small fully associative array sized from the
+* DATABASE_CACHE_SIZE RAM budget.  When a new record needs an entry the least
+* recently used clean entry is replaced, dirty entries are never evicted.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "record_cache.h"
+#include "block_index.h"
+
+_Static_assert(DATABASE_CACHE_SIZE == 0 || RECORD_CACHE_ENTRIES > 0, "DATABASE_CACHE_SIZE must hold at least one record, or be 0 to disable the cache.");
+
+/**
+* Record cache storage
+*/
+static record_cache_entry_t cache_entries[(RECORD_CACHE_ENTRIES > 0) ? RECORD_CACHE_ENTRIES : 1];
+static uint32_t cache_sequence = 0;
+static record_cache_statistics_t cache_statistics;
+
+/**
+* Compare a cache entry against a record key.
+*
+* \param    entry		Pointer to the cache entry
+* \param	recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the record key
+*
+* \returns  true if the entry holds the record.
+*/
+static bool record_cache_match ( const record_cache_entry_t* entry, uint8_t recordType, const uint8_t* uuid )
+{
+	const EntryHeader_t* header = (const EntryHeader_t*)entry->data;
+
+	if ( (entry->flags & RECORD_CACHE_VALID) == 0 )
+		return false;
+
+	if ( recordType != BLOCK_INDEX_ANY_TYPE && header->block_entry.recordType != recordType )
+		return false;
+
+	return ( memcmp ( header->block_entry.UUID, uuid, BLOCK_INDEX_UUID_SIZE ) == 0 );
+}
+
+/**
+* Reset the record cache.
+* All entries, including dirty ones, are discarded.
+*
+* \param    None
+*
+* \returns  None
+*/
+void record_cache_reset ( void )
+{
+	memset ( cache_entries, 0, sizeof(cache_entries) );
+	cache_sequence = 0;
+}
+
+/**
+* Check if a record can be held in the cache.
+*
+* \param    recordType	Record type
+* \param	length		Size of the record
+*
+* \returns  true if the record is cacheable.
+*/
+bool record_cache_is_cacheable ( uint8_t recordType, uint32_t length )
+{
+	if ( RECORD_CACHE_ENTRIES == 0 || length < sizeof(EntryHeader_t) || length > RECORD_CACHE_RECORD_SIZE )
+		return false;
+
+	return ( recordType == RecordTypeSessionHeader || recordType == RecordTypeUserPreferences );
+}
+
+/**
+* Find a record in the cache.
+*
+* \param    recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the record key
+*
+* \returns  Pointer to the cache entry, NULL if the record is not cached.
+*/
+record_cache_entry_t* record_cache_find ( uint8_t recordType, const uint8_t* uuid )
+{
+#if DATABASE_CACHE_SIZE > 0
+	for ( uint32_t entry = 0; entry < RECORD_CACHE_ENTRIES; entry++ )
+	{
+		if ( record_cache_match ( &cache_entries[entry], recordType, uuid ) )
+			return &cache_entries[entry];
+	}
+#endif
+	return NULL;
+}
+
+/**
+* Read a record from the cache.
+*
+* \param    uuid		Pointer to the record key
+* \param	record		Pointer to the record buffer
+* \param	size		Size of the record buffer
+*
+* \returns  true if the record was cached and copied.
+*/
+bool record_cache_read ( const uint8_t* uuid, void* record, uint32_t size )
+{
+	record_cache_entry_t* entry = record_cache_find ( BLOCK_INDEX_ANY_TYPE, uuid );
+
+	if ( entry == NULL )
+		return false;
+
+	/*
+	 * Bytes past the end of the record read back as erased flash
+	 */
+	memcpy ( record, entry->data, ( size < entry->length ) ? size : entry->length );
+	if ( size > entry->length )
+		memset ( (uint8_t*)record + entry->length, 0xFF, size - entry->length );
+
+	entry->last_used = ++cache_sequence;
+	cache_statistics.hits++;
+	return true;
+}
+
+/**
+* Store a record in the cache.
+* A dirty record replaces the cached copy of the same record, so repeated
+* updates are coalesced into a single flash write.
+*
+* \param    data		Pointer to the record, starting with an EntryHeader_t
+* \param	length		Size of the record
+* \param	dirty		true if the record still has to be written to flash
+* \param	now			Current tick count
+*
+* \returns  true if successful, false if every entry is dirty.
+*/
+bool record_cache_put ( const uint8_t* data, uint32_t length, bool dirty, uint32_t now )
+{
+	const EntryHeader_t*  header = (const EntryHeader_t*)data;
+	record_cache_entry_t* entry  = record_cache_find ( header->block_entry.recordType, header->block_entry.UUID );
+
+	if ( entry == NULL )
+	{
+		/*
+		 * Use a free entry, or replace the least recently used clean one
+		 */
+#if DATABASE_CACHE_SIZE > 0
+		for ( uint32_t index = 0; index < RECORD_CACHE_ENTRIES; index++ )
+		{
+			record_cache_entry_t* candidate = &cache_entries[index];
+
+			if ( (candidate->flags & RECORD_CACHE_VALID) == 0 )
+			{
+				entry = candidate;
+				break;
+			}
+			if ( (candidate->flags & RECORD_CACHE_DIRTY) == 0 && (entry == NULL || candidate->last_used < entry->last_used) )
+				entry = candidate;
+		}
+#endif
+
+		if ( entry == NULL )
+			return false;
+
+		entry->flags = 0;
+	}
+	else if ( dirty && (entry->flags & RECORD_CACHE_DIRTY) )
+	{
+		cache_statistics.coalesced++;
+	}
+
+	memcpy ( entry->data, data, length );
+	entry->length    = (uint16_t)length;
+	entry->last_used = ++cache_sequence;
+
+	if ( dirty && (entry->flags & RECORD_CACHE_DIRTY) == 0 )
+	{
+		entry->dirty_time = now;
+		entry->flags     |= RECORD_CACHE_DIRTY;
+	}
+	entry->flags |= RECORD_CACHE_VALID;
+
+	return true;
+}
+
+/**
+* Remove a record from the cache.
+*
+* \param    recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the record key
+*
+* \returns  true if the record was cached and removed.
+*/
+bool record_cache_remove ( uint8_t recordType, const uint8_t* uuid )
+{
+	record_cache_entry_t* entry = record_cache_find ( recordType, uuid );
+
+	if ( entry == NULL )
+		return false;
+
+	entry->flags = 0;
+	return true;
+}
+
+/**
+* Get the next dirty record.
+*
+* \param    None
+*
+* \returns  Pointer to the cache entry, NULL if no record is dirty.
+*/
+record_cache_entry_t* record_cache_next_dirty ( void )
+{
+#if DATABASE_CACHE_SIZE > 0
+	for ( uint32_t entry = 0; entry < RECORD_CACHE_ENTRIES; entry++ )
+	{
+		if ( cache_entries[entry].flags & RECORD_CACHE_DIRTY )
+			return &cache_entries[entry];
+	}
+#endif
+	return NULL;
+}
+
+/**
+* Mark a cached record as written to flash.
+*
+* \param    entry		Pointer to the cache entry
+*
+* \returns  None
+*/
+void record_cache_mark_clean ( record_cache_entry_t* entry )
+{
+	entry->flags &= ~RECORD_CACHE_DIRTY;
+}
+
+/**
+* Get the number of dirty records.
+*
+* \param    None
+*
+* \returns  Number of dirty records.
+*/
+uint32_t record_cache_dirty_count ( void )
+{
+	uint32_t count = 0;
+
+#if DATABASE_CACHE_SIZE > 0
+	for ( uint32_t entry = 0; entry < RECORD_CACHE_ENTRIES; entry++ )
+	{
+		if ( cache_entries[entry].flags & RECORD_CACHE_DIRTY )
+			count++;
+	}
+#endif
+	return count;
+}
+
+/**
+* Get the age of the oldest dirty record.
+*
+* \param    now			Current tick count
+*
+* \returns  Age in ticks, 0 if no record is dirty.
+*/
+uint32_t record_cache_dirty_age ( uint32_t now )
+{
+	uint32_t age = 0;
+
+#if DATABASE_CACHE_SIZE > 0
+	for ( uint32_t entry = 0; entry < RECORD_CACHE_ENTRIES; entry++ )
+	{
+		if ( (cache_entries[entry].flags & RECORD_CACHE_DIRTY) && (now - cache_entries[entry].dirty_time) > age )
+			age = now - cache_entries[entry].dirty_time;
+	}
+#endif
+	return age;
+}
+
+/**
+* Count a read of a cacheable record that had to be served from flash.
+*
+* \param    None
+*
+* \returns  None
+*/
+void record_cache_count_miss ( void )
+{
+	cache_statistics.misses++;
+}
+
+/**
+* Get the record cache statistics.
+*
+* \param    statistics	Pointer to storage for the statistics
+*
+* \returns  None
+*/
+void record_cache_get_statistics ( record_cache_statistics_t* statistics )
+{
+	if ( statistics != NULL )
+		*statistics = cache_statistics;
+}
+
+/**
+* Reset the record cache statistics.
+*
+* \param    None
+*
+* \returns  None
+*/
+void record_cache_reset_statistics ( void )
+{
+	memset ( &cache_statistics, 0, sizeof(record_cache_statistics_t) );
+}
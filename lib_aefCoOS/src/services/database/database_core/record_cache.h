@@ -0,0 +1,191 @@
+
+/**
+* record_cache.h
+*
+* \copyright
+* Copyright 2015 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the database write-back record cache.
+*
+* The record cache keeps the hot, frequently rewritten records (session
+* headers and user preferences) in RAM.  Updates replace the cached copy and
+* mark it dirty, and the database core writes the dirty records back to
+* flash in a single group commit.  The cache only stores records, all
+* flash access is left to the database core.
+*/
+
+#ifndef SRC_SERVICES_DATABASE_DATABASE_CORE_RECORD_CACHE_H_
+#define SRC_SERVICES_DATABASE_DATABASE_CORE_RECORD_CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <aef/embedded/service/database/database_service.h>
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+#define RECORD_CACHE_RECORD_SIZE	sizeof(SessionHeader_t)		// Largest record held in the cache
+#define RECORD_CACHE_ENTRIES		(DATABASE_CACHE_SIZE / sizeof(record_cache_entry_t))
+
+#define RECORD_CACHE_VALID			0x01			// Entry holds a record
+#define RECORD_CACHE_DIRTY			0x02			// Record has not been written to flash
+
+/**
+* Record cache entry structure definition
+*/
+typedef struct _record_cache_entry_def
+{
+	uint8_t		 flags;							// RECORD_CACHE_VALID, RECORD_CACHE_DIRTY
+	uint16_t	 length;						// Size of the record
+	uint32_t	 dirty_time;					// Tick count when the record became dirty
+	uint32_t	 last_used;						// Access sequence for replacement
+	uint8_t		 data[RECORD_CACHE_RECORD_SIZE];// Record, starting with an EntryHeader_t
+} record_cache_entry_t;
+
+/**
+* Record cache statistics structure definition
+*/
+typedef struct _record_cache_statistics_def
+{
+	uint32_t	hits;							// Reads served from the cache
+	uint32_t	misses;							// Reads of cacheable records served from flash
+	uint32_t	coalesced;						// Updates merged into a dirty record
+} record_cache_statistics_t;
+
+/**
+* Reset the record cache.
+* All entries, including dirty ones, are discarded.
+*
+* \param    None
+*
+* \returns  None
+*/
+void record_cache_reset ( void );
+
+/**
+* Check if a record can be held in the cache.
+*
+* \param    recordType	Record type
+* \param	length		Size of the record
+*
+* \returns  true if the record is cacheable.
+*/
+bool record_cache_is_cacheable ( uint8_t recordType, uint32_t length );
+
+/**
+* Find a record in the cache.
+*
+* \param    recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the record key
+*
+* \returns  Pointer to the cache entry, NULL if the record is not cached.
+*/
+record_cache_entry_t* record_cache_find ( uint8_t recordType, const uint8_t* uuid );
+
+/**
+* Read a record from the cache.
+*
+* \param    uuid		Pointer to the record key
+* \param	record		Pointer to the record buffer
+* \param	size		Size of the record buffer
+*
+* \returns  true if the record was cached and copied.
+*/
+bool record_cache_read ( const uint8_t* uuid, void* record, uint32_t size );
+
+/**
+* Store a record in the cache.
+* A dirty record replaces the cached copy of the same record, so repeated
+* updates are coalesced into a single flash write.
+*
+* \param    data		Pointer to the record, starting with an EntryHeader_t
+* \param	length		Size of the record
+* \param	dirty		true if the record still has to be written to flash
+* \param	now			Current tick count
+*
+* \returns  true if successful, false if every entry is dirty.
+*/
+bool record_cache_put ( const uint8_t* data, uint32_t length, bool dirty, uint32_t now );
+
+/**
+* Remove a record from the cache.
+*
+* \param    recordType	Record type or BLOCK_INDEX_ANY_TYPE
+* \param	uuid		Pointer to the record key
+*
+* \returns  true if the record was cached and removed.
+*/
+bool record_cache_remove ( uint8_t recordType, const uint8_t* uuid );
+
+/**
+* Get the next dirty record.
+*
+* \param    None
+*
+* \returns  Pointer to the cache entry, NULL if no record is dirty.
+*/
+record_cache_entry_t* record_cache_next_dirty ( void );
+
+/**
+* Mark a cached record as written to flash.
+*
+* \param    entry		Pointer to the cache entry
+*
+* \returns  None
+*/
+void record_cache_mark_clean ( record_cache_entry_t* entry );
+
+/**
+* Get the number of dirty records.
+*
+* \param    None
+*
+* \returns  Number of dirty records.
+*/
+uint32_t record_cache_dirty_count ( void );
+
+/**
+* Get the age of the oldest dirty record.
+*
+* \param    now			Current tick count
+*
+* \returns  Age in ticks, 0 if no record is dirty.
+*/
+uint32_t record_cache_dirty_age ( uint32_t now );
+
+/**
+* Count a read of a cacheable record that had to be served from flash.
+*
+* \param    None
+*
+* \returns  None
+*/
+void record_cache_count_miss ( void );
+
+/**
+* Get the record cache statistics.
+*
+* \param    statistics	Pointer to storage for the statistics
+*
+* \returns  None
+*/
+void record_cache_get_statistics ( record_cache_statistics_t* statistics );
+
+/**
+* Reset the record cache statistics.
+*
+* \param    None
+*
+* \returns  None
+*/
+void record_cache_reset_statistics ( void );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* SRC_SERVICES_DATABASE_DATABASE_CORE_RECORD_CACHE_H_ */
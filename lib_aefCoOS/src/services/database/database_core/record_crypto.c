@@ -0,0 +1,280 @@
+
+/**
+* record_crypto.c
+*
+* \copyright
+* Copyright 2015 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the database record protection stream.
+*
+* The CTR key stream is generated a chunk at a time with a single AES-ECB call
+* over consecutive counter blocks, so the per call cost of the crypto library
+* is paid once per chunk rather than once per AES block.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <aef/crypto/ll_crypto_manager.h>
+#include <aef/crypto/ll_crypto_block_cipher.h>
+#include <aef/crypto/ll_crypto_message_authentication.h>
+#include <aef/crypto/ll_crypto_memcmp.h>
+#include "record_crypto.h"
+#include "block_allocator.h"
+
+#define RECORD_CRYPTO_KEY_SIZE		16				// AES-128 key size
+#define RECORD_CRYPTO_MAC_KEY_SIZE	32				// HMAC-SHA256 key size
+#define RECORD_CRYPTO_NONCE_SIZE	8				// Per-boot part of the IV
+#define RECORD_CRYPTO_CIPHER_CTX	512				// Storage for the AES context
+#define RECORD_CRYPTO_MAC_CTX		256				// Storage for the HMAC context
+
+/**
+* Record protection state
+*/
+static bool		 crypto_enabled = false;
+static uint64_t	 cipher_ctx[RECORD_CRYPTO_CIPHER_CTX / sizeof(uint64_t)];
+static uint64_t	 mac_ctx[RECORD_CRYPTO_MAC_CTX / sizeof(uint64_t)];
+static uint8_t	 mac_key[RECORD_CRYPTO_MAC_KEY_SIZE];
+static uint8_t	 iv_nonce[RECORD_CRYPTO_NONCE_SIZE];
+static uint32_t	 iv_sequence = 0;
+static uint8_t	 counter[RECORD_CRYPTO_BLOCK_SIZE];
+static uint8_t	 keystream[CHUNK_SIZE];
+static uint32_t	 keystream_used = CHUNK_SIZE;
+
+/**
+* Generate the next chunk of CTR key stream.
+*
+* \param    None
+*
+* \returns  true if successful.
+*/
+static bool record_crypto_refill ( void )
+{
+	for ( uint32_t offset = 0; offset < sizeof(keystream); offset += RECORD_CRYPTO_BLOCK_SIZE )
+	{
+		memcpy ( &keystream[offset], counter, RECORD_CRYPTO_BLOCK_SIZE );
+
+		/*
+		 * The last word of the counter block is a big endian block counter
+		 */
+		for ( uint32_t index = RECORD_CRYPTO_BLOCK_SIZE; index > RECORD_CRYPTO_BLOCK_SIZE - 4; index-- )
+		{
+			if ( ++counter[index - 1] != 0 )
+				break;
+		}
+	}
+
+	/*
+	 * The ECB cipher takes its input size in blocks
+	 */
+	if ( ll_crypto_block_cipher_aes_128_ecb_encrypt ( cipher_ctx, keystream, sizeof(keystream) / RECORD_CRYPTO_BLOCK_SIZE, keystream ) != CRYPTO_STATUS_SUCCESS )
+		return false;
+
+	keystream_used = 0;
+	return true;
+}
+
+/**
+* Apply the CTR key stream to a range of bytes.
+*
+* \param    data		Pointer to the data
+* \param	length		Number of bytes
+*
+* \returns  true if successful.
+*/
+static bool record_crypto_xor ( uint8_t* data, uint32_t length )
+{
+	while ( length != 0 )
+	{
+		if ( keystream_used == sizeof(keystream) && ! record_crypto_refill () )
+			return false;
+
+		*data++ ^= keystream[keystream_used++];
+		length--;
+	}
+	return true;
+}
+
+/**
+* Load the record protection keys.
+*
+* \param    key			Pointer to the encryption key
+* \param	authentication_key	Pointer to the authentication key
+* \param	nonce		Pointer to the per-boot IV nonce
+*
+* \returns  true if successful.
+*/
+bool record_crypto_init ( const uint8_t* key, const uint8_t* authentication_key, const uint8_t* nonce )
+{
+	size_t ctx_size = sizeof(cipher_ctx);
+
+	crypto_enabled = false;
+
+	if ( key == NULL || authentication_key == NULL || nonce == NULL )
+		return false;
+
+	if ( ll_crypto_init () != CRYPTO_STATUS_SUCCESS ||
+		 ll_crypto_register_block_cipher_aes_128_ecb () != CRYPTO_STATUS_SUCCESS ||
+		 ll_crypto_register_message_authentication_256 () != CRYPTO_STATUS_SUCCESS )
+		return false;
+
+	/*
+	 * The ECB cipher takes its key size in bits
+	 */
+	if ( ll_crypto_block_cipher_aes_128_ecb_init ( BLOCK_CIPHER_INIT_ENCRYPT, key, RECORD_CRYPTO_KEY_SIZE * 8, cipher_ctx, &ctx_size ) != CRYPTO_STATUS_SUCCESS )
+		return false;
+
+	memcpy ( mac_key, authentication_key, sizeof(mac_key) );
+	memcpy ( iv_nonce, nonce, sizeof(iv_nonce) );
+	iv_sequence    = 0;
+	crypto_enabled = true;
+
+	return true;
+}
+
+/**
+* Discard the record protection keys.
+*
+* \param    None
+*
+* \returns  None
+*/
+void record_crypto_disable ( void )
+{
+	crypto_enabled = false;
+	memset ( cipher_ctx, 0, sizeof(cipher_ctx) );
+	memset ( mac_ctx, 0, sizeof(mac_ctx) );
+	memset ( mac_key, 0, sizeof(mac_key) );
+	memset ( keystream, 0, sizeof(keystream) );
+}
+
+/**
+* Check if record protection is enabled.
+*
+* \param    None
+*
+* \returns  true if the keys are loaded.
+*/
+bool record_crypto_enabled ( void )
+{
+	return crypto_enabled;
+}
+
+/**
+* Generate a fresh IV for a record.
+* The IV is the per-boot nonce followed by a record sequence number, the
+* last word is the CTR block counter.
+*
+* \param    iv			Pointer to storage for the IV
+*
+* \returns  None
+*/
+void record_crypto_new_iv ( uint8_t* iv )
+{
+	iv_sequence++;
+
+	memcpy ( iv, iv_nonce, RECORD_CRYPTO_NONCE_SIZE );
+	iv[8]  = (uint8_t)(iv_sequence >> 24);
+	iv[9]  = (uint8_t)(iv_sequence >> 16);
+	iv[10] = (uint8_t)(iv_sequence >> 8);
+	iv[11] = (uint8_t)(iv_sequence);
+	memset ( &iv[12], 0, 4 );
+}
+
+/**
+* Start the protection stream of a record.
+* The record type, UUID and IV of the header are authenticated.
+*
+* \param    header		Pointer to the record header
+*
+* \returns  true if successful.
+*/
+bool record_crypto_begin ( const EntryHeader_t* header )
+{
+	size_t ctx_size = sizeof(mac_ctx);
+
+	if ( ! crypto_enabled )
+		return false;
+
+	memcpy ( counter, header->IV, sizeof(counter) );
+	keystream_used = sizeof(keystream);
+
+	if ( ll_crypto_message_authentication_256_init ( mac_key, sizeof(mac_key), mac_ctx, &ctx_size ) != CRYPTO_STATUS_SUCCESS )
+		return false;
+
+	ll_crypto_message_authentication_256_update ( mac_ctx, &header->block_entry.recordType, 1 );
+	ll_crypto_message_authentication_256_update ( mac_ctx, &header->block_entry.uuidSize, 1 );
+	ll_crypto_message_authentication_256_update ( mac_ctx, header->block_entry.UUID, sizeof(header->block_entry.UUID) );
+	ll_crypto_message_authentication_256_update ( mac_ctx, header->IV, sizeof(header->IV) );
+
+	return true;
+}
+
+/**
+* Encrypt the next bytes of the record in place and authenticate them.
+*
+* \param    data		Pointer to the plaintext
+* \param	length		Number of bytes
+*
+* \returns  true if successful.
+*/
+bool record_crypto_encrypt ( uint8_t* data, uint32_t length )
+{
+	if ( ! record_crypto_xor ( data, length ) )
+		return false;
+
+	return ( ll_crypto_message_authentication_256_update ( mac_ctx, data, length ) == CRYPTO_STATUS_SUCCESS );
+}
+
+/**
+* Authenticate the next bytes of the record and decrypt them in place.
+*
+* \param    data		Pointer to the ciphertext
+* \param	length		Number of bytes
+*
+* \returns  true if successful.
+*/
+bool record_crypto_decrypt ( uint8_t* data, uint32_t length )
+{
+	if ( ll_crypto_message_authentication_256_update ( mac_ctx, data, length ) != CRYPTO_STATUS_SUCCESS )
+		return false;
+
+	return record_crypto_xor ( data, length );
+}
+
+/**
+* Finish the protection stream and return the MAC.
+*
+* \param    mac			Pointer to storage for the MAC
+*
+* \returns  true if successful.
+*/
+bool record_crypto_finish ( uint8_t* mac )
+{
+	size_t mac_size = RECORD_CRYPTO_MAC_SIZE;
+
+	return ( ll_crypto_message_authentication_256_finalize ( mac_ctx, mac_key, sizeof(mac_key), mac, &mac_size ) == CRYPTO_STATUS_SUCCESS );
+}
+
+/**
+* Finish the protection stream and check the MAC.
+*
+* \param    mac			Pointer to the MAC read from the record
+*
+* \returns  true if the record is authentic.
+*/
+bool record_crypto_verify ( const uint8_t* mac )
+{
+	uint8_t expected[RECORD_CRYPTO_MAC_SIZE];
+	bool	result;
+
+	if ( ! record_crypto_finish ( expected ) )
+		return false;
+
+	result = ( ll_crypto_memcmp ( expected, mac, RECORD_CRYPTO_MAC_SIZE ) == 0 );
+	memset ( expected, 0, sizeof(expected) );
+
+	return result;
+}
@@ -0,0 +1,126 @@
+
+/**
+* record_crypto.h
+*
+* \copyright
+* Copyright 2015 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the database record protection stream.
+*
+* Records are protected with AES-128-CTR and authenticated with HMAC-SHA256
+* over the ciphertext (encrypt-then-MAC).  The stream is fed one chunk at a
+* time as the record moves to or from flash, so a record is encrypted and
+* authenticated in a single pass without being buffered.  The MAC also covers
+* the record type, UUID and IV, which stay in the clear for the block index.
+*/
+
+#ifndef SRC_SERVICES_DATABASE_DATABASE_CORE_RECORD_CRYPTO_H_
+#define SRC_SERVICES_DATABASE_DATABASE_CORE_RECORD_CRYPTO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <aef/embedded/service/database/database_service.h>
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+#define RECORD_CRYPTO_BLOCK_SIZE	16				// AES block size
+#define RECORD_CRYPTO_MAC_SIZE		32				// HMAC-SHA256 digest size, the size of EntryFooter_t
+
+/**
+* Load the record protection keys.
+*
+* \param    key			Pointer to the encryption key
+* \param	authentication_key	Pointer to the authentication key
+* \param	nonce		Pointer to the per-boot IV nonce
+*
+* \returns  true if successful.
+*/
+bool record_crypto_init ( const uint8_t* key, const uint8_t* authentication_key, const uint8_t* nonce );
+
+/**
+* Discard the record protection keys.
+*
+* \param    None
+*
+* \returns  None
+*/
+void record_crypto_disable ( void );
+
+/**
+* Check if record protection is enabled.
+*
+* \param    None
+*
+* \returns  true if the keys are loaded.
+*/
+bool record_crypto_enabled ( void );
+
+/**
+* Generate a fresh IV for a record.
+* The IV is the per-boot nonce followed by a record sequence number, the
+* last word is the CTR block counter.
+*
+* \param    iv			Pointer to storage for the IV
+*
+* \returns  None
+*/
+void record_crypto_new_iv ( uint8_t* iv );
+
+/**
+* Start the protection stream of a record.
+* The record type, UUID and IV of the header are authenticated.
+*
+* \param    header		Pointer to the record header
+*
+* \returns  true if successful.
+*/
+bool record_crypto_begin ( const EntryHeader_t* header );
+
+/**
+* Encrypt the next bytes of the record in place and authenticate them.
+*
+* \param    data		Pointer to the plaintext
+* \param	length		Number of bytes
+*
+* \returns  true if successful.
+*/
+bool record_crypto_encrypt ( uint8_t* data, uint32_t length );
+
+/**
+* Authenticate the next bytes of the record and decrypt them in place.
+*
+* \param    data		Pointer to the ciphertext
+* \param	length		Number of bytes
+*
+* \returns  true if successful.
+*/
+bool record_crypto_decrypt ( uint8_t* data, uint32_t length );
+
+/**
+* Finish the protection stream and return the MAC.
+*
+* \param    mac			Pointer to storage for the MAC
+*
+* \returns  true if successful.
+*/
+bool record_crypto_finish ( uint8_t* mac );
+
+/**
+* Finish the protection stream and check the MAC.
+*
+* \param    mac			Pointer to the MAC read from the record
+*
+* \returns  true if the record is authentic.
+*/
+bool record_crypto_verify ( const uint8_t* mac );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* SRC_SERVICES_DATABASE_DATABASE_CORE_RECORD_CRYPTO_H_ */
@@ -12,11 +12,19 @@
 *
 */
 
+#ifndef SERIAL_FLASH_SIMULATOR
+
 #include <CoOS.h>
 #include "serial_flash.h"
+#include <string.h>
 
 #include <aef/embedded/osal/time.h>
 #include <aef/embedded/osal/time_delay.h>
+#include <OsConfig.h>
+
+#if SPI_SERIAL_FLASH_CYCLE_COUNT
+#include "MK64F12.h"
+#endif
 
 #define HIBYTE(w)					((uint8_t)(((uint16_t)(w) >> 8) & 0xFF))
 #define LOBYTE(w)					((uint8_t)(w))
@@ -32,6 +40,21 @@
 static const stream_driver_vtable_t* serial_flash_spi_drv = NULL;
 static stream_driver_ctx_t* serial_flash_spi_ctx = NULL;
 static uint8_t	transfer_buffer[SPI_SERIAL_FLASH_BUFFER_SIZE];
+static serial_flash_statistics_t serial_flash_statistics;
+static uint32_t serial_flash_last_polls = 0;
+static bool		erase_active = false;			// Background erase started
+static bool		erase_suspended = false;		// Background erase suspended
+static uint32_t erase_start = 0;				// Tick count when the background erase started
+
+#if SPI_SERIAL_FLASH_READ_AHEAD
+static uint8_t	read_ahead_buffer[SPI_SERIAL_FLASH_READ_AHEAD];
+static uint32_t read_ahead_addr = 0;
+static uint32_t read_ahead_size = 0;			// 0 when the buffer is empty
+static uint32_t read_last_addr = 0;				// Address of the last read
+static uint32_t read_next_addr = 0;				// Address following the last read
+static bool		read_ahead_used = false;		// The buffer served a read since its fill
+static bool		read_ahead_enabled = true;		// Reads are sequential enough to fill the buffer
+#endif
 
 /**
 * Initialize serial flash SPI support
@@ -39,14 +62,134 @@ static uint8_t	transfer_buffer[SPI_SERIAL_FLASH_BUFFER_SIZE];
 * \param    drv			Stream device driver vtable
 * \param	ctx			Stream device driver context
 *
-* \returns  SERVICE_STATUS_SUCCESS if successful.
-*           SERVICE_FAILURE_GENERAL if unsuccessful.
-*           SERVICE_FAILURE_INVALID_PARAMETER if an invalid parameter.
+* \returns  true if successful, false if the driver or its context is invalid.
 */
-void serial_flash_initialize ( const stream_driver_vtable_t* drv, stream_driver_ctx_t* ctx )
+bool serial_flash_initialize ( const stream_driver_vtable_t* drv, stream_driver_ctx_t* ctx )
 {
+	if ( drv == NULL || ctx == NULL )
+		return false;
+
 	serial_flash_spi_drv = drv;
 	serial_flash_spi_ctx = ctx;
+	serial_flash_read_ahead_invalidate ();
+
+#if SPI_SERIAL_FLASH_CYCLE_COUNT
+	/*
+	 * Start the DWT cycle counter used to time reads
+	 */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+	return true;
+}
+
+/**
+* Send a single byte instruction to the memory device
+*
+* \param    instruction	Instruction to send
+*
+* \returns  None
+*/
+static void serial_flash_instruction ( uint8_t instruction )
+{
+    uint32_t bytes_transferred = 0;
+
+    serial_flash_spi_drv->write (serial_flash_spi_ctx, &instruction, 1, &bytes_transferred);
+
+    /*
+     * Deactivate CS
+     */
+    serial_flash_spi_drv->iocontrol (serial_flash_spi_ctx, IOCTL_SPI_FLUSH, NULL, 0L, NULL, 0L, NULL);
+}
+
+/**
+* Account for the end of the background erase
+*
+* \param    None
+*
+* \returns  None
+*/
+static void serial_flash_erase_done ( void )
+{
+	serial_flash_statistics.erase_ticks += (uint32_t)time_get_ticks (NULL) - erase_start;
+	erase_active    = false;
+	erase_suspended = false;
+}
+
+/**
+* Suspend the background erase so the device can be read or programmed
+* The erase is left alone if it has already completed.
+*
+* \param    None
+*
+* \returns  None
+*/
+static void serial_flash_erase_suspend ( void )
+{
+	if ( ! erase_active || erase_suspended )
+		return;
+
+	if ( ! (serial_flash_read_status () & STATUS_BUSY) )
+	{
+		serial_flash_erase_done ();
+		return;
+	}
+
+	serial_flash_instruction (SPI_SERIAL_FLASH_ERASE_SUSPEND);
+	serial_flash_wait_ready (SPI_SERIAL_FLASH_SUSPEND_TIMEOUT);
+	erase_suspended = true;
+	serial_flash_statistics.erase_suspends++;
+}
+
+/**
+* Read a byte stream from the memory device in a single burst
+* The instruction, address and data share one chip select window.
+*
+* \param    addr		Address in the memory device
+* \param	size		Number of bytes to read
+* \param	data		Pointer to the buffer to store the bytes read.
+*
+* \returns  Number of bytes read.
+*/
+static uint32_t serial_flash_burst_read ( uint32_t addr, uint32_t size, uint8_t* data )
+{
+    uint32_t bytes_transferred = 0;
+    uint8_t  command[5];
+    uint32_t command_size;
+
+    ////////////////////////////////////////////////////////
+    // Read instruction, address and, for a fast read, the dummy byte
+#if SPI_SERIAL_FLASH_FAST_READ_ENABLE
+    command[0] = SPI_SERIAL_FLASH_FAST_READ;
+    command[4] = 0x00;
+    command_size = 5;
+#else
+    command[0] = SPI_SERIAL_FLASH_READ_DATA;
+    command_size = 4;
+#endif
+    command[1] = LNMSB(addr);
+    command[2] = LNLSB(addr);
+    command[3] = LLSB(addr);
+    serial_flash_statistics.reads++;
+    serial_flash_statistics.read_bytes += size;
+    serial_flash_erase_suspend ();
+
+    /*
+     * Send command
+     */
+    serial_flash_spi_drv->write (serial_flash_spi_ctx, command, command_size, &bytes_transferred);
+
+    if ( bytes_transferred == command_size )
+    {
+    	serial_flash_spi_drv->read (serial_flash_spi_ctx, data, size, &bytes_transferred );
+    }
+
+    /*
+     * Deactivate CS
+     */
+    serial_flash_spi_drv->iocontrol (serial_flash_spi_ctx, IOCTL_SPI_FLUSH, NULL, 0L, NULL, 0L, NULL);
+
+    return ( (bytes_transferred != size) ? 0 : size );
 }
 
 /**
@@ -163,6 +306,10 @@ uint32_t serial_flash_chip_erase ( void )
     uint32_t bytes_transferred = 0;
     uint8_t  command;
     uint32_t result;
+    uint32_t start;
+
+    serial_flash_read_ahead_invalidate ();
+    serial_flash_erase_complete ();
 
     /*
      * Enable write
@@ -170,6 +317,7 @@ uint32_t serial_flash_chip_erase ( void )
     serial_flash_set_write_latch (true);
 
     command = SPI_SERIAL_FLASH_CHIP_ERASE;
+    serial_flash_statistics.erases++;
 
     /*
      * Send command
@@ -181,15 +329,9 @@ uint32_t serial_flash_chip_erase ( void )
      */
     serial_flash_spi_drv->iocontrol (serial_flash_spi_ctx, IOCTL_SPI_FLUSH, NULL, 0L, NULL, 0L, NULL);
 
-    time_delay (1);
-    result = (uint32_t)serial_flash_read_status();
-
-//    WAITFOR_TIMEOUT ( (! (memory_read_status() & STATUS_BUSY)), 60000 );
-
-    /*
-     * Disable write
-     */
-    serial_flash_set_write_latch (false);
+    start = (uint32_t)time_get_ticks (NULL);
+    result = (uint32_t)serial_flash_wait_ready (SPI_SERIAL_FLASH_CHIP_TIMEOUT);
+    serial_flash_statistics.erase_ticks += (uint32_t)time_get_ticks (NULL) - start;
 
     return ( (result == 0x00 ) ? false : true );
 }
@@ -205,6 +347,10 @@ void serial_flash_subsector_erase ( uint32_t addr )
 {
     uint32_t bytes_transferred = 0;
     uint8_t  command[4];
+    uint32_t start;
+
+    serial_flash_read_ahead_invalidate ();
+    serial_flash_erase_complete ();
 
     serial_flash_set_write_latch (true);
 
@@ -212,6 +358,7 @@ void serial_flash_subsector_erase ( uint32_t addr )
     command[1] = LNMSB(addr);
     command[2] = LNLSB(addr);
     command[3] = LLSB(addr);
+    serial_flash_statistics.erases++;
 
     /*
      * Send command
@@ -223,12 +370,9 @@ void serial_flash_subsector_erase ( uint32_t addr )
      */
     serial_flash_spi_drv->iocontrol (serial_flash_spi_ctx, IOCTL_SPI_FLUSH, NULL, 0L, NULL, 0L, NULL);
 
-    time_delay (1);
-//    WAITFOR_TIMEOUT ( (! (memory_read_status() & STATUS_BUSY)), 15000 );
-
-    ////////////////////////////////////////////////////////
-    // disable write operation
-    serial_flash_set_write_latch (false);
+    start = (uint32_t)time_get_ticks (NULL);
+    serial_flash_wait_ready (SPI_SERIAL_FLASH_SUBSECTOR_TIMEOUT);
+    serial_flash_statistics.erase_ticks += (uint32_t)time_get_ticks (NULL) - start;
 }
 
 /**
@@ -242,6 +386,10 @@ void serial_flash_sector_erase ( uint32_t addr )
 {
     uint32_t bytes_transferred = 0;
     uint8_t  command[4];
+    uint32_t start;
+
+    serial_flash_read_ahead_invalidate ();
+    serial_flash_erase_complete ();
 
     serial_flash_set_write_latch (true);
 
@@ -252,6 +400,7 @@ void serial_flash_sector_erase ( uint32_t addr )
     command[1] = LNMSB(addr);
     command[2] = LNLSB(addr);
     command[3] = LLSB(addr);
+    serial_flash_statistics.erases++;
 
     /*
      * Send command
@@ -263,38 +412,37 @@ void serial_flash_sector_erase ( uint32_t addr )
      */
     serial_flash_spi_drv->iocontrol (serial_flash_spi_ctx, IOCTL_SPI_FLUSH, NULL, 0L, NULL, 0L, NULL);
 
-    time_delay (1);
-//    WAITFOR_TIMEOUT ( (! (memory_read_status() & STATUS_BUSY)), 30000 );
-
-    ////////////////////////////////////////////////////////
-    // disable write operation
-    serial_flash_set_write_latch (false);
+    start = (uint32_t)time_get_ticks (NULL);
+    serial_flash_wait_ready (SPI_SERIAL_FLASH_SECTOR_TIMEOUT);
+    serial_flash_statistics.erase_ticks += (uint32_t)time_get_ticks (NULL) - start;
 }
 
 /**
-* Write a byte to the memory device
+* Start a sector erase in the background
+* Only one background erase is in progress at a time, a previous one is
+* completed first.
 *
-* \param    addr		Address to write the byte
-* \param	data		Byte to write
+* \param    Addr		Address of the sector to erase
 *
 * \returns  None
 */
-void serial_flash_write_byte ( uint32_t addr, uint8_t data )
+void serial_flash_sector_erase_start ( uint32_t addr )
 {
     uint32_t bytes_transferred = 0;
-    uint8_t  command[5];
+    uint8_t  command[4];
 
+    serial_flash_read_ahead_invalidate ();
+    serial_flash_erase_complete ();
     serial_flash_set_write_latch (true);
-    serial_flash_read_status ();
 
     /*
      * Set up command buffer
      */
-    command[0] = SPI_SERIAL_FLASH_WRITE_DATA;
+    command[0] = SPI_SERIAL_FLASH_SECTOR_ERASE;
     command[1] = LNMSB(addr);
     command[2] = LNLSB(addr);
     command[3] = LLSB(addr);
-    command[4] = data;
+    serial_flash_statistics.erases++;
 
     /*
      * Send command
@@ -306,72 +454,151 @@ void serial_flash_write_byte ( uint32_t addr, uint8_t data )
      */
     serial_flash_spi_drv->iocontrol (serial_flash_spi_ctx, IOCTL_SPI_FLUSH, NULL, 0L, NULL, 0L, NULL);
 
-    /* There is 1 ms internal write cycle needed for memory */
-    time_delay (1);
-//    WAITFOR_TIMEOUT ( (! (memory_read_status() & STATUS_BUSY)), 1000 );
+    erase_start     = (uint32_t)time_get_ticks (NULL);
+    erase_active    = true;
+    erase_suspended = false;
+}
 
-    ////////////////////////////////////////////////////////
-    // Disable write operation must be enabled in memory
-    serial_flash_set_write_latch (false);
+/**
+* Check if a background erase is still in progress
+*
+* \param    None
+*
+* \returns  true if the background erase has not completed.
+*/
+bool serial_flash_erase_busy ( void )
+{
+	if ( ! erase_active )
+		return false;
+
+	if ( erase_suspended || (serial_flash_read_status () & STATUS_BUSY) )
+		return true;
 
+	serial_flash_erase_done ();
+	return false;
 }
 
 /**
-* Read a byte from the memory device
+* Resume a suspended background erase
 *
-* \param    addr		Address of the byte
+* \param    None
 *
-* \returns  Byte value read.
+* \returns  None
 */
-uint8_t serial_flash_read_byte ( uint32_t addr )
+void serial_flash_erase_resume ( void )
 {
+	if ( erase_active && erase_suspended )
+	{
+		serial_flash_instruction (SPI_SERIAL_FLASH_ERASE_RESUME);
+		erase_suspended = false;
+	}
+}
 
+/**
+* Wait for a background erase to complete
+*
+* \param    None
+*
+* \returns  true if the erase completed, false on timeout.
+*/
+bool serial_flash_erase_complete ( void )
+{
+	bool result;
+
+	if ( ! erase_active )
+		return true;
+
+	serial_flash_erase_resume ();
+	result = serial_flash_wait_ready (SPI_SERIAL_FLASH_SECTOR_TIMEOUT);
+	serial_flash_erase_done ();
+
+	return result;
+}
+
+/**
+* Write a byte to the memory device
+*
+* \param    addr		Address to write the byte
+* \param	data		Byte to write
+*
+* \returns  None
+*/
+void serial_flash_write_byte ( uint32_t addr, uint8_t data )
+{
     uint32_t bytes_transferred = 0;
-    uint8_t  command[4];
-    uint8_t  data = 0;
+    uint8_t  command[5];
+
+    serial_flash_read_ahead_invalidate ();
+    serial_flash_erase_suspend ();
+
+    serial_flash_set_write_latch (true);
 
     /*
      * Set up command buffer
      */
-    command[0] = SPI_SERIAL_FLASH_READ_DATA;
+    command[0] = SPI_SERIAL_FLASH_WRITE_DATA;
     command[1] = LNMSB(addr);
     command[2] = LNLSB(addr);
     command[3] = LLSB(addr);
+    command[4] = data;
+    serial_flash_statistics.programs++;
+    serial_flash_statistics.program_bytes++;
 
     /*
      * Send command
      */
     serial_flash_spi_drv->write (serial_flash_spi_ctx, command, sizeof(command), &bytes_transferred);
 
-    if ( bytes_transferred == sizeof(command) )
-    {
-    	serial_flash_spi_drv->read (serial_flash_spi_ctx, &data, 1, &bytes_transferred );
-    }
-
     /*
      * Deactivate CS
      */
     serial_flash_spi_drv->iocontrol (serial_flash_spi_ctx, IOCTL_SPI_FLUSH, NULL, 0L, NULL, 0L, NULL);
 
+    /*
+     * Wait for the internal write cycle, the write latch clears when it completes
+     */
+    serial_flash_wait_ready (SPI_SERIAL_FLASH_PROGRAM_TIMEOUT);
+}
+
+/**
+* Read a byte from the memory device
+*
+* \param    addr		Address of the byte
+*
+* \returns  Byte value read.
+*/
+uint8_t serial_flash_read_byte ( uint32_t addr )
+{
+    uint8_t  data = 0;
+
+    serial_flash_read_data ( addr, 1, &data );
+
     return data;
 }
 
 /**
 * Write a byte stream to the memory device
+* Pages are programmed back to back.  The status register is polled for the
+* end of each program cycle instead of sleeping for the worst case, and the
+* next page is only held off until the device reports ready.
 *
 * \param    addr		Address in the memory device
 * \param	size		Number of bytes to write
 * \param	data		Pointer to the data to write
 *
-* \returns  Byte value read.
+* \returns  Number of bytes written.
 */
 uint32_t serial_flash_write_data (uint32_t addr, uint32_t size, uint8_t* data)
 {
     uint32_t bytes_transferred = 0;
 	uint32_t bytes_to_write = size;
 	uint32_t page_size;
+	uint32_t start = (uint32_t)time_get_ticks (NULL);
 	uint8_t  command[4];
 
+	serial_flash_read_ahead_invalidate ();
+	serial_flash_erase_suspend ();
+
 	while (bytes_to_write > 0)
 	{
 
@@ -381,13 +608,6 @@ uint32_t serial_flash_write_data (uint32_t addr, uint32_t size, uint8_t* data)
 		page_size = bytes_to_write;
 	    if (page_size > SPI_SERIAL_FLASH_PAGE_SIZE - (addr & (SPI_SERIAL_FLASH_PAGE_SIZE - 1)))
 	    	page_size = SPI_SERIAL_FLASH_PAGE_SIZE - (addr & (SPI_SERIAL_FLASH_PAGE_SIZE - 1));
-	    bytes_to_write -= page_size;
-
-	    /*
-	     * Enable writes
-	     */
-	    serial_flash_set_write_latch (true);
-	    serial_flash_read_status ();
 
 	    /*
 	     * Set up command buffer
@@ -397,6 +617,22 @@ uint32_t serial_flash_write_data (uint32_t addr, uint32_t size, uint8_t* data)
 	    command[2] = LNLSB(addr);
 	    command[3] = LLSB(addr);
 
+	    /*
+	     * Wait for the previous page to finish programming
+	     */
+	    if ( ! serial_flash_wait_ready (SPI_SERIAL_FLASH_PROGRAM_TIMEOUT) )
+	    {
+	    	size -= bytes_to_write;
+	    	break;
+	    }
+	    if ( serial_flash_last_polls > serial_flash_statistics.program_max_polls )
+	    	serial_flash_statistics.program_max_polls = serial_flash_last_polls;
+
+	    /*
+	     * Enable writes, the latch clears at the end of every program cycle
+	     */
+	    serial_flash_set_write_latch (true);
+
 	    /*
 	     * Send command
 	     */
@@ -404,7 +640,7 @@ uint32_t serial_flash_write_data (uint32_t addr, uint32_t size, uint8_t* data)
 
 	    if ( bytes_transferred != sizeof(command) )
 	    {
-	    	size = 0;
+	    	size -= bytes_to_write;
 	    	break;
 	    }
 
@@ -420,22 +656,19 @@ uint32_t serial_flash_write_data (uint32_t addr, uint32_t size, uint8_t* data)
 	    }
 
 	    /*
-	     * Deactivate CS
+	     * Deactivate CS to start the program cycle
 	     */
 	    serial_flash_spi_drv->iocontrol (serial_flash_spi_ctx, IOCTL_SPI_FLUSH, NULL, 0L, NULL, 0L, NULL);
+	    serial_flash_statistics.programs++;
+	    serial_flash_statistics.program_bytes += page_size;
 
 	    /*
 	     * Move to next block to write
 	     */
+	    bytes_to_write -= page_size;
 	    addr += page_size;
 	    data += page_size;
 
-	    /*
-	     * Allow for 5ms internal memory write cycle
-	     */
-	    time_delay (5);
-//	    WAITFOR_TIMEOUT ( (! (memory_read_status() & STATUS_BUSY)), 5000 );
-
 	} // while
 
     /*
@@ -444,49 +677,183 @@ uint32_t serial_flash_write_data (uint32_t addr, uint32_t size, uint8_t* data)
     serial_flash_spi_drv->iocontrol (serial_flash_spi_ctx, IOCTL_SPI_FLUSH, NULL, 0L, NULL, 0L, NULL);
 
     /*
-     * Disable writes
+     * Wait for the last page so the data can be read back
      */
-	serial_flash_set_write_latch (false);
+    serial_flash_wait_ready (SPI_SERIAL_FLASH_PROGRAM_TIMEOUT);
+    if ( serial_flash_last_polls > serial_flash_statistics.program_max_polls )
+    	serial_flash_statistics.program_max_polls = serial_flash_last_polls;
+    serial_flash_statistics.program_ticks += (uint32_t)time_get_ticks (NULL) - start;
 
 	return size;
 }
 
+#if SPI_SERIAL_FLASH_READ_AHEAD
+/**
+* Look up a small read in the read-ahead buffer, refilling it on a miss
+* A buffer replaced before it served a read turns read-ahead off, the reads
+* are scattered, as in a scan of the block headers, and every fill would
+* cost more than the read.  A read that starts within or right after the
+* previous one, such as a record read after its header, turns it back on.
+*
+* \param    addr		Address in the memory device
+* \param	size		Number of bytes to read
+*
+* \returns  true if the read is served from the buffer.
+*/
+static bool serial_flash_read_ahead ( uint32_t addr, uint32_t size )
+{
+	bool sequential = ( addr >= read_last_addr && addr <= read_next_addr );
+
+	if ( read_ahead_size != 0 && addr >= read_ahead_addr && (addr - read_ahead_addr) + size <= read_ahead_size )
+	{
+		serial_flash_statistics.read_ahead_hits++;
+		read_ahead_used = true;
+		return true;
+	}
+
+	if ( read_ahead_size != 0 && ! read_ahead_used )
+		read_ahead_enabled = false;
+	if ( sequential )
+		read_ahead_enabled = true;
+	if ( ! read_ahead_enabled )
+		return false;
+
+	read_ahead_size = SPI_SERIAL_FLASH_READ_AHEAD;
+	if ( read_ahead_size > SPI_SERIAL_FLASH_SERIAL_FLASH_SIZE - addr )
+		read_ahead_size = SPI_SERIAL_FLASH_SERIAL_FLASH_SIZE - addr;
+
+	read_ahead_addr = addr;
+	read_ahead_size = serial_flash_burst_read ( addr, read_ahead_size, read_ahead_buffer );
+	read_ahead_used = sequential;
+	serial_flash_statistics.read_ahead_fills++;
+	return true;
+}
+#endif
+
 /**
 * Read a byte stream from the memory device
+* Reads smaller than the read-ahead buffer are served from it while the
+* reads are sequential, refilling it with a single burst from the requested
+* address on a miss.  Larger and scattered reads are streamed straight into
+* the caller's buffer.
 *
 * \param    addr		Address in the memory device
 * \param	size		Number of bytes to read
 * \param	data		Pointer to the buffer to store the bytes read.
 *
-* \returns  Byte value read.
+* \returns  Number of bytes read.
 */
 uint32_t serial_flash_read_data ( uint32_t addr, uint32_t size, uint8_t* data )
 {
-    uint32_t bytes_transferred = 0;
-    uint8_t  command[4];
+	uint32_t result;
+#if SPI_SERIAL_FLASH_CYCLE_COUNT
+	uint32_t cycles = DWT->CYCCNT;
+#endif
 
-    ////////////////////////////////////////////////////////
-    // Read instruction, address
-    command[0] = SPI_SERIAL_FLASH_READ_DATA;
-    command[1] = LNMSB(addr);
-    command[2] = LNLSB(addr);
-    command[3] = LLSB(addr);
+#if SPI_SERIAL_FLASH_READ_AHEAD
+	if ( size < SPI_SERIAL_FLASH_READ_AHEAD && addr < SPI_SERIAL_FLASH_SERIAL_FLASH_SIZE && serial_flash_read_ahead ( addr, size ) )
+	{
+		result = 0;
+		if ( read_ahead_size != 0 && (addr - read_ahead_addr) + size <= read_ahead_size )
+		{
+			memcpy ( data, &read_ahead_buffer[addr - read_ahead_addr], size );
+			result = size;
+		}
+	}
+	else
+#endif
+	{
+		result = serial_flash_burst_read ( addr, size, data );
+	}
 
-    /*
-     * Send command
-     */
-    serial_flash_spi_drv->write (serial_flash_spi_ctx, command, sizeof(command), &bytes_transferred);
+#if SPI_SERIAL_FLASH_READ_AHEAD
+	read_last_addr = addr;
+	read_next_addr = addr + size;
+#endif
 
-    if ( bytes_transferred == sizeof(command) )
-    {
-    	serial_flash_spi_drv->read (serial_flash_spi_ctx, data, size, &bytes_transferred );
-    }
+#if SPI_SERIAL_FLASH_CYCLE_COUNT
+	serial_flash_statistics.read_cycles += DWT->CYCCNT - cycles;
+#endif
 
-    /*
-     * Deactivate CS
-     */
-    serial_flash_spi_drv->iocontrol (serial_flash_spi_ctx, IOCTL_SPI_FLUSH, NULL, 0L, NULL, 0L, NULL);
+	return result;
+}
 
-    return ( (bytes_transferred != size) ? 0 : size );
-} // CN25Q064ADrv::memory_read_data
+/**
+* Discard the read-ahead buffer
+*
+* \param    None
+*
+* \returns  None
+*/
+void serial_flash_read_ahead_invalidate ( void )
+{
+#if SPI_SERIAL_FLASH_READ_AHEAD
+	read_ahead_size = 0;
+#endif
+}
+
+/**
+* Wait for the memory device to complete a program or erase
+* The status register is polled back to back for SPI_SERIAL_FLASH_BUSY_SPIN
+* reads, after which the caller sleeps a tick between polls.
+*
+* \param    timeout		Maximum wait in ms
+*
+* \returns  true if the device is ready, false on timeout.
+*/
+bool serial_flash_wait_ready ( uint32_t timeout )
+{
+	uint32_t polls = 0;
+	uint32_t start = (uint32_t)time_get_ticks (NULL);
+	uint32_t ticks = ((timeout * CFG_SYSTICK_FREQ) / 1000) + 1;
+
+	while ( serial_flash_read_status () & STATUS_BUSY )
+	{
+		polls++;
+		if ( polls >= SPI_SERIAL_FLASH_BUSY_SPIN )
+		{
+			if ( ((uint32_t)time_get_ticks (NULL) - start) > ticks )
+			{
+				serial_flash_statistics.busy_polls += polls;
+				serial_flash_statistics.busy_timeouts++;
+				serial_flash_last_polls = polls;
+				return false;
+			}
+
+			time_delay (1);
+			serial_flash_statistics.busy_sleeps++;
+		}
+	}
+
+	serial_flash_statistics.busy_polls += polls;
+	serial_flash_last_polls = polls;
+
+	return true;
+}
+
+/**
+* Get the serial flash transaction statistics
+*
+* \param    statistics	Pointer to storage for the statistics
+*
+* \returns  None
+*/
+void serial_flash_get_statistics ( serial_flash_statistics_t* statistics )
+{
+	if ( statistics != NULL )
+		*statistics = serial_flash_statistics;
+}
+
+/**
+* Reset the serial flash transaction statistics
+*
+* \param    None
+*
+* \returns  None
+*/
+void serial_flash_reset_statistics ( void )
+{
+	memset ( &serial_flash_statistics, 0, sizeof(serial_flash_statistics_t) );
+}
 
+#endif /* SERIAL_FLASH_SIMULATOR */
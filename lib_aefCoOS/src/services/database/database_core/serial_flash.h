@@ -34,17 +34,55 @@ extern "C" {
 #define	SPI_SERIAL_FLASH_BUFFER_SIZE			SPI_SERIAL_FLASH_PAGE_SIZE
 #define SPI_SERIAL_FLASH_WAIT_TIME				500				// Command wait interval in ms
 
+////////////////////////////////////////////////////////////
+// Busy wait tuning.  The status register is polled back to back up to
+// SPI_SERIAL_FLASH_BUSY_SPIN times before the caller is put to sleep
+// between polls.  Timeouts are the datasheet maximums in ms.
+#ifndef SPI_SERIAL_FLASH_BUSY_SPIN
+	#define SPI_SERIAL_FLASH_BUSY_SPIN			256
+#endif
+
+#define SPI_SERIAL_FLASH_PROGRAM_TIMEOUT		5				// Page program
+#define SPI_SERIAL_FLASH_SUBSECTOR_TIMEOUT		800				// Sub-sector erase
+#define SPI_SERIAL_FLASH_SECTOR_TIMEOUT			3000			// Sector erase
+#define SPI_SERIAL_FLASH_CHIP_TIMEOUT			240000			// Chip erase
+#define SPI_SERIAL_FLASH_SUSPEND_TIMEOUT		1				// Erase suspend
+
+////////////////////////////////////////////////////////////
+// Read tuning.  Reads use the fast read instruction and stream the whole
+// request in one chip select window.  Reads smaller than the read-ahead
+// buffer fetch SPI_SERIAL_FLASH_READ_AHEAD bytes instead, so the header
+// and field reads that follow are served without another command.  Scattered
+// reads, such as the block header scan, turn the buffer off until a read
+// starts within or right after the previous one.  A read-ahead of 0 disables the
+// buffer, the default until it is measured on the target: on the host bench
+// a 256 byte buffer reads slower than none.
+#ifndef SPI_SERIAL_FLASH_FAST_READ_ENABLE
+	#define SPI_SERIAL_FLASH_FAST_READ_ENABLE	1				// Use the fast read instruction
+#endif
+
+#ifndef SPI_SERIAL_FLASH_READ_AHEAD
+	#define SPI_SERIAL_FLASH_READ_AHEAD			0				// Read-ahead buffer size, 0 off
+#endif
+
+#ifndef SPI_SERIAL_FLASH_CYCLE_COUNT
+	#define SPI_SERIAL_FLASH_CYCLE_COUNT		0				// Count CPU cycles spent reading
+#endif
+
 ////////////////////////////////////////////////////////////
 // The SPI serial memory instructions
 #define SPI_SERIAL_FLASH_WRITE_STATUS        	0x01
 #define SPI_SERIAL_FLASH_WRITE_DATA          	0x02
 #define SPI_SERIAL_FLASH_READ_DATA           	0x03
+#define SPI_SERIAL_FLASH_FAST_READ           	0x0B			// Followed by one dummy byte
 #define SPI_SERIAL_FLASH_WRITE_LATCH_DISABLE 	0x04
 #define SPI_SERIAL_FLASH_READ_STATUS         	0x05
 #define SPI_SERIAL_FLASH_WRITE_LATCH_ENABLE  	0x06
 #define SPI_SERIAL_FLASH_CHIP_ERASE          	0xC7
 #define SPI_SERIAL_FLASH_SUBSECTOR_ERASE		0x20
 #define SPI_SERIAL_FLASH_SECTOR_ERASE			0xD8
+#define SPI_SERIAL_FLASH_ERASE_SUSPEND			0x75
+#define SPI_SERIAL_FLASH_ERASE_RESUME			0x7A
 
 ////////////////////////////////////////////////////////////
 // Status register bit identifier definitions
@@ -57,17 +95,37 @@ extern "C" {
 #define STATUS_BLOCK_PROTECT_4					0x40
 #define STATUS_REG_WRITE_ENABLE					0x80
 
+/**
+* Serial flash statistics structure definition
+*/
+typedef struct _serial_flash_statistics_def
+{
+	uint32_t	reads;					// Number of read transactions
+	uint32_t	read_bytes;				// Number of bytes read
+	uint32_t	programs;				// Number of page program transactions
+	uint32_t	program_bytes;			// Number of bytes programmed
+	uint32_t	erases;					// Number of erase transactions
+	uint32_t	busy_polls;				// Status register polls while busy
+	uint32_t	busy_sleeps;			// Sleeps taken while busy
+	uint32_t	busy_timeouts;			// Operations that did not complete in time
+	uint32_t	program_max_polls;		// Longest page program in status polls
+	uint32_t	program_ticks;			// OS ticks spent programming
+	uint32_t	erase_ticks;			// OS ticks spent erasing
+	uint32_t	read_ahead_hits;		// Reads served from the read-ahead buffer
+	uint32_t	read_ahead_fills;		// Read-ahead buffer fills
+	uint32_t	read_cycles;			// CPU cycles spent reading, SPI_SERIAL_FLASH_CYCLE_COUNT
+	uint32_t	erase_suspends;			// Background erases suspended for a read or program
+} serial_flash_statistics_t;
+
 /**
 * Initialize serial flash SPI support
 *
 * \param    drv			Stream device driver vtable
 * \param	ctx			Stream device driver context
 *
-* \returns  SERVICE_STATUS_SUCCESS if successful.
-*           SERVICE_FAILURE_GENERAL if unsuccessful.
-*           SERVICE_FAILURE_INVALID_PARAMETER if an invalid parameter.
+* \returns  true if successful, false if the driver or its context is invalid.
 */
-void serial_flash_initialize ( const stream_driver_vtable_t* drv, stream_driver_ctx_t* ctx );
+bool serial_flash_initialize ( const stream_driver_vtable_t* drv, stream_driver_ctx_t* ctx );
 
 /**
 * Erase the entire memory device
@@ -96,6 +154,46 @@ void serial_flash_subsector_erase ( uint32_t addr );
 */
 void serial_flash_sector_erase ( uint32_t addr );
 
+/**
+* Start a sector erase in the background
+* The call returns as soon as the erase command has been sent.  Reads and
+* programs of other sectors suspend the erase until serial_flash_erase_resume
+* is called, and serial_flash_erase_busy reports when it has completed.
+*
+* \param    Addr		Address of the sector to erase
+*
+* \returns  None
+*/
+void serial_flash_sector_erase_start ( uint32_t addr );
+
+/**
+* Check if a background erase is still in progress
+* A suspended erase is in progress.
+*
+* \param    None
+*
+* \returns  true if the background erase has not completed.
+*/
+bool serial_flash_erase_busy ( void );
+
+/**
+* Resume a suspended background erase
+*
+* \param    None
+*
+* \returns  None
+*/
+void serial_flash_erase_resume ( void );
+
+/**
+* Wait for a background erase to complete
+*
+* \param    None
+*
+* \returns  true if the erase completed, false on timeout.
+*/
+bool serial_flash_erase_complete ( void );
+
 /**
 * Set memory device write latch
 *
@@ -123,6 +221,15 @@ void serial_flash_set_protection ( bool protect );
 */
 uint8_t serial_flash_read_status ( void );
 
+/**
+* Wait for the memory device to complete a program or erase
+*
+* \param    timeout		Maximum wait in ms
+*
+* \returns  true if the device is ready, false on timeout.
+*/
+bool serial_flash_wait_ready ( uint32_t timeout );
+
 /**
 * Write a byte to the memory device
 *
@@ -155,15 +262,115 @@ uint32_t serial_flash_write_data ( uint32_t addr, uint32_t size, uint8_t* data )
 
 /**
 * Read a byte stream from the memory device
+* Small reads are served from the read-ahead buffer when possible.
 *
 * \param    addr		Address in the memory device
 * \param	size		Number of bytes to read
 * \param	data		Pointer to the buffer to store the bytes read.
 *
-* \returns  Byte value read.
+* \returns  Number of bytes read.
 */
 uint32_t serial_flash_read_data ( uint32_t addr, uint32_t size, uint8_t* data );
 
+/**
+* Discard the read-ahead buffer
+* Programs and erases discard it themselves, this is only needed when the
+* memory device is changed behind the driver's back.
+*
+* \param    None
+*
+* \returns  None
+*/
+void serial_flash_read_ahead_invalidate ( void );
+
+/**
+* Get the serial flash transaction statistics
+*
+* \param    statistics	Pointer to storage for the statistics
+*
+* \returns  None
+*/
+void serial_flash_get_statistics ( serial_flash_statistics_t* statistics );
+
+/**
+* Reset the serial flash transaction statistics
+*
+* \param    None
+*
+* \returns  None
+*/
+void serial_flash_reset_statistics ( void );
+
+#ifdef SERIAL_FLASH_SIMULATOR
+
+////////////////////////////////////////////////////////////
+// Simulated device geometry and latencies (typical datasheet values)
+#ifndef SERIAL_FLASH_SIM_SIZE
+	#define SERIAL_FLASH_SIM_SIZE				0x00040000		// Simulated memory size
+#endif
+
+#ifndef SERIAL_FLASH_SIM_SPI_CLOCK
+	#define SERIAL_FLASH_SIM_SPI_CLOCK			24000000		// SPI clock in Hz
+#endif
+
+#ifndef SERIAL_FLASH_SIM_COMMAND_US
+	#define SERIAL_FLASH_SIM_COMMAND_US			10				// Driver call and chip select time per transaction in us
+#endif
+
+#ifndef SERIAL_FLASH_SIM_PROGRAM_US
+	#define SERIAL_FLASH_SIM_PROGRAM_US			500				// Page program time in us
+#endif
+
+#ifndef SERIAL_FLASH_SIM_SUBSECTOR_ERASE_US
+	#define SERIAL_FLASH_SIM_SUBSECTOR_ERASE_US	250000			// Sub-sector erase time in us
+#endif
+
+#ifndef SERIAL_FLASH_SIM_SECTOR_ERASE_US
+	#define SERIAL_FLASH_SIM_SECTOR_ERASE_US	700000			// Sector erase time in us
+#endif
+
+#ifndef SERIAL_FLASH_SIM_CHIP_ERASE_US
+	#define SERIAL_FLASH_SIM_CHIP_ERASE_US		60000000		// Chip erase time in us
+#endif
+
+/**
+* Cut the power after a number of programmed bytes
+*
+* \param    bytes		Number of bytes to program before the power loss, 0 to disarm
+*
+* \returns  None
+*/
+void serial_flash_sim_power_loss ( uint32_t bytes );
+
+/**
+* Restore power to the simulated device
+*
+* \param    None
+*
+* \returns  None
+*/
+void serial_flash_sim_power_cycle ( void );
+
+/**
+* Get the time the real device would have spent on the operations so far
+*
+* \param    None
+*
+* \returns  Elapsed time in us.
+*/
+uint64_t serial_flash_sim_get_elapsed_us ( void );
+
+/**
+* Get the erase count of a sector
+*
+* \param    sector		Sector number
+*
+* \returns  Number of times the sector has been erased.
+*/
+uint32_t serial_flash_sim_get_erase_count ( uint32_t sector );
+
+#endif /* SERIAL_FLASH_SIMULATOR */
+
 /**
 * Perform a self test of the memory device
 *
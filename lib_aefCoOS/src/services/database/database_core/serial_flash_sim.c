@@ -0,0 +1,562 @@
+
+/**
+* serial_flash_sim.c
+*
+* \copyright
+* Copyright 2015 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Simulated serial flash memory device.
+*
+* A RAM backed replacement for serial_flash.c, built when SERIAL_FLASH_SIMULATOR
+* is defined.  It implements the same interface with NOR semantics (programming
+* only clears bits, erasing sets them), accumulates the time the real device
+* would have spent on each operation, keeps per-sector erase counts and can
+* cut the power part way through a program or erase.
+*/
+
+#ifdef SERIAL_FLASH_SIMULATOR
+
+#include <string.h>
+#include "serial_flash.h"
+
+/**
+* Simulated memory and state
+*/
+static uint8_t	 sim_memory[SERIAL_FLASH_SIM_SIZE];
+static uint32_t	 sim_erase_counts[SERIAL_FLASH_SIM_SIZE / SPI_SERIAL_FLASH_SECTOR_SIZE];
+static bool		 sim_initialized = false;
+static bool		 sim_powered = true;
+static uint32_t	 sim_power_budget = 0;			// Program bytes until power loss, 0 when disarmed
+static uint64_t	 sim_elapsed_us = 0;
+static bool		 sim_write_latch = false;
+static serial_flash_statistics_t serial_flash_statistics;
+
+#if SPI_SERIAL_FLASH_READ_AHEAD
+static uint32_t	 read_ahead_addr = 0;
+static uint32_t	 read_ahead_size = 0;			// 0 when the buffer is empty
+static uint32_t	 read_last_addr = 0;			// Address of the last read
+static uint32_t	 read_next_addr = 0;			// Address following the last read
+static bool		 read_ahead_used = false;		// The buffer served a read since its fill
+static bool		 read_ahead_enabled = true;		// Reads are sequential enough to fill the buffer
+#endif
+
+/**
+* Erase the simulated memory the first time it is used
+* A static array starts out zeroed, which would read as every block written.
+*
+* \param    None
+*
+* \returns  None
+*/
+static void serial_flash_sim_start ( void )
+{
+	if ( ! sim_initialized )
+	{
+		memset ( sim_memory, 0xFF, sizeof(sim_memory) );
+		memset ( sim_erase_counts, 0, sizeof(sim_erase_counts) );
+		sim_initialized = true;
+	}
+}
+
+/**
+* Account for the SPI transfer time of a transaction
+*
+* \param    bytes		Number of bytes on the bus, including the command
+*
+* \returns  None
+*/
+static void serial_flash_sim_transfer ( uint32_t bytes )
+{
+	sim_elapsed_us += SERIAL_FLASH_SIM_COMMAND_US + ((uint64_t)bytes * 8 * 1000000) / SERIAL_FLASH_SIM_SPI_CLOCK;
+}
+
+/**
+* Erase a range of the simulated memory
+* A power loss during the erase leaves the first half of the range erased.
+*
+* \param    addr		Address of the range
+* \param	size		Size of the range
+* \param	latency		Erase time in us
+*
+* \returns  None
+*/
+static void serial_flash_sim_erase ( uint32_t addr, uint32_t size, uint32_t latency )
+{
+	serial_flash_sim_start ();
+	if ( ! sim_powered || ! sim_write_latch || addr >= SERIAL_FLASH_SIM_SIZE )
+		return;
+
+	addr &= ~(size - 1);
+	if ( size > SERIAL_FLASH_SIM_SIZE - addr )
+		size = SERIAL_FLASH_SIM_SIZE - addr;
+
+	serial_flash_sim_transfer ( 4 );
+	serial_flash_statistics.erases++;
+	serial_flash_read_ahead_invalidate ();
+	sim_write_latch = false;
+
+	if ( sim_power_budget != 0 && --sim_power_budget == 0 )
+	{
+		memset ( &sim_memory[addr], 0xFF, size / 2 );
+		sim_powered = false;
+		return;
+	}
+
+	memset ( &sim_memory[addr], 0xFF, size );
+	sim_elapsed_us += latency;
+
+	for ( uint32_t sector = addr / SPI_SERIAL_FLASH_SECTOR_SIZE; sector <= (addr + size - 1) / SPI_SERIAL_FLASH_SECTOR_SIZE; sector++ )
+		sim_erase_counts[sector]++;
+}
+
+/**
+* Program the simulated memory
+* Bits can only be cleared.  A power loss stops the program at the byte where
+* the budget runs out.
+*
+* \param    addr		Address in the memory device
+* \param	size		Number of bytes to program
+* \param	data		Pointer to the data
+*
+* \returns  Number of bytes programmed.
+*/
+static uint32_t serial_flash_sim_program ( uint32_t addr, uint32_t size, uint8_t* data )
+{
+	uint32_t count;
+
+	serial_flash_sim_start ();
+	if ( ! sim_powered || ! sim_write_latch || addr >= SERIAL_FLASH_SIM_SIZE )
+		return 0;
+
+	if ( size > SERIAL_FLASH_SIM_SIZE - addr )
+		size = SERIAL_FLASH_SIM_SIZE - addr;
+
+	serial_flash_sim_transfer ( 4 + size );
+	serial_flash_statistics.programs++;
+	serial_flash_read_ahead_invalidate ();
+	sim_write_latch = false;
+
+	for ( count = 0; count < size; count++ )
+	{
+		if ( sim_power_budget != 0 && --sim_power_budget == 0 )
+		{
+			sim_powered = false;
+			break;
+		}
+		sim_memory[addr + count] &= data[count];
+	}
+
+	serial_flash_statistics.program_bytes += count;
+	sim_elapsed_us += SERIAL_FLASH_SIM_PROGRAM_US;
+
+	return count;
+}
+
+/**
+* Initialize serial flash SPI support
+* The simulated memory starts erased and keeps its contents across calls.
+*
+* \param    drv			Stream device driver vtable, unused
+* \param	ctx			Stream device driver context, unused
+*
+* \returns  true, the simulated device is always present.
+*/
+bool serial_flash_initialize ( const stream_driver_vtable_t* drv, stream_driver_ctx_t* ctx )
+{
+	serial_flash_sim_start ();
+	return true;
+}
+
+/**
+* Read the status register of the memory device
+* Operations complete immediately, so the device is never busy.
+*
+* \param    None
+*
+* \returns  Status register contents
+*/
+uint8_t serial_flash_read_status ( void )
+{
+	serial_flash_sim_transfer ( 2 );
+	return ( sim_write_latch ) ? STATUS_WRITE_ENABLE_LATCH : 0x00;
+}
+
+/**
+* Set memory device write latch
+*
+* \param    enable		Enable or disable writes
+*
+* \returns  None
+*/
+void serial_flash_set_write_latch ( bool enable )
+{
+	serial_flash_sim_transfer ( 1 );
+	sim_write_latch = enable;
+}
+
+/**
+* Set memory device protection
+*
+* \param    protect		Enable or disable protection
+*
+* \returns  None
+*/
+void serial_flash_set_protection ( bool protect )
+{
+	serial_flash_sim_transfer ( 4 );
+}
+
+/**
+* Erase the entire memory device
+*
+* \param    None
+*
+* \returns  Non zero if successful, or 0 if failed
+*/
+uint32_t serial_flash_chip_erase ( void )
+{
+	serial_flash_set_write_latch ( true );
+	serial_flash_sim_erase ( 0, SERIAL_FLASH_SIM_SIZE, SERIAL_FLASH_SIM_CHIP_ERASE_US );
+	return ( sim_powered ) ? true : false;
+}
+
+/**
+* Erase memory device sub-sector
+*
+* \param    Addr		Address of the sub-sector to erase
+*
+* \returns  None
+*/
+void serial_flash_subsector_erase ( uint32_t addr )
+{
+	serial_flash_set_write_latch ( true );
+	serial_flash_sim_erase ( addr, SPI_SERIAL_FLASH_SUBSECTOR_SIZE, SERIAL_FLASH_SIM_SUBSECTOR_ERASE_US );
+}
+
+/**
+* Erase memory device sector
+*
+* \param    Addr		Address of the sector to erase
+*
+* \returns  None
+*/
+void serial_flash_sector_erase ( uint32_t addr )
+{
+	serial_flash_set_write_latch ( true );
+	serial_flash_sim_erase ( addr, SPI_SERIAL_FLASH_SECTOR_SIZE, SERIAL_FLASH_SIM_SECTOR_ERASE_US );
+}
+
+/**
+* Start a sector erase in the background
+* The erase completes immediately.  It runs alongside the foreground on the
+* real device, so its latency is not added to the elapsed time.
+*
+* \param    Addr		Address of the sector to erase
+*
+* \returns  None
+*/
+void serial_flash_sector_erase_start ( uint32_t addr )
+{
+	serial_flash_set_write_latch ( true );
+	serial_flash_sim_erase ( addr, SPI_SERIAL_FLASH_SECTOR_SIZE, 0 );
+}
+
+/**
+* Check if a background erase is still in progress
+*
+* \param    None
+*
+* \returns  false, background erases complete immediately.
+*/
+bool serial_flash_erase_busy ( void )
+{
+	return false;
+}
+
+/**
+* Resume a suspended background erase
+*
+* \param    None
+*
+* \returns  None
+*/
+void serial_flash_erase_resume ( void )
+{
+}
+
+/**
+* Wait for a background erase to complete
+*
+* \param    None
+*
+* \returns  true, background erases complete immediately.
+*/
+bool serial_flash_erase_complete ( void )
+{
+	return true;
+}
+
+/**
+* Write a byte to the memory device
+*
+* \param    addr		Address to write the byte
+* \param	data		Byte to write
+*
+* \returns  None
+*/
+void serial_flash_write_byte ( uint32_t addr, uint8_t data )
+{
+	serial_flash_set_write_latch ( true );
+	serial_flash_sim_program ( addr, 1, &data );
+}
+
+/**
+* Read a byte from the memory device
+*
+* \param    addr		Address of the byte
+*
+* \returns  Byte value read.
+*/
+uint8_t serial_flash_read_byte ( uint32_t addr )
+{
+	uint8_t data = 0xFF;
+
+	serial_flash_read_data ( addr, 1, &data );
+	return data;
+}
+
+/**
+* Write a byte stream to the memory device
+* The stream is split on page boundaries like the real device.
+*
+* \param    addr		Address in the memory device
+* \param	size		Number of bytes to write
+* \param	data		Pointer to the data to write
+*
+* \returns  Number of bytes written.
+*/
+uint32_t serial_flash_write_data ( uint32_t addr, uint32_t size, uint8_t* data )
+{
+	uint32_t written = 0;
+	uint32_t page_size;
+
+	while ( written < size )
+	{
+		page_size = size - written;
+		if ( page_size > SPI_SERIAL_FLASH_PAGE_SIZE - (addr & (SPI_SERIAL_FLASH_PAGE_SIZE - 1)) )
+			page_size = SPI_SERIAL_FLASH_PAGE_SIZE - (addr & (SPI_SERIAL_FLASH_PAGE_SIZE - 1));
+
+		serial_flash_set_write_latch ( true );
+		if ( serial_flash_sim_program ( addr, page_size, data ) != page_size )
+			break;
+
+		written += page_size;
+		addr    += page_size;
+		data    += page_size;
+	}
+
+	return written;
+}
+
+/**
+* Account for a read burst
+*
+* \param    size		Number of data bytes in the burst
+*
+* \returns  None
+*/
+static void serial_flash_sim_burst ( uint32_t size )
+{
+#if SPI_SERIAL_FLASH_FAST_READ_ENABLE
+	serial_flash_sim_transfer ( 5 + size );
+#else
+	serial_flash_sim_transfer ( 4 + size );
+#endif
+	serial_flash_statistics.reads++;
+	serial_flash_statistics.read_bytes += size;
+}
+
+#if SPI_SERIAL_FLASH_READ_AHEAD
+/**
+* Look up a small read in the modelled read-ahead buffer, refilling it on a miss
+* Follows the real driver, read-ahead is turned off by a buffer replaced
+* before it served a read and back on by a read starting within or right
+* after the previous one.
+*
+* \param    addr		Address in the memory device
+* \param	size		Number of bytes to read
+*
+* \returns  true if the read is served from the buffer.
+*/
+static bool serial_flash_sim_read_ahead ( uint32_t addr, uint32_t size )
+{
+	bool sequential = ( addr >= read_last_addr && addr <= read_next_addr );
+
+	if ( read_ahead_size != 0 && addr >= read_ahead_addr && (addr - read_ahead_addr) + size <= read_ahead_size )
+	{
+		serial_flash_statistics.read_ahead_hits++;
+		read_ahead_used = true;
+		return true;
+	}
+
+	if ( read_ahead_size != 0 && ! read_ahead_used )
+		read_ahead_enabled = false;
+	if ( sequential )
+		read_ahead_enabled = true;
+	if ( ! read_ahead_enabled )
+		return false;
+
+	read_ahead_addr = addr;
+	read_ahead_size = SPI_SERIAL_FLASH_READ_AHEAD;
+	if ( read_ahead_size > SERIAL_FLASH_SIM_SIZE - addr )
+		read_ahead_size = SERIAL_FLASH_SIM_SIZE - addr;
+
+	serial_flash_sim_burst ( read_ahead_size );
+	read_ahead_used = sequential;
+	serial_flash_statistics.read_ahead_fills++;
+	return true;
+}
+#endif
+
+/**
+* Read a byte stream from the memory device
+* The read-ahead buffer of the real driver is modelled so the bus time and
+* statistics match it.  The data itself always comes from the memory array.
+*
+* \param    addr		Address in the memory device
+* \param	size		Number of bytes to read
+* \param	data		Pointer to the buffer to store the bytes read.
+*
+* \returns  Number of bytes read.
+*/
+uint32_t serial_flash_read_data ( uint32_t addr, uint32_t size, uint8_t* data )
+{
+	serial_flash_sim_start ();
+	if ( ! sim_powered || addr >= SERIAL_FLASH_SIM_SIZE || size > SERIAL_FLASH_SIM_SIZE - addr )
+		return 0;
+
+#if SPI_SERIAL_FLASH_READ_AHEAD
+	if ( ! ( size < SPI_SERIAL_FLASH_READ_AHEAD && serial_flash_sim_read_ahead ( addr, size ) ) )
+		serial_flash_sim_burst ( size );
+	read_last_addr = addr;
+	read_next_addr = addr + size;
+#else
+	serial_flash_sim_burst ( size );
+#endif
+
+	memcpy ( data, &sim_memory[addr], size );
+	return size;
+}
+
+/**
+* Discard the read-ahead buffer
+*
+* \param    None
+*
+* \returns  None
+*/
+void serial_flash_read_ahead_invalidate ( void )
+{
+#if SPI_SERIAL_FLASH_READ_AHEAD
+	read_ahead_size = 0;
+#endif
+}
+
+/**
+* Wait for the memory device to complete a program or erase
+*
+* \param    timeout		Maximum wait in ms, unused
+*
+* \returns  true, the simulated device is never busy.
+*/
+bool serial_flash_wait_ready ( uint32_t timeout )
+{
+	return true;
+}
+
+/**
+* Get the serial flash transaction statistics
+*
+* \param    statistics	Pointer to storage for the statistics
+*
+* \returns  None
+*/
+void serial_flash_get_statistics ( serial_flash_statistics_t* statistics )
+{
+	if ( statistics != NULL )
+		*statistics = serial_flash_statistics;
+}
+
+/**
+* Reset the serial flash transaction statistics
+*
+* \param    None
+*
+* \returns  None
+*/
+void serial_flash_reset_statistics ( void )
+{
+	memset ( &serial_flash_statistics, 0, sizeof(serial_flash_statistics_t) );
+	sim_elapsed_us = 0;
+}
+
+/**
+* Cut the power after a number of programmed bytes
+* Once the budget is used up every program, erase and read fails until
+* serial_flash_sim_power_cycle is called.  An erase counts as one byte.
+*
+* \param    bytes		Number of bytes to program before the power loss, 0 to disarm
+*
+* \returns  None
+*/
+void serial_flash_sim_power_loss ( uint32_t bytes )
+{
+	sim_power_budget = bytes;
+}
+
+/**
+* Restore power to the simulated device
+*
+* \param    None
+*
+* \returns  None
+*/
+void serial_flash_sim_power_cycle ( void )
+{
+	sim_powered      = true;
+	sim_power_budget = 0;
+	sim_write_latch  = false;
+	serial_flash_read_ahead_invalidate ();
+}
+
+/**
+* Get the time the real device would have spent on the operations so far
+*
+* \param    None
+*
+* \returns  Elapsed time in us.
+*/
+uint64_t serial_flash_sim_get_elapsed_us ( void )
+{
+	return sim_elapsed_us;
+}
+
+/**
+* Get the erase count of a sector
+*
+* \param    sector		Sector number
+*
+* \returns  Number of times the sector has been erased.
+*/
+uint32_t serial_flash_sim_get_erase_count ( uint32_t sector )
+{
+	serial_flash_sim_start ();
+	if ( sector < (SERIAL_FLASH_SIM_SIZE / SPI_SERIAL_FLASH_SECTOR_SIZE) )
+		return sim_erase_counts[sector];
+	return 0;
+}
+
+#endif /* SERIAL_FLASH_SIMULATOR */
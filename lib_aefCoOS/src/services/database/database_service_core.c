@@ -18,9 +18,16 @@
 #include <aef/embedded/driver/spi/spi_driver.h>
 #include <aef/embedded/driver/stream_driver.h>
 #include <aef/embedded/system/system_core.h>
+#include <aef/embedded/system/system_management.h>
+#include <aef/embedded/osal/critical_section.h>
+#include <aef/embedded/osal/time.h>
+#include <OsConfig.h>
 
 #include "database_core/serial_flash.h"
 #include "database_core/block_allocator.h"
+#include "database_core/block_index.h"
+#include "database_core/record_cache.h"
+#include "database_core/record_crypto.h"
 
 /**
 * Internal routines.
@@ -32,7 +39,7 @@ static service_status_t database_core_status (service_ctx_t* ctx);
 static service_status_t database_core_pause (service_ctx_t* ctx);
 static service_status_t database_core_continue (service_ctx_t* ctx);
 
-static service_status_t database_core_initialize (service_ctx_t* ctx, void* config);
+static service_status_t database_core_initialize (service_ctx_t* ctx, void* config, uint32_t size);
 static service_status_t database_core_format (service_ctx_t* ctx);
 static service_status_t database_core_erase (service_ctx_t* ctx);
 static service_status_t database_core_readrecord (service_ctx_t* ctx, void* record_key, uint32_t size, void* record, uint32_t record_size, uint32_t* bytes_transferred);
@@ -40,8 +47,18 @@ static service_status_t database_core_writerecord (service_ctx_t* ctx, void* rec
 static service_status_t database_core_updaterecord (service_ctx_t* ctx, void* record, uint32_t size);
 static service_status_t database_core_deleterecord (service_ctx_t* ctx, void* record_key, uint32_t size);
 static service_status_t database_core_garbagecollection (service_ctx_t* ctx);
+static service_status_t database_core_getstatistics (service_ctx_t* ctx, void* output_buffer, uint32_t output_size, uint32_t* bytes_transferred);
+static service_status_t database_core_resetstatistics (service_ctx_t* ctx);
+static service_status_t database_core_sync (service_ctx_t* ctx);
+static service_status_t database_core_getsparesectors (service_ctx_t* ctx, void* output_buffer, uint32_t output_size, uint32_t* bytes_transferred);
+static service_status_t database_core_opencursor (service_ctx_t* ctx, void* input_buffer, uint32_t input_size, void* output_buffer, uint32_t output_size, uint32_t* bytes_transferred);
+static service_status_t database_core_fetchcursor (service_ctx_t* ctx, void* input_buffer, uint32_t input_size, void* output_buffer, uint32_t output_size, uint32_t* bytes_transferred);
+static service_status_t database_core_closecursor (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+
+static void database_service_task (void* instance);
 
 static uint32_t initialize_database ( void );
+static uint32_t write_superblock_header ( uint8_t superBlock );
 static uint32_t write_database_header ( void );
 static uint32_t write_session_header ( uint8_t* sessionUUID, uint8_t* serverUUID, uint8_t* rSecret, uint8_t* sSecret, uint8_t* certificate, uint16_t certificateLength );
 static uint32_t write_user_preferences_record ( uint8_t* uuid, uint8_t* preferences );
@@ -52,15 +69,102 @@ static uint32_t delete_block ( uint8_t* uuid );
 static DBCURSOR find_empty_block ( void );
 static uint32_t read_block ( uint16_t block_ref, uint8_t* data, uint32_t length );
 static uint32_t write_block ( uint16_t block_ref, uint8_t* data, uint32_t length );
+static uint32_t write_block_field ( uint16_t block_ref, uint32_t offset, uint8_t value );
+static uint32_t write_record ( uint16_t block_ref, uint8_t* data, uint32_t length );
+static bool read_record ( uint16_t block_ref, uint8_t* data, uint32_t size );
+static bool protect_chunk ( uint8_t* chunk, uint32_t offset, uint32_t size, uint32_t footer, bool encrypt );
+static uint32_t record_footer_offset ( uint8_t recordType );
+static uint32_t block_address ( uint16_t block_ref );
+static uint32_t append_record ( uint8_t* data, uint32_t length, bool protect );
+static uint32_t store_record ( uint8_t* data, uint32_t length );
+static bool record_exists ( uint8_t recordType, uint8_t* uuid );
+static uint32_t cache_flush ( void );
+static uint32_t cursor_read_record ( const block_index_entry_t* entry, uint8_t* data, uint32_t size, uint32_t* length );
 static uint32_t bulk_erase (void);
+static uint32_t build_block_index ( void );
+static uint32_t gc_step ( void );
+static uint32_t gc_select_sector ( void );
+static uint32_t gc_relocate_block ( BlockRefType block );
+static bool allocate_block ( BlockRefType* block );
+static uint32_t allocation_sector ( uint32_t exclude, bool most_worn );
+static bool is_spare_sector ( uint32_t sector );
+static uint32_t spare_sector_count ( void );
+static void load_erase_counts ( void );
+static uint32_t wear_spread ( uint32_t* coldest );
+static bool wear_level_due ( uint32_t* coldest );
+static BlockRefType block_ref_to_index ( uint16_t block_ref );
+static uint16_t index_to_block_ref ( BlockRefType block );
 
 static const stream_driver_vtable_t* database_spi_drv = NULL;
 static stream_driver_ctx_t* spi_ctx = NULL;
 static uint32_t chip_select = 4;
+static critical_section_ctx_t database_cs;
 
 #define DB_NUMBER_OF_SECTORS	4L
 #define DB_SECTOR_SIZE			0x00010000
+#define DB_BLOCKS_PER_SECTOR	(DB_SECTOR_SIZE / BLOCK_SIZE)
+#define DB_SUPERBLOCKS_PER_SECTOR	(DB_BLOCKS_PER_SECTOR / ENTRIES_PER_TABLE)
 #define RECORD_VERSION			1
+#define DB_FILL_PENDING			0x0F	// Fill indicator of a record that is still being written
+#define DB_CACHE_FLUSH_TICKS	((DATABASE_CACHE_FLUSH_INTERVAL * CFG_SYSTICK_FREQ) / 1000)
+
+_Static_assert(DATABASE_MAX_RECORD_SIZE == BLOCK_SIZE, "A record must fit in a single block.");
+
+/**
+* Garbage collection states
+*/
+#define DB_GC_IDLE				0		// No sector is being compacted
+#define DB_GC_RELOCATE			1		// Relocating the live blocks of the victim sector
+#define DB_GC_ERASE				2		// Starting the erase of the victim sector
+#define DB_GC_ERASING			3		// Waiting for the background erase of the victim sector
+
+/**
+* Garbage collection context
+*/
+static uint32_t gc_state = DB_GC_IDLE;
+static uint32_t gc_sector = 0;
+static uint32_t gc_block = 0;
+static uint32_t gc_relocations = 0;
+static uint32_t gc_compactions = 0;
+static uint8_t  gc_buffer[BLOCK_SIZE];
+
+/**
+* Wear leveling context
+*/
+static uint32_t sector_erases[DB_NUMBER_OF_SECTORS];
+static uint32_t wear_levelings = 0;
+static bool     wear_leveling = false;		// Spread reached the threshold and has not dropped back
+static uint32_t wear_stalled = 0;			// Spread at which no cold sector could be moved, 0 if none
+static bool     gc_wear = false;			// Victim sector is relocated for wear leveling
+static bool     wear_relocation = false;	// Allocate from the most worn sector
+
+/**
+* Write-back cache context
+*/
+static uint32_t cache_commits = 0;
+static uint32_t cache_committed = 0;
+
+/**
+* Record protection context
+*/
+static uint32_t auth_failures = 0;
+static uint8_t  record_chunk[CHUNK_SIZE];
+
+/**
+* Record cursor context.
+* A cursor remembers the key of the last record it returned, so records
+* written or deleted between fetches do not invalidate it.
+*/
+typedef struct _db_cursor_def
+{
+	bool		open;						// Cursor is in use
+	bool		started;					// A record has been returned
+	uint8_t		recordType;					// Record type or RecordTypeInvalid for every type
+	uint8_t		uuid[DATABASE_UUID_SIZE];	// Key of the last record returned
+} db_cursor_t;
+
+static db_cursor_t cursors[DATABASE_MAX_CURSORS];
+
 /**
 * Initialize the database service.
 *
@@ -75,7 +179,7 @@ service_status_t database_core_init (service_ctx_t* ctx)
 	device_manager_vtable_t* device_manager = system_get_device_manager();
 	database_spi_drv = device_manager->getdevice(DRV_SPI_B);
 
-	if ( database_spi_drv != NULL )
+	if ( database_spi_drv != NULL && critical_section_create (&database_cs) == SYSTEM_STATUS_SUCCESS )
 	{
 		ctx->state = SERVICE_START_PENDING;
 		return SERVICE_STATUS_SUCCESS;
@@ -94,6 +198,7 @@ service_status_t database_core_init (service_ctx_t* ctx)
 */
 service_status_t database_core_deinit (service_ctx_t* ctx)
 {
+	critical_section_destroy (&database_cs);
 	return SERVICE_STATUS_SUCCESS;
 }
 
@@ -126,6 +231,8 @@ database_core_ioctl (service_ctx_t* ctx, uint32_t code, void* input_buffer, uint
 	if ( bytes_transferred != NULL )
 		*bytes_transferred = 0;
 
+	critical_section_acquire (&database_cs);
+
 	switch ( code )
 	{
 		case IOCTL_SERVICE_START:
@@ -147,7 +254,7 @@ database_core_ioctl (service_ctx_t* ctx, uint32_t code, void* input_buffer, uint
 			status = database_core_continue(ctx);
 			break;
 		case IOCTL_DATABASE_INITIALIZE:
-			status = database_core_initialize(ctx, input_buffer);
+			status = database_core_initialize(ctx, input_buffer, input_size);
 			break;
 		case IOCTL_DATABASE_FORMAT:
 			status = database_core_format(ctx);
@@ -170,10 +277,38 @@ database_core_ioctl (service_ctx_t* ctx, uint32_t code, void* input_buffer, uint
 		case IOCTL_DATABASE_GARBAGE_COLLECTION:
 			status = database_core_garbagecollection(ctx);
 			break;
+		case IOCTL_DATABASE_GET_STATISTICS:
+			status = database_core_getstatistics(ctx, output_buffer, output_size, bytes_transferred);
+			break;
+		case IOCTL_DATABASE_RESET_STATISTICS:
+			status = database_core_resetstatistics(ctx);
+			break;
+		case IOCTL_DATABASE_SYNC:
+			status = database_core_sync(ctx);
+			break;
+		case IOCTL_DATABASE_GET_SPARE_SECTORS:
+			status = database_core_getsparesectors(ctx, output_buffer, output_size, bytes_transferred);
+			break;
+		case IOCTL_DATABASE_OPEN_CURSOR:
+			status = database_core_opencursor(ctx, input_buffer, input_size, output_buffer, output_size, bytes_transferred);
+			break;
+		case IOCTL_DATABASE_FETCH_CURSOR:
+			status = database_core_fetchcursor(ctx, input_buffer, input_size, output_buffer, output_size, bytes_transferred);
+			break;
+		case IOCTL_DATABASE_CLOSE_CURSOR:
+			status = database_core_closecursor(ctx, input_buffer, input_size);
+			break;
 		default:
 			break;
 	}
 
+	/*
+	 * Let a background erase suspended for this request carry on
+	 */
+	serial_flash_erase_resume ();
+
+	critical_section_release (&database_cs);
+
 	return status;
 }
 
@@ -189,32 +324,50 @@ database_core_ioctl (service_ctx_t* ctx, uint32_t code, void* input_buffer, uint
 */
 service_status_t database_core_start (service_ctx_t* ctx)
 {
-//	char* pname = NULL;
-//	uint32_t param;
+	char* pname = NULL;
 
-	ctx->state = SERVICE_START_PENDING;
+	if ( ctx == NULL )
+		return SERVICE_FAILURE_INVALID_PARAMETER;
 
-//	pname = database_spi_drv->getname();
-//	spi_ctx = database_spi_drv->open(pname, 0, chip_select );
-//	if (spi_ctx)
-//	{
-//		serial_flash_initialize ( database_spi_drv, spi_ctx );
+	if ( ctx->state == SERVICE_RUNNING )
+		return SERVICE_FAILURE_INCORRECT_MODE;
 
-//		param = SPI_DEVICE_MASTER_MODE;
-//		database_spi_drv->iocontrol(spi_ctx, IO_IOCTL_SPI_SET_TRANSFER_MODE, &param, 4, NULL, 0, NULL );
+	ctx->state = SERVICE_START_PENDING;
 
-//		param = 48000000;
-//		database_spi_drv->iocontrol(spi_ctx, IO_IOCTL_SPI_SET_BAUD, &param, 4, NULL, 0, NULL );
+	/*
+	 * The memory device has to be reachable before its block headers are read
+	 */
+	pname   = database_spi_drv->getname();
+	spi_ctx = database_spi_drv->open(pname, 0, chip_select );
+	if ( spi_ctx == NULL )
+	{
+		ctx->state = SERVICE_DISABLED;
+		return SERVICE_FAILURE_GENERAL;
+	}
 
-//		param = SPI_CLK_POL_PHA_MODE3;
-//		database_spi_drv->iocontrol(spi_ctx, IO_IOCTL_SPI_SET_MODE, &param, 4, NULL, 0, NULL );
+	if ( ! serial_flash_initialize ( database_spi_drv, spi_ctx ) )
+	{
+		database_spi_drv->close (spi_ctx);
+		spi_ctx = NULL;
+		ctx->state = SERVICE_DISABLED;
+		return SERVICE_FAILURE_GENERAL;
+	}
 
-//		param = SPI_DEVICE_BIG_ENDIAN;
-//		database_spi_drv->iocontrol(spi_ctx, IO_IOCTL_SPI_SET_ENDIAN, &param, 4, NULL, 0, NULL );
+	/*
+	 * Build the block index from the block headers in flash
+	 */
+	build_block_index ();
+	load_erase_counts ();
+	record_cache_reset ();
+	memset ( cursors, 0, sizeof(cursors) );
+	gc_state = DB_GC_IDLE;
+	wear_leveling = false;
+	wear_stalled  = 0;
 
-//		ctx->state = SERVICE_RUNNING;
-//		return SERVICE_STATUS_SUCCESS;
-//	}
+	/*
+	 * Attach the background garbage collector
+	 */
+	system_management_func_attach (ctx->name, ctx, database_service_task);
 
 	ctx->state = SERVICE_RUNNING;
 
@@ -250,7 +403,19 @@ service_status_t database_core_stop (service_ctx_t* ctx)
 {
 	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
 	{
+		system_management_func_detach (database_service_task);
+		cache_flush ();
+
+		/*
+		 * Finish a compaction waiting for its erase
+		 */
+		if ( gc_state == DB_GC_ERASING )
+		{
+			serial_flash_erase_complete ();
+			gc_step ();
+		}
 		database_spi_drv->close (spi_ctx);
+		spi_ctx = NULL;
 		ctx->state = SERVICE_STOPPED;
 	}
 	return SERVICE_FAILURE_GENERAL;
@@ -305,21 +470,36 @@ service_status_t database_core_continue (service_ctx_t* ctx)
 
 /**
 * Initialize the hardware database.
+* Record protection is enabled with the keys of a database_config_t, or
+* disabled if no configuration is given.  Records are protected as they are
+* written, existing records are read either way.
 *
 * \param    ctx				Pointer to the service context
-* \param    config			Pointer to configuration information
+* \param    config			Pointer to a database_config_t structure, or NULL
+* \param	size			Size of the configuration
 *
-* \returns  SERVICE_STATUS_SUCCESS if character is available.
-*           SERVICE_FAILURE_GENERAL if no characters are present
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_INVALID_PARAMETER if the configuration is invalid.
+*           SERVICE_FAILURE_GENERAL if unable to perform the command.
 */
 service_status_t
-database_core_initialize (service_ctx_t* ctx, void* config)
+database_core_initialize (service_ctx_t* ctx, void* config, uint32_t size)
 {
+	database_config_t* settings = (database_config_t*)config;
+
 	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
 	{
-//	    GenerateDatabaseEncryptionKeys();
+		if ( settings == NULL )
+		{
+			record_crypto_disable ();
+			return SERVICE_STATUS_SUCCESS;
+		}
 
-		return SERVICE_STATUS_SUCCESS;
+		if ( size != sizeof(database_config_t) )
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+
+		if ( record_crypto_init ( settings->encryption_key, settings->authentication_key, settings->nonce ) )
+			return SERVICE_STATUS_SUCCESS;
 	}
 	return SERVICE_FAILURE_GENERAL;
 }
@@ -337,6 +517,8 @@ database_core_format (service_ctx_t* ctx)
 {
 	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
 	{
+		gc_state = DB_GC_IDLE;
+		record_cache_reset ();
 		bulk_erase ();
 		initialize_database ();
 		write_database_header ();
@@ -359,7 +541,14 @@ database_core_erase (service_ctx_t* ctx)
 {
 	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
 	{
+		gc_state = DB_GC_IDLE;
+		record_cache_reset ();
 		bulk_erase ();
+
+		/*
+		 * The superblock headers carry the erase counts
+		 */
+		initialize_database ();
 		return SERVICE_STATUS_SUCCESS;
 	}
 	return SERVICE_FAILURE_GENERAL;
@@ -385,8 +574,27 @@ database_core_readrecord (service_ctx_t* ctx, void* record_key, uint32_t size, v
 	{
 		if ( record_key != NULL && size == DATABASE_UUID_SIZE && record != NULL )
 		{
+			if ( record_cache_read ( record_key, record, record_size ) )
+			{
+				if ( bytes_transferred )
+					*bytes_transferred = record_size;
+				return SERVICE_STATUS_SUCCESS;
+			}
+
 			if ( find_block( record_key, record, record_size ) != INVALID_BLOCKREF )
 			{
+				EntryHeader_t* header = (EntryHeader_t*)record;
+
+				/*
+				 * Keep hot records in RAM for the next read
+				 */
+				if ( record_size >= sizeof(EntryHeader_t) && header->encBytes <= record_size &&
+					 record_cache_is_cacheable ( header->block_entry.recordType, header->encBytes ) )
+				{
+					record_cache_count_miss ();
+					record_cache_put ( (uint8_t*)record, header->encBytes, false, (uint32_t)time_get_ticks (NULL) );
+				}
+
 				if ( bytes_transferred )
 					*bytes_transferred = record_size;
 				return SERVICE_STATUS_SUCCESS;
@@ -402,40 +610,69 @@ database_core_readrecord (service_ctx_t* ctx, void* record_key, uint32_t size, v
 
 /**
 * Write a record to the database
+* The record must start with an EntryHeader_t and its key must not already be in the database.
+* The length in the header, encBytes, must lie within the record.
+* Session headers and user preferences are held in the write-back cache until the next group commit.
 *
 * \param    ctx				Pointer to the service context
 * \param	record			Pointer to memory for the database record
 * \param	record_size		Size of the record
 *
 * \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_INVALID_PARAMETER if the record is invalid.
 *           SERVICE_FAILURE_GENERAL if unable to perform the command.
 */
 service_status_t
 database_core_writerecord (service_ctx_t* ctx, void* record, uint32_t record_size)
 {
+	EntryHeader_t* header = (EntryHeader_t*)record;
+
 	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
 	{
-		return SERVICE_STATUS_SUCCESS;
+		if ( header == NULL || record_size < sizeof(EntryHeader_t) || record_size > BLOCK_SIZE ||
+			 header->block_entry.uuidSize != DATABASE_UUID_SIZE ||
+			 header->encBytes < sizeof(EntryHeader_t) || header->encBytes > record_size )
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+
+		if ( record_exists ( header->block_entry.recordType, header->block_entry.UUID ) )
+			return SERVICE_FAILURE_GENERAL;
+
+		if ( store_record ( (uint8_t*)record, record_size ) == DATABASE_API_SUCCESS )
+			return SERVICE_STATUS_SUCCESS;
 	}
 	return SERVICE_FAILURE_GENERAL;
 }
 
 /**
 * Update a record in the database
+* A new version of the record is appended and the previous version is invalidated.
+* Updates of cached records are coalesced in RAM until the next group commit.
 *
 * \param    ctx				Pointer to the service context
 * \param	record			Pointer to memory for the database record
 * \param	record_size		Size of the record
 *
 * \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_INVALID_PARAMETER if the record is invalid.
 *           SERVICE_FAILURE_GENERAL if unable to perform the command.
 */
 service_status_t
 database_core_updaterecord (service_ctx_t* ctx, void* record, uint32_t record_size)
 {
+	EntryHeader_t* header = (EntryHeader_t*)record;
+
 	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
 	{
-		return SERVICE_STATUS_SUCCESS;
+		if ( header == NULL || record_size < sizeof(EntryHeader_t) || record_size > BLOCK_SIZE ||
+			 header->block_entry.uuidSize != DATABASE_UUID_SIZE ||
+			 header->encBytes < sizeof(EntryHeader_t) || header->encBytes > record_size )
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+
+		if ( ! record_exists ( header->block_entry.recordType, header->block_entry.UUID ) )
+			return SERVICE_FAILURE_GENERAL;
+
+		if ( store_record ( (uint8_t*)record, record_size ) == DATABASE_API_SUCCESS )
+			return SERVICE_STATUS_SUCCESS;
 	}
 	return SERVICE_FAILURE_GENERAL;
 }
@@ -472,6 +709,7 @@ database_core_deleterecord (service_ctx_t* ctx, void* record_key, uint32_t size)
 
 /**
 * Perform garbage collection on the database
+* Runs a single bounded slice of the incremental garbage collector.
 *
 * \param    ctx				Pointer to the service context
 *
@@ -483,192 +721,585 @@ database_core_garbagecollection (service_ctx_t* ctx)
 {
 	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
 	{
+		if ( DATABASE_ERROR ( gc_step () ) )
+			return SERVICE_FAILURE_GENERAL;
 		return SERVICE_STATUS_SUCCESS;
 	}
 	return SERVICE_FAILURE_GENERAL;
 }
 
 /**
-* Create the initial database structure
+* Synchronize the database
+* Writes every pending update held in the write-back cache to flash.
 *
-* \param	None
+* \param    ctx				Pointer to the service context
 *
-* \returns  DATABASE_API_SUCCESS if successful.
-*           DATABASE_API_ERROR_NOT_FOUND if unable to perform the command.
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_GENERAL if unable to perform the command.
 */
-uint32_t initialize_database ( void )
+service_status_t
+database_core_sync (service_ctx_t* ctx)
 {
-uint16_t BlockRef;
-uint32_t MaxSuperBlocks = SUPER_BLOCKS;
-SuperBlockHeader_t superBlockHeader;
-
-	for ( uint8_t superBlock = 0; superBlock < MaxSuperBlocks; superBlock++ )
+	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
 	{
+		if ( cache_flush () == DATABASE_API_SUCCESS )
+			return SERVICE_STATUS_SUCCESS;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
 
-		////////////////////////////////////////////////////
-		// Initialize the superblock header
-		memset ( &superBlockHeader, 0xFF, sizeof(SuperBlockHeader_t) );
-		superBlockHeader.fillInd    = 0x00;
-		superBlockHeader.recordType = RecordTypeSuperBlock;
+/**
+* Get the number of spare sectors
+* A spare sector is fully erased and held in reserve, so a write can always
+* be placed without waiting for an erase.
+*
+* \param    ctx					Pointer to the service context
+* \param	output_buffer		Pointer to a uint32_t for the spare sector count
+* \param	output_size			Size of the output buffer
+* \param	bytes_transferred	Pointer to the number of bytes transferred
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_INVALID_PARAMETER if the output buffer is invalid.
+*           SERVICE_FAILURE_GENERAL if unable to perform the command.
+*/
+service_status_t
+database_core_getsparesectors (service_ctx_t* ctx, void* output_buffer, uint32_t output_size, uint32_t* bytes_transferred)
+{
+	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
+	{
+		if ( output_buffer == NULL || output_size < sizeof(uint32_t) )
+			return SERVICE_FAILURE_INVALID_PARAMETER;
 
-		//The generation for the first superblock is 0.  The generation for each
-	    //subsequent superblock is 0xFFFFFFFF, indicating that these are free blocks.
-		if( superBlock == 0 )
-		    superBlockHeader.generation = 0x0;
-        else
-            superBlockHeader.generation = 0xFFFFFFFF;
+		*(uint32_t*)output_buffer = spare_sector_count ();
 
-		////////////////////////////////////////////////////
-		// Write the superblock header
-		BlockRef = blockRefsToShortRef( superBlock, 0 );
-		write_block ( BlockRef, (uint8_t*)&superBlockHeader, BLOCK_SIZE );
+		if ( bytes_transferred )
+			*bytes_transferred = sizeof(uint32_t);
+		return SERVICE_STATUS_SUCCESS;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
 
-	} // for
+/**
+* Open a record cursor
+*
+* \param    ctx					Pointer to the service context
+* \param	input_buffer		Pointer to the record type, RecordTypeInvalid for every type
+* \param	input_size			Size of the input buffer
+* \param	output_buffer		Pointer to a uint32_t for the cursor
+* \param	output_size			Size of the output buffer
+* \param	bytes_transferred	Pointer to the number of bytes transferred
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_INVALID_PARAMETER if a buffer is invalid.
+*           SERVICE_FAILURE_GENERAL if every cursor is in use.
+*/
+service_status_t
+database_core_opencursor (service_ctx_t* ctx, void* input_buffer, uint32_t input_size, void* output_buffer, uint32_t output_size, uint32_t* bytes_transferred)
+{
+	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
+	{
+		if ( input_buffer == NULL || input_size != sizeof(uint8_t) || output_buffer == NULL || output_size < sizeof(uint32_t) )
+			return SERVICE_FAILURE_INVALID_PARAMETER;
 
-	return DATABASE_API_SUCCESS;
+		for ( uint32_t index = 0; index < DATABASE_MAX_CURSORS; index++ )
+		{
+			if ( ! cursors[index].open )
+			{
+				cursors[index].open       = true;
+				cursors[index].started    = false;
+				cursors[index].recordType = *(uint8_t*)input_buffer;
+
+				/*
+				 * Cursors are numbered from 1
+				 */
+				*(uint32_t*)output_buffer = index + 1;
+				if ( bytes_transferred )
+					*bytes_transferred = sizeof(uint32_t);
+				return SERVICE_STATUS_SUCCESS;
+			}
+		}
+	}
+	return SERVICE_FAILURE_GENERAL;
 }
 
 /**
-* Write the header record to the database
+* Fetch the next records of a cursor
+* Records are returned in key order straight from the block index, so a
+* full scan reads every record once.  Pending updates in the write-back
+* cache are committed first so the index holds every record.  Records that
+* fail authentication are skipped.
 *
-* \param	None
+* \param    ctx					Pointer to the service context
+* \param	input_buffer		Pointer to a database_cursor_fetch_t structure
+* \param	input_size			Size of the input buffer
+* \param	output_buffer		Pointer to the record buffer
+* \param	output_size			Size of the record buffer
+* \param	bytes_transferred	Pointer to the number of bytes returned, 0 at the end
 *
-* \returns  DATABASE_API_SUCCESS if successful.
-*           DATABASE_API_ERROR_NOT_FOUND if unable to perform the command.
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_INVALID_PARAMETER if the cursor is invalid or the next record does not fit.
+*           SERVICE_FAILURE_GENERAL if unable to perform the command.
 */
-uint32_t write_database_header ( void )
+service_status_t
+database_core_fetchcursor (service_ctx_t* ctx, void* input_buffer, uint32_t input_size, void* output_buffer, uint32_t output_size, uint32_t* bytes_transferred)
 {
-    uint16_t BlockRef;
-    DatabaseHeader_t DbaseHeader;
+	database_cursor_fetch_t* fetch = (database_cursor_fetch_t*)input_buffer;
+	uint8_t*		buffer = (uint8_t*)output_buffer;
+	db_cursor_t*	cursor;
+	block_index_entry_t entry;
+	uint32_t		offset = 0;
+	uint32_t		fetched = 0;
+	uint32_t		length;
+	uint32_t		result;
 
-	////////////////////////////////////////////////////////
-	// Initialize the database header entry
-	memset ( &DbaseHeader, 0xFF, sizeof(DatabaseHeader_t) );
-	memset ( DbaseHeader.header.block_entry.UUID, 0x00, DATABASE_UUID_SIZE );
-	DbaseHeader.header.block_entry.fillInd    = 0x00;
-	DbaseHeader.header.block_entry.recordType = RecordTypeDatabaseHeader;
-	DbaseHeader.header.block_entry.uuidSize   = 0;
-	DbaseHeader.header.encBytes   			  = sizeof(DatabaseHeader_t);
-	DbaseHeader.version          		 	  = DATABASE_VERSION;
+	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
+	{
+		if ( fetch == NULL || input_size != sizeof(database_cursor_fetch_t) || buffer == NULL ||
+			 fetch->cursor == 0 || fetch->cursor > DATABASE_MAX_CURSORS || ! cursors[fetch->cursor - 1].open )
+			return SERVICE_FAILURE_INVALID_PARAMETER;
 
-    //Encrypt and MAC the record
-//    encryptAndMac(((uint8_t*)&DbaseHeader) + HEADER_PROTECTED_OFFSET, HEADER_PROTECTED_SIZE,
-//            DbaseHeader.header.IV, &DbaseHeader.footer);
+		cursor = &cursors[fetch->cursor - 1];
+		if ( cache_flush () != DATABASE_API_SUCCESS )
+			return SERVICE_FAILURE_GENERAL;
 
-	////////////////////////////////////////////////////////
-	// Write the database header
-	BlockRef = blockRefsToShortRef( 0, 1 );
-	write_block ( BlockRef, (uint8_t*)&DbaseHeader, sizeof(DatabaseHeader_t) );
+		while ( fetched < fetch->count &&
+				block_index_next ( cursor->recordType, ( cursor->started ) ? cursor->uuid : NULL, &entry ) )
+		{
+			result = cursor_read_record ( &entry, &buffer[offset], output_size - offset, &length );
 
-	return DATABASE_API_SUCCESS;
+			/*
+			 * Leave a record that does not fit for the next fetch
+			 */
+			if ( result == DATABASE_API_ERROR_FULL )
+			{
+				if ( offset == 0 )
+					return SERVICE_FAILURE_INVALID_PARAMETER;
+				break;
+			}
+
+			memcpy ( cursor->uuid, entry.uuid, DATABASE_UUID_SIZE );
+			cursor->started = true;
+
+			if ( result == DATABASE_API_SUCCESS )
+			{
+				offset += length;
+				fetched++;
+			}
+		}
+
+		if ( bytes_transferred )
+			*bytes_transferred = offset;
+		return SERVICE_STATUS_SUCCESS;
+	}
+	return SERVICE_FAILURE_GENERAL;
 }
 
 /**
-* Write a session header record to the database
+* Close a record cursor
 *
-* \param	sessionUUID			UUID of the session
-* \param	serverUUID			UUID of the server
-* \param	rSecret				Rolling secret
-* \param	sSecret				Hardened secret
-* \param	certificate			Pointer to certificate data
-* \param	sertificateLength	Length of the certificate
-* \param	record				Pointer of the data buffer
-* \param	maxReadSize			Maximum record size to read
+* \param    ctx					Pointer to the service context
+* \param	input_buffer		Pointer to the uint32_t cursor
+* \param	input_size			Size of the input buffer
 *
-* \returns  DATABASE_API_SUCCESS if successful.
-*           DATABASE_API_ERROR_NOT_FOUND if unable to perform the command.
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_INVALID_PARAMETER if the cursor is invalid.
+*           SERVICE_FAILURE_GENERAL if unable to perform the command.
 */
-uint32_t write_session_header ( uint8_t* sessionUUID, uint8_t* serverUUID, uint8_t* rSecret, uint8_t* sSecret,
-							    uint8_t* certificate, uint16_t certificateLength )
+service_status_t
+database_core_closecursor (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
 {
-uint16_t 		 BlockRef;
-uint8_t	         BlockData[sizeof(SessionHeader_t) + certificateLength];
-SessionHeader_t* pSessionRecord = (SessionHeader_t*)&BlockData[0];
-
-	////////////////////////////////////////////////////////
-	// Initialize the header entry
-	memset ( pSessionRecord, 0xFF, sizeof(SessionHeader_t) );
-	memcpy ( pSessionRecord->header.block_entry.UUID, sessionUUID, DATABASE_UUID_SIZE );
-	pSessionRecord->header.block_entry.fillInd    = 0x00;
-	pSessionRecord->header.block_entry.recordType = RecordTypeSessionHeader;
-	pSessionRecord->header.block_entry.uuidSize   = DATABASE_UUID_SIZE;
-	pSessionRecord->header.encBytes               = sizeof(SessionHeader_t) + certificateLength;
-
-	////////////////////////////////////////////////////////
-	// Load session information
-	memcpy ( pSessionRecord->sessionUuid,    sessionUUID, sizeof(pSessionRecord->sessionUuid) );
-	memcpy ( pSessionRecord->serverUUID,     serverUUID,  sizeof(pSessionRecord->serverUUID) );
-	memcpy ( pSessionRecord->rollingSecret,  rSecret,     sizeof(pSessionRecord->rollingSecret) );
-	memcpy ( pSessionRecord->hardenedSecret, sSecret,     sizeof(pSessionRecord->hardenedSecret) );
+	uint32_t handle;
 
-    //Encrypt and MAC the record
-//    encryptAndMac(((uint8_t*)pSessionRecord) + SESSION_PROTECTED_OFFSET, SESSION_PROTECTED_SIZE,
-//            pSessionRecord->header.IV, &pSessionRecord->footer);
+	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
+	{
+		if ( input_buffer == NULL || input_size != sizeof(uint32_t) )
+			return SERVICE_FAILURE_INVALID_PARAMETER;
 
-	////////////////////////////////////////////////////////
-	// Load certificate or other extra data
-	if ( (certificate != NULL) && (certificateLength != 0) )
-		memcpy ( &BlockData[sizeof(SessionHeader_t)], certificate, certificateLength );
+		handle = *(uint32_t*)input_buffer;
+		if ( handle == 0 || handle > DATABASE_MAX_CURSORS || ! cursors[handle - 1].open )
+			return SERVICE_FAILURE_INVALID_PARAMETER;
 
-	////////////////////////////////////////////////////////
-	// Write the session record to the database
-	BlockRef = find_empty_block ();
-	if ( BlockRef != INVALID_BLOCKREF )
-	{
-		write_block ( BlockRef, BlockData, sizeof(BlockData) );
-		return DATABASE_API_SUCCESS;
+		cursors[handle - 1].open = false;
+		return SERVICE_STATUS_SUCCESS;
 	}
-
-	return DATABASE_API_ERROR_FULL;
+	return SERVICE_FAILURE_GENERAL;
 }
 
-////////////////////////////////////////////////////////////
-// CDatabase::WriteUserPreferencesRecord
-//   Routine to create and write the user preferences record
 /**
-* Write a user preferences record to the database
+* Database service task.
+* Commits the write-back cache once its oldest update is
+* DATABASE_CACHE_FLUSH_INTERVAL old, and runs a garbage collection slice when
+* a compaction is in progress, free blocks are running low or fewer than
+* DATABASE_SPARE_SECTORS erased sectors are in reserve.  Sector erases run in
+* the background and are polled here, so that erases are kept off the write
+* path.  A pass that finds a client request holding the database is skipped,
+* the work is picked up by the next pass.
 *
-* \param	uuid				UUID of this record
-* \param	preferences			Use preferences
+* \param    instance		Pointer to the service context
 *
-* \returns  DATABASE_API_SUCCESS if successful.
-*           DATABASE_API_ERROR_NOT_FOUND if unable to perform the command.
+* \returns  None
 */
-uint32_t write_user_preferences_record ( uint8_t* uuid, uint8_t* preferences )
+void database_service_task (void* instance)
 {
-DBCURSOR BlockRef;
-UserPreferences_t PreferencesRecord;
+	service_ctx_t* ctx = (service_ctx_t*)instance;
+	bool flush;
+	bool collect;
 
-	////////////////////////////////////////////////////////
-	// Initialize the header entry
-	memset ( &PreferencesRecord, 0xFF, sizeof(UserPreferences_t) );
-	memcpy ( PreferencesRecord.header.block_entry.UUID, uuid, DATABASE_UUID_SIZE );
-	PreferencesRecord.header.block_entry.fillInd    = 0x00;
-	PreferencesRecord.header.block_entry.recordType = RecordTypeUserPreferences;
-	PreferencesRecord.header.block_entry.uuidSize   = DATABASE_UUID_SIZE;
-	PreferencesRecord.header.encBytes               = sizeof(UserPreferences_t);
+	if ( ctx == NULL || ctx->state != SERVICE_RUNNING )
+		return;
 
-	////////////////////////////////////////////////////////
-	// Load preferences record information
-	memcpy ( PreferencesRecord.preferencesBits, preferences, sizeof(PreferencesRecord.preferencesBits) );
+	/*
+	 * Do not stall the system management thread behind a client request.
+	 * The cache and collector state is only looked at with the lock held.
+	 */
+	if ( critical_section_try_acquire (&database_cs) != SYSTEM_STATUS_SUCCESS )
+		return;
 
-	////////////////////////////////////////////////////////
-	// Write the user preferences record
-	BlockRef = find_empty_block ();
-	if ( BlockRef != INVALID_BLOCKREF )
-	{
-		write_block ( BlockRef, (uint8_t*)&PreferencesRecord, sizeof(UserPreferences_t) );
-		return DATABASE_API_SUCCESS;
-	}
+	flush   = ( record_cache_dirty_count () != 0 && record_cache_dirty_age ( (uint32_t)time_get_ticks (NULL) ) >= DB_CACHE_FLUSH_TICKS );
+	collect = ( gc_state != DB_GC_IDLE || block_index_free_count () < DATABASE_GC_FREE_THRESHOLD ||
+				spare_sector_count () < DATABASE_SPARE_SECTORS || wear_level_due ( NULL ) );
 
-	return DATABASE_API_ERROR_FULL;
+	if ( flush )
+		cache_flush ();
+	if ( collect )
+		gc_step ();
+	if ( flush || collect )
+		serial_flash_erase_resume ();
+
+	critical_section_release (&database_cs);
 }
 
 /**
-* Write an eKey record to the database
+* Retrieve the database statistics
 *
-* \param	uuid				UUID of the ekey
-* \param	ekeyType			Type of the ekey
+* \param    ctx					Pointer to the service context
+* \param	output_buffer		Pointer to a database_statistics_t structure
+* \param	output_size			Size of the output buffer
+* \param	bytes_transferred	Pointer to the number of bytes transferred
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_INVALID_PARAMETER if the output buffer is invalid.
+*           SERVICE_FAILURE_GENERAL if unable to perform the command.
+*/
+service_status_t
+database_core_getstatistics (service_ctx_t* ctx, void* output_buffer, uint32_t output_size, uint32_t* bytes_transferred)
+{
+	serial_flash_statistics_t flash_statistics;
+	record_cache_statistics_t cache_statistics;
+	database_statistics_t* statistics = (database_statistics_t*)output_buffer;
+	uint32_t coldest;
+
+	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
+	{
+		if ( statistics == NULL || output_size < sizeof(database_statistics_t) )
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+
+		serial_flash_get_statistics ( &flash_statistics );
+		record_cache_get_statistics ( &cache_statistics );
+		statistics->flash_reads         = flash_statistics.reads;
+		statistics->flash_read_bytes    = flash_statistics.read_bytes;
+		statistics->flash_programs      = flash_statistics.programs;
+		statistics->flash_program_bytes = flash_statistics.program_bytes;
+		statistics->flash_erases        = flash_statistics.erases;
+		statistics->flash_busy_polls    = flash_statistics.busy_polls;
+		statistics->flash_program_max_polls = flash_statistics.program_max_polls;
+		statistics->flash_program_ticks = flash_statistics.program_ticks;
+		statistics->flash_erase_ticks   = flash_statistics.erase_ticks;
+		statistics->flash_read_ahead_hits  = flash_statistics.read_ahead_hits;
+		statistics->flash_read_ahead_fills = flash_statistics.read_ahead_fills;
+		statistics->flash_read_cycles   = flash_statistics.read_cycles;
+		statistics->flash_erase_suspends = flash_statistics.erase_suspends;
+		statistics->index_entries       = block_index_count ();
+		statistics->free_blocks         = block_index_free_count ();
+		statistics->gc_relocations      = gc_relocations;
+		statistics->gc_compactions      = gc_compactions;
+		statistics->spare_sectors       = spare_sector_count ();
+		statistics->wear_max_erases     = 0;
+		statistics->wear_total_erases   = 0;
+		for ( uint32_t sector = 0; sector < DB_NUMBER_OF_SECTORS; sector++ )
+		{
+			if ( sector_erases[sector] > statistics->wear_max_erases )
+				statistics->wear_max_erases = sector_erases[sector];
+			statistics->wear_total_erases += sector_erases[sector];
+		}
+		wear_spread ( &coldest );
+		statistics->wear_min_erases     = sector_erases[coldest];
+		statistics->wear_levelings      = wear_levelings;
+		statistics->cache_hits          = cache_statistics.hits;
+		statistics->cache_misses        = cache_statistics.misses;
+		statistics->cache_coalesced     = cache_statistics.coalesced;
+		statistics->cache_commits       = cache_commits;
+		statistics->cache_committed     = cache_committed;
+		statistics->auth_failures       = auth_failures;
+
+		if ( bytes_transferred )
+			*bytes_transferred = sizeof(database_statistics_t);
+		return SERVICE_STATUS_SUCCESS;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Reset the database statistics
+*
+* \param    ctx				Pointer to the service context
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_GENERAL if unable to perform the command.
+*/
+service_status_t
+database_core_resetstatistics (service_ctx_t* ctx)
+{
+	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
+	{
+		serial_flash_reset_statistics ();
+		record_cache_reset_statistics ();
+		cache_commits   = 0;
+		cache_committed = 0;
+		auth_failures   = 0;
+		wear_levelings  = 0;
+		return SERVICE_STATUS_SUCCESS;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Read a record for a cursor
+* The record is copied from the write-back cache if it is held there.
+*
+* \param	entry			Pointer to the index entry of the record
+* \param	data			Pointer to the record buffer
+* \param	size			Size of the record buffer
+* \param	length			Pointer to storage for the padded record length
+*
+* \returns  DATABASE_API_SUCCESS if successful.
+*           DATABASE_API_ERROR_FULL if the record does not fit in the buffer.
+*           DATABASE_API_ERROR if the record is invalid or not authentic.
+*/
+uint32_t cursor_read_record ( const block_index_entry_t* entry, uint8_t* data, uint32_t size, uint32_t* length )
+{
+	EntryHeader_t*		  header = (EntryHeader_t*)data;
+	record_cache_entry_t* cached = record_cache_find ( entry->recordType, entry->uuid );
+	DBCURSOR			  BlockRef = index_to_block_ref ( entry->block );
+
+	if ( size < sizeof(EntryHeader_t) )
+		return DATABASE_API_ERROR_FULL;
+
+	if ( cached != NULL )
+	{
+		*length = cached->length;
+		if ( ((*length + 3) & ~3UL) > size )
+			return DATABASE_API_ERROR_FULL;
+
+		memcpy ( data, cached->data, *length );
+	}
+	else
+	{
+		read_block ( BlockRef, data, sizeof(EntryHeader_t) );
+
+		/*
+		 * A plaintext record gives its length up front, a protected one once
+		 * it has been decrypted
+		 */
+		if ( header->block_entry.protInd != 0x00 )
+		{
+			*length = header->encBytes;
+			if ( *length < sizeof(EntryHeader_t) || *length > BLOCK_SIZE )
+				return DATABASE_API_ERROR;
+			if ( ((*length + 3) & ~3UL) > size )
+				return DATABASE_API_ERROR_FULL;
+
+			read_block ( BlockRef, data, *length );
+		}
+		else
+		{
+			if ( ! read_record ( BlockRef, data, size ) )
+			{
+				auth_failures++;
+				return DATABASE_API_ERROR;
+			}
+
+			*length = header->encBytes;
+			if ( ((*length + 3) & ~3UL) > size )
+				return DATABASE_API_ERROR_FULL;
+		}
+	}
+
+	*length = (*length + 3) & ~3UL;
+	return DATABASE_API_SUCCESS;
+}
+
+/**
+* Create the initial database structure
+*
+* \param	None
+*
+* \returns  DATABASE_API_SUCCESS if successful.
+*           DATABASE_API_ERROR_NOT_FOUND if unable to perform the command.
+*/
+uint32_t initialize_database ( void )
+{
+uint32_t MaxSuperBlocks = SUPER_BLOCKS;
+
+	for ( uint8_t superBlock = 0; superBlock < MaxSuperBlocks; superBlock++ )
+		write_superblock_header ( superBlock );
+
+	return DATABASE_API_SUCCESS;
+}
+
+/**
+* Write a superblock header
+*
+* \param	superBlock		Superblock number
+*
+* \returns  DATABASE_API_SUCCESS if successful.
+*/
+uint32_t write_superblock_header ( uint8_t superBlock )
+{
+uint16_t BlockRef;
+SuperBlockHeader_t superBlockHeader;
+
+	////////////////////////////////////////////////////
+	// Initialize the superblock header
+	memset ( &superBlockHeader, 0xFF, sizeof(SuperBlockHeader_t) );
+	superBlockHeader.fillInd    = 0x00;
+	superBlockHeader.recordType = RecordTypeSuperBlock;
+
+	//The generation for the first superblock is 0.  The generation for each
+	//subsequent superblock is 0xFFFFFFFF, indicating that these are free blocks.
+	if( superBlock == 0 )
+		superBlockHeader.generation = 0x0;
+	else
+		superBlockHeader.generation = 0xFFFFFFFF;
+
+	superBlockHeader.eraseCount = sector_erases[superBlock / DB_SUPERBLOCKS_PER_SECTOR];
+
+	////////////////////////////////////////////////////
+	// Write the superblock header
+	BlockRef = blockRefsToShortRef( superBlock, 0 );
+	write_block ( BlockRef, (uint8_t*)&superBlockHeader, sizeof(SuperBlockHeader_t) );
+
+	return DATABASE_API_SUCCESS;
+}
+
+/**
+* Write the header record to the database
+*
+* \param	None
+*
+* \returns  DATABASE_API_SUCCESS if successful.
+*           DATABASE_API_ERROR_NOT_FOUND if unable to perform the command.
+*/
+uint32_t write_database_header ( void )
+{
+    uint16_t BlockRef;
+    DatabaseHeader_t DbaseHeader;
+
+	////////////////////////////////////////////////////////
+	// Initialize the database header entry
+	memset ( &DbaseHeader, 0xFF, sizeof(DatabaseHeader_t) );
+	memset ( DbaseHeader.header.block_entry.UUID, 0x00, DATABASE_UUID_SIZE );
+	DbaseHeader.header.block_entry.fillInd    = 0x00;
+	DbaseHeader.header.block_entry.recordType = RecordTypeDatabaseHeader;
+	DbaseHeader.header.block_entry.uuidSize   = 0;
+	DbaseHeader.header.encBytes   			  = sizeof(DatabaseHeader_t);
+	DbaseHeader.version          		 	  = DATABASE_VERSION;
+
+	////////////////////////////////////////////////////////
+	// Encrypt, MAC and write the database header
+	BlockRef = blockRefsToShortRef( 0, 1 );
+	write_record ( BlockRef, (uint8_t*)&DbaseHeader, sizeof(DatabaseHeader_t) );
+	block_index_insert ( RecordTypeDatabaseHeader, DbaseHeader.header.block_entry.UUID, block_ref_to_index ( BlockRef ) );
+
+	return DATABASE_API_SUCCESS;
+}
+
+/**
+* Write a session header record to the database
+*
+* \param	sessionUUID			UUID of the session
+* \param	serverUUID			UUID of the server
+* \param	rSecret				Rolling secret
+* \param	sSecret				Hardened secret
+* \param	certificate			Pointer to certificate data
+* \param	sertificateLength	Length of the certificate
+* \param	record				Pointer of the data buffer
+* \param	maxReadSize			Maximum record size to read
+*
+* \returns  DATABASE_API_SUCCESS if successful.
+*           DATABASE_API_ERROR_NOT_FOUND if unable to perform the command.
+*/
+uint32_t write_session_header ( uint8_t* sessionUUID, uint8_t* serverUUID, uint8_t* rSecret, uint8_t* sSecret,
+							    uint8_t* certificate, uint16_t certificateLength )
+{
+uint8_t	         BlockData[sizeof(SessionHeader_t) + certificateLength];
+SessionHeader_t* pSessionRecord = (SessionHeader_t*)&BlockData[0];
+
+	////////////////////////////////////////////////////////
+	// Initialize the header entry
+	memset ( pSessionRecord, 0xFF, sizeof(SessionHeader_t) );
+	memcpy ( pSessionRecord->header.block_entry.UUID, sessionUUID, DATABASE_UUID_SIZE );
+	pSessionRecord->header.block_entry.fillInd    = 0x00;
+	pSessionRecord->header.block_entry.recordType = RecordTypeSessionHeader;
+	pSessionRecord->header.block_entry.uuidSize   = DATABASE_UUID_SIZE;
+	pSessionRecord->header.encBytes               = sizeof(SessionHeader_t) + certificateLength;
+
+	////////////////////////////////////////////////////////
+	// Load session information
+	memcpy ( pSessionRecord->sessionUuid,    sessionUUID, sizeof(pSessionRecord->sessionUuid) );
+	memcpy ( pSessionRecord->serverUUID,     serverUUID,  sizeof(pSessionRecord->serverUUID) );
+	memcpy ( pSessionRecord->rollingSecret,  rSecret,     sizeof(pSessionRecord->rollingSecret) );
+	memcpy ( pSessionRecord->hardenedSecret, sSecret,     sizeof(pSessionRecord->hardenedSecret) );
+
+	////////////////////////////////////////////////////////
+	// Load certificate or other extra data
+	if ( (certificate != NULL) && (certificateLength != 0) )
+		memcpy ( &BlockData[sizeof(SessionHeader_t)], certificate, certificateLength );
+
+	////////////////////////////////////////////////////////
+	// Write the session record to the database
+	return store_record ( BlockData, sizeof(BlockData) );
+}
+
+////////////////////////////////////////////////////////////
+// CDatabase::WriteUserPreferencesRecord
+//   Routine to create and write the user preferences record
+/**
+* Write a user preferences record to the database
+*
+* \param	uuid				UUID of this record
+* \param	preferences			Use preferences
+*
+* \returns  DATABASE_API_SUCCESS if successful.
+*           DATABASE_API_ERROR_NOT_FOUND if unable to perform the command.
+*/
+uint32_t write_user_preferences_record ( uint8_t* uuid, uint8_t* preferences )
+{
+UserPreferences_t PreferencesRecord;
+
+	////////////////////////////////////////////////////////
+	// Initialize the header entry
+	memset ( &PreferencesRecord, 0xFF, sizeof(UserPreferences_t) );
+	memcpy ( PreferencesRecord.header.block_entry.UUID, uuid, DATABASE_UUID_SIZE );
+	PreferencesRecord.header.block_entry.fillInd    = 0x00;
+	PreferencesRecord.header.block_entry.recordType = RecordTypeUserPreferences;
+	PreferencesRecord.header.block_entry.uuidSize   = DATABASE_UUID_SIZE;
+	PreferencesRecord.header.encBytes               = sizeof(UserPreferences_t);
+
+	////////////////////////////////////////////////////////
+	// Load preferences record information
+	memcpy ( PreferencesRecord.preferencesBits, preferences, sizeof(PreferencesRecord.preferencesBits) );
+
+	////////////////////////////////////////////////////////
+	// Write the user preferences record
+	return store_record ( (uint8_t*)&PreferencesRecord, sizeof(UserPreferences_t) );
+}
+
+/**
+* Write an eKey record to the database
+*
+* \param	uuid				UUID of the ekey
+* \param	ekeyType			Type of the ekey
 * \param	sharedSecret		Shared secret
 * \param	serialNumber		Serial number
 * \param	permissions			Permission information
@@ -681,7 +1312,6 @@ UserPreferences_t PreferencesRecord;
 uint32_t write_ekey_record ( uint8_t* uuid, uint8_t ekeyType, uint8_t* sharedSecret, uint32_t serialNumber, uint8_t permissions,
 						     uint8_t* certificate, uint16_t certificateLength )
 {
-	DBCURSOR     BlockRef;
 	uint8_t	     BlockData[sizeof(EKeyEntry_t) + certificateLength];
 	EKeyEntry_t* pEkeyRecord = (EKeyEntry_t*)&BlockData[0];
 
@@ -708,28 +1338,15 @@ uint32_t write_ekey_record ( uint8_t* uuid, uint8_t ekeyType, uint8_t* sharedSec
 		memcpy ( &BlockData[sizeof(EKeyEntry_t)], certificate, certificateLength );
 	}
 
-    //Encrypt and MAC the record
-//    encryptAndMac(((uint8_t*)pEkeyRecord) + EKEY_PROTECTED_OFFSET, EKEY_PROTECTED_SIZE, pEkeyRecord->header.IV, &pEkeyRecord->footer);
-    /*****************************************************************************
-    DO NOT USE anything in the rec pointer after this point (except rec->header), it has been encrpyted
-    and thus the values are incorrect.
-    ******************************************************************************/
-
 	/*
-	 * Write the record
+	 * Write the record, it is encrypted and MACed on its way to flash
 	 */
-	BlockRef = find_empty_block ();
-	if ( BlockRef != INVALID_BLOCKREF )
-	{
-		write_block ( BlockRef, BlockData, sizeof(BlockData) );
-		return DATABASE_API_SUCCESS;
-	}
-
-	return DATABASE_API_ERROR_FULL;
+	return append_record ( BlockData, sizeof(BlockData), true );
 }
 
 /**
 * Modify an existing record in the database
+* The new version is appended and the previous version invalidated, no erase is required.
 *
 * \param	uuid				UUID of the ekey
 * \param	ekeyType			Type of the ekey
@@ -746,7 +1363,9 @@ uint32_t update_ekey_record ( uint8_t* uuid, uint8_t ekeyType, uint8_t* sharedSe
 							  uint8_t* certificate, uint16_t certificateLength )
 {
 
-	delete_block ( uuid );
+	if ( ! block_index_find ( RecordTypeEKeyEntry, uuid, NULL ) )
+		return DATABASE_API_ERROR_NOT_FOUND;
+
 	return write_ekey_record ( uuid, ekeyType, sharedSecret, serialNumber, permissions, certificate, certificateLength );
 
 }
@@ -764,51 +1383,29 @@ uint32_t update_ekey_record ( uint8_t* uuid, uint8_t ekeyType, uint8_t* sharedSe
 DBCURSOR find_block( uint8_t* uuid, void* pRecord, uint32_t maxReadSize )
 {
     DBCURSOR BlockRef;
-    EKeyEntry_t blockHeader;
-    uint32_t MaxSuperBlocks = SUPER_BLOCKS;
-    uint32_t MaxEntries     = ENTRIES_PER_TABLE;
+    BlockRefType Block;
 
     /*
-     * Search for block
+     * Look up the block in the index
      */
-	for ( uint8_t superBlock = 0; superBlock < MaxSuperBlocks; superBlock++ )
-	{
-		for ( uint8_t Block = 1; Block < MaxEntries; Block++ )
-		{
-			BlockRef = blockRefsToShortRef( superBlock, Block );
-			read_block ( BlockRef, (uint8_t*)&blockHeader, sizeof(EKeyEntry_t) );
+    if ( ! block_index_find ( BLOCK_INDEX_ANY_TYPE, uuid, &Block ) )
+        return INVALID_BLOCKREF;
 
-			/*
-			 * Verify the block is in use
-			 */
-            if ((blockHeader.header.block_entry.deleteInd == 0xFF) &&
-                (blockHeader.header.block_entry.fillInd == 0x00) &&
-                (blockHeader.header.block_entry.uuidSize == DATABASE_UUID_SIZE) &&
-				memcmp ( blockHeader.header.block_entry.UUID, uuid, blockHeader.header.block_entry.uuidSize ) == 0)
-            {
-                //only read entire record if storage set
-                if (pRecord)
-                {
-                    read_block ( BlockRef, (uint8_t*)pRecord, maxReadSize );
-                    ////////////////////////////////////////////////
-                    // Decrypt and Verify that the block is marked as in use, has not been deleted, and then compare the key
-//                    if ( validateEKeyEntry( (EKeyEntry_t*)pRecord ))
-//                    {
-                        return BlockRef;
-//                    }
-                }
-                else //No data requested, just looking for matching key.
-                {
-                    return BlockRef;
-                }
-            } // if
-		} // for
-	} // for
+    BlockRef = index_to_block_ref ( Block );
 
-	/*
-	 * Not found
-	 */
-	return INVALID_BLOCKREF;
+    //only read entire record if storage set
+    if (pRecord)
+    {
+        ////////////////////////////////////////////////
+        // Decrypt and verify the record
+        if ( ! read_record ( BlockRef, (uint8_t*)pRecord, maxReadSize ) )
+        {
+            auth_failures++;
+            return INVALID_BLOCKREF;
+        }
+    }
+
+    return BlockRef;
 }
 
 /**
@@ -822,17 +1419,26 @@ DBCURSOR find_block( uint8_t* uuid, void* pRecord, uint32_t maxReadSize )
 uint32_t delete_block ( uint8_t* uuid )
 {
     DBCURSOR BlockRef;
-    EntryHeader_t blockHeader;
+    bool     Cached;
 
-    BlockRef = find_block ( uuid, &blockHeader, sizeof(EntryHeader_t) );
+    /*
+     * A pending update is dropped along with the record
+     */
+    Cached = record_cache_remove ( BLOCK_INDEX_ANY_TYPE, uuid );
+
+    BlockRef = find_block ( uuid, NULL, 0 );
     if ( BlockRef != INVALID_BLOCKREF )
     {
-		blockHeader.block_entry.deleteInd = 0x00;
-		write_block ( BlockRef, (uint8_t*)&blockHeader, sizeof(EntryHeader_t) );
+		write_block_field ( BlockRef, offsetof(BlockEntry_t, deleteInd), 0x00 );
+
+		/*
+		 * The block stays in use until its sector is erased
+		 */
+		block_index_remove ( BLOCK_INDEX_ANY_TYPE, uuid, NULL );
 		return DATABASE_API_SUCCESS;
     }
 
-	return DATABASE_API_ERROR_NOT_FOUND;
+	return ( Cached ) ? DATABASE_API_SUCCESS : DATABASE_API_ERROR_NOT_FOUND;
 }
 
 /**
@@ -845,29 +1451,18 @@ uint32_t delete_block ( uint8_t* uuid )
 */
 DBCURSOR find_empty_block ( void )
 {
-    DBCURSOR BlockRef;
-    EntryHeader_t blockHeader;
-    uint32_t MaxSuperBlocks = SUPER_BLOCKS;
-    uint32_t MaxEntries     = ENTRIES_PER_TABLE;
+    BlockRefType Block;
 
     /*
      * Find an empty block
      */
-	for ( uint8_t superBlock = 0; superBlock < MaxSuperBlocks; superBlock++ )
-	{
-		for ( uint8_t Block = 1; Block < MaxEntries; Block++ )
-		{
-			BlockRef = blockRefsToShortRef( superBlock, Block );
-			read_block ( BlockRef, (uint8_t*)&blockHeader, sizeof(EntryHeader_t) );
-			if ( blockHeader.block_entry.fillInd == 0xFF )
-				return BlockRef;
-		}
-	}
+    if ( allocate_block ( &Block ) )
+        return index_to_block_ref ( Block );
 
-	/*
-	 * Ghostrider the pattern is full
-	 */
-	return INVALID_BLOCKREF;
+    /*
+     * Ghostrider the pattern is full
+     */
+    return INVALID_BLOCKREF;
 }
 
 /**
@@ -929,18 +1524,938 @@ uint8_t Block;
 }
 
 /**
-* Erase the entire database
+* Program a single byte of a block header
+* Only bits that are set can be cleared, so this is used to flag a block
+* without erasing it.
 *
-* \param    ctx				Pointer to the service context
+* \param	block_ref		Block reference
+* \param	offset			Offset of the field in the block
+* \param    value			Value to program
 *
-* \returns  SERVICE_STATUS_SUCCESS if successful.
-*           SERVICE_FAILURE_GENERAL if unable to perform the command.
+* \returns  DATABASE_API_SUCCESS if successful.
+*           DATABASE_API_ERROR if unable to perform the command.
 */
-uint32_t bulk_erase (void)
+uint32_t write_block_field ( uint16_t block_ref, uint32_t offset, uint8_t value )
 {
-	for ( uint32_t sector = 0; sector < DB_NUMBER_OF_SECTORS; sector++ )
-		serial_flash_sector_erase ( (uint32_t)(sector * DB_SECTOR_SIZE) );
+uint8_t SuperBlock;
+uint8_t Block;
+
+	computeBlockRefsFromShortRef( block_ref, &SuperBlock, &Block );
+
+	uint32_t Address = getSuperBlockOffset( SuperBlock ) + getBlockOffset ( Block ) + offset;
+
+	if ( serial_flash_write_data ( Address, 1, &value ) != 1 )
+		return DATABASE_API_ERROR;
 
 	return DATABASE_API_SUCCESS;
 }
 
+/**
+* Write a record to a block, encrypting and authenticating it on the way
+* The record is copied a chunk at a time into a chunk buffer, encrypted and
+* MACed there, and programmed before the next chunk is touched, so it is
+* walked only once.  The MAC is placed in the footer of the last chunk, or
+* programmed into the erased footer afterwards if the footer is not in the last
+* chunk.  Records without a footer, or written while protection is disabled,
+* are written as plaintext.
+*
+* \param	block_ref		Block reference
+* \param	data			Pointer to the plaintext record, starting with an EntryHeader_t
+* \param    length			Size of the record
+*
+* \returns  DATABASE_API_SUCCESS if successful.
+*           DATABASE_API_ERROR if unable to perform the command.
+*/
+uint32_t write_record ( uint16_t block_ref, uint8_t* data, uint32_t length )
+{
+    EntryHeader_t* header  = (EntryHeader_t*)data;
+    uint32_t       address = block_address ( block_ref );
+    uint32_t       footer  = record_footer_offset ( header->block_entry.recordType );
+    uint8_t        mac[RECORD_CRYPTO_MAC_SIZE];
+    bool           mac_written = false;
+    uint32_t       size;
+
+    if ( ! record_crypto_enabled () || footer == 0 || length < footer + sizeof(EntryFooter_t) || length > BLOCK_SIZE )
+    {
+        header->block_entry.protInd = 0xFF;
+        return write_block ( block_ref, data, length );
+    }
+
+    header->block_entry.protInd = 0x00;
+    header->encBytes            = (uint16_t)length;
+    record_crypto_new_iv ( header->IV );
+
+    if ( ! record_crypto_begin ( header ) )
+        return DATABASE_API_ERROR;
+
+    for ( uint32_t offset = 0; offset < length; offset += size )
+    {
+        size = ( (length - offset) < CHUNK_SIZE ) ? (length - offset) : CHUNK_SIZE;
+
+        memcpy ( record_chunk, &data[offset], size );
+        if ( ! protect_chunk ( record_chunk, offset, size, footer, true ) )
+            return DATABASE_API_ERROR;
+
+        if ( (offset + size) == length && footer >= offset )
+        {
+            if ( ! record_crypto_finish ( &record_chunk[footer - offset] ) )
+                return DATABASE_API_ERROR;
+            mac_written = true;
+        }
+
+        serial_flash_write_data ( address + offset, size, record_chunk );
+    }
+
+    if ( ! mac_written )
+    {
+        if ( ! record_crypto_finish ( mac ) )
+            return DATABASE_API_ERROR;
+        serial_flash_write_data ( address + footer, sizeof(mac), mac );
+    }
+
+    return DATABASE_API_SUCCESS;
+}
+
+/**
+* Read a record from a block, authenticating and decrypting it on the way
+* The record is read a chunk at a time and each chunk is MACed and decrypted
+* before the next one is read.  Plaintext records are read as is.
+*
+* \param	block_ref		Block reference
+* \param	data			Pointer to the record buffer
+* \param    size			Size of the record buffer
+*
+* \returns  true if successful, false if the record failed authentication.
+*/
+bool read_record ( uint16_t block_ref, uint8_t* data, uint32_t size )
+{
+    EntryHeader_t header;
+    uint32_t      address = block_address ( block_ref );
+    uint32_t      footer;
+    uint32_t      length;
+    uint32_t      count;
+    uint8_t       mac[RECORD_CRYPTO_MAC_SIZE];
+
+    read_block ( block_ref, (uint8_t*)&header, sizeof(EntryHeader_t) );
+    if ( header.block_entry.protInd != 0x00 )
+    {
+        read_block ( block_ref, data, size );
+        return true;
+    }
+
+    /*
+     * The record length is the first encrypted field
+     */
+    footer = record_footer_offset ( header.block_entry.recordType );
+    if ( footer == 0 || ! record_crypto_begin ( &header ) ||
+         ! record_crypto_decrypt ( (uint8_t*)&header.encBytes, sizeof(header.encBytes) ) )
+        return false;
+
+    length = header.encBytes;
+    if ( length < footer + sizeof(EntryFooter_t) || length > BLOCK_SIZE )
+        return false;
+
+    memcpy ( data, &header, ( size < sizeof(EntryHeader_t) ) ? size : sizeof(EntryHeader_t) );
+
+    for ( uint32_t offset = sizeof(EntryHeader_t); offset < length; offset += count )
+    {
+        count = ( (length - offset) < CHUNK_SIZE ) ? (length - offset) : CHUNK_SIZE;
+        serial_flash_read_data ( address + offset, count, record_chunk );
+
+        /*
+         * Collect the MAC before the chunk is decrypted
+         */
+        for ( uint32_t index = 0; index < count; index++ )
+        {
+            if ( (offset + index) >= footer && (offset + index) < footer + sizeof(mac) )
+                mac[offset + index - footer] = record_chunk[index];
+        }
+
+        if ( ! protect_chunk ( record_chunk, offset, count, footer, false ) )
+            return false;
+
+        if ( offset < size )
+            memcpy ( &data[offset], record_chunk, ( (size - offset) < count ) ? (size - offset) : count );
+    }
+
+    if ( ! record_crypto_verify ( mac ) )
+    {
+        memset ( data, 0, size );
+        return false;
+    }
+
+    /*
+     * Bytes past the end of the record read back as erased flash
+     */
+    if ( size > length )
+        memset ( &data[length], 0xFF, size - length );
+
+    return true;
+}
+
+/**
+* Encrypt or decrypt the protected bytes of a record chunk
+* The protected region starts after the record management bytes and excludes
+* the footer, which holds the MAC.  On encryption the footer bytes are left
+* erased.
+*
+* \param	chunk			Pointer to the chunk
+* \param	offset			Offset of the chunk in the record
+* \param    size			Size of the chunk
+* \param    footer			Offset of the footer in the record
+* \param    encrypt			true to encrypt, false to decrypt
+*
+* \returns  true if successful.
+*/
+bool protect_chunk ( uint8_t* chunk, uint32_t offset, uint32_t size, uint32_t footer, bool encrypt )
+{
+    uint32_t start = ( offset < RECORD_MANAGEMENT_BYTES_SIZE ) ? RECORD_MANAGEMENT_BYTES_SIZE : offset;
+    uint32_t end   = offset + size;
+    uint32_t first_end    = ( end < footer ) ? end : footer;
+    uint32_t second_start = ( start > footer + sizeof(EntryFooter_t) ) ? start : footer + sizeof(EntryFooter_t);
+    bool     result = true;
+
+    if ( start < first_end )
+        result = ( encrypt ) ? record_crypto_encrypt ( &chunk[start - offset], first_end - start )
+                             : record_crypto_decrypt ( &chunk[start - offset], first_end - start );
+
+    if ( result && second_start < end )
+        result = ( encrypt ) ? record_crypto_encrypt ( &chunk[second_start - offset], end - second_start )
+                             : record_crypto_decrypt ( &chunk[second_start - offset], end - second_start );
+
+    if ( encrypt )
+    {
+        for ( uint32_t index = footer; index < footer + sizeof(EntryFooter_t); index++ )
+        {
+            if ( index >= offset && index < end )
+                chunk[index - offset] = 0xFF;
+        }
+    }
+
+    return result;
+}
+
+/**
+* Get the offset of the footer of a record
+*
+* \param	recordType		Record type
+*
+* \returns  Offset of the EntryFooter_t, 0 if the record type has no footer.
+*/
+uint32_t record_footer_offset ( uint8_t recordType )
+{
+    switch ( recordType )
+    {
+        case RecordTypeDatabaseHeader:
+            return HEADER_PROTECTED_OFFSET + HEADER_PROTECTED_SIZE;
+        case RecordTypeSessionHeader:
+            return SESSION_PROTECTED_OFFSET + SESSION_PROTECTED_SIZE;
+        case RecordTypeEKeyEntry:
+            return EKEY_PROTECTED_OFFSET + EKEY_PROTECTED_SIZE;
+        case RecordTypeUserPreferences:
+            return PREFERENCES_PROTECTED_OFFSET + PREFERENCES_PROTECTED_SIZE;
+        default:
+            return 0;
+    }
+}
+
+/**
+* Get the flash address of a block
+*
+* \param	block_ref		Block reference
+*
+* \returns  Address of the block in the memory device
+*/
+uint32_t block_address ( uint16_t block_ref )
+{
+uint8_t SuperBlock;
+uint8_t Block;
+
+	computeBlockRefsFromShortRef( block_ref, &SuperBlock, &Block );
+	return getSuperBlockOffset( SuperBlock ) + getBlockOffset ( Block );
+}
+
+/**
+* Append a record to the database log
+* If a version of the record already exists it is superseded without an
+* erase.  The old version is first flagged with the transaction indicator,
+* the new version is written and committed, and only then is the old version
+* deleted.  The new version carries a pending fill indicator until it has been
+* written completely, so a torn write is never indexed.  A power loss at any
+* point leaves exactly one complete version visible on rebuild.
+*
+* \param	data			Pointer to the record, starting with an EntryHeader_t
+* \param    length			Size of the record
+* \param	protect			true to encrypt and MAC a plaintext record, false to copy a record as is
+*
+* \returns  DATABASE_API_SUCCESS if successful.
+*           DATABASE_API_ERROR_FULL if no free block is available.
+*/
+uint32_t append_record ( uint8_t* data, uint32_t length, bool protect )
+{
+    EntryHeader_t* header = (EntryHeader_t*)data;
+    BlockRefType   OldBlock;
+    BlockRefType   NewBlock;
+    DBCURSOR       OldBlockRef = INVALID_BLOCKREF;
+    DBCURSOR       NewBlockRef;
+
+    if ( length > BLOCK_SIZE )
+        return DATABASE_API_ERROR;
+
+    if ( ! allocate_block ( &NewBlock ) )
+        return DATABASE_API_ERROR_FULL;
+    NewBlockRef = index_to_block_ref ( NewBlock );
+
+    /*
+     * Mark the current version as being superseded
+     */
+    if ( block_index_find ( header->block_entry.recordType, header->block_entry.UUID, &OldBlock ) )
+    {
+        OldBlockRef = index_to_block_ref ( OldBlock );
+        write_block_field ( OldBlockRef, offsetof(BlockEntry_t, ectInd), 0x00 );
+    }
+
+    /*
+     * Write the new version
+     */
+    header->block_entry.deleteInd = 0xFF;
+    header->block_entry.fillInd   = DB_FILL_PENDING;
+    header->block_entry.ectInd    = 0xFF;
+    if ( protect )
+        write_record ( NewBlockRef, data, length );
+    else
+        write_block ( NewBlockRef, data, length );
+
+    /*
+     * Commit the new version
+     */
+    write_block_field ( NewBlockRef, offsetof(BlockEntry_t, fillInd), 0x00 );
+    header->block_entry.fillInd   = 0x00;
+    block_index_insert ( header->block_entry.recordType, header->block_entry.UUID, NewBlock );
+
+    /*
+     * Invalidate the previous version
+     */
+    if ( OldBlockRef != INVALID_BLOCKREF )
+        write_block_field ( OldBlockRef, offsetof(BlockEntry_t, deleteInd), 0x00 );
+
+    return DATABASE_API_SUCCESS;
+}
+
+/**
+* Store a record
+* Cacheable records are held in the write-back cache, everything else is
+* appended to flash directly.  If every cache entry is waiting for its commit
+* the cache is flushed first.
+*
+* \param	data			Pointer to the record, starting with an EntryHeader_t
+* \param    length			Size of the record
+*
+* \returns  DATABASE_API_SUCCESS if successful.
+*           DATABASE_API_ERROR_FULL if no free block is available.
+*/
+uint32_t store_record ( uint8_t* data, uint32_t length )
+{
+    EntryHeader_t* header = (EntryHeader_t*)data;
+    uint32_t       result;
+
+    if ( ! record_cache_is_cacheable ( header->block_entry.recordType, length ) )
+    {
+        /*
+         * The flash version supersedes any cached one
+         */
+        record_cache_remove ( header->block_entry.recordType, header->block_entry.UUID );
+        return append_record ( data, length, true );
+    }
+
+    if ( record_cache_put ( data, length, true, (uint32_t)time_get_ticks (NULL) ) )
+        return DATABASE_API_SUCCESS;
+
+    result = cache_flush ();
+    if ( result != DATABASE_API_SUCCESS )
+        return result;
+
+    return ( record_cache_put ( data, length, true, (uint32_t)time_get_ticks (NULL) ) ) ? DATABASE_API_SUCCESS : DATABASE_API_ERROR;
+}
+
+/**
+* Check if a record exists in the cache or in flash
+*
+* \param	recordType		Record type
+* \param	uuid			Pointer to the record key
+*
+* \returns  true if the record exists.
+*/
+bool record_exists ( uint8_t recordType, uint8_t* uuid )
+{
+    return ( record_cache_find ( recordType, uuid ) != NULL || block_index_find ( recordType, uuid, NULL ) );
+}
+
+/**
+* Group commit of the write-back cache
+* Every dirty record is appended with the superseding protocol of
+* append_record, so a power loss during the commit leaves each record at
+* either its previous or its new version.
+*
+* \param	None
+*
+* \returns  DATABASE_API_SUCCESS if successful.
+*           DATABASE_API_ERROR_FULL if no free block is available.
+*/
+uint32_t cache_flush ( void )
+{
+    record_cache_entry_t* entry;
+    uint32_t count  = 0;
+    uint32_t result = DATABASE_API_SUCCESS;
+
+    while ( (entry = record_cache_next_dirty ()) != NULL )
+    {
+        result = append_record ( entry->data, entry->length, true );
+        if ( result != DATABASE_API_SUCCESS )
+            break;
+
+        record_cache_mark_clean ( entry );
+        count++;
+    }
+
+    if ( count != 0 )
+    {
+        cache_commits++;
+        cache_committed += count;
+    }
+
+    return result;
+}
+
+/**
+* Erase the entire database
+*
+* \param    ctx				Pointer to the service context
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_GENERAL if unable to perform the command.
+*/
+uint32_t bulk_erase (void)
+{
+	for ( uint32_t sector = 0; sector < DB_NUMBER_OF_SECTORS; sector++ )
+	{
+		serial_flash_sector_erase ( (uint32_t)(sector * DB_SECTOR_SIZE) );
+		sector_erases[sector]++;
+	}
+
+	/*
+	 * Every block is free after an erase
+	 */
+	block_index_reset ();
+
+	return DATABASE_API_SUCCESS;
+}
+
+/**
+* Build the block index from the block headers in flash.
+* This is the only place the whole database is scanned, all later lookups
+* and allocations are served from the index.
+*
+* A record flagged with the transaction indicator was being superseded when
+* power was lost.  It is only indexed if the new version never made it to
+* flash, otherwise it is invalidated here.
+*
+* \param	None
+*
+* \returns  DATABASE_API_SUCCESS if successful.
+*           DATABASE_API_ERROR_FULL if the index could not hold every record.
+*/
+uint32_t build_block_index ( void )
+{
+    DBCURSOR BlockRef;
+    BlockEntry_t blockEntry;
+    uint32_t result = DATABASE_API_SUCCESS;
+
+	block_index_reset ();
+
+	for ( uint32_t pass = 0; pass < 2; pass++ )
+	{
+		for ( uint32_t block = 0; block < MAX_BLOCKS; block++ )
+		{
+			/*
+			 * Skip the superblock tables
+			 */
+			if ( (block % ENTRIES_PER_TABLE) == 0 )
+				continue;
+
+			BlockRef = index_to_block_ref ( (BlockRefType)block );
+			if ( read_block ( BlockRef, (uint8_t*)&blockEntry, sizeof(BlockEntry_t) ) != sizeof(BlockEntry_t) )
+				continue;
+
+			/*
+			 * Blocks that have been written, including deleted and torn ones,
+			 * are not available until their sector is erased
+			 */
+			if ( blockEntry.fillInd == 0xFF )
+				continue;
+
+			block_index_mark_used ( (BlockRefType)block );
+
+			if ( (blockEntry.deleteInd != 0xFF) || (blockEntry.fillInd != 0x00) )
+				continue;
+
+			if ( (blockEntry.uuidSize != DATABASE_UUID_SIZE) && (blockEntry.recordType != RecordTypeDatabaseHeader) )
+				continue;
+
+			/*
+			 * Current versions are indexed in the first pass, interrupted
+			 * updates are resolved in the second
+			 */
+			if ( pass == 0 && blockEntry.ectInd == 0xFF )
+			{
+				if ( ! block_index_insert ( blockEntry.recordType, blockEntry.UUID, (BlockRefType)block ) )
+					result = DATABASE_API_ERROR_FULL;
+			}
+			else if ( pass == 1 && blockEntry.ectInd != 0xFF )
+			{
+				if ( block_index_find ( blockEntry.recordType, blockEntry.UUID, NULL ) )
+					write_block_field ( BlockRef, offsetof(BlockEntry_t, deleteInd), 0x00 );
+				else if ( ! block_index_insert ( blockEntry.recordType, blockEntry.UUID, (BlockRefType)block ) )
+					result = DATABASE_API_ERROR_FULL;
+			}
+		}
+	}
+
+	return result;
+}
+
+/**
+* Run one slice of the incremental garbage collector.
+* The sector with the most dead blocks is compacted by relocating at most
+* DATABASE_GC_SLICE_BLOCKS live blocks per call.  Once empty it is erased in
+* the background and released when a later call finds the erase complete.
+*
+* \param	None
+*
+* \returns  DATABASE_API_SUCCESS if there is nothing left to collect.
+*           DATABASE_API_STATUS_PENDING if a compaction is in progress.
+*           DATABASE_API_ERROR_FULL if a live block could not be relocated.
+*/
+uint32_t gc_step ( void )
+{
+	uint32_t relocated = 0;
+	uint32_t first;
+
+	switch ( gc_state )
+	{
+		case DB_GC_IDLE:
+			if ( gc_select_sector () != DATABASE_API_SUCCESS )
+				return DATABASE_API_SUCCESS;
+
+			/*
+			 * Reserve the free blocks of the victim so nothing new is written there
+			 */
+			first = gc_sector * DB_BLOCKS_PER_SECTOR;
+			for ( uint32_t block = first; block < first + DB_BLOCKS_PER_SECTOR; block++ )
+				block_index_mark_used ( (BlockRefType)block );
+
+			gc_block = first;
+			gc_state = DB_GC_RELOCATE;
+			break;
+
+		case DB_GC_RELOCATE:
+			first = gc_sector * DB_BLOCKS_PER_SECTOR;
+			while ( gc_block < first + DB_BLOCKS_PER_SECTOR && relocated < DATABASE_GC_SLICE_BLOCKS )
+			{
+				if ( block_index_is_live ( (BlockRefType)gc_block ) )
+				{
+					if ( gc_relocate_block ( (BlockRefType)gc_block ) != DATABASE_API_SUCCESS )
+						return DATABASE_API_ERROR_FULL;
+					relocated++;
+				}
+				gc_block++;
+			}
+
+			if ( gc_block >= first + DB_BLOCKS_PER_SECTOR )
+				gc_state = DB_GC_ERASE;
+			break;
+
+		case DB_GC_ERASE:
+			/*
+			 * The erase runs in the background, foreground accesses suspend it
+			 */
+			serial_flash_sector_erase_start ( (uint32_t)(gc_sector * DB_SECTOR_SIZE) );
+			gc_state = DB_GC_ERASING;
+			break;
+
+		case DB_GC_ERASING:
+			if ( serial_flash_erase_busy () )
+				break;
+
+			first = gc_sector * DB_BLOCKS_PER_SECTOR;
+			sector_erases[gc_sector]++;
+
+			/*
+			 * Restore the superblock tables and release the blocks
+			 */
+			for ( uint32_t block = first; block < first + DB_BLOCKS_PER_SECTOR; block++ )
+			{
+				if ( (block % ENTRIES_PER_TABLE) == 0 )
+					write_superblock_header ( getSuperBlockForBlock ( (BlockRefType)block ) );
+				else
+					block_index_mark_free ( (BlockRefType)block );
+			}
+
+			gc_compactions++;
+			gc_state = DB_GC_IDLE;
+			return DATABASE_API_SUCCESS;
+
+		default:
+			gc_state = DB_GC_IDLE;
+			return DATABASE_API_SUCCESS;
+	}
+
+	return DATABASE_API_STATUS_PENDING;
+}
+
+/**
+* Allocate a free block.
+* Blocks are taken from sectors already in use first, so the erased spare
+* sectors are only opened once everything else is full.  Among the sectors
+* that qualify the least worn one is chosen.  Records relocated for wear
+* leveling take the most worn sector instead.
+*
+* \param	block			Pointer to storage for the free block
+*
+* \returns  true if a free block was found.
+*/
+bool allocate_block ( BlockRefType* block )
+{
+	uint32_t best = allocation_sector ( DB_NUMBER_OF_SECTORS, wear_relocation );
+
+	if ( best == DB_NUMBER_OF_SECTORS )
+		return false;
+
+	return block_index_find_free_range ( best * DB_BLOCKS_PER_SECTOR, DB_BLOCKS_PER_SECTOR, block );
+}
+
+/**
+* Select the sector to allocate a block from.
+*
+* \param	exclude			Sector to leave out, or DB_NUMBER_OF_SECTORS
+* \param	most_worn		true for the most worn sector with a free block,
+*							false for the allocate_block order
+*
+* \returns  Sector number, DB_NUMBER_OF_SECTORS if no sector has a free block.
+*/
+uint32_t allocation_sector ( uint32_t exclude, bool most_worn )
+{
+	uint32_t best = DB_NUMBER_OF_SECTORS;
+	bool     best_spare = true;
+	bool     spare;
+
+	for ( uint32_t sector = 0; sector < DB_NUMBER_OF_SECTORS; sector++ )
+	{
+		if ( sector == exclude || block_index_range_free ( sector * DB_BLOCKS_PER_SECTOR, DB_BLOCKS_PER_SECTOR ) == 0 )
+			continue;
+
+		if ( most_worn )
+		{
+			if ( best == DB_NUMBER_OF_SECTORS || sector_erases[sector] > sector_erases[best] )
+				best = sector;
+			continue;
+		}
+
+		spare = is_spare_sector ( sector );
+		if ( best == DB_NUMBER_OF_SECTORS || (best_spare && ! spare) ||
+			 (best_spare == spare && sector_erases[sector] < sector_erases[best]) )
+		{
+			best       = sector;
+			best_spare = spare;
+		}
+	}
+
+	return best;
+}
+
+/**
+* Check if a sector is a spare.
+* Every block of a spare sector, other than its superblock tables, is free.
+*
+* \param	sector			Sector number
+*
+* \returns  true if the sector is erased and unused.
+*/
+bool is_spare_sector ( uint32_t sector )
+{
+	return ( block_index_range_free ( sector * DB_BLOCKS_PER_SECTOR, DB_BLOCKS_PER_SECTOR ) ==
+			 DB_BLOCKS_PER_SECTOR - (DB_BLOCKS_PER_SECTOR / ENTRIES_PER_TABLE) );
+}
+
+/**
+* Get the number of spare sectors.
+*
+* \param	None
+*
+* \returns  Number of erased and unused sectors.
+*/
+uint32_t spare_sector_count ( void )
+{
+	uint32_t count = 0;
+
+	for ( uint32_t sector = 0; sector < DB_NUMBER_OF_SECTORS; sector++ )
+	{
+		if ( is_spare_sector ( sector ) )
+			count++;
+	}
+	return count;
+}
+
+/**
+* Select the sector to compact.
+* While wear leveling is due the victim is the least worn sector, provided
+* moving its live blocks narrows the spread.  Otherwise the victim is the
+* sector with the most dead blocks whose live blocks fit in the free blocks
+* of the other sectors.
+*
+* \param	None
+*
+* \returns  DATABASE_API_SUCCESS if a sector was selected.
+*           DATABASE_API_ERROR_NO_GC_STRATEGY if there is nothing to collect.
+*/
+uint32_t gc_select_sector ( void )
+{
+	uint32_t best_dead = 0;
+	uint32_t total_free = block_index_free_count ();
+	uint32_t coldest;
+
+	gc_wear = false;
+
+	/*
+	 * Move the data off the least worn sector once the erase counts drift
+	 * too far apart, so it takes its share of the erases.  That only helps
+	 * if the data lands on a sector worn more than the erase it costs.
+	 */
+	if ( wear_level_due ( &coldest ) )
+	{
+		uint32_t first  = coldest * DB_BLOCKS_PER_SECTOR;
+		uint32_t free   = block_index_range_free ( first, DB_BLOCKS_PER_SECTOR );
+		uint32_t live   = block_index_range_live ( first, DB_BLOCKS_PER_SECTOR );
+		uint32_t target = allocation_sector ( coldest, true );
+
+		if ( live <= (total_free - free) &&
+			 (live == 0 || (target != DB_NUMBER_OF_SECTORS && sector_erases[target] > sector_erases[coldest] + 1)) )
+		{
+			gc_sector = coldest;
+			gc_wear   = true;
+			wear_levelings++;
+			return DATABASE_API_SUCCESS;
+		}
+
+		/*
+		 * Leave the spread alone until it has grown
+		 */
+		wear_leveling = false;
+		wear_stalled  = wear_spread ( NULL );
+	}
+
+	for ( uint32_t sector = 0; sector < DB_NUMBER_OF_SECTORS; sector++ )
+	{
+		uint32_t first = sector * DB_BLOCKS_PER_SECTOR;
+		uint32_t free  = block_index_range_free ( first, DB_BLOCKS_PER_SECTOR );
+		uint32_t live  = block_index_range_live ( first, DB_BLOCKS_PER_SECTOR );
+		uint32_t used  = DB_BLOCKS_PER_SECTOR - (DB_BLOCKS_PER_SECTOR / ENTRIES_PER_TABLE) - free;
+		uint32_t dead  = used - live;
+
+		/*
+		 * Ties go to the less worn sector
+		 */
+		if ( live <= (total_free - free) &&
+			 (dead > best_dead || (dead != 0 && dead == best_dead && sector_erases[sector] < sector_erases[gc_sector])) )
+		{
+			best_dead = dead;
+			gc_sector = sector;
+		}
+	}
+
+	return ( best_dead != 0 ) ? DATABASE_API_SUCCESS : DATABASE_API_ERROR_NO_GC_STRATEGY;
+}
+
+/**
+* Get the spread of the sector erase counts.
+* Spare sectors are left out of the least worn, they are the next to be
+* written anyway.
+*
+* \param	coldest			Pointer to storage for the least worn sector in use, or NULL
+*
+* \returns  Erase count of the most worn sector less that of the least worn sector in use.
+*/
+uint32_t wear_spread ( uint32_t* coldest )
+{
+	uint32_t most  = 0;
+	uint32_t least = 0;
+	bool     found = false;
+
+	for ( uint32_t sector = 0; sector < DB_NUMBER_OF_SECTORS; sector++ )
+	{
+		if ( sector_erases[sector] > most )
+			most = sector_erases[sector];
+
+		if ( ! is_spare_sector ( sector ) && (! found || sector_erases[sector] < sector_erases[least]) )
+		{
+			least = sector;
+			found = true;
+		}
+	}
+
+	if ( coldest != NULL )
+		*coldest = least;
+
+	return ( found ) ? most - sector_erases[least] : 0;
+}
+
+/**
+* Check if wear leveling is due.
+* Wear leveling starts once the erase count spread reaches
+* DATABASE_WEAR_LEVEL_THRESHOLD and carries on until the spread has dropped
+* DATABASE_WEAR_LEVEL_HYSTERESIS below it.  When no cold sector could be
+* moved it is not tried again before the spread has grown by another
+* DATABASE_WEAR_LEVEL_HYSTERESIS.
+*
+* \param	coldest			Pointer to storage for the least worn sector in use, or NULL
+*
+* \returns  true if the least worn sector should be relocated.
+*/
+bool wear_level_due ( uint32_t* coldest )
+{
+	uint32_t spread = wear_spread ( coldest );
+
+	if ( spread < DATABASE_WEAR_LEVEL_THRESHOLD )
+		wear_stalled = 0;
+
+	if ( wear_leveling )
+	{
+		if ( spread + DATABASE_WEAR_LEVEL_HYSTERESIS <= DATABASE_WEAR_LEVEL_THRESHOLD )
+			wear_leveling = false;
+	}
+	else if ( spread >= DATABASE_WEAR_LEVEL_THRESHOLD &&
+			  (wear_stalled == 0 || spread >= wear_stalled + DATABASE_WEAR_LEVEL_HYSTERESIS) )
+	{
+		wear_leveling = true;
+	}
+
+	return wear_leveling;
+}
+
+/**
+* Load the sector erase counts from the superblock headers.
+* A sector whose headers were lost to a power cut during its erase is given
+* the highest count found, and missing headers are rewritten.
+*
+* \param	None
+*
+* \returns  None
+*/
+void load_erase_counts ( void )
+{
+	SuperBlockHeader_t header;
+	bool     known[DB_NUMBER_OF_SECTORS];
+	uint32_t most = 0;
+
+	memset ( sector_erases, 0, sizeof(sector_erases) );
+	memset ( known, 0, sizeof(known) );
+
+	for ( uint32_t superBlock = 0; superBlock < SUPER_BLOCKS; superBlock++ )
+	{
+		uint32_t sector = superBlock / DB_SUPERBLOCKS_PER_SECTOR;
+
+		read_block ( blockRefsToShortRef( superBlock, 0 ), (uint8_t*)&header, sizeof(SuperBlockHeader_t) );
+		if ( header.fillInd != 0x00 || header.recordType != RecordTypeSuperBlock )
+			continue;
+
+		known[sector] = true;
+		if ( header.eraseCount != 0xFFFFFFFF && header.eraseCount > sector_erases[sector] )
+			sector_erases[sector] = header.eraseCount;
+		if ( sector_erases[sector] > most )
+			most = sector_erases[sector];
+	}
+
+	for ( uint32_t superBlock = 0; superBlock < SUPER_BLOCKS; superBlock++ )
+	{
+		uint32_t sector = superBlock / DB_SUPERBLOCKS_PER_SECTOR;
+
+		if ( ! known[sector] )
+			sector_erases[sector] = most;
+
+		read_block ( blockRefsToShortRef( superBlock, 0 ), (uint8_t*)&header, sizeof(SuperBlockHeader_t) );
+		if ( header.fillInd == 0xFF )
+			write_superblock_header ( (uint8_t)superBlock );
+	}
+}
+
+/**
+* Relocate a live block out of the sector being compacted
+*
+* \param	block			Block number
+*
+* \returns  DATABASE_API_SUCCESS if successful.
+*           DATABASE_API_ERROR_FULL if no free block is available.
+*/
+uint32_t gc_relocate_block ( BlockRefType block )
+{
+	EntryHeader_t* header = (EntryHeader_t*)gc_buffer;
+	DBCURSOR BlockRef = index_to_block_ref ( block );
+	uint32_t length;
+	uint32_t result;
+
+	read_block ( BlockRef, gc_buffer, sizeof(EntryHeader_t) );
+
+	/*
+	 * The length of a protected record is encrypted with it
+	 */
+	if ( header->block_entry.protInd == 0x00 &&
+		 ! (record_crypto_begin ( header ) && record_crypto_decrypt ( (uint8_t*)&header->encBytes, sizeof(header->encBytes) )) )
+		header->encBytes = BLOCK_SIZE;
+
+	length = header->encBytes;
+	if ( length < sizeof(EntryHeader_t) || length > BLOCK_SIZE )
+		length = BLOCK_SIZE;
+
+	/*
+	 * The record is moved as is, its IV and MAC do not depend on its location.
+	 * Cold records moved for wear leveling go to the most worn sector.
+	 */
+	read_block ( BlockRef, gc_buffer, length );
+	wear_relocation = gc_wear;
+	result = append_record ( gc_buffer, length, false );
+	wear_relocation = false;
+	if ( result != DATABASE_API_SUCCESS )
+		return DATABASE_API_ERROR_FULL;
+
+	gc_relocations++;
+	return DATABASE_API_SUCCESS;
+}
+
+/**
+* Convert a block reference to a block index block number
+*
+* \param	block_ref		Block reference
+*
+* \returns  Block number
+*/
+BlockRefType block_ref_to_index ( uint16_t block_ref )
+{
+uint8_t SuperBlock;
+uint8_t Block;
+
+	computeBlockRefsFromShortRef( block_ref, &SuperBlock, &Block );
+	return (BlockRefType)((SuperBlock * ENTRIES_PER_TABLE) + Block);
+}
+
+/**
+* Convert a block index block number to a block reference
+*
+* \param	block			Block number
+*
+* \returns  Block reference
+*/
+uint16_t index_to_block_ref ( BlockRefType block )
+{
+	return blockRefsToShortRef( getSuperBlockForBlock ( block ), block % ENTRIES_PER_TABLE );
+}
+
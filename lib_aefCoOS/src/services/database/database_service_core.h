@@ -33,25 +33,6 @@ extern "C" {
 
 #define INVALID_BLOCKREF					0xFFFF
 
-//The record management bytes include all bytes up to and including the IV.
-//There are only two bytes after the IV -- the encrypted bytes -- which must be
-//part of the encrypted payload and the AES-CBC-MAC payload as per proper
-//cryptographic use of these algorithms.  Therefore, this size should be
-//sizeof(EntryHeader) - sizeof(EntryHeader::encBytes)
-#define RECORD_MANAGEMENT_BYTES_SIZE (sizeof(EntryHeader_t) - sizeof(EntryHeader_t::encBytes))
-
-//The PROTECTED region covers all of the record EXCEPT the footer and the first two bytes
-#define HEADER_PROTECTED_SIZE ((sizeof(DatabaseHeader_t) - RECORD_MANAGEMENT_BYTES_SIZE) - sizeof(EntryFooter_t))
-#define HEADER_PROTECTED_OFFSET RECORD_MANAGEMENT_BYTES_SIZE
-
-//The PROTECTED region covers all of the session EXCEPT the footer and the first two bytes
-#define SESSION_PROTECTED_SIZE ((sizeof(SessionHeader_t) - RECORD_MANAGEMENT_BYTES_SIZE) - sizeof(EntryFooter_t))
-#define SESSION_PROTECTED_OFFSET RECORD_MANAGEMENT_BYTES_SIZE
-
-//The PROTECTED region covers all of the eKey EXCEPT the footer and the first two bytes
-#define EKEY_PROTECTED_SIZE ((sizeof(EKeyEntry_t) - RECORD_MANAGEMENT_BYTES_SIZE) - sizeof(EntryFooter_t))
-#define EKEY_PROTECTED_OFFSET RECORD_MANAGEMENT_BYTES_SIZE
-
 /**
  * Return codes for Device Database methods.
  */
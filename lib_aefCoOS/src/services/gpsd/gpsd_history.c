@@ -0,0 +1,284 @@
+
+/**
+* gpsd_history.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the GPSD fix history.
+*
+* Distances use a flat earth around the older fix, good to a fraction of a
+* percent over the distances a filter is set to, and no floating point.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "gpsd_history.h"
+
+#define GPSD_UM_PER_UNIT			11132	// Micrometers per 1e-7 degree of latitude
+#define GPSD_FULL_CIRCLE			36000	// Centidegrees
+#define GPSD_COS_SCALE				16		// Fraction bits of the cosine
+
+/**
+* Get the cosine of a latitude.
+* Bhaskara's approximation, within 0.002 of the cosine.
+*
+* \param    latitude	Latitude in 1e-7 degrees
+*
+* \returns  Cosine scaled by 2^GPSD_COS_SCALE.
+*/
+static int64_t gpsd_history_cos ( int32_t latitude )
+{
+	int64_t x = ( latitude < 0 ) ? -(int64_t)latitude : latitude;
+
+	x  = x / 100000;							// Centidegrees
+	x *= x;
+	return ( ( 324000000LL - 4 * x ) << GPSD_COS_SCALE ) / ( 324000000LL + x );
+}
+
+/**
+* Check if two fixes are a distance apart.
+*
+* \param    from		Pointer to the older fix
+* \param	to			Pointer to the newer fix
+* \param	distance	Distance (mm)
+*
+* \returns  true if the fixes are at least the distance apart.
+*/
+static bool gpsd_history_moved ( const gps_fix_int_t* from, const gps_fix_int_t* to, uint32_t distance )
+{
+	int64_t north = (int64_t)to->latitude - from->latitude;
+	int64_t east  = (int64_t)to->longitude - from->longitude;
+
+	/*
+	 * The shorter way round across the antimeridian
+	 */
+	if ( east > 1800000000LL )
+		east -= 3600000000LL;
+	else if ( east < -1800000000LL )
+		east += 3600000000LL;
+
+	north = north * GPSD_UM_PER_UNIT / 1000;
+	east  = ( ( east * GPSD_UM_PER_UNIT / 1000 ) * gpsd_history_cos ( from->latitude ) ) >> GPSD_COS_SCALE;
+	if ( north < 0 )
+		north = -north;
+	if ( east < 0 )
+		east = -east;
+
+	/*
+	 * Either way alone is far enough, else both are below 2^32 and the
+	 * halved squares add up without overflow
+	 */
+	if ( north >= distance || east >= distance )
+		return true;
+	return (uint64_t)north * (uint64_t)north / 2 + (uint64_t)east * (uint64_t)east / 2 >= (uint64_t)distance * distance / 2;
+}
+
+/**
+* Check a fix against the filter of a subscriber.
+*
+* \param    subscriber	Pointer to the subscriber
+* \param	fix			Pointer to the fix
+*
+* \returns  true if the fix passes the filter.
+*/
+static bool gpsd_history_passes ( const gpsd_subscriber_t* subscriber, const gps_fix_int_t* fix )
+{
+	const gpsd_subscribe_parms_t* parms = &subscriber->parms;
+	const gps_fix_int_t* last = &subscriber->last;
+	int32_t change;
+
+	if ( ! subscriber->has_last || fix->mode != last->mode )
+		return true;
+
+	if ( parms->distance == 0 && parms->heading == 0 && parms->speed == 0 )
+		return true;
+
+	if ( parms->distance != 0 && gpsd_history_moved ( last, fix, parms->distance ) )
+		return true;
+
+	if ( parms->heading != 0 )
+	{
+		change = ( fix->track - last->track ) % GPSD_FULL_CIRCLE;
+		if ( change < 0 )
+			change += GPSD_FULL_CIRCLE;
+		if ( change > GPSD_FULL_CIRCLE / 2 )
+			change = GPSD_FULL_CIRCLE - change;
+		if ( (uint32_t)change >= parms->heading )
+			return true;
+	}
+
+	if ( parms->speed != 0 )
+	{
+		change = fix->speed - last->speed;
+		if ( change < 0 )
+			change = -change;
+		if ( (uint32_t)change >= parms->speed )
+			return true;
+	}
+	return false;
+}
+
+/**
+* Empty the history and drop every subscriber.
+*
+* \param    history		Pointer to the history
+*
+* \returns  None
+*/
+void gpsd_history_reset ( gpsd_history_t* history )
+{
+	memset ( history, 0, sizeof(gpsd_history_t) );
+}
+
+/**
+* Add a fix to the history.
+* A fix with the time of the newest record updates that record.
+*
+* \param    history		Pointer to the history
+* \param	fix			Pointer to the fix
+* \param	ticks		Tick count the fix was decoded
+*
+* \returns  Subscribers to call back, bit n set for subscriber n + 1.
+*/
+uint32_t gpsd_history_add ( gpsd_history_t* history, const gps_fix_int_t* fix, uint64_t ticks )
+{
+	gpsd_fix_record_t* record = &history->record[( history->next - 1 ) % GPSD_HISTORY_SIZE];
+	uint32_t notify = 0;
+
+	if ( history->next == 0 || record->fix.time != fix->time )
+	{
+		record = &history->record[history->next % GPSD_HISTORY_SIZE];
+		record->sequence = history->next++;
+		record->ticks    = ticks;
+	}
+	record->fix = *fix;
+
+	/*
+	 * A callback held back by the interval goes out with the first fix
+	 * after it, passing the filter or not
+	 */
+	for ( uint32_t index = 0; index < GPSD_MAX_SUBSCRIBERS; index++ )
+	{
+		gpsd_subscriber_t* subscriber = &history->subscriber[index];
+
+		if ( ! subscriber->in_use || subscriber->parms.cbfunc == NULL )
+			continue;
+
+		if ( gpsd_history_passes ( subscriber, fix ) )
+			subscriber->pending = true;
+
+		if ( subscriber->pending && ( subscriber->notified == 0 || ticks - subscriber->notified >= subscriber->interval ) )
+		{
+			subscriber->pending  = false;
+			subscriber->notified = ticks;
+			notify |= 1UL << index;
+		}
+	}
+	return notify;
+}
+
+/**
+* Add a subscriber.
+* The subscriber reads the fixes added from now on.
+*
+* \param    history		Pointer to the history
+* \param	parms		Pointer to the filter and callback
+* \param	interval	Shortest time between two callbacks (ticks)
+*
+* \returns  Subscriber id, 0 if every entry is taken.
+*/
+uint32_t gpsd_history_subscribe ( gpsd_history_t* history, const gpsd_subscribe_parms_t* parms, uint64_t interval )
+{
+	for ( uint32_t index = 0; index < GPSD_MAX_SUBSCRIBERS; index++ )
+	{
+		gpsd_subscriber_t* subscriber = &history->subscriber[index];
+
+		if ( ! subscriber->in_use )
+		{
+			memset ( subscriber, 0, sizeof(gpsd_subscriber_t) );
+			subscriber->in_use   = true;
+			subscriber->cursor   = history->next;
+			subscriber->interval = interval;
+			subscriber->parms    = *parms;
+			return index + 1;
+		}
+	}
+	return 0;
+}
+
+/**
+* Remove a subscriber.
+*
+* \param    history		Pointer to the history
+* \param	id			Subscriber id
+*
+* \returns  true if the subscriber was found.
+*/
+bool gpsd_history_unsubscribe ( gpsd_history_t* history, uint32_t id )
+{
+	gpsd_subscriber_t* subscriber = gpsd_history_subscriber ( history, id );
+
+	if ( subscriber == NULL )
+		return false;
+
+	subscriber->in_use = false;
+	return true;
+}
+
+/**
+* Get a subscriber.
+*
+* \param    history		Pointer to the history
+* \param	id			Subscriber id
+*
+* \returns  Pointer to the subscriber, NULL if the id is not subscribed.
+*/
+gpsd_subscriber_t* gpsd_history_subscriber ( gpsd_history_t* history, uint32_t id )
+{
+	if ( id == 0 || id > GPSD_MAX_SUBSCRIBERS || ! history->subscriber[id - 1].in_use )
+		return NULL;
+
+	return &history->subscriber[id - 1];
+}
+
+/**
+* Read the fixes of a subscriber that pass its filter.
+* Fixes already overwritten are skipped, fixes failing the filter are
+* passed over.
+*
+* \param    history		Pointer to the history
+* \param	id			Subscriber id
+* \param	records		Pointer to storage for the records
+* \param	count		Records that fit in the storage
+*
+* \returns  Records read.
+*/
+uint32_t gpsd_history_read ( gpsd_history_t* history, uint32_t id, gpsd_fix_record_t* records, uint32_t count )
+{
+	gpsd_subscriber_t* subscriber = gpsd_history_subscriber ( history, id );
+	uint32_t read = 0;
+
+	if ( subscriber == NULL )
+		return 0;
+
+	if ( history->next - subscriber->cursor > GPSD_HISTORY_SIZE )
+		subscriber->cursor = history->next - GPSD_HISTORY_SIZE;
+
+	while ( read < count && subscriber->cursor != history->next )
+	{
+		const gpsd_fix_record_t* record = &history->record[subscriber->cursor % GPSD_HISTORY_SIZE];
+
+		subscriber->cursor++;
+		if ( gpsd_history_passes ( subscriber, &record->fix ) )
+		{
+			records[read++]      = *record;
+			subscriber->last     = record->fix;
+			subscriber->has_last = true;
+		}
+	}
+	return read;
+}
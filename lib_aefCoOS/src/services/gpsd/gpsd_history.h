@@ -0,0 +1,127 @@
+
+/**
+* gpsd_history.h
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the GPSD fix history.
+*
+* The last GPSD_HISTORY_SIZE fixes are kept in a ring, each subscriber has
+* its own read cursor into it, so a subscriber slower than the fix rate
+* reads the fixes it missed instead of only the latest one.  Sentences of
+* the same epoch update the newest record instead of adding one.  The
+* history does no locking, the GPSD core serializes every call.
+*/
+
+#ifndef SRC_SERVICES_GPSD_GPSD_HISTORY_H_
+#define SRC_SERVICES_GPSD_GPSD_HISTORY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <aef/embedded/service/gpsd/gpsd_service.h>
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+/**
+* GPSD subscriber structure definition
+*/
+typedef struct _gpsd_subscriber_def
+{
+	bool		 in_use;					// Entry is taken
+	bool		 pending;					// A fix passing the filter has not been notified
+	bool		 has_last;					// last holds a fix
+	uint32_t	 cursor;					// Sequence number of the next fix to look at
+	uint64_t	 interval;					// Shortest time between two callbacks (ticks)
+	uint64_t	 notified;					// Tick count of the last callback
+	gps_fix_int_t last;						// Last fix read, the filter reference
+	gpsd_subscribe_parms_t parms;			// Filter and callback
+} gpsd_subscriber_t;
+
+/**
+* GPSD fix history structure definition
+*/
+typedef struct _gpsd_history_def
+{
+	uint32_t	 next;						// Sequence number of the next fix added
+	gpsd_fix_record_t record[GPSD_HISTORY_SIZE];	// Fix ring
+	gpsd_subscriber_t subscriber[GPSD_MAX_SUBSCRIBERS];	// Subscribers
+} gpsd_history_t;
+
+/**
+* Empty the history and drop every subscriber.
+*
+* \param    history		Pointer to the history
+*
+* \returns  None
+*/
+void gpsd_history_reset ( gpsd_history_t* history );
+
+/**
+* Add a fix to the history.
+* A fix with the time of the newest record updates that record.
+*
+* \param    history		Pointer to the history
+* \param	fix			Pointer to the fix
+* \param	ticks		Tick count the fix was decoded
+*
+* \returns  Subscribers to call back, bit n set for subscriber n + 1.
+*/
+uint32_t gpsd_history_add ( gpsd_history_t* history, const gps_fix_int_t* fix, uint64_t ticks );
+
+/**
+* Add a subscriber.
+* The subscriber reads the fixes added from now on.
+*
+* \param    history		Pointer to the history
+* \param	parms		Pointer to the filter and callback
+* \param	interval	Shortest time between two callbacks (ticks)
+*
+* \returns  Subscriber id, 0 if every entry is taken.
+*/
+uint32_t gpsd_history_subscribe ( gpsd_history_t* history, const gpsd_subscribe_parms_t* parms, uint64_t interval );
+
+/**
+* Remove a subscriber.
+*
+* \param    history		Pointer to the history
+* \param	id			Subscriber id
+*
+* \returns  true if the subscriber was found.
+*/
+bool gpsd_history_unsubscribe ( gpsd_history_t* history, uint32_t id );
+
+/**
+* Get a subscriber.
+*
+* \param    history		Pointer to the history
+* \param	id			Subscriber id
+*
+* \returns  Pointer to the subscriber, NULL if the id is not subscribed.
+*/
+gpsd_subscriber_t* gpsd_history_subscriber ( gpsd_history_t* history, uint32_t id );
+
+/**
+* Read the fixes of a subscriber that pass its filter.
+* Fixes already overwritten are skipped, fixes failing the filter are
+* passed over.
+*
+* \param    history		Pointer to the history
+* \param	id			Subscriber id
+* \param	records		Pointer to storage for the records
+* \param	count		Records that fit in the storage
+*
+* \returns  Records read.
+*/
+uint32_t gpsd_history_read ( gpsd_history_t* history, uint32_t id, gpsd_fix_record_t* records, uint32_t count );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* SRC_SERVICES_GPSD_GPSD_HISTORY_H_ */
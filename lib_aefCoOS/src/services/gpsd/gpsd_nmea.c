@@ -0,0 +1,265 @@
+
+/**
+* gpsd_nmea.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the NMEA0183 sentence tokenizer.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "gpsd_nmea.h"
+
+#define NMEA_FIXED_LIMIT		100000000000000000LL	// Largest scaled value that can take another digit
+
+/**
+* Get the value of a hex digit.
+*
+* \param    c			Character
+*
+* \returns  Value of the digit, -1 if not a hex digit.
+*/
+static int32_t nmea_hex_value ( char c )
+{
+	if ( c >= '0' && c <= '9' )
+		return c - '0';
+	if ( c >= 'A' && c <= 'F' )
+		return c - 'A' + 10;
+	if ( c >= 'a' && c <= 'f' )
+		return c - 'a' + 10;
+	return -1;
+}
+
+/**
+* Split a sentence into fields and check its checksum.
+*
+* \param    sentence	Pointer to the sentence, starting with '$'
+* \param	length		Size of the sentence
+* \param	tokens		Pointer to storage for the fields
+*
+* \returns  true if the sentence is well formed and its checksum matches.
+*/
+bool nmea_tokenize ( const char* sentence, uint32_t length, nmea_sentence_t* tokens )
+{
+	uint8_t  checksum = 0;
+	uint32_t index;
+	int32_t  high, low;
+
+	if ( sentence == NULL || length < 2 || length > NMEA_MAX_SENTENCE || sentence[0] != '$' )
+		return false;
+
+	tokens->sentence = sentence;
+	tokens->count    = 1;
+	tokens->field[0].offset = 1;
+
+	for ( index = 1; index < length && sentence[index] != '*'; index++ )
+	{
+		char c = sentence[index];
+
+		if ( c == '\r' || c == '\n' || c == '$' || c == '\0' )
+			return false;
+
+		checksum ^= (uint8_t)c;
+		if ( c == ',' )
+		{
+			if ( tokens->count == NMEA_MAX_FIELDS )
+				return false;
+			tokens->field[tokens->count - 1].length = (uint8_t)( index - tokens->field[tokens->count - 1].offset );
+			tokens->field[tokens->count].offset = (uint8_t)( index + 1 );
+			tokens->count++;
+		}
+	}
+
+	/*
+	 * '*' and two hex digits must follow the last field
+	 */
+	if ( index + 2 >= length )
+		return false;
+
+	tokens->field[tokens->count - 1].length = (uint8_t)( index - tokens->field[tokens->count - 1].offset );
+	high = nmea_hex_value ( sentence[index + 1] );
+	low  = nmea_hex_value ( sentence[index + 2] );
+	return ( high >= 0 && low >= 0 && (uint8_t)( ( high << 4 ) | low ) == checksum );
+}
+
+/**
+* Check the address field of a sentence.
+*
+* \param    tokens		Pointer to the tokenized sentence
+* \param	address		Pointer to the NUL terminated address, "GPGGA" for example
+*
+* \returns  true if the address matches.
+*/
+bool nmea_is_sentence ( const nmea_sentence_t* tokens, const char* address )
+{
+	uint32_t length = strlen ( address );
+
+	return ( tokens->field[0].length == length && memcmp ( tokens->sentence + tokens->field[0].offset, address, length ) == 0 );
+}
+
+/**
+* Get the first character of a field.
+*
+* \param    tokens		Pointer to the tokenized sentence
+* \param	index		Field number
+*
+* \returns  The character, 0 if the field is empty or missing.
+*/
+char nmea_field_char ( const nmea_sentence_t* tokens, uint32_t index )
+{
+	if ( index >= tokens->count || tokens->field[index].length == 0 )
+		return 0;
+	return tokens->sentence[tokens->field[index].offset];
+}
+
+/**
+* Parse a decimal number to a scaled integer.
+*
+* \param    field		Pointer to the number, not NUL terminated
+* \param	length		Size of the number
+* \param	digits		Decimal digits to keep
+* \param	value		Pointer to storage for the value
+*
+* \returns  true if the number is well formed.
+*/
+static bool nmea_parse_fixed ( const char* field, uint32_t length, uint32_t digits, int64_t* value )
+{
+	int64_t  result   = 0;
+	uint32_t index    = 0;
+	uint32_t fraction = 0;
+	bool     negative = false;
+	bool     point    = false;
+	bool     round    = false;
+
+	if ( length != 0 && ( field[0] == '-' || field[0] == '+' ) )
+	{
+		negative = ( field[0] == '-' );
+		index++;
+	}
+	if ( index == length )
+		return false;
+
+	for ( ; index < length; index++ )
+	{
+		char c = field[index];
+
+		if ( c == '.' && ! point )
+		{
+			point = true;
+		}
+		else if ( c < '0' || c > '9' )
+		{
+			return false;
+		}
+		else if ( ! point || fraction < digits )
+		{
+			if ( result >= NMEA_FIXED_LIMIT )
+				return false;
+			result = result * 10 + ( c - '0' );
+			fraction += ( point ) ? 1 : 0;
+		}
+		else if ( fraction++ == digits )
+		{
+			round = ( c >= '5' );
+		}
+	}
+
+	for ( ; fraction < digits; fraction++ )
+	{
+		if ( result >= NMEA_FIXED_LIMIT )
+			return false;
+		result *= 10;
+	}
+	if ( round )
+	{
+		result++;
+	}
+	*value = ( negative ) ? -result : result;
+	return true;
+}
+
+/**
+* Get the value of a decimal field as a scaled integer.
+* Digits past the scale are rounded off, 12.3456 read with 3 digits is 12346.
+*
+* \param    tokens		Pointer to the tokenized sentence
+* \param	index		Field number
+* \param	digits		Decimal digits to keep (0 - 9)
+* \param	value		Pointer to storage for the value
+*
+* \returns  true if the field holds a number that fits, value is unchanged otherwise.
+*/
+bool nmea_field_fixed ( const nmea_sentence_t* tokens, uint32_t index, uint32_t digits, int32_t* value )
+{
+	int64_t result;
+
+	if ( index >= tokens->count || digits > 9 ||
+		 ! nmea_parse_fixed ( tokens->sentence + tokens->field[index].offset, tokens->field[index].length, digits, &result ) ||
+		 result > INT32_MAX || result < INT32_MIN )
+		return false;
+
+	*value = (int32_t)result;
+	return true;
+}
+
+/**
+* Get a latitude or longitude field in 1e-7 degrees.
+* The field is (d)ddmm.mmmm and the field after it holds the hemisphere,
+* south and west are negative.
+*
+* \param    tokens		Pointer to the tokenized sentence
+* \param	index		Field number of the coordinate
+* \param	value		Pointer to storage for the value
+*
+* \returns  true if the field holds a coordinate, value is unchanged otherwise.
+*/
+bool nmea_field_coordinate ( const nmea_sentence_t* tokens, uint32_t index, int32_t* value )
+{
+	int64_t  minutes;
+	int64_t  result;
+	char     hemisphere = nmea_field_char ( tokens, index + 1 );
+
+	if ( index >= tokens->count ||
+		 ! nmea_parse_fixed ( tokens->sentence + tokens->field[index].offset, tokens->field[index].length, 7, &minutes ) ||
+		 minutes < 0 || minutes > 18000 * 10000000LL )
+		return false;
+
+	/*
+	 * Whole degrees are the digits above the minutes
+	 */
+	result = ( minutes / 1000000000LL ) * 10000000LL + ( minutes % 1000000000LL + 30 ) / 60;
+	*value = (int32_t)( ( hemisphere == 'S' || hemisphere == 'W' ) ? -result : result );
+	return true;
+}
+
+/**
+* Get a hhmmss.sss time field in milliseconds since midnight.
+*
+* \param    tokens		Pointer to the tokenized sentence
+* \param	index		Field number
+* \param	value		Pointer to storage for the value
+*
+* \returns  true if the field holds a time, value is unchanged otherwise.
+*/
+bool nmea_field_time ( const nmea_sentence_t* tokens, uint32_t index, uint32_t* value )
+{
+	int32_t  time;
+	uint32_t hours, minutes, milliseconds;
+
+	if ( ! nmea_field_fixed ( tokens, index, 3, &time ) || time < 0 )
+		return false;
+
+	hours        = (uint32_t)time / 10000000;
+	minutes      = (uint32_t)time / 100000 % 100;
+	milliseconds = (uint32_t)time % 100000;
+	if ( hours > 23 || minutes > 59 || milliseconds > 60999 )
+		return false;
+
+	*value = ( hours * 60 + minutes ) * 60000 + milliseconds;
+	return true;
+}
@@ -0,0 +1,129 @@
+
+/**
+* gpsd_nmea.h
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the NMEA0183 sentence tokenizer.
+*
+* A sentence is split into fields in one pass, which also computes the XOR
+* checksum of the characters between '$' and '*'.  A sentence whose
+* checksum does not match is rejected.  Fields are views into the sentence,
+* a field ends at the ',' or '*' following it.  Numeric fields are read
+* as scaled integers, so no floating point is used.
+*/
+
+#ifndef SRC_SERVICES_GPSD_GPSD_NMEA_H_
+#define SRC_SERVICES_GPSD_GPSD_NMEA_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+#ifndef NMEA_MAX_FIELDS
+	#define NMEA_MAX_FIELDS				24		// Most fields in a sentence, including the address field
+#endif
+
+#ifndef NMEA_MAX_SENTENCE
+	#define NMEA_MAX_SENTENCE			192		// Longest sentence accepted, including "\r\n"
+#endif
+
+/**
+* NMEA0183 field view structure definition
+*/
+typedef struct _nmea_field_def
+{
+	uint8_t		 offset;					// Offset of the field in the sentence
+	uint8_t		 length;					// Size of the field, 0 if empty
+} nmea_field_t;
+
+/**
+* NMEA0183 tokenized sentence structure definition
+*/
+typedef struct _nmea_sentence_def
+{
+	const char*	 sentence;					// Sentence starting with '$'
+	uint32_t	 count;						// Fields found, field 0 is the address
+	nmea_field_t field[NMEA_MAX_FIELDS];	// Field views
+} nmea_sentence_t;
+
+/**
+* Split a sentence into fields and check its checksum.
+*
+* \param    sentence	Pointer to the sentence, starting with '$'
+* \param	length		Size of the sentence
+* \param	tokens		Pointer to storage for the fields
+*
+* \returns  true if the sentence is well formed and its checksum matches.
+*/
+bool nmea_tokenize ( const char* sentence, uint32_t length, nmea_sentence_t* tokens );
+
+/**
+* Check the address field of a sentence.
+*
+* \param    tokens		Pointer to the tokenized sentence
+* \param	address		Pointer to the NUL terminated address, "GPGGA" for example
+*
+* \returns  true if the address matches.
+*/
+bool nmea_is_sentence ( const nmea_sentence_t* tokens, const char* address );
+
+/**
+* Get the first character of a field.
+*
+* \param    tokens		Pointer to the tokenized sentence
+* \param	index		Field number
+*
+* \returns  The character, 0 if the field is empty or missing.
+*/
+char nmea_field_char ( const nmea_sentence_t* tokens, uint32_t index );
+
+/**
+* Get the value of a decimal field as a scaled integer.
+* Digits past the scale are rounded off, 12.3456 read with 3 digits is 12346.
+*
+* \param    tokens		Pointer to the tokenized sentence
+* \param	index		Field number
+* \param	digits		Decimal digits to keep (0 - 9)
+* \param	value		Pointer to storage for the value
+*
+* \returns  true if the field holds a number that fits, value is unchanged otherwise.
+*/
+bool nmea_field_fixed ( const nmea_sentence_t* tokens, uint32_t index, uint32_t digits, int32_t* value );
+
+/**
+* Get a latitude or longitude field in 1e-7 degrees.
+* The field is (d)ddmm.mmmm and the field after it holds the hemisphere,
+* south and west are negative.
+*
+* \param    tokens		Pointer to the tokenized sentence
+* \param	index		Field number of the coordinate
+* \param	value		Pointer to storage for the value
+*
+* \returns  true if the field holds a coordinate, value is unchanged otherwise.
+*/
+bool nmea_field_coordinate ( const nmea_sentence_t* tokens, uint32_t index, int32_t* value );
+
+/**
+* Get a hhmmss.sss time field in milliseconds since midnight.
+*
+* \param    tokens		Pointer to the tokenized sentence
+* \param	index		Field number
+* \param	value		Pointer to storage for the value
+*
+* \returns  true if the field holds a time, value is unchanged otherwise.
+*/
+bool nmea_field_time ( const nmea_sentence_t* tokens, uint32_t index, uint32_t* value );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* SRC_SERVICES_GPSD_GPSD_NMEA_H_ */
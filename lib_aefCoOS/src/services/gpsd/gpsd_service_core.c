@@ -13,6 +13,9 @@
 */
 
 #include "gpsd_service_core.h"
+#include "gpsd_nmea.h"
+#include "gpsd_ubx.h"
+#include "gpsd_history.h"
 
 #include <aef/embedded/driver/device_manager.h>
 #include <aef/embedded/driver/stream_driver.h>
@@ -20,6 +23,10 @@
 #include <aef/embedded/system/system_core.h>
 #include <aef/embedded/system/system_management.h>
 #include <aef/embedded/osal/event.h>
+#include <aef/embedded/osal/critical_section.h>
+#include <aef/embedded/osal/time.h>
+#include <aef/embedded/osal/thread.h>
+#include <aef/embedded/osal/time_delay.h>
 #include <aef/cutils/hexstring.h>
 #include "string.h"
 #include "stdlib.h"
@@ -39,15 +46,26 @@ static service_status_t gpsd_core_enable_callback (service_ctx_t* ctx);
 static service_status_t gpsd_core_disable_callback (service_ctx_t* ctx);
 static service_status_t gpsd_core_poll (service_ctx_t* ctx, void* buffer, uint32_t length, uint32_t* bytes_read);
 
-static void gpsd_core_process_nmea (service_ctx_t* ctx, int8_t* NMEAStream, gps_fix_t* gps_fix_data);
+static service_status_t gpsd_core_poll_fix (service_ctx_t* ctx, void* buffer, uint32_t length, uint32_t* bytes_read);
+static void gpsd_core_process_nmea (service_ctx_t* ctx, const char* NMEAStream, uint32_t length, gps_fix_int_t* gps_fix_data);
+static void gpsd_core_process_ubx (service_ctx_t* ctx, const ubx_parser_t* frame, gps_fix_int_t* gps_fix_data);
+static service_status_t gpsd_core_set_protocol (service_ctx_t* ctx, void* buffer, uint32_t length);
+static bool gpsd_core_send_ubx (const uint8_t* frame, uint32_t length);
+static void gpsd_core_notify (const gps_fix_int_t* gps_fix_data);
+static service_status_t gpsd_core_subscribe (service_ctx_t* ctx, void* input_buffer, uint32_t input_size, void* output_buffer, uint32_t output_size, uint32_t* bytes_read);
+static service_status_t gpsd_core_unsubscribe (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+static service_status_t gpsd_core_read_fixes (service_ctx_t* ctx, void* input_buffer, uint32_t input_size, void* output_buffer, uint32_t output_size, uint32_t* bytes_read);
 
-static void NMEA_nmeaToDegreesLatLong ( gps_fix_t* gps_fix_data );
-static uint8_t NMEA0183_ExtractData (int8_t* pGPSStream, gps_fix_t* pGPSData);
-static void NMEA0183_ExtractGGA (int8_t* NMEAStream, gps_fix_t* gps_fix_data);
-static void NMEA0183_ExtractRMC (int8_t* NMEAStream, gps_fix_t* gps_fix_data);
+static bool NMEA0183_ExtractData (const char* NMEAStream, uint32_t length, gps_fix_int_t* gps_fix_data);
+static void NMEA0183_ExtractGGA (const nmea_sentence_t* tokens, gps_fix_int_t* gps_fix_data);
+static void NMEA0183_ExtractRMC (const nmea_sentence_t* tokens, gps_fix_int_t* gps_fix_data);
 
 static bool gpsd_core_encode (char c);
-static bool GetField (uint8_t *pData, uint8_t *pField, int nFieldNum, int nMaxFieldLen);
+
+static bool gpsd_reader_start (service_ctx_t* ctx);
+static void gpsd_reader_stop (void);
+static void gpsd_reader_task (void* instance);
+static uint32_t gpsd_reader_ticks (uint32_t ms);
 
 /**
 * Service context variables
@@ -59,18 +77,21 @@ static gpsd_init_parms_t gpsd_parms;
 static uint32_t baudRate = 9600;
 static bool cb_enabled_flag = FALSE;
 static event_ctx_t gpsd_event;
+static thread_ctx_t gpsd_reader;
+static volatile bool gpsd_reader_stopping = FALSE;
+static volatile bool gpsd_reader_stopped = FALSE;
+static volatile uint32_t gpsd_reader_wait;
 
 /**
 * Local variables
 */
-static char  GPSMid[10];
-static int8_t  NMEAString[192];
+static char  NMEAString[NMEA_MAX_SENTENCE + 1];
 //static int8_t  localBuffer[192];
-static uint8_t ucData[30];
-static uint8_t gpsd_ucNS;
-static uint8_t gpsd_ucEW;
 static uint16_t gpsd_encodedCharCount = 0;
-static gps_fix_t gps_fix_data;
+static gps_fix_int_t gps_fix_data;
+static ubx_parser_t gpsd_ubx;
+static gpsd_history_t gpsd_history;
+static critical_section_ctx_t gpsd_history_cs;	// Guards gps_fix_data and gpsd_history
 
 /**
 * NMEA0183 message identifiers
@@ -79,7 +100,6 @@ static gps_fix_t gps_fix_data;
 #define GPS_GLL_MSG             "GPGGL"         // Global position - Latitude/Longitude
 #define GPS_RMC_MSG             "GPRMC"         // Recommended minimum specific BNSS data
 
-#define GPS_MID_SIZE            6               // GPS MID identifier size
 #define GPS_PREAMBLE            0xFA            // GPS packet identifier
 
 /**
@@ -122,8 +142,11 @@ static gps_fix_t gps_fix_data;
 * GPSD service task
 *
 * This is a system management task routine.
-* This routine is registered with the system management task.
-* The system management task will call this routine to run the GPSD service
+* This routine is registered with the system management task, or run by the
+* reader task when GPSD_READER_THREAD is set.
+* Everything the UART has received is taken GPSD_READ_SIZE bytes per driver
+* call.  Bytes that are not part of a UBX frame are assembled into NMEA
+* sentences.
 *
 * \param    instance		Pointer to instance data
 *
@@ -134,33 +157,135 @@ static void gpsd_service_task ( void* instance )
 	if ( instance != NULL )
 	{
 		service_ctx_t* ctx = (service_ctx_t*)instance;
+		char stream[GPSD_READ_SIZE];
+		uint32_t bytes_read;
 
 		/**
 		* Read serial stream from GPS device
 		*/
-		uint32_t stream_size;
-		int8_t stream_char;
-		gpsd_uart_drv->iocontrol ( uart_ctx, IOCTL_UART_CHARPRESENT, NULL, 0, NULL, 0, &stream_size );
-
-		while ( stream_size )
+		do
 		{
-			uint32_t bytes_read;
-			gpsd_uart_drv->read ( uart_ctx, &stream_char, 1, &bytes_read );
-			if ( gpsd_core_encode ( stream_char ) )
+			bytes_read = 0;
+			gpsd_uart_drv->iocontrol ( uart_ctx, IOCTL_UART_READAVAIL, NULL, 0, stream, sizeof(stream), &bytes_read );
+
+			for ( uint32_t index = 0; index < bytes_read; index++ )
 			{
-				/**
-				* Process NMEA string
-				*/
-				gpsd_core_process_nmea ( ctx, NMEAString, &gps_fix_data );
+				uint32_t frame = ubx_parse ( &gpsd_ubx, (uint8_t)stream[index] );
+
+				if ( frame == UBX_PARSE_FRAME )
+				{
+					/**
+					* Process UBX frame
+					*/
+					gpsd_core_process_ubx ( ctx, &gpsd_ubx, &gps_fix_data );
+				}
+				else if ( frame == UBX_PARSE_NONE && gpsd_core_encode ( stream[index] ) )
+				{
+					/**
+					* Process NMEA string
+					*/
+					gpsd_core_process_nmea ( ctx, NMEAString, gpsd_encodedCharCount, &gps_fix_data );
+				}
 			}
-			--stream_size;
-		}
+		} while ( bytes_read == sizeof(stream) );
 	}
 	return;
 }
 
+/**
+* Start the GPSD reader task
+*
+* \param    ctx				Pointer to the service context
+*
+* \returns  TRUE if the reader task is running.
+*/
+static bool gpsd_reader_start ( service_ctx_t* ctx )
+{
+	gpsd_reader_stopping = FALSE;
+	gpsd_reader_stopped  = FALSE;
+	gpsd_reader_wait     = gpsd_reader_ticks ( GPSD_READER_TIMEOUT );
+	if ( thread_create ( &gpsd_reader,
+						 GPSD_READER_STACK_SIZE,
+						 DEFAULT_QUANTUM,
+						 GPSD_READER_PRIORITY,
+						 0,
+						 gpsd_reader_task,
+						 (uint32_t)(uintptr_t)ctx ) == SYSTEM_STATUS_SUCCESS )
+	{
+		thread_start ( &gpsd_reader );
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+* Stop the GPSD reader task
+*
+* Waits for the reader task to finish the pass it is running, so the UART
+* can be closed afterwards.
+*
+* \returns  none
+*/
+static void gpsd_reader_stop ( void )
+{
+	gpsd_reader_stopping = TRUE;
+	event_signal ( &gpsd_event );
+	while ( ! gpsd_reader_stopped )
+	{
+		time_delay ( 1 );
+	}
+	thread_destroy ( &gpsd_reader );
+}
+
+/**
+* GPSD reader task
+*
+* Runs the GPSD service task when GPSD_READER_THREAD is set.  The UART is
+* opened in line mode, so the receive interrupt signals the GPSD event at
+* the end of each sentence and the task sleeps until then.  The timeout
+* catches a stream with no line ends filling the receive buffer, and is
+* GPSD_UBX_POLL while the receiver outputs UBX frames.
+*
+* \param    instance		Pointer to the service context
+*
+* \returns  none
+*/
+static void gpsd_reader_task ( void* instance )
+{
+	while ( ! gpsd_reader_stopping )
+	{
+		event_wait_single ( &gpsd_event, gpsd_reader_wait );
+		gpsd_service_task ( instance );
+	}
+
+	/**
+	* Wait here to be destroyed
+	*/
+	gpsd_reader_stopped = TRUE;
+	for ( ;; )
+	{
+		thread_suspend ( &gpsd_reader );
+	}
+}
+
+/**
+* Convert a reader task timeout to ticks
+* The event wait hands the timeout to the kernel as is.
+*
+* \param    ms				Timeout (ms)
+*
+* \returns  Timeout in ticks, at least 1.
+*/
+static uint32_t gpsd_reader_ticks ( uint32_t ms )
+{
+	uint32_t ticks = ( ms * CFG_SYSTICK_FREQ + 999 ) / 1000;
+
+	return ( ticks != 0 ) ? ticks : 1;
+}
+
 /**
 * Encode characters from the NMEA data stream.
+* A sentence longer than NMEA_MAX_SENTENCE is dropped.
 *
 * \param    c				Character to encode
 *
@@ -171,6 +296,11 @@ bool gpsd_core_encode(char c)
 {
 	bool returnCode = FALSE;
 
+	if ( c != '$' && gpsd_encodedCharCount >= NMEA_MAX_SENTENCE )
+	{
+		return FALSE;
+	}
+
 	switch(c)
 	{
 		case '\n': // sentence end
@@ -208,8 +338,9 @@ service_status_t gpsd_core_init (service_ctx_t* ctx)
 		device_manager_vtable_t* device_manager = system_get_device_manager();
 		gpsd_uart_drv = device_manager->getdevice(uart_device_drv_id);
 
-		if ( gpsd_uart_drv )
+		if ( gpsd_uart_drv && critical_section_create (&gpsd_history_cs) == SYSTEM_STATUS_SUCCESS )
 		{
+			gpsd_history_reset ( &gpsd_history );
 			ctx->state = SERVICE_START_PENDING;
 			return SERVICE_STATUS_SUCCESS;
 		}
@@ -294,6 +425,21 @@ gpsd_core_ioctl (service_ctx_t* ctx, uint32_t code, void* input_buffer, uint32_t
 		case IOCTL_GPSD_POLL:
 			status = gpsd_core_poll(ctx, output_buffer, output_size, bytes_transferred);
 			break;
+		case IOCTL_GPSD_POLL_FIX:
+			status = gpsd_core_poll_fix(ctx, output_buffer, output_size, bytes_transferred);
+			break;
+		case IOCTL_GPSD_SET_PROTOCOL:
+			status = gpsd_core_set_protocol(ctx, input_buffer, input_size);
+			break;
+		case IOCTL_GPSD_SUBSCRIBE:
+			status = gpsd_core_subscribe(ctx, input_buffer, input_size, output_buffer, output_size, bytes_transferred);
+			break;
+		case IOCTL_GPSD_UNSUBSCRIBE:
+			status = gpsd_core_unsubscribe(ctx, input_buffer, input_size);
+			break;
+		case IOCTL_GPSD_READ_FIXES:
+			status = gpsd_core_read_fixes(ctx, input_buffer, input_size, output_buffer, output_size, bytes_transferred);
+			break;
 		default:
 			break;
 	}
@@ -322,25 +468,44 @@ service_status_t gpsd_core_start (service_ctx_t* ctx)
 
 			uart_config_parms_t config;
 			memset ( &gpsd_parms, 0, sizeof(gpsd_init_parms_t) );
-			memset ( &gps_fix_data, 0, sizeof(gps_fix_t) );
+			memset ( &gps_fix_data, 0, sizeof(gps_fix_int_t) );
+			ubx_parser_reset ( &gpsd_ubx );
 
-//			event_create (&gpsd_event, "GPSD_EVENT", FALSE, FALSE);
+			memset ( &gpsd_event, 0, sizeof(event_ctx_t) );
+			if ( event_create (&gpsd_event, "GPSD_EVENT", FALSE, FALSE) != SYSTEM_STATUS_SUCCESS )
+			{
+				ctx->state = SERVICE_DISABLED;
+				return SERVICE_FAILURE_GENERAL;
+			}
 
 			config.event_handle = &gpsd_event;
 			config.baud         = baudRate;
 			config.size		    = 8;
 			config.parity       = 0;
 			config.stop_bits    = 1;
-			uart_ctx = gpsd_uart_drv->open(pname, UARTMODE_RAW, (uint32_t)&config );
+			uart_ctx = gpsd_uart_drv->open(pname, ( GPSD_READER_THREAD ) ? UARTMODE_LINE : UARTMODE_RAW, (uint32_t)&config );
 			if (uart_ctx)
 			{
 				/**
-				* Register the GPSD system management task
+				* Start the reader task, or register the GPSD system management task
 				*/
-	            system_management_func_attach (ctx->name, ctx, gpsd_service_task);
-				ctx->state = SERVICE_RUNNING;
-				return SERVICE_STATUS_SUCCESS;
+				if ( GPSD_READER_THREAD )
+				{
+					if ( gpsd_reader_start (ctx) )
+					{
+						ctx->state = SERVICE_RUNNING;
+						return SERVICE_STATUS_SUCCESS;
+					}
+					gpsd_uart_drv->close (uart_ctx);
+				}
+				else
+				{
+		            system_management_func_attach (ctx->name, ctx, gpsd_service_task);
+					ctx->state = SERVICE_RUNNING;
+					return SERVICE_STATUS_SUCCESS;
+				}
 			}
+			event_destroy ( &gpsd_event );
 			ctx->state = SERVICE_DISABLED;
 			gpsd_encodedCharCount = 0;
 			return SERVICE_FAILURE_GENERAL;
@@ -388,11 +553,14 @@ service_status_t gpsd_core_stop (service_ctx_t* ctx)
 	if ( ctx != NULL && ctx->state == SERVICE_RUNNING )
 	{
 		/**
-		* Deregister the GPSD system management task
+		* Stop the reader task, or deregister the GPSD system management task
 		*/
-//		event_destroy ( &gpsd_event );
-        system_management_func_detach (gpsd_service_task);
+		if ( GPSD_READER_THREAD )
+			gpsd_reader_stop ();
+		else
+	        system_management_func_detach (gpsd_service_task);
 		gpsd_uart_drv->close (uart_ctx);
+		event_destroy ( &gpsd_event );
 		ctx->state = SERVICE_STOPPED;
 		return SERVICE_STATUS_SUCCESS;
 	}
@@ -515,9 +683,10 @@ service_status_t gpsd_core_disable_callback (service_ctx_t* ctx)
 
 /**
 * Poll the GPSD service.
+* The fix is converted to a gps_fix_t.
 *
 * \param    ctx				Pointer to the service context
-* \param	buffer			Pointer to GPSD service output data (NMEA or gpsData_t)
+* \param	buffer			Pointer to GPSD service output data (gps_fix_t)
 * \param	length			Size of output data
 * \param	bytes_read		Pointer to the number of bytes returned
 *
@@ -529,7 +698,9 @@ service_status_t gpsd_core_poll (service_ctx_t* ctx, void* buffer, uint32_t leng
 {
 	if ( ctx != NULL && buffer != NULL && length >= sizeof(gps_fix_t) )
 	{
-		memcpy ( buffer, &gps_fix_data, sizeof(gps_fix_t) );
+		critical_section_acquire ( &gpsd_history_cs );
+		gpsd_fix_to_double ( &gps_fix_data, (gps_fix_t*)buffer );
+		critical_section_release ( &gpsd_history_cs );
 		if ( bytes_read != NULL )
 			*bytes_read = sizeof(gps_fix_t);
 		return SERVICE_STATUS_SUCCESS;
@@ -537,21 +708,287 @@ service_status_t gpsd_core_poll (service_ctx_t* ctx, void* buffer, uint32_t leng
 	return SERVICE_FAILURE_GENERAL;
 }
 
+/**
+* Poll the GPSD service for the fix in integer units.
+*
+* \param    ctx				Pointer to the service context
+* \param	buffer			Pointer to GPSD service output data (gps_fix_int_t)
+* \param	length			Size of output data
+* \param	bytes_read		Pointer to the number of bytes returned
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_GENERAL if unsuccessful.
+*           SERVICE_FAILURE_INVALID_PARAMETER if an invalid parameter.
+*/
+service_status_t gpsd_core_poll_fix (service_ctx_t* ctx, void* buffer, uint32_t length, uint32_t* bytes_read)
+{
+	if ( ctx != NULL && buffer != NULL && length >= sizeof(gps_fix_int_t) )
+	{
+		critical_section_acquire ( &gpsd_history_cs );
+		memcpy ( buffer, &gps_fix_data, sizeof(gps_fix_int_t) );
+		critical_section_release ( &gpsd_history_cs );
+		if ( bytes_read != NULL )
+			*bytes_read = sizeof(gps_fix_int_t);
+		return SERVICE_STATUS_SUCCESS;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Select the protocol the receiver outputs.
+* The receiver is switched with UBX configuration messages.  A new baud rate
+* is sent at the current one, and the UART follows once the message is out.
+*
+* \param    ctx				Pointer to the service context
+* \param	buffer			Pointer to protocol parameters (gpsd_protocol_parms_t)
+* \param	length			Size of protocol parameters
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_GENERAL if unsuccessful.
+*           SERVICE_FAILURE_INCORRECT_MODE if the service is not running.
+*           SERVICE_FAILURE_INVALID_PARAMETER if an invalid parameter.
+*/
+service_status_t gpsd_core_set_protocol (service_ctx_t* ctx, void* buffer, uint32_t length)
+{
+	if ( ctx != NULL && buffer != NULL && length == sizeof(gpsd_protocol_parms_t) )
+	{
+		gpsd_protocol_parms_t* parms = (gpsd_protocol_parms_t*)buffer;
+		bool ubx = ( parms->protocol == GPSD_PROTOCOL_UBX );
+		uint32_t baud = ( parms->baud != 0 ) ? parms->baud : baudRate;
+		uint8_t frame[UBX_CFG_MAX_FRAME];
+
+		if ( ctx->state != SERVICE_RUNNING )
+			return SERVICE_FAILURE_INCORRECT_MODE;
+
+		if ( parms->protocol > GPSD_PROTOCOL_UBX || parms->period > UINT16_MAX )
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+
+		/**
+		* Output protocol and baud rate
+		*/
+		if ( ! gpsd_core_send_ubx ( frame, ubx_cfg_prt ( frame, baud, ubx ) ) )
+			return SERVICE_FAILURE_GENERAL;
+
+		if ( baud != baudRate )
+		{
+			uart_config_parms_t config;
+
+			/**
+			* Let the characters still in the transmit FIFO go out
+			*/
+			gpsd_uart_drv->iocontrol ( uart_ctx, IOCTL_UART_WAITFORDONE, NULL, 0, NULL, 0, NULL );
+			time_delay ( 80000 / baudRate + 1 );
+
+			memset ( &config, 0, sizeof(uart_config_parms_t) );
+			config.baud      = baud;
+			config.size      = 8;
+			config.parity    = 0;
+			config.stop_bits = 1;
+			if ( gpsd_uart_drv->iocontrol ( uart_ctx, IOCTL_UART_INITIALIZE, &config, sizeof(uart_config_parms_t), NULL, 0, NULL ) != DRIVER_STATUS_SUCCESS )
+				return SERVICE_FAILURE_GENERAL;
+			baudRate = baud;
+		}
+
+		/**
+		* NAV-PVT every solution, NAV-SAT every GPSD_UBX_SAT_RATE solutions
+		*/
+		gpsd_core_send_ubx ( frame, ubx_cfg_msg ( frame, UBX_CLASS_NAV, UBX_NAV_PVT, ubx ? 1 : 0 ) );
+		gpsd_core_send_ubx ( frame, ubx_cfg_msg ( frame, UBX_CLASS_NAV, UBX_NAV_SAT, ubx ? GPSD_UBX_SAT_RATE : 0 ) );
+
+		if ( parms->period != 0 )
+			gpsd_core_send_ubx ( frame, ubx_cfg_rate ( frame, (uint16_t)parms->period ) );
+
+		gpsd_reader_wait = gpsd_reader_ticks ( ubx ? GPSD_UBX_POLL : GPSD_READER_TIMEOUT );
+		return SERVICE_STATUS_SUCCESS;
+	}
+	return SERVICE_FAILURE_INVALID_PARAMETER;
+}
+
+/**
+* Send a UBX frame to the receiver.
+*
+* \param    frame			Pointer to the frame
+* \param	length			Size of the frame
+*
+* \returns  TRUE if the whole frame was written.
+*/
+bool gpsd_core_send_ubx (const uint8_t* frame, uint32_t length)
+{
+	uint32_t written = 0;
+
+	gpsd_uart_drv->write ( uart_ctx, (void*)frame, length, &written );
+	return ( written == length );
+}
+
+/**
+* Subscribe to the fix history.
+*
+* \param    ctx				Pointer to the service context
+* \param	input_buffer	Pointer to subscription parameters (gpsd_subscribe_parms_t)
+* \param	input_size		Size of subscription parameters
+* \param	output_buffer	Pointer to storage for the subscriber id (uint32_t)
+* \param	output_size		Size of the subscriber id storage
+* \param	bytes_read		Pointer to the number of bytes returned
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_GENERAL if every subscriber entry is taken.
+*           SERVICE_FAILURE_INVALID_PARAMETER if an invalid parameter.
+*/
+service_status_t gpsd_core_subscribe (service_ctx_t* ctx, void* input_buffer, uint32_t input_size, void* output_buffer, uint32_t output_size, uint32_t* bytes_read)
+{
+	if ( ctx != NULL && input_buffer != NULL && input_size == sizeof(gpsd_subscribe_parms_t) && output_buffer != NULL && output_size >= sizeof(uint32_t) )
+	{
+		gpsd_subscribe_parms_t* parms = (gpsd_subscribe_parms_t*)input_buffer;
+		uint64_t interval = ( (uint64_t)parms->interval * CFG_SYSTICK_FREQ + 999 ) / 1000;
+		uint32_t id;
+
+		critical_section_acquire ( &gpsd_history_cs );
+		id = gpsd_history_subscribe ( &gpsd_history, parms, interval );
+		critical_section_release ( &gpsd_history_cs );
+
+		if ( id == 0 )
+			return SERVICE_FAILURE_GENERAL;
+
+		*(uint32_t*)output_buffer = id;
+		if ( bytes_read != NULL )
+			*bytes_read = sizeof(uint32_t);
+		return SERVICE_STATUS_SUCCESS;
+	}
+	return SERVICE_FAILURE_INVALID_PARAMETER;
+}
+
+/**
+* Unsubscribe from the fix history.
+*
+* \param    ctx				Pointer to the service context
+* \param	input_buffer	Pointer to the subscriber id (uint32_t)
+* \param	input_size		Size of the subscriber id
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_GENERAL if the id is not subscribed.
+*           SERVICE_FAILURE_INVALID_PARAMETER if an invalid parameter.
+*/
+service_status_t gpsd_core_unsubscribe (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
+{
+	if ( ctx != NULL && input_buffer != NULL && input_size == sizeof(uint32_t) )
+	{
+		bool found;
+
+		critical_section_acquire ( &gpsd_history_cs );
+		found = gpsd_history_unsubscribe ( &gpsd_history, *(uint32_t*)input_buffer );
+		critical_section_release ( &gpsd_history_cs );
+
+		return ( found ) ? SERVICE_STATUS_SUCCESS : SERVICE_FAILURE_GENERAL;
+	}
+	return SERVICE_FAILURE_INVALID_PARAMETER;
+}
+
+/**
+* Read the fixes waiting for a subscriber.
+* The fixes passing the subscriber filter are returned oldest first, as
+* many as fit in the output buffer.
+*
+* \param    ctx				Pointer to the service context
+* \param	input_buffer	Pointer to the subscriber id (uint32_t)
+* \param	input_size		Size of the subscriber id
+* \param	output_buffer	Pointer to storage for the records (gpsd_fix_record_t)
+* \param	output_size		Size of the record storage
+* \param	bytes_read		Pointer to the number of bytes returned, 0 if no fix is waiting
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+*           SERVICE_FAILURE_GENERAL if the id is not subscribed.
+*           SERVICE_FAILURE_INVALID_PARAMETER if an invalid parameter.
+*/
+service_status_t gpsd_core_read_fixes (service_ctx_t* ctx, void* input_buffer, uint32_t input_size, void* output_buffer, uint32_t output_size, uint32_t* bytes_read)
+{
+	if ( ctx != NULL && input_buffer != NULL && input_size == sizeof(uint32_t) && output_buffer != NULL && output_size >= sizeof(gpsd_fix_record_t) )
+	{
+		uint32_t id = *(uint32_t*)input_buffer;
+		uint32_t count;
+		bool found;
+
+		critical_section_acquire ( &gpsd_history_cs );
+		found = ( gpsd_history_subscriber ( &gpsd_history, id ) != NULL );
+		count = gpsd_history_read ( &gpsd_history, id, (gpsd_fix_record_t*)output_buffer, output_size / sizeof(gpsd_fix_record_t) );
+		critical_section_release ( &gpsd_history_cs );
+
+		if ( ! found )
+			return SERVICE_FAILURE_GENERAL;
+
+		if ( bytes_read != NULL )
+			*bytes_read = count * sizeof(gpsd_fix_record_t);
+		return SERVICE_STATUS_SUCCESS;
+	}
+	return SERVICE_FAILURE_INVALID_PARAMETER;
+}
+
+/**
+* Convert an integer fix to a gps_fix_t.
+* The time is converted to the hhmmss.sss form the NMEA sentences carry.
+*
+* \param    fix				Pointer to the integer fix
+* \param	gps_fix_data	Pointer to the gps_fix_t to fill in
+*
+* \returns  none
+*/
+void gpsd_fix_to_double ( const gps_fix_int_t* fix, gps_fix_t* gps_fix_data )
+{
+	uint32_t seconds = fix->time / 1000;
+
+	memset ( gps_fix_data, 0, sizeof(gps_fix_t) );
+	gps_fix_data->time      = (double)( ( seconds / 3600 ) * 10000 + ( seconds / 60 % 60 ) * 100 + seconds % 60 ) + (double)( fix->time % 1000 ) / 1000.0;
+	gps_fix_data->mode      = fix->mode;
+	gps_fix_data->latitude  = (double)fix->latitude / 1e7;
+	gps_fix_data->longitude = (double)fix->longitude / 1e7;
+	gps_fix_data->altitude  = (double)fix->altitude / 1000.0;
+	gps_fix_data->track     = (double)fix->track / 100.0;
+	gps_fix_data->speed     = (double)fix->speed / 1000.0;
+	gps_fix_data->climb     = (double)fix->climb / 1000.0;
+}
+
 /**
 * Process NMEA sentence.
 *
 * \param    ctx				Pointer to the service context
 * \param	NMEAStream		Pointer to NMEA string
+* \param	length			Size of the NMEA string
 * \param	gps_fix_data	Pointer to the GPS fix data structure
 *
 * \returns  none
 */
-void gpsd_core_process_nmea (service_ctx_t* ctx, int8_t* NMEAStream, gps_fix_t* gps_fix_data)
+void gpsd_core_process_nmea (service_ctx_t* ctx, const char* NMEAStream, uint32_t length, gps_fix_int_t* gps_fix_data)
 {
+	gps_fix_int_t fix;
+	bool decoded;
+
 	/**
-	* Process NMEA strings
+	* Process NMEA strings, a corrupted or unknown sentence is dropped.  The
+	* fix is updated under the lock the polls read it with.
 	*/
-	NMEA0183_ExtractData ( NMEAStream, gps_fix_data );
+	critical_section_acquire ( &gpsd_history_cs );
+	decoded = NMEA0183_ExtractData ( NMEAStream, length, gps_fix_data );
+	fix     = *gps_fix_data;
+	critical_section_release ( &gpsd_history_cs );
+
+	if ( decoded )
+		gpsd_core_notify ( &fix );
+}
+
+/**
+* Report an updated fix.
+* Calls the service callback, then adds the fix to the history and calls
+* the subscribers it is time to notify.  Subscriber callbacks run outside
+* the history lock, so they can read the history.
+*
+* \param	gps_fix_data	Pointer to the GPS fix data structure
+*
+* \returns  none
+*/
+void gpsd_core_notify (const gps_fix_int_t* gps_fix_data)
+{
+	gpsd_callback_func_t cbfunc[GPSD_MAX_SUBSCRIBERS];
+	void* instance[GPSD_MAX_SUBSCRIBERS];
+	uint32_t notify;
 
 	/**
 	* Call callback
@@ -560,231 +997,178 @@ void gpsd_core_process_nmea (service_ctx_t* ctx, int8_t* NMEAStream, gps_fix_t*
 	{
 		(*gpsd_parms.cbfunc)(gpsd_parms.instance);
 	}
+
+	critical_section_acquire ( &gpsd_history_cs );
+	notify = gpsd_history_add ( &gpsd_history, gps_fix_data, time_get_ticks(NULL) );
+	for ( uint32_t index = 0; index < GPSD_MAX_SUBSCRIBERS; index++ )
+	{
+		cbfunc[index]   = gpsd_history.subscriber[index].parms.cbfunc;
+		instance[index] = gpsd_history.subscriber[index].parms.instance;
+	}
+	critical_section_release ( &gpsd_history_cs );
+
+	for ( uint32_t index = 0; index < GPSD_MAX_SUBSCRIBERS; index++ )
+	{
+		if ( notify & ( 1UL << index ) )
+			(*cbfunc[index])(instance[index]);
+	}
 }
 
 /**
-* NMEA_nmeaToDegreesLatLong
-*
-* \brief 	Convert NMEA GPS latitude and longitude values to degrees
+* UBX message decoder table
+*/
+typedef struct _ubx_decoder_def
+{
+	uint8_t msg_class;
+	uint8_t msg_id;
+	bool (*decode) (const uint8_t* payload, uint32_t length, gps_fix_int_t* gps_fix_data);
+} ubx_decoder_t;
+
+static const ubx_decoder_t ubx_decoders[] =
+{
+	{ UBX_CLASS_NAV, UBX_NAV_PVT, ubx_decode_nav_pvt },
+	{ UBX_CLASS_NAV, UBX_NAV_SAT, ubx_decode_nav_sat },
+};
+
+/**
+* Process UBX frame.
+* Frames other than the navigation messages decoded here are ignored.
 *
-* \param   gps_fix_data			Pointer to the gps_fix_t structure
+* \param    ctx				Pointer to the service context
+* \param	frame			Pointer to the frame synchronizer holding the frame
+* \param	gps_fix_data	Pointer to the GPS fix data structure
 *
-* \return  None
+* \returns  none
 */
-void NMEA_nmeaToDegreesLatLong( gps_fix_t* gps_fix_data )
+void gpsd_core_process_ubx (service_ctx_t* ctx, const ubx_parser_t* frame, gps_fix_int_t* gps_fix_data)
 {
-    int DD_lat = (int)( ( (double)gps_fix_data->latitude)/(double)100.0 );
-    double SS_lat = ( (double)gps_fix_data->latitude ) - ( (double)DD_lat*(double)100.0 );
-    gps_fix_data->latitude = (double)( (double)DD_lat + ( SS_lat/(double)60.0 ) );
+	gps_fix_int_t fix;
+	bool decoded;
 
-    int DD_long = (int)( ( (double)gps_fix_data->longitude)/(double)100.0 );
-    double SS_long = ( (double)gps_fix_data->longitude ) - ( (double)DD_long*(double)100.0 );
-    gps_fix_data->longitude = (double)( (double)DD_long + ( SS_long/(double)60.0 ) );
+	for ( uint32_t index = 0; index < sizeof(ubx_decoders) / sizeof(ubx_decoders[0]); index++ )
+	{
+		if ( frame->msg_class == ubx_decoders[index].msg_class && frame->msg_id == ubx_decoders[index].msg_id )
+		{
+			critical_section_acquire ( &gpsd_history_cs );
+			decoded = (*ubx_decoders[index].decode)( frame->payload, frame->length, gps_fix_data );
+			fix     = *gps_fix_data;
+			critical_section_release ( &gpsd_history_cs );
+
+			if ( decoded )
+				gpsd_core_notify ( &fix );
+			return;
+		}
+	}
+}
 
-    if ( gpsd_ucNS == 'S' )
-       gps_fix_data->latitude *= (double)(-1.0);
-    if ( gpsd_ucEW == 'W' )
-       gps_fix_data->longitude *= (double)(-1.0);
+/**
+* NMEA0183 sentence decoder table
+*/
+typedef struct _nmea_decoder_def
+{
+	const char* address;
+	void (*decode) (const nmea_sentence_t* tokens, gps_fix_int_t* gps_fix_data);
+} nmea_decoder_t;
 
-} // NEMA_nemaToDegreesLatLong
+static const nmea_decoder_t nmea_decoders[] =
+{
+	{ GPS_GGA_MSG, NMEA0183_ExtractGGA },
+	{ GPS_RMC_MSG, NMEA0183_ExtractRMC },
+};
 
 /**
 * Extract data from a NMEA string
 *
+* The sentence is tokenized once and its fields handed to the decoder of
+* its address.
+*
 * \param    NMEAStream			Pointer to the NMEA string
-* \param	gps_fix_data		Pointer to the gps_fix_t data structure
+* \param	length				Size of the NMEA string
+* \param	gps_fix_data		Pointer to the gps_fix_int_t data structure
 *
-* \returns  TRUE if successful.
-*           FALSE if unsuccessful.
+* \returns  TRUE if the sentence updated the fix.
+*           FALSE if the sentence is corrupted or not decoded.
 */
-uint8_t NMEA0183_ExtractData(int8_t* NMEAStream, gps_fix_t* gps_fix_data)
+bool NMEA0183_ExtractData(const char* NMEAStream, uint32_t length, gps_fix_int_t* gps_fix_data)
 {
-  uint8_t result = 0;
+    nmea_sentence_t tokens;
 
-    /**
-    * Extract the GPS NMEA0183 message type from the stream
-    * Remove the original first octet of the stream ('$')
-    */
-    memset(GPSMid, '\0', sizeof(GPSMid));
-    memcpy(GPSMid, NMEAStream + 1, GPS_MID_SIZE - 1);
-    gpsd_ucEW = gpsd_ucNS = 0x78;
-
-    /**
-    * Parse the GPGGA message
-    */
-    if (memcmp(GPSMid, GPS_GGA_MSG, GPS_MID_SIZE - 1) == 0)
-    {
-    	NMEA0183_ExtractGGA(NMEAStream, gps_fix_data);
-    } // if
-
-    /**
-    * Parse the GPGLL message
-    */
-    if (memcmp(GPSMid, GPS_GLL_MSG, GPS_MID_SIZE - 1) == 0)
-    {
-    } // if
+    if ( ! nmea_tokenize ( NMEAStream, length, &tokens ) )
+    	return FALSE;
 
-    /**
-    * Parse the GPRMC message
-    */
-    if (memcmp(GPSMid, GPS_RMC_MSG, GPS_MID_SIZE - 1) == 0)
+    for ( uint32_t index = 0; index < sizeof(nmea_decoders) / sizeof(nmea_decoders[0]); index++ )
     {
-    	NMEA0183_ExtractRMC(NMEAStream, gps_fix_data);
-    } // if
-
-    return result;
+    	if ( nmea_is_sentence ( &tokens, nmea_decoders[index].address ) )
+    	{
+    		(*nmea_decoders[index].decode)( &tokens, gps_fix_data );
+    		return TRUE;
+    	}
+    }
+    return FALSE;
 }
 
 /**
 * Extract information from a GPGGA NMEA string
 *
-* \param    NMEAStream			Pointer to the NMEA string
-* \param	gps_fix_data		Pointer to the gps_fix_t data structure
+* \param    tokens				Pointer to the tokenized NMEA string
+* \param	gps_fix_data		Pointer to the gps_fix_int_t data structure
 *
 * \returns  none
 */
-void NMEA0183_ExtractGGA(int8_t* NMEAStream, gps_fix_t* gps_fix_data)
+void NMEA0183_ExtractGGA(const nmea_sentence_t* tokens, gps_fix_int_t* gps_fix_data)
 {
     /**
     * Retrieve "Position Fix Indicator" from the NMEA stream
     */
-    memset(ucData, '\0', sizeof(ucData));
-    GetField((uint8_t*)NMEAStream, ucData, GGAFIELD_FIX, sizeof(ucData));
-    gps_fix_data->mode = 1 + ucData[0];
+    char quality = nmea_field_char ( tokens, GGAFIELD_FIX );
+    if ( quality < '1' || quality > '9' )
+    	gps_fix_data->mode = MODE_NO_FIX;
+    else if ( quality == '1' )
+    	gps_fix_data->mode = MODE_2D;
+    else
+    	gps_fix_data->mode = MODE_3D;
 
     if ( gps_fix_data->mode >= MODE_2D )
     {
-        // N/S
-        memset(ucData, '\0', sizeof(ucData));
-        if (GetField((uint8_t*)NMEAStream, ucData, GGAFIELD_NS, sizeof(ucData)))
-            gpsd_ucNS = ucData[0];
+        // UTC
+        nmea_field_time ( tokens, GGAFIELD_UTC, &gps_fix_data->time );
 
-        // E/W
-        memset(ucData, '\0', sizeof(ucData));
-        if (GetField((uint8_t*)NMEAStream, ucData, GGAFIELD_EW, sizeof(ucData)))
-            gpsd_ucEW = ucData[0];
+        // Latitude, N/S
+        nmea_field_coordinate ( tokens, GGAFIELD_LATITUDE, &gps_fix_data->latitude );
 
-        // UTC
-        memset(ucData, '\0', sizeof(ucData));
-        if (GetField((uint8_t*)NMEAStream, ucData, GGAFIELD_UTC, sizeof(ucData)))
-        	gps_fix_data->time = atof((const char *)ucData);
-
-        // Latitude
-        memset(ucData, '\0', sizeof(ucData));
-        if (GetField((uint8_t*)NMEAStream, ucData, GGAFIELD_LATITUDE, sizeof(ucData)))
-        	gps_fix_data->latitude = atof((const char *)ucData);
-
-        // Longitude
-        memset(ucData, '\0', sizeof(ucData));
-        if (GetField((uint8_t*)NMEAStream, ucData, GGAFIELD_LONGITUDE, sizeof(ucData)))
-        	gps_fix_data->longitude = atof((const char *)ucData);
-
-        // Altitude
-        memset(ucData, '\0', sizeof(ucData));
-        if (GetField((uint8_t*)NMEAStream, ucData, GGAFIELD_ALTITUDE, sizeof(ucData)))
-        	gps_fix_data->altitude = atof((const char *)ucData);
-
-        // Climb
-        memset(ucData, '\0', sizeof(ucData));
-        if (GetField((uint8_t*)NMEAStream, ucData, GGAFIELD_HEIGHT, sizeof(ucData)))
-        	gps_fix_data->climb = atof((const char *)ucData);
-
-    	NMEA_nmeaToDegreesLatLong ( gps_fix_data );
+        // Longitude, E/W
+        nmea_field_coordinate ( tokens, GGAFIELD_LONGITUDE, &gps_fix_data->longitude );
+
+        // Altitude (millimeters)
+        nmea_field_fixed ( tokens, GGAFIELD_ALTITUDE, 3, &gps_fix_data->altitude );
     } // if
+
+    // Satellites in use
+    nmea_field_fixed ( tokens, GGAFIELD_SAT, 0, &gps_fix_data->satellites_used );
 }
 
 /**
 * Extract information from a GPRMC NMEA string
 *
-* \param    NMEAStream			Pointer to the NMEA string
-* \param	gps_fix_data		Pointer to the gps_fix_t data structure
+* \param    tokens				Pointer to the tokenized NMEA string
+* \param	gps_fix_data		Pointer to the gps_fix_int_t data structure
 *
 * \returns  none
 */
-void NMEA0183_ExtractRMC(int8_t* NMEAStream, gps_fix_t* gps_fix_data)
-{
-    if ( gps_fix_data->mode >= MODE_2D )
-    {
-        // Speed
-        memset(ucData, '\0', sizeof(ucData));
-        if (GetField((uint8_t*)NMEAStream, ucData, RMCFIELD_SPEED, sizeof(ucData)))
-        	gps_fix_data->speed = atof((const char *)ucData);
-
-        // Track
-        memset(ucData, '\0', sizeof(ucData));
-        if (GetField((uint8_t*)NMEAStream, ucData, RMCFIELD_TRACK, sizeof(ucData)))
-        	gps_fix_data->track = atof((const char *)ucData);
-    }
-}
-
-/**
-* Get a field from a NMEA string.
-*
-* \param    pData				Pointer to the NMEA string
-* \param	pField				Pointer to field memory area
-* \param	nFieldNum			Field number
-* \param	nMaxFieldLen		Maximum field length
-*
-* \returns  TRUE if successful.
-*           FALSE if unsuccessful.
-*/
-bool GetField(uint8_t *pData, uint8_t *pField, int nFieldNum, int nMaxFieldLen)
+void NMEA0183_ExtractRMC(const nmea_sentence_t* tokens, gps_fix_int_t* gps_fix_data)
 {
-    /**
-    * Validate params
-    */
-    if (pData == NULL || pField == NULL || nMaxFieldLen <= 0)
-    {
-        return FALSE;
-    }
+	int32_t knots;
 
-    /**
-    * Go to the beginning of the selected field
-    */
-    int i = 0;
-    int nField = 0;
-    while (nField != nFieldNum && pData[i])
+    if ( gps_fix_data->mode >= MODE_2D )
     {
-        if (pData[i] == ',')
-        {
-            nField++;
-        }
-
-        i++;
-
-        if (pData[i] == 0)       // was NULL
-        {
-            pField[0] = '\0';
-            return FALSE;
-        }
-    }
+        // UTC
+        nmea_field_time ( tokens, RMCFIELD_UTC, &gps_fix_data->time );
 
-    if (pData[i] == ',' || pData[i] == '*')
-    {
-        pField[0] = '\0';
-        return FALSE;
-    }
+        // Speed, knots to millimeters/sec
+        if ( nmea_field_fixed ( tokens, RMCFIELD_SPEED, 3, &knots ) )
+        	gps_fix_data->speed = (int32_t)( ( (int64_t)knots * 1852 + 1800 ) / 3600 );
 
-    /**
-    * copy field from pData to Field
-    */
-    int i2 = 0;
-    while (pData[i] != ',' && pData[i] != '*' && pData[i])
-    {
-        pField[i2] = pData[i];
-        i2++; i++;
-
-        /**
-        * check if field is too big to fit on passed parameter. If it is,
-        * crop returned field to its max length.
-        */
-        if (i2 >= nMaxFieldLen)
-        {
-            i2 = nMaxFieldLen - 1;
-            break;
-        }
+        // Track (centidegrees)
+        nmea_field_fixed ( tokens, RMCFIELD_TRACK, 2, &gps_fix_data->track );
     }
-    pField[i2] = '\0';
-    return TRUE;
 }
-
@@ -0,0 +1,383 @@
+
+/**
+* gpsd_ubx.c
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the u-blox UBX binary protocol decoder.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "gpsd_ubx.h"
+
+/**
+* Frame synchronizer states
+*/
+#define UBX_STATE_SYNC1				0		// Waiting for the first sync character
+#define UBX_STATE_SYNC2				1		// Waiting for the second sync character
+#define UBX_STATE_CLASS				2
+#define UBX_STATE_ID				3
+#define UBX_STATE_LENGTH1			4
+#define UBX_STATE_LENGTH2			5
+#define UBX_STATE_PAYLOAD			6
+#define UBX_STATE_CK_A				7
+#define UBX_STATE_CK_B				8
+
+/**
+* NAV-PVT and NAV-SAT flags
+*/
+#define UBX_PVT_VALID_TIME			0x02	// valid: UTC time of day is valid
+#define UBX_PVT_GNSS_FIX_OK			0x01	// flags: fix within the accuracy masks
+#define UBX_PVT_FIX_2D				2		// fixType: 2D fix
+#define UBX_PVT_FIX_3D				3		// fixType: 3D fix
+#define UBX_PVT_FIX_GNSS_DR			4		// fixType: GNSS and dead reckoning combined
+#define UBX_SAT_SV_USED				0x08	// flags: satellite used for navigation
+
+#define UBX_MS_PER_DAY				86400000L
+
+/**
+* Read a little endian unsigned field.
+*
+* \param    field		Pointer to the field
+*
+* \returns  Value of the field.
+*/
+static uint32_t ubx_u32 ( const uint8_t* field )
+{
+	return (uint32_t)field[0] | ( (uint32_t)field[1] << 8 ) | ( (uint32_t)field[2] << 16 ) | ( (uint32_t)field[3] << 24 );
+}
+
+/**
+* Read a little endian signed field.
+*
+* \param    field		Pointer to the field
+*
+* \returns  Value of the field.
+*/
+static int32_t ubx_i32 ( const uint8_t* field )
+{
+	return (int32_t)ubx_u32 ( field );
+}
+
+/**
+* Write a little endian 16 bit field.
+*
+* \param    field		Pointer to the field
+* \param	value		Value of the field
+*
+* \returns  None
+*/
+static void ubx_put_u16 ( uint8_t* field, uint16_t value )
+{
+	field[0] = (uint8_t)( value & 0xFF );
+	field[1] = (uint8_t)( value >> 8 );
+}
+
+/**
+* Write a little endian 32 bit field.
+*
+* \param    field		Pointer to the field
+* \param	value		Value of the field
+*
+* \returns  None
+*/
+static void ubx_put_u32 ( uint8_t* field, uint32_t value )
+{
+	ubx_put_u16 ( field, (uint16_t)( value & 0xFFFF ) );
+	ubx_put_u16 ( field + 2, (uint16_t)( value >> 16 ) );
+}
+
+/**
+* Reset the frame synchronizer.
+*
+* \param    parser		Pointer to the frame synchronizer
+*
+* \returns  None
+*/
+void ubx_parser_reset ( ubx_parser_t* parser )
+{
+	parser->state  = UBX_STATE_SYNC1;
+	parser->length = 0;
+	parser->index  = 0;
+	parser->errors = 0;
+}
+
+/**
+* Take the next byte of the stream.
+* After UBX_PARSE_FRAME the frame is in the synchronizer until the next byte.
+*
+* \param    parser		Pointer to the frame synchronizer
+* \param	c			Byte received
+*
+* \returns  UBX_PARSE_NONE, UBX_PARSE_PENDING or UBX_PARSE_FRAME.
+*/
+uint32_t ubx_parse ( ubx_parser_t* parser, uint8_t c )
+{
+	switch ( parser->state )
+	{
+		case UBX_STATE_SYNC1:
+			if ( c != UBX_SYNC_CHAR_1 )
+				return UBX_PARSE_NONE;
+			parser->state = UBX_STATE_SYNC2;
+			return UBX_PARSE_PENDING;
+
+		case UBX_STATE_SYNC2:
+			if ( c == UBX_SYNC_CHAR_2 )
+			{
+				parser->state = UBX_STATE_CLASS;
+				parser->ck_a  = 0;
+				parser->ck_b  = 0;
+				return UBX_PARSE_PENDING;
+			}
+			if ( c == UBX_SYNC_CHAR_1 )
+				return UBX_PARSE_PENDING;
+			parser->state = UBX_STATE_SYNC1;
+			return UBX_PARSE_NONE;
+
+		case UBX_STATE_CLASS:
+			parser->msg_class = c;
+			parser->state     = UBX_STATE_ID;
+			break;
+
+		case UBX_STATE_ID:
+			parser->msg_id = c;
+			parser->state  = UBX_STATE_LENGTH1;
+			break;
+
+		case UBX_STATE_LENGTH1:
+			parser->length = c;
+			parser->state  = UBX_STATE_LENGTH2;
+			break;
+
+		case UBX_STATE_LENGTH2:
+			parser->length |= (uint16_t)c << 8;
+			parser->index   = 0;
+			if ( parser->length > UBX_MAX_PAYLOAD )
+			{
+				/*
+				 * Resynchronize on the next sync characters
+				 */
+				parser->errors++;
+				parser->state = UBX_STATE_SYNC1;
+				return UBX_PARSE_PENDING;
+			}
+			parser->state = ( parser->length != 0 ) ? UBX_STATE_PAYLOAD : UBX_STATE_CK_A;
+			break;
+
+		case UBX_STATE_PAYLOAD:
+			parser->payload[parser->index++] = c;
+			if ( parser->index == parser->length )
+				parser->state = UBX_STATE_CK_A;
+			break;
+
+		case UBX_STATE_CK_A:
+			if ( c != parser->ck_a )
+			{
+				parser->errors++;
+				parser->state = UBX_STATE_SYNC1;
+				return UBX_PARSE_PENDING;
+			}
+			parser->state = UBX_STATE_CK_B;
+			return UBX_PARSE_PENDING;
+
+		case UBX_STATE_CK_B:
+			parser->state = UBX_STATE_SYNC1;
+			if ( c == parser->ck_b )
+				return UBX_PARSE_FRAME;
+			parser->errors++;
+			return UBX_PARSE_PENDING;
+
+		default:
+			parser->state = UBX_STATE_SYNC1;
+			return UBX_PARSE_NONE;
+	}
+
+	parser->ck_a += c;
+	parser->ck_b += parser->ck_a;
+	return UBX_PARSE_PENDING;
+}
+
+/**
+* Build a frame.
+*
+* \param    frame		Pointer to storage for the frame, length + UBX_FRAME_OVERHEAD bytes
+* \param	msg_class	Message class
+* \param	msg_id		Message id
+* \param	payload		Pointer to the payload, NULL if length is 0
+* \param	length		Size of the payload
+*
+* \returns  Size of the frame.
+*/
+uint32_t ubx_encode ( uint8_t* frame, uint8_t msg_class, uint8_t msg_id, const uint8_t* payload, uint16_t length )
+{
+	uint8_t ck_a = 0;
+	uint8_t ck_b = 0;
+	uint32_t index;
+
+	frame[0] = UBX_SYNC_CHAR_1;
+	frame[1] = UBX_SYNC_CHAR_2;
+	frame[2] = msg_class;
+	frame[3] = msg_id;
+	ubx_put_u16 ( &frame[4], length );
+	if ( length != 0 )
+		memcpy ( &frame[6], payload, length );
+
+	for ( index = 2; index < 6u + length; index++ )
+	{
+		ck_a += frame[index];
+		ck_b += ck_a;
+	}
+	frame[index++] = ck_a;
+	frame[index++] = ck_b;
+	return index;
+}
+
+/**
+* Build a CFG-PRT frame for UART1, 8N1, taking UBX and NMEA input.
+*
+* \param    frame		Pointer to storage for the frame, UBX_CFG_MAX_FRAME bytes
+* \param	baud		Baud rate
+* \param	ubx			true to output UBX, false to output NMEA
+*
+* \returns  Size of the frame.
+*/
+uint32_t ubx_cfg_prt ( uint8_t* frame, uint32_t baud, bool ubx )
+{
+	uint8_t payload[UBX_CFG_PRT_LENGTH];
+
+	memset ( payload, 0, sizeof(payload) );
+	payload[0] = 1;								// UART1
+	ubx_put_u32 ( &payload[4], 0x000008C0 );	// 8 bits, no parity, 1 stop bit
+	ubx_put_u32 ( &payload[8], baud );
+	ubx_put_u16 ( &payload[12], 0x0003 );		// UBX and NMEA input
+	ubx_put_u16 ( &payload[14], ubx ? 0x0001 : 0x0002 );
+	return ubx_encode ( frame, UBX_CLASS_CFG, UBX_CFG_PRT, payload, sizeof(payload) );
+}
+
+/**
+* Build a CFG-MSG frame setting the rate of a message on the current port.
+*
+* \param    frame		Pointer to storage for the frame, UBX_CFG_MAX_FRAME bytes
+* \param	msg_class	Message class
+* \param	msg_id		Message id
+* \param	rate		Navigation solutions per message, 0 to disable the message
+*
+* \returns  Size of the frame.
+*/
+uint32_t ubx_cfg_msg ( uint8_t* frame, uint8_t msg_class, uint8_t msg_id, uint8_t rate )
+{
+	uint8_t payload[3] = { msg_class, msg_id, rate };
+
+	return ubx_encode ( frame, UBX_CLASS_CFG, UBX_CFG_MSG, payload, sizeof(payload) );
+}
+
+/**
+* Build a CFG-RATE frame, one navigation solution per measurement, GPS time.
+*
+* \param    frame		Pointer to storage for the frame, UBX_CFG_MAX_FRAME bytes
+* \param	period		Time between measurements (ms)
+*
+* \returns  Size of the frame.
+*/
+uint32_t ubx_cfg_rate ( uint8_t* frame, uint16_t period )
+{
+	uint8_t payload[6];
+
+	ubx_put_u16 ( &payload[0], period );
+	ubx_put_u16 ( &payload[2], 1 );
+	ubx_put_u16 ( &payload[4], 1 );
+	return ubx_encode ( frame, UBX_CLASS_CFG, UBX_CFG_RATE, payload, sizeof(payload) );
+}
+
+/**
+* Decode a NAV-PVT payload into the fix.
+* The position is only updated when the receiver has a 2D or 3D fix.
+*
+* \param    payload		Pointer to the payload
+* \param	length		Size of the payload
+* \param	fix			Pointer to the fix
+*
+* \returns  true if the payload is a NAV-PVT solution.
+*/
+bool ubx_decode_nav_pvt ( const uint8_t* payload, uint32_t length, gps_fix_int_t* fix )
+{
+	int32_t nano;
+	int32_t time;
+
+	if ( length < UBX_NAV_PVT_LENGTH )
+		return false;
+
+	/*
+	 * UTC time of day, the nanosecond field corrects the rounded second and
+	 * may be negative
+	 */
+	if ( payload[11] & UBX_PVT_VALID_TIME )
+	{
+		nano = ubx_i32 ( &payload[16] );
+		time = ( (int32_t)payload[8] * 3600 + (int32_t)payload[9] * 60 + (int32_t)payload[10] ) * 1000;
+		time += ( nano + ( ( nano < 0 ) ? -500000 : 500000 ) ) / 1000000;
+		if ( time < 0 )
+			time += UBX_MS_PER_DAY;
+		else if ( time >= UBX_MS_PER_DAY )
+			time -= UBX_MS_PER_DAY;
+		fix->time = (uint32_t)time;
+	}
+
+	if ( ! ( payload[21] & UBX_PVT_GNSS_FIX_OK ) )
+		fix->mode = MODE_NO_FIX;
+	else if ( payload[20] == UBX_PVT_FIX_2D )
+		fix->mode = MODE_2D;
+	else if ( payload[20] == UBX_PVT_FIX_3D || payload[20] == UBX_PVT_FIX_GNSS_DR )
+		fix->mode = MODE_3D;
+	else
+		fix->mode = MODE_NO_FIX;
+
+	fix->satellites_used = payload[23];
+
+	if ( fix->mode >= MODE_2D )
+	{
+		fix->longitude = ubx_i32 ( &payload[24] );				// 1e-7 degrees
+		fix->latitude  = ubx_i32 ( &payload[28] );				// 1e-7 degrees
+		fix->altitude  = ubx_i32 ( &payload[36] );				// Above mean sea level, millimeters
+		fix->climb     = -ubx_i32 ( &payload[56] );				// Velocity down, millimeters/sec
+		fix->speed     = ubx_i32 ( &payload[60] );				// Ground speed, millimeters/sec
+		fix->track     = ( ubx_i32 ( &payload[64] ) + 500 ) / 1000;	// Heading of motion, 1e-5 degrees
+	}
+	return true;
+}
+
+/**
+* Decode a NAV-SAT payload into the satellite counts of the fix.
+*
+* \param    payload		Pointer to the payload
+* \param	length		Size of the payload
+* \param	fix			Pointer to the fix
+*
+* \returns  true if the payload is a NAV-SAT report.
+*/
+bool ubx_decode_nav_sat ( const uint8_t* payload, uint32_t length, gps_fix_int_t* fix )
+{
+	uint32_t count;
+	uint32_t used = 0;
+
+	if ( length < UBX_NAV_SAT_HEADER )
+		return false;
+
+	count = payload[5];
+	if ( length < UBX_NAV_SAT_HEADER + count * UBX_NAV_SAT_BLOCK )
+		return false;
+
+	for ( uint32_t index = 0; index < count; index++ )
+	{
+		if ( ubx_u32 ( &payload[UBX_NAV_SAT_HEADER + index * UBX_NAV_SAT_BLOCK + 8] ) & UBX_SAT_SV_USED )
+			used++;
+	}
+	fix->satellites_visible = (int32_t)count;
+	fix->satellites_used    = (int32_t)used;
+	return true;
+}
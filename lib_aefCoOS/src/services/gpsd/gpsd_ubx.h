@@ -0,0 +1,178 @@
+
+/**
+* gpsd_ubx.h
+*
+* \copyright
+* Copyright 2018 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the u-blox UBX binary protocol decoder.
+*
+* A UBX frame is the two sync characters 0xB5 0x62, the message class and
+* id, a little endian payload length, the payload and an 8 bit Fletcher
+* checksum over everything after the sync characters.  The frame
+* synchronizer takes the stream one byte at a time and tells the caller
+* which bytes were not part of a frame, so NMEA sentences can be mixed in
+* the same stream.  Payload fields are little endian integers and are read
+* without floating point.
+*/
+
+#ifndef SRC_SERVICES_GPSD_GPSD_UBX_H_
+#define SRC_SERVICES_GPSD_GPSD_UBX_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <aef/embedded/service/gpsd/gpsd_service.h>
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+#ifndef UBX_MAX_PAYLOAD
+	#define UBX_MAX_PAYLOAD				512		// Largest payload accepted, NAV-SAT needs 8 + 12 bytes per satellite
+#endif
+
+#define UBX_SYNC_CHAR_1				0xB5	// First frame sync character
+#define UBX_SYNC_CHAR_2				0x62	// Second frame sync character
+#define UBX_FRAME_OVERHEAD			8		// Sync, class, id, length and checksum bytes
+
+/**
+* UBX message classes and ids
+*/
+#define UBX_CLASS_NAV				0x01	// Navigation results
+#define UBX_CLASS_ACK				0x05	// Configuration acknowledgements
+#define UBX_CLASS_CFG				0x06	// Configuration
+
+#define UBX_NAV_PVT					0x07	// Navigation position velocity time solution
+#define UBX_NAV_SAT					0x35	// Satellite information
+#define UBX_ACK_NAK					0x00	// Message not acknowledged
+#define UBX_ACK_ACK					0x01	// Message acknowledged
+#define UBX_CFG_PRT					0x00	// Port configuration
+#define UBX_CFG_MSG					0x01	// Message rate
+#define UBX_CFG_RATE				0x08	// Navigation and measurement rate
+
+#define UBX_NAV_PVT_LENGTH			92		// NAV-PVT payload size
+#define UBX_NAV_SAT_HEADER			8		// NAV-SAT payload size before the satellite blocks
+#define UBX_NAV_SAT_BLOCK			12		// NAV-SAT payload size per satellite
+#define UBX_CFG_PRT_LENGTH			20		// CFG-PRT payload size
+#define UBX_CFG_MAX_FRAME			( UBX_CFG_PRT_LENGTH + UBX_FRAME_OVERHEAD )	// Largest configuration frame built here
+
+/**
+* UBX frame synchronizer results
+*/
+#define UBX_PARSE_NONE				0		// Byte is not part of a frame
+#define UBX_PARSE_PENDING			1		// Byte taken, the frame is not complete
+#define UBX_PARSE_FRAME				2		// Frame complete, its checksum matches
+
+/**
+* UBX frame synchronizer structure definition
+*/
+typedef struct _ubx_parser_def
+{
+	uint8_t		 state;						// Next part of the frame expected
+	uint8_t		 msg_class;					// Message class of the frame
+	uint8_t		 msg_id;					// Message id of the frame
+	uint8_t		 ck_a;						// Running checksum
+	uint8_t		 ck_b;
+	uint16_t	 length;					// Payload size of the frame
+	uint16_t	 index;						// Payload bytes received
+	uint32_t	 errors;					// Frames dropped for a bad checksum or length
+	uint8_t		 payload[UBX_MAX_PAYLOAD];	// Payload of the frame
+} ubx_parser_t;
+
+/**
+* Reset the frame synchronizer.
+*
+* \param    parser		Pointer to the frame synchronizer
+*
+* \returns  None
+*/
+void ubx_parser_reset ( ubx_parser_t* parser );
+
+/**
+* Take the next byte of the stream.
+* After UBX_PARSE_FRAME the frame is in the synchronizer until the next byte.
+*
+* \param    parser		Pointer to the frame synchronizer
+* \param	c			Byte received
+*
+* \returns  UBX_PARSE_NONE, UBX_PARSE_PENDING or UBX_PARSE_FRAME.
+*/
+uint32_t ubx_parse ( ubx_parser_t* parser, uint8_t c );
+
+/**
+* Build a frame.
+*
+* \param    frame		Pointer to storage for the frame, length + UBX_FRAME_OVERHEAD bytes
+* \param	msg_class	Message class
+* \param	msg_id		Message id
+* \param	payload		Pointer to the payload, NULL if length is 0
+* \param	length		Size of the payload
+*
+* \returns  Size of the frame.
+*/
+uint32_t ubx_encode ( uint8_t* frame, uint8_t msg_class, uint8_t msg_id, const uint8_t* payload, uint16_t length );
+
+/**
+* Build a CFG-PRT frame for UART1, 8N1, taking UBX and NMEA input.
+*
+* \param    frame		Pointer to storage for the frame, UBX_CFG_MAX_FRAME bytes
+* \param	baud		Baud rate
+* \param	ubx			true to output UBX, false to output NMEA
+*
+* \returns  Size of the frame.
+*/
+uint32_t ubx_cfg_prt ( uint8_t* frame, uint32_t baud, bool ubx );
+
+/**
+* Build a CFG-MSG frame setting the rate of a message on the current port.
+*
+* \param    frame		Pointer to storage for the frame, UBX_CFG_MAX_FRAME bytes
+* \param	msg_class	Message class
+* \param	msg_id		Message id
+* \param	rate		Navigation solutions per message, 0 to disable the message
+*
+* \returns  Size of the frame.
+*/
+uint32_t ubx_cfg_msg ( uint8_t* frame, uint8_t msg_class, uint8_t msg_id, uint8_t rate );
+
+/**
+* Build a CFG-RATE frame, one navigation solution per measurement, GPS time.
+*
+* \param    frame		Pointer to storage for the frame, UBX_CFG_MAX_FRAME bytes
+* \param	period		Time between measurements (ms)
+*
+* \returns  Size of the frame.
+*/
+uint32_t ubx_cfg_rate ( uint8_t* frame, uint16_t period );
+
+/**
+* Decode a NAV-PVT payload into the fix.
+* The position is only updated when the receiver has a 2D or 3D fix.
+*
+* \param    payload		Pointer to the payload
+* \param	length		Size of the payload
+* \param	fix			Pointer to the fix
+*
+* \returns  true if the payload is a NAV-PVT solution.
+*/
+bool ubx_decode_nav_pvt ( const uint8_t* payload, uint32_t length, gps_fix_int_t* fix );
+
+/**
+* Decode a NAV-SAT payload into the satellite counts of the fix.
+*
+* \param    payload		Pointer to the payload
+* \param	length		Size of the payload
+* \param	fix			Pointer to the fix
+*
+* \returns  true if the payload is a NAV-SAT report.
+*/
+bool ubx_decode_nav_sat ( const uint8_t* payload, uint32_t length, gps_fix_int_t* fix );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* SRC_SERVICES_GPSD_GPSD_UBX_H_ */
@@ -0,0 +1,722 @@
+
+/**
+* mqtt_offline_queue.c
+*
+* \copyright
+* Copyright 2017 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the MQTT offline publish queue.
+*
+* The RAM tier is a FIFO list of heap copies.  The flash tier is a run of
+* RecordTypeMqttMessage records keyed by the queue key and a big endian
+* sequence number, so a cursor scan finds the run again after a restart.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <aef/embedded/system/system_core.h>
+#include "mqtt_offline_queue.h"
+
+#define MQTT_QUEUE_RECORD_HEADER_SIZE	(sizeof(mqtt_queue_record_t) - MQTT_QUEUE_RECORD_DATA_SIZE)
+
+#define MQTT_QUEUE_SPILLED				0		// The oldest RAM publish left the RAM tier
+#define MQTT_QUEUE_SPILL_FULL			1		// No flash tier, or the flash tier is full
+#define MQTT_QUEUE_SPILL_FAILED			2		// The flash tier is busy or the write failed
+
+/**
+* Size of the RAM tier charge of a publish.
+*
+* \param    entry		Pointer to the publish
+*
+* \returns  Number of bytes.
+*/
+static uint32_t mqtt_queue_charge ( const mqtt_queue_entry_t* entry )
+{
+	return sizeof(mqtt_queue_entry_t) + entry->length;
+}
+
+/**
+* Build the record key of a flash tier publish.
+*
+* \param    queue		Pointer to the queue
+* \param	sequence	Sequence number of the publish
+* \param	uuid		Pointer to storage for the key
+*
+* \returns  None
+*/
+static void mqtt_queue_key ( const mqtt_queue_t* queue, uint32_t sequence, uint8_t* uuid )
+{
+	memset ( uuid, 0x00, sizeof(queue->record->header.block_entry.UUID) );
+	uuid[0] = (uint8_t)(queue->flashKey >> 24);
+	uuid[1] = (uint8_t)(queue->flashKey >> 16);
+	uuid[2] = (uint8_t)(queue->flashKey >> 8);
+	uuid[3] = (uint8_t)(queue->flashKey);
+	uuid[4] = (uint8_t)(sequence >> 24);
+	uuid[5] = (uint8_t)(sequence >> 16);
+	uuid[6] = (uint8_t)(sequence >> 8);
+	uuid[7] = (uint8_t)(sequence);
+}
+
+/**
+* Release the lock of the caller around database I/O.
+*
+* \param    queue		Pointer to the queue
+*
+* \returns  None
+*/
+static void mqtt_queue_unlock ( mqtt_queue_t* queue )
+{
+	if ( queue->lock != NULL )
+		critical_section_release ( queue->lock );
+}
+
+/**
+* Take the lock of the caller again after database I/O.
+*
+* \param    queue		Pointer to the queue
+*
+* \returns  None
+*/
+static void mqtt_queue_relock ( mqtt_queue_t* queue )
+{
+	if ( queue->lock != NULL )
+		critical_section_acquire ( queue->lock );
+}
+
+/**
+* Find a flash tier publish in the index.
+*
+* \param    queue		Pointer to the queue
+* \param	sequence	Sequence number of the publish
+*
+* \returns  Position in the index, -1 if the publish is not in flash.
+*/
+static int32_t mqtt_queue_flash_find ( const mqtt_queue_t* queue, uint32_t sequence )
+{
+	for ( uint32_t position = 0; position < queue->flashCount; position++ )
+	{
+		if ( queue->flashIndex[position].sequence == sequence )
+			return (int32_t)position;
+	}
+	return -1;
+}
+
+/**
+* Delete a flash tier publish.
+* The publish leaves the index before the lock is released for the delete.
+*
+* \param    queue		Pointer to the queue
+* \param	position	Position of the publish in the index
+*
+* \returns  None
+*/
+static void mqtt_queue_flash_delete ( mqtt_queue_t* queue, uint32_t position )
+{
+	service_vtable_t* dbsrv = queue->dbsrv;
+	uint8_t uuid[sizeof(queue->record->header.block_entry.UUID)];
+
+	mqtt_queue_key ( queue, queue->flashIndex[position].sequence, uuid );
+	memmove ( &queue->flashIndex[position], &queue->flashIndex[position + 1],
+			  ( queue->flashCount - position - 1 ) * sizeof(mqtt_queue_flash_t) );
+	queue->flashCount--;
+
+	mqtt_queue_unlock ( queue );
+	dbsrv->iocontrol ( IOCTL_DATABASE_DELETE_RECORD, uuid, sizeof(uuid), NULL, 0, NULL );
+	mqtt_queue_relock ( queue );
+}
+
+/**
+* Move the oldest RAM tier publish to the flash tier.
+* A publish too large for a record is lost.  The publish leaves the RAM
+* tier while the lock is released for the write, and goes back to its front
+* if the write fails.
+*
+* \param    queue		Pointer to the queue
+*
+* \returns  MQTT_QUEUE_SPILLED if the RAM tier shrank,
+*			MQTT_QUEUE_SPILL_FULL if there is no flash tier or it is full,
+*			MQTT_QUEUE_SPILL_FAILED if the flash tier is busy or the database
+*			failed the write.
+*/
+static uint32_t mqtt_queue_spill ( mqtt_queue_t* queue )
+{
+	mqtt_queue_entry_t* entry = queue->head;
+	mqtt_queue_record_t* record = queue->record;
+	service_vtable_t* dbsrv = queue->dbsrv;
+	service_status_t status;
+	uint32_t sequence;
+	uint32_t size;
+
+	if ( entry == NULL || dbsrv == NULL || queue->flashCount >= queue->flashLimit )
+		return MQTT_QUEUE_SPILL_FULL;
+	if ( queue->flashBusy )
+		return MQTT_QUEUE_SPILL_FAILED;
+
+	queue->head = entry->next;
+	if ( queue->head == NULL )
+		queue->tail = NULL;
+	queue->ramBytes -= mqtt_queue_charge ( entry );
+
+	if ( entry->length > MQTT_QUEUE_RECORD_DATA_SIZE )
+	{
+		queue->dropped++;
+		free ( entry );
+		return MQTT_QUEUE_SPILLED;
+	}
+
+	sequence = queue->flashTail++;
+	size     = MQTT_QUEUE_RECORD_HEADER_SIZE + entry->length;
+
+	memset ( &record->header, 0xFF, sizeof(record->header) );
+	mqtt_queue_key ( queue, sequence, record->header.block_entry.UUID );
+	record->header.block_entry.fillInd    = 0x00;
+	record->header.block_entry.recordType = RecordTypeMqttMessage;
+	record->header.block_entry.uuidSize   = sizeof(record->header.block_entry.UUID);
+	record->header.encBytes               = (uint16_t)size;
+	record->qos           = entry->qos;
+	record->retain        = entry->retain;
+	record->topicLength   = entry->topicLength;
+	record->payloadLength = (uint16_t)(entry->length - entry->topicLength);
+	memcpy ( record->data, entry->data, entry->length );
+
+	queue->flashBusy = true;
+	mqtt_queue_unlock ( queue );
+	status = dbsrv->iocontrol ( IOCTL_DATABASE_WRITE_RECORD, record, size, NULL, 0, NULL );
+	mqtt_queue_relock ( queue );
+	queue->flashBusy = false;
+
+	if ( status != SERVICE_STATUS_SUCCESS )
+	{
+		entry->next = queue->head;
+		queue->head = entry;
+		if ( queue->tail == NULL )
+			queue->tail = entry;
+		queue->ramBytes += mqtt_queue_charge ( entry );
+		return MQTT_QUEUE_SPILL_FAILED;
+	}
+
+	/*
+	 * Only one write is made at a time, so the record is the newest in flash
+	 */
+	queue->flashIndex[queue->flashCount].sequence = sequence;
+	queue->flashIndex[queue->flashCount].qos      = entry->qos;
+	queue->flashCount++;
+	queue->spilled++;
+	free ( entry );
+
+	return MQTT_QUEUE_SPILLED;
+}
+
+/**
+* Drop a RAM tier publish.
+*
+* \param    queue		Pointer to the queue
+* \param	entry		Pointer to the publish
+*
+* \returns  None
+*/
+static void mqtt_queue_unlink ( mqtt_queue_t* queue, mqtt_queue_entry_t* entry )
+{
+	mqtt_queue_entry_t* previous = NULL;
+
+	for ( mqtt_queue_entry_t* next = queue->head; next != NULL; previous = next, next = next->next )
+	{
+		if ( next == entry )
+		{
+			if ( previous != NULL )
+				previous->next = entry->next;
+			else
+				queue->head = entry->next;
+			if ( queue->tail == entry )
+				queue->tail = previous;
+
+			queue->ramBytes -= mqtt_queue_charge ( entry );
+			queue->dropped++;
+			free ( entry );
+			return;
+		}
+	}
+}
+
+/**
+* Drop the oldest publish of the lowest quality of service, up to that of
+* the new publish, from either tier.  The flash tier holds the older
+* publishes, so it is searched first.
+*
+* \param    queue		Pointer to the queue
+* \param	qos			Quality of service of the new publish
+*
+* \returns  true if a publish was dropped.
+*/
+static bool mqtt_queue_drop_lowest ( mqtt_queue_t* queue, uint8_t qos )
+{
+	mqtt_queue_entry_t* victim = NULL;
+	int32_t  position = -1;
+	uint32_t lowest   = (uint32_t)qos + 1;
+
+	if ( queue->dbsrv != NULL )
+	{
+		for ( uint32_t index = 0; index < queue->flashCount; index++ )
+		{
+			if ( queue->flashIndex[index].qos < lowest )
+			{
+				lowest   = queue->flashIndex[index].qos;
+				position = (int32_t)index;
+			}
+		}
+	}
+	for ( mqtt_queue_entry_t* entry = queue->head; entry != NULL; entry = entry->next )
+	{
+		if ( entry->qos < lowest )
+		{
+			lowest = entry->qos;
+			victim = entry;
+		}
+	}
+
+	if ( victim != NULL )
+	{
+		mqtt_queue_unlink ( queue, victim );
+	}
+	else if ( position >= 0 )
+	{
+		mqtt_queue_flash_delete ( queue, (uint32_t)position );
+		queue->dropped++;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+/**
+* Make room in the RAM tier for a new publish.
+* A publish is only dropped when the budget is used and the flash tier
+* cannot take the oldest RAM publish because it is full or missing.  When
+* the flash tier is busy or the database fails the write, no queued
+* publish is dropped for the new one.
+*
+* \param    queue		Pointer to the queue
+* \param	size		RAM tier charge of the new publish
+* \param	qos			Quality of service of the new publish
+*
+* \returns  true if the new publish fits.
+*/
+static bool mqtt_queue_make_room ( mqtt_queue_t* queue, uint32_t size, uint8_t qos )
+{
+	if ( size > queue->budget )
+		return false;
+
+	while ( queue->ramBytes + size > queue->budget )
+	{
+		switch ( mqtt_queue_spill ( queue ) )
+		{
+			case MQTT_QUEUE_SPILLED:
+				continue;
+			case MQTT_QUEUE_SPILL_FULL:
+				break;
+			case MQTT_QUEUE_SPILL_FAILED:
+			default:
+				return false;
+		}
+
+		switch ( queue->dropPolicy )
+		{
+			case MQTT_DROP_OLDEST:
+				/*
+				 * The flash tier holds the oldest publishes
+				 */
+				if ( queue->dbsrv != NULL && queue->flashCount != 0 )
+				{
+					mqtt_queue_flash_delete ( queue, 0 );
+					queue->dropped++;
+				}
+				else if ( queue->head != NULL )
+				{
+					mqtt_queue_unlink ( queue, queue->head );
+				}
+				else
+				{
+					return false;
+				}
+				break;
+
+			case MQTT_DROP_LOWEST_QOS:
+				if ( ! mqtt_queue_drop_lowest ( queue, qos ) )
+					return false;
+				break;
+
+			case MQTT_DROP_NEWEST:
+			default:
+				return false;
+		}
+	}
+	return true;
+}
+
+/**
+* Find the flash tier records left by a previous run.
+* Records over the flash tier limit stay in flash for a later run.  Runs
+* with the flash tier busy and the lock released, the index is only
+* published once the scan is done.
+*
+* \param    queue		Pointer to the queue
+*
+* \returns  None
+*/
+static void mqtt_queue_recover ( mqtt_queue_t* queue )
+{
+	database_cursor_fetch_t fetch;
+	service_vtable_t* dbsrv = queue->dbsrv;
+	mqtt_queue_record_t* record = queue->record;
+	uint8_t		 recordType = RecordTypeMqttMessage;
+	uint8_t		 key[4];
+	uint32_t	 bytes;
+	uint32_t	 sequence;
+	uint32_t	 count = 0;
+	uint8_t*	 uuid;
+
+	queue->flashCount = 0;
+	queue->flashTail  = 0;
+	queue->flashBusy  = true;
+	mqtt_queue_unlock ( queue );
+
+	if ( dbsrv->iocontrol ( IOCTL_DATABASE_OPEN_CURSOR, &recordType, sizeof(recordType), &fetch.cursor, sizeof(fetch.cursor), NULL ) == SERVICE_STATUS_SUCCESS )
+	{
+		mqtt_queue_key ( queue, 0, record->header.block_entry.UUID );
+		memcpy ( key, record->header.block_entry.UUID, sizeof(key) );
+
+		/*
+		 * Records come back in key order, so the run of this queue is contiguous
+		 */
+		fetch.count = 1;
+		while ( dbsrv->iocontrol ( IOCTL_DATABASE_FETCH_CURSOR, &fetch, sizeof(fetch), record, sizeof(mqtt_queue_record_t), &bytes ) == SERVICE_STATUS_SUCCESS &&
+				bytes != 0 )
+		{
+			uuid = record->header.block_entry.UUID;
+			if ( memcmp ( uuid, key, sizeof(key) ) != 0 )
+				continue;
+
+			sequence = ((uint32_t)uuid[4] << 24) | ((uint32_t)uuid[5] << 16) | ((uint32_t)uuid[6] << 8) | uuid[7];
+			if ( count < queue->flashLimit )
+			{
+				queue->flashIndex[count].sequence = sequence;
+				queue->flashIndex[count].qos      = record->qos;
+				count++;
+			}
+			queue->flashTail = sequence + 1;
+		}
+
+		dbsrv->iocontrol ( IOCTL_DATABASE_CLOSE_CURSOR, &fetch.cursor, sizeof(fetch.cursor), NULL, 0, NULL );
+	}
+
+	mqtt_queue_relock ( queue );
+	queue->flashBusy  = false;
+	queue->flashCount = (uint16_t)count;
+}
+
+/**
+* Configure the offline queue.
+* With a flash tier the records left by a previous run are picked up again.
+*
+* \param    queue		Pointer to the queue
+* \param	parms		Pointer to the queue parameters
+* \param	lock		Pointer to the lock held by the callers of the queue
+*
+* \returns  true if successful, false if the flash tier is busy or cannot be
+*			set up.
+*/
+bool mqtt_queue_configure ( mqtt_queue_t* queue, const mqtt_offline_queue_parms_t* parms, critical_section_ctx_t* lock )
+{
+	uint16_t limit = ( parms->flashRecords != 0 ) ? parms->flashRecords : MQTT_OFFLINE_FLASH_RECORDS;
+
+	if ( queue->flashBusy )
+		return false;
+
+	queue->lock       = lock;
+	queue->budget     = parms->budget;
+	queue->dropPolicy = parms->dropPolicy;
+	queue->drainRate  = ( parms->drainRate != 0 ) ? parms->drainRate : MQTT_OFFLINE_DRAIN_RATE;
+
+	if ( parms->flash && parms->budget != 0 )
+	{
+		if ( queue->record == NULL )
+		{
+			queue->record = malloc ( sizeof(mqtt_queue_record_t) );
+			if ( queue->record == NULL )
+				return false;
+		}
+		if ( queue->flashIndex == NULL || queue->flashLimit != limit )
+		{
+			free ( queue->flashIndex );
+			queue->flashCount = 0;
+			queue->flashIndex = malloc ( limit * sizeof(mqtt_queue_flash_t) );
+			if ( queue->flashIndex == NULL )
+			{
+				queue->dbsrv = NULL;
+				return false;
+			}
+		}
+
+		service_manager_vtable_t* service_manager = system_get_service_manager();
+		queue->dbsrv      = service_manager->getservice(SRV_SYSTEM_DATABASE);
+		queue->flashKey   = parms->flashKey;
+		queue->flashLimit = limit;
+		if ( queue->dbsrv == NULL )
+			return false;
+
+		mqtt_queue_recover ( queue );
+	}
+	else
+	{
+		queue->dbsrv = NULL;
+		free ( queue->record );
+		queue->record = NULL;
+		free ( queue->flashIndex );
+		queue->flashIndex = NULL;
+		queue->flashCount = 0;
+	}
+
+	/*
+	 * A smaller budget takes effect as publishes are queued
+	 */
+	return true;
+}
+
+/**
+* Release the RAM held by the queue.
+* The flash tier records are kept.
+*
+* \param    queue		Pointer to the queue
+*
+* \returns  None
+*/
+void mqtt_queue_reset ( mqtt_queue_t* queue )
+{
+	mqtt_queue_entry_t* next;
+
+	while ( queue->head != NULL )
+	{
+		next = queue->head->next;
+		free ( queue->head );
+		queue->head = next;
+	}
+	queue->tail     = NULL;
+	queue->ramBytes = 0;
+	queue->budget   = 0;
+	queue->dbsrv    = NULL;
+	free ( queue->record );
+	queue->record   = NULL;
+	free ( queue->flashIndex );
+	queue->flashIndex = NULL;
+	queue->flashCount = 0;
+}
+
+/**
+* Check if the queue is enabled.
+*
+* \param    queue		Pointer to the queue
+*
+* \returns  true if publishes can be queued.
+*/
+bool mqtt_queue_enabled ( const mqtt_queue_t* queue )
+{
+	return ( queue->budget != 0 );
+}
+
+/**
+* Check if the queue is empty.
+*
+* \param    queue		Pointer to the queue
+*
+* \returns  true if no publish is queued in either tier.
+*/
+bool mqtt_queue_empty ( const mqtt_queue_t* queue )
+{
+	/*
+	 * A publish being written to flash is in neither tier
+	 */
+	return ( ! queue->flashBusy && queue->head == NULL && ( queue->dbsrv == NULL || queue->flashCount == 0 ) );
+}
+
+/**
+* Queue a publish.
+* Room is made by spilling to the flash tier or by the drop policy.  When
+* the database fails the write, or the flash tier is busy, only the new
+* publish is dropped.
+*
+* \param    queue		Pointer to the queue
+* \param	topic		Pointer to the topic
+* \param	topicLength	Size of the topic
+* \param	payload		Pointer to the payload segments
+* \param	count		Number of payload segments
+* \param	qos			Quality of service
+* \param	retain		Retain flag
+*
+* \returns  true if queued, false if the publish was dropped.
+*/
+bool mqtt_queue_push ( mqtt_queue_t* queue, const char* topic, uint16_t topicLength, const mqtt_iovec_t* payload, uint32_t count, uint8_t qos, uint8_t retain )
+{
+	mqtt_queue_entry_t* entry;
+	uint32_t length = topicLength;
+	uint32_t offset;
+
+	for ( uint32_t index = 0; index < count; index++ )
+		length += payload[index].length;
+
+	if ( ! mqtt_queue_make_room ( queue, sizeof(mqtt_queue_entry_t) + length, qos ) ||
+		 ( entry = malloc ( sizeof(mqtt_queue_entry_t) + length ) ) == NULL )
+	{
+		queue->dropped++;
+		return false;
+	}
+
+	entry->next        = NULL;
+	entry->length      = length;
+	entry->sequence    = 0;
+	entry->topicLength = topicLength;
+	entry->qos         = qos;
+	entry->retain      = retain;
+	entry->flash       = false;
+
+	memcpy ( entry->data, topic, topicLength );
+	offset = topicLength;
+	for ( uint32_t index = 0; index < count; index++ )
+	{
+		memcpy ( &entry->data[offset], payload[index].base, payload[index].length );
+		offset += payload[index].length;
+	}
+
+	if ( queue->tail != NULL )
+		queue->tail->next = entry;
+	else
+		queue->head = entry;
+	queue->tail = entry;
+	queue->ramBytes += mqtt_queue_charge ( entry );
+	queue->queued++;
+
+	return true;
+}
+
+/**
+* Take the oldest publish for sending.
+* A flash tier publish stays in flash until it is completed.
+*
+* \param    queue		Pointer to the queue
+*
+* \returns  Pointer to the publish, NULL if the queue is empty or the flash
+*			tier is busy.
+*/
+mqtt_queue_entry_t* mqtt_queue_pop ( mqtt_queue_t* queue )
+{
+	mqtt_queue_entry_t* entry;
+	mqtt_queue_record_t* record = queue->record;
+	uint8_t uuid[sizeof(record->header.block_entry.UUID)];
+	service_status_t status;
+	uint32_t sequence;
+	uint32_t length;
+	int32_t  position;
+
+	/*
+	 * The publish being written to flash is older than the RAM tier
+	 */
+	if ( queue->flashBusy )
+		return NULL;
+
+	while ( queue->dbsrv != NULL && queue->flashCount != 0 )
+	{
+		service_vtable_t* dbsrv = queue->dbsrv;
+
+		sequence = queue->flashIndex[0].sequence;
+		mqtt_queue_key ( queue, sequence, uuid );
+
+		queue->flashBusy = true;
+		mqtt_queue_unlock ( queue );
+		status = dbsrv->iocontrol ( IOCTL_DATABASE_READ_RECORD, uuid, sizeof(uuid), record, sizeof(mqtt_queue_record_t), NULL );
+		mqtt_queue_relock ( queue );
+		queue->flashBusy = false;
+
+		/*
+		 * The publish may have been completed or dropped meanwhile
+		 */
+		position = mqtt_queue_flash_find ( queue, sequence );
+		if ( position < 0 )
+			continue;
+
+		if ( status == SERVICE_STATUS_SUCCESS && record->header.encBytes >= MQTT_QUEUE_RECORD_HEADER_SIZE )
+		{
+			length = record->header.encBytes - MQTT_QUEUE_RECORD_HEADER_SIZE;
+			entry  = malloc ( sizeof(mqtt_queue_entry_t) + length );
+			if ( entry == NULL )
+				return NULL;
+
+			entry->next        = NULL;
+			entry->length      = length;
+			entry->sequence    = sequence;
+			entry->topicLength = record->topicLength;
+			entry->qos         = record->qos;
+			entry->retain      = record->retain;
+			entry->flash       = true;
+			memcpy ( entry->data, record->data, length );
+			return entry;
+		}
+
+		/*
+		 * A record that cannot be read is lost
+		 */
+		mqtt_queue_flash_delete ( queue, (uint32_t)position );
+		queue->dropped++;
+	}
+
+	entry = queue->head;
+	if ( entry != NULL )
+	{
+		queue->head = entry->next;
+		if ( queue->head == NULL )
+			queue->tail = NULL;
+		queue->ramBytes -= mqtt_queue_charge ( entry );
+		entry->next = NULL;
+	}
+	return entry;
+}
+
+/**
+* Complete a publish taken by mqtt_queue_pop.
+* A publish that could not be sent goes back to the front of the queue.
+*
+* \param    queue		Pointer to the queue
+* \param	entry		Pointer to the publish
+* \param	sent		true if the publish was sent
+*
+* \returns  None
+*/
+void mqtt_queue_complete ( mqtt_queue_t* queue, mqtt_queue_entry_t* entry, bool sent )
+{
+	if ( entry->flash )
+	{
+		/*
+		 * The drop policy may have removed the record while it was sent
+		 */
+		int32_t position = ( sent && queue->dbsrv != NULL ) ? mqtt_queue_flash_find ( queue, entry->sequence ) : -1;
+		if ( position >= 0 )
+			mqtt_queue_flash_delete ( queue, (uint32_t)position );
+		free ( entry );
+	}
+	else if ( sent || ! mqtt_queue_enabled ( queue ) )
+	{
+		free ( entry );
+	}
+	else
+	{
+		entry->next = queue->head;
+		queue->head = entry;
+		if ( queue->tail == NULL )
+			queue->tail = entry;
+		queue->ramBytes += mqtt_queue_charge ( entry );
+	}
+}
@@ -0,0 +1,187 @@
+
+/**
+* mqtt_offline_queue.h
+*
+* \copyright
+* Copyright 2017 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the MQTT offline publish queue.
+*
+* Publishes made while a broker session is down are held in a RAM tier with
+* a byte budget.  When the RAM tier is full its oldest publishes can spill
+* to a flash tier kept as database records, so the flash tier always holds
+* the oldest publishes and the queue drains flash first.  When neither tier
+* has room the drop policy picks the publish that is lost.  Every call is
+* made with the MQTT core lock held.  The queue releases the lock around
+* database reads, writes and deletes, so a slow flash does not hold up the
+* other brokers, and marks the flash tier busy meanwhile.
+*/
+
+#ifndef SRC_SERVICES_MQTT_MQTT_OFFLINE_QUEUE_H_
+#define SRC_SERVICES_MQTT_MQTT_OFFLINE_QUEUE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <aef/embedded/osal/critical_section.h>
+#include <aef/embedded/service/mqtt/mqtt_service.h>
+#include <aef/embedded/service/database/database_service.h>
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+/**
+* Queued publish structure definition
+*/
+typedef struct _mqtt_queue_entry_def
+{
+	struct _mqtt_queue_entry_def* next;		// Next newer publish
+	uint32_t	 length;					// Size of the topic and payload
+	uint32_t	 sequence;					// Flash record sequence number
+	uint16_t	 topicLength;				// Size of the topic
+	uint8_t		 qos;						// Quality of service (0, 1, 2)
+	uint8_t		 retain;					// Retain flag
+	uint8_t		 flash;						// Copy of the oldest flash record
+	uint8_t		 data[];					// Topic followed by the payload
+} mqtt_queue_entry_t;
+
+/**
+* Flash tier record structure definition
+*/
+struct _mqtt_queue_record_def
+{
+	EntryHeader_t header;					// Key is the queue key and sequence number
+	uint8_t		 qos;						// Quality of service (0, 1, 2)
+	uint8_t		 retain;					// Retain flag
+	uint16_t	 topicLength;				// Size of the topic
+	uint16_t	 payloadLength;				// Size of the payload
+	uint8_t		 data[DATABASE_MAX_RECORD_SIZE - sizeof(EntryHeader_t) - 6];	// Topic followed by the payload
+} __attribute__((__packed__));
+typedef struct _mqtt_queue_record_def mqtt_queue_record_t;
+
+#define MQTT_QUEUE_RECORD_DATA_SIZE	(sizeof(((mqtt_queue_record_t*)0)->data))
+
+/**
+* Flash tier index entry structure definition
+*/
+typedef struct _mqtt_queue_flash_def
+{
+	uint32_t	 sequence;					// Flash record sequence number
+	uint8_t		 qos;						// Quality of service (0, 1, 2)
+} mqtt_queue_flash_t;
+
+/**
+* Offline publish queue structure definition
+*/
+typedef struct _mqtt_queue_def
+{
+	mqtt_queue_entry_t*	head;				// Oldest publish in RAM
+	mqtt_queue_entry_t*	tail;				// Newest publish in RAM
+	uint32_t	 ramBytes;					// RAM tier bytes in use
+	uint32_t	 budget;					// RAM tier byte budget, 0 when disabled
+	uint8_t		 dropPolicy;				// MQTT_DROP_xxx
+	uint16_t	 drainRate;					// Publishes sent per service task run
+	critical_section_ctx_t* lock;			// MQTT core lock, released around database I/O
+	service_vtable_t*	dbsrv;				// Database service, NULL without a flash tier
+	mqtt_queue_record_t* record;			// Flash record memory
+	mqtt_queue_flash_t* flashIndex;			// Flash records, oldest first
+	uint32_t	 flashKey;					// Key prefix of the flash records
+	uint16_t	 flashLimit;				// Flash tier record limit
+	uint16_t	 flashCount;				// Flash records in the index
+	uint32_t	 flashTail;					// Sequence number of the next flash record
+	bool		 flashBusy;					// Flash record memory in use with the lock released
+	uint32_t	 queued;					// Publishes queued
+	uint32_t	 dropped;					// Publishes lost to the drop policy
+	uint32_t	 spilled;					// Publishes moved to the flash tier
+} mqtt_queue_t;
+
+/**
+* Configure the offline queue.
+* With a flash tier the records left by a previous run are picked up again.
+*
+* \param    queue		Pointer to the queue
+* \param	parms		Pointer to the queue parameters
+* \param	lock		Pointer to the lock held by the callers of the queue
+*
+* \returns  true if successful, false if the flash tier is busy or cannot be
+*			set up.
+*/
+bool mqtt_queue_configure ( mqtt_queue_t* queue, const mqtt_offline_queue_parms_t* parms, critical_section_ctx_t* lock );
+
+/**
+* Release the RAM held by the queue.
+* The flash tier records are kept.
+*
+* \param    queue		Pointer to the queue
+*
+* \returns  None
+*/
+void mqtt_queue_reset ( mqtt_queue_t* queue );
+
+/**
+* Check if the queue is enabled.
+*
+* \param    queue		Pointer to the queue
+*
+* \returns  true if publishes can be queued.
+*/
+bool mqtt_queue_enabled ( const mqtt_queue_t* queue );
+
+/**
+* Check if the queue is empty.
+*
+* \param    queue		Pointer to the queue
+*
+* \returns  true if no publish is queued in either tier.
+*/
+bool mqtt_queue_empty ( const mqtt_queue_t* queue );
+
+/**
+* Queue a publish.
+* Room is made by spilling to the flash tier or by the drop policy.  When
+* the database fails the write, or the flash tier is busy, only the new
+* publish is dropped.
+*
+* \param    queue		Pointer to the queue
+* \param	topic		Pointer to the topic
+* \param	topicLength	Size of the topic
+* \param	payload		Pointer to the payload segments
+* \param	count		Number of payload segments
+* \param	qos			Quality of service
+* \param	retain		Retain flag
+*
+* \returns  true if queued, false if the publish was dropped.
+*/
+bool mqtt_queue_push ( mqtt_queue_t* queue, const char* topic, uint16_t topicLength, const mqtt_iovec_t* payload, uint32_t count, uint8_t qos, uint8_t retain );
+
+/**
+* Take the oldest publish for sending.
+* A flash tier publish stays in flash until it is completed.
+*
+* \param    queue		Pointer to the queue
+*
+* \returns  Pointer to the publish, NULL if the queue is empty or the flash
+*			tier is busy.
+*/
+mqtt_queue_entry_t* mqtt_queue_pop ( mqtt_queue_t* queue );
+
+/**
+* Complete a publish taken by mqtt_queue_pop.
+* A publish that could not be sent goes back to the front of the queue.
+*
+* \param    queue		Pointer to the queue
+* \param	entry		Pointer to the publish
+* \param	sent		true if the publish was sent
+*
+* \returns  None
+*/
+void mqtt_queue_complete ( mqtt_queue_t* queue, mqtt_queue_entry_t* entry, bool sent );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* SRC_SERVICES_MQTT_MQTT_OFFLINE_QUEUE_H_ */
@@ -20,9 +20,39 @@
 #include <aef/embedded/system/system_management.h>
 #include <aef/embedded/osal/time.h>
 #include <aef/embedded/osal/time_delay.h>
+#include <aef/embedded/osal/critical_section.h>
+#include <aef/embedded/osal/thread.h>
+#include <aef/embedded/osal/event.h>
 #include <string.h>
 
 #include "bsp.h"
+#include "mqtt_offline_queue.h"
+#include "mqtt_topic_trie.h"
+#include "mqtt_sn.h"
+
+/**
+* MQTT inflight publish state identifier definitions
+*/
+#define MQTT_INFLIGHT_FREE			0x00	// Entry not in use
+#define MQTT_INFLIGHT_RESERVED		0x01	// Packet id taken, publish being built
+#define MQTT_INFLIGHT_WAIT_PUBACK	0x02	// QoS 1 publish sent
+#define MQTT_INFLIGHT_WAIT_PUBREC	0x03	// QoS 2 publish sent
+#define MQTT_INFLIGHT_WAIT_PUBCOMP	0x04	// QoS 2 release sent
+
+/**
+* MQTT inflight publish structure definition
+*/
+typedef struct
+{
+	uint8_t* packet;							// Copy of the PUBLISH packet for retransmission
+	uint32_t size;								// Size of the packet
+	uint64_t firstSent;							// Tick count of the first transmission
+	uint64_t sentTime;							// Tick count of the last transmission
+	uint32_t interval;							// Retransmit interval (ticks)
+	uint16_t messageId;							// Packet id
+	uint8_t state;								// MQTT_INFLIGHT_xxx
+	uint8_t retries;							// Retransmits so far
+} mqttInflight_t;
 
 /**
 * MQTT broker context structure definition
@@ -33,6 +63,10 @@ typedef struct
 	socket_desc_t socket;						// Transport descriptor
     uint8_t* buffer;                            // Message buffer memory
     uint8_t* recvBuffer;						// Message receive memory
+    uint16_t rxStart;							// Start of the unparsed received bytes
+    uint16_t rxEnd;								// End of the received bytes
+    uint32_t rxPacketSize;						// Size of the packet at rxStart, 0 if not yet decoded
+    uint32_t rxDiscard;							// Bytes left of a packet too large for the receive memory
     uint16_t bufferSize;                        // Size of message buffer memory
     uint8_t* varHeader;                         // Variable length header memory
     uint16_t varHeaderSize;                     // Size of variable length header memory
@@ -56,6 +90,44 @@ typedef struct
     uint8_t state;								// Service task state
     uint8_t substate;							// Service task substate
     uint8_t status;								// Status flags
+    // Session timers
+    uint64_t stateTime;							// Tick count the connect, reconnect or session wait started
+    uint64_t lastSent;							// Tick count of the last packet sent
+    uint64_t pingSent;							// Tick count of the outstanding PINGREQ, 0 if none
+    uint32_t reconnectDelay;					// Next reconnect delay (ticks)
+    uint16_t reconnectMin;						// First reconnect delay (seconds), 0 if disabled
+    uint16_t reconnectMax;						// Reconnect delay limit (seconds)
+    // QoS 1 and 2 delivery
+    mqttInflight_t inflight[MQTT_INFLIGHT_WINDOW];	// Publishes awaiting acknowledgement
+    uint8_t inflightWindow;						// Inflight entries in use (1 - MQTT_INFLIGHT_WINDOW)
+    // Offline publishes
+    mqtt_queue_t queue;							// Publishes waiting for the session
+    // Received publishes
+    mqtt_topic_node_t* topics;					// Topic handlers
+    mqtt_topic_matches_t topicMatches;			// Handlers of the publish being dispatched
+    // Statistics
+    mqtt_statistics_t statistics;				// Counters since initialization or reset
+    uint64_t statisticsTime;					// Tick count the counters were reset
+    // Publish coalescing
+    uint8_t* coalesce;							// Coalescing buffer, NULL when disabled
+    uint16_t coalesceSize;						// Size of the coalescing buffer
+    uint16_t coalesceUsed;						// Bytes waiting in the coalescing buffer
+    uint32_t coalesceDelay;						// Longest wait for the send (ticks)
+    uint64_t coalesceTime;						// Tick count the oldest waiting publish was packed
+    // Transmit stream
+    critical_section_ctx_t txLock;				// Guards txBusy
+    volatile bool txBusy;						// Set while a sender owns the socket and the coalescing buffer
+    volatile bool txLost;						// Set by a sender that cut a packet short, the service task drops the session
+    // MQTT-SN
+    uint8_t transport;							// MQTT_TRANSPORT_xxx
+    uint8_t snState;							// MQTT-SN client state
+    uint16_t sleepDuration;						// MQTT-SN sleep duration (seconds), 0 to stay active
+    mqtt_sn_topic_t snTopics[MQTT_SN_MAX_TOPICS];	// Predefined and gateway registered topic ids
+    // Worker task (MQTT_WORKER_THREAD)
+    thread_ctx_t worker;						// Worker task running the service task
+    event_ctx_t wake;							// Set to run the worker task before its timeout
+    volatile bool workerStop;					// Set to stop the worker task
+    volatile bool workerStopped;				// Set by the worker task once stopped
 } mqttBrokerCtx_t;
 
 /**
@@ -86,25 +158,87 @@ static service_status_t mqtt_core_subscribe (service_ctx_t* ctx, void* input_buf
 static service_status_t mqtt_core_unsubscribe (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
 static service_status_t mqtt_core_ping_req (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
 static service_status_t mqtt_core_deinitialize (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+static service_status_t mqtt_core_publish_ex (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+static service_status_t mqtt_core_set_inflight_window (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+static service_status_t mqtt_core_set_offline_queue (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+static service_status_t mqtt_core_set_reconnect (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+static service_status_t mqtt_core_add_topic_handler (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+static service_status_t mqtt_core_remove_topic_handler (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+static service_status_t mqtt_core_get_statistics (service_ctx_t* ctx, void* input_buffer, uint32_t input_size, void* output_buffer, uint32_t output_size, uint32_t* bytes_transferred);
+static service_status_t mqtt_core_reset_statistics (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+static service_status_t mqtt_core_set_coalescing (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+static service_status_t mqtt_core_flush (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+static service_status_t mqtt_core_set_transport (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
+static service_status_t mqtt_core_register_topic (service_ctx_t* ctx, void* input_buffer, uint32_t input_size);
 
 /**
 * Internal helper routines.
 */
 static uint32_t mqtt_connect ( mqttBrokerCtx_t* broker );
-static uint32_t mqtt_publish_with_qos ( mqttBrokerCtx_t* broker, const char* topic, const char* msg, uint8_t retain, uint8_t qos, uint16_t* message_id );
+static service_status_t mqtt_publish_or_queue ( mqttBrokerCtx_t* broker, const char* topic, uint16_t topic_len, const mqtt_iovec_t* payload, uint32_t payload_count, uint8_t retain, uint8_t qos, uint16_t* message_id );
+static uint32_t mqtt_publish_segments ( mqttBrokerCtx_t* broker, const char* topic, uint16_t topic_len, const mqtt_iovec_t* payload, uint32_t payload_count, uint8_t retain, uint8_t qos, uint16_t* message_id );
+static void     mqtt_count_publish ( mqttBrokerCtx_t* broker, uint8_t qos, uint32_t msglen );
 static uint32_t mqtt_subscribe_unsubscribe ( mqttBrokerCtx_t* broker, uint8_t subUnsub, const char* topic, uint8_t qos, uint16_t* message_id );
 static uint32_t mqtt_disconnect ( mqttBrokerCtx_t* broker );
+static uint32_t mqtt_sn_connect ( mqttBrokerCtx_t* broker );
+static uint32_t mqtt_sn_publish ( mqttBrokerCtx_t* broker, const char* topic, uint16_t topic_len, const mqtt_iovec_t* payload, uint32_t payload_count, uint32_t msglen, uint8_t retain, uint8_t qos, uint16_t* message_id );
+static uint32_t mqtt_sn_subscribe_unsubscribe ( mqttBrokerCtx_t* broker, uint8_t subUnsub, const char* topic, uint8_t qos, uint16_t* message_id );
+static int32_t  mqtt_send_pingreq ( mqttBrokerCtx_t* broker );
+static int32_t  mqtt_sn_send_ack ( mqttBrokerCtx_t* broker, uint8_t msgType, uint16_t topicId, uint16_t messageId, uint8_t returnCode );
 static int32_t  mqtt_send_packet ( mqttBrokerCtx_t* broker, uint8_t* packet, uint32_t size, uint32_t timeout );
-static int32_t  mqtt_recv_packet ( mqttBrokerCtx_t* broker, uint8_t* packet, uint32_t size, uint32_t timeout );
+static int32_t  mqtt_send_segments ( mqttBrokerCtx_t* broker, const mqtt_iovec_t* segments, uint32_t count, uint32_t timeout );
+static int32_t  mqtt_send_publish ( mqttBrokerCtx_t* broker, const mqtt_iovec_t* segments, uint32_t count );
+static int32_t  mqtt_coalesce_flush ( mqttBrokerCtx_t* broker );
+static void     mqtt_tx_acquire ( mqttBrokerCtx_t* broker );
+static void     mqtt_tx_release ( mqttBrokerCtx_t* broker );
+static uint8_t  mqtt_encode_rem_len ( uint8_t* buf, uint32_t length );
+static int32_t  mqtt_recv_fill ( mqttBrokerCtx_t* broker );
+static int32_t  mqtt_recv_next ( mqttBrokerCtx_t* broker, const uint8_t** packet );
+static void     mqtt_recv_reset ( mqttBrokerCtx_t* broker );
 static uint16_t mqtt_increment_sequence ( mqttBrokerCtx_t* broker );
+static uint16_t mqtt_next_packet_id ( mqttBrokerCtx_t* broker );
+static uint32_t mqtt_inflight_used ( mqttBrokerCtx_t* broker );
+static bool     mqtt_qos_valid ( mqttBrokerCtx_t* broker, uint8_t qos );
+static mqttInflight_t* mqtt_inflight_alloc ( mqttBrokerCtx_t* broker, uint32_t size );
+static uint32_t mqtt_inflight_send ( mqttBrokerCtx_t* broker, mqttInflight_t* entry, uint8_t qos );
+static void     mqtt_inflight_release ( mqttInflight_t* entry );
+static void     mqtt_inflight_delivered ( mqttBrokerCtx_t* broker, mqttInflight_t* entry, uint64_t now );
+static void     mqtt_inflight_ack ( mqttBrokerCtx_t* broker, uint8_t msgType, uint16_t messageId );
+static void     mqtt_inflight_restart ( mqttBrokerCtx_t* broker );
+static int32_t  mqtt_send_pubrel ( mqttBrokerCtx_t* broker, uint16_t messageId );
 static void     mqtt_resolve_hostname ( mqttBrokerCtx_t* broker );
+static bool     mqtt_socket_open ( mqttBrokerCtx_t* broker );
+static uint32_t mqtt_socket_state ( mqttBrokerCtx_t* broker );
+static void     mqtt_socket_close ( mqttBrokerCtx_t* broker );
 
 /**
 * MQTT task routines
 */
 static void mqtt_task_connect ( mqttBrokerCtx_t* broker );
+static void mqtt_task_start ( mqttBrokerCtx_t* broker );
+static void mqtt_task_lost ( mqttBrokerCtx_t* broker );
+static void mqtt_task_reconnect ( mqttBrokerCtx_t* broker );
+static void mqtt_task_backoff ( mqttBrokerCtx_t* broker );
 static void mqtt_task_online ( mqttBrokerCtx_t* broker );
+static void mqtt_task_dispatch ( mqttBrokerCtx_t* broker, const uint8_t* packet );
 static void mqtt_task_disconnect ( mqttBrokerCtx_t* broker );
+static void mqtt_task_retransmit ( mqttBrokerCtx_t* broker );
+static void mqtt_task_drain ( mqttBrokerCtx_t* broker );
+static void mqtt_task_flush ( mqttBrokerCtx_t* broker );
+static void mqtt_task_deliver ( mqttBrokerCtx_t* broker, const char* topic, uint32_t topic_len, const char* message, uint32_t message_len, uint8_t dup, uint8_t qos, uint8_t retain, uint16_t message_id );
+static void mqtt_sn_task_online ( mqttBrokerCtx_t* broker );
+static void mqtt_sn_task_dispatch ( mqttBrokerCtx_t* broker, const uint8_t* packet, uint32_t size );
+static void mqtt_sn_task_keepalive ( mqttBrokerCtx_t* broker );
+static bool mqtt_worker_start ( mqttBrokerCtx_t* broker );
+static void mqtt_worker_stop ( mqttBrokerCtx_t* broker );
+static void mqtt_worker_wake ( mqttBrokerCtx_t* broker );
+static uint32_t mqtt_worker_timeout ( mqttBrokerCtx_t* broker );
+static void mqtt_worker_task ( void* instance );
+
+/**
+* MQTT service critical section, guards the inflight tables
+*/
+static critical_section_ctx_t mqtt_cs;
 
 /**
 * MQTT task state identifier definitions
@@ -113,6 +247,23 @@ static void mqtt_task_disconnect ( mqttBrokerCtx_t* broker );
 #define MQTT_STATE_CONNECT		0x01
 #define MQTT_STATE_ONLINE		0x02
 #define MQTT_STATE_DISCONNECT	0x04
+#define MQTT_STATE_BACKOFF		0x08
+
+/**
+* MQTT task substate identifier definitions
+*/
+#define MQTT_CONNECT_START		0x00	// Waiting for the address, then opening the socket
+#define MQTT_CONNECT_WAIT		0x01	// Waiting for the TCP connection
+#define MQTT_DISCONNECT_USER	0x00	// Disconnect requested by the client
+#define MQTT_DISCONNECT_LOST	0x01	// Connection lost, reconnect if enabled
+
+/**
+* MQTT-SN client states
+*/
+#define MQTT_SN_CONNECTING		0x00	// CONNECT sent, waiting for the CONNACK
+#define MQTT_SN_ACTIVE			0x01	// Session active
+#define MQTT_SN_ASLEEP			0x02	// Asleep, the gateway holds publishes for the client
+#define MQTT_SN_AWAKE			0x03	// Awake, collecting the publishes held by the gateway
 
 /**
 * Extract the message type from buffer.
@@ -191,25 +342,55 @@ uint8_t mqtt_num_rem_len_bytes (const uint8_t* buf)
 *
 * /return remaining length
 */
-uint16_t mqtt_parse_rem_len (const uint8_t* buf)
+uint32_t mqtt_parse_rem_len (const uint8_t* buf)
 {
-    uint16_t multiplier = 1;
-    uint16_t value = 0;
+    uint32_t multiplier = 1;
+    uint32_t value = 0;
     uint8_t digit;
+    uint8_t count = 0;
 
     buf++;	// skip "flags" byte in fixed header
 
     do
     {
     	digit = *buf;
-    	value += (digit & 0x7F) * multiplier;
+    	value += (uint32_t)(digit & 0x7F) * multiplier;
     	multiplier *= 128;
     	buf++;
-    } while ((digit & 0x80) != 0);
+    } while ((digit & 0x80) != 0 && ++count < 4);
 
     return value;
 }
 
+/**
+* Encode a remaining length value.
+*
+* The remaining length is encoded 7 bits at a time, least significant
+* group first, with the MSB of each byte set when more bytes follow.
+*
+* /param buf            Pointer to storage for up to 4 bytes.
+* /param length         Remaining length (up to MQTT_MAX_REMAINING_LENGTH).
+*
+* /return number of bytes (1 - 4)
+*/
+uint8_t mqtt_encode_rem_len (uint8_t* buf, uint32_t length)
+{
+    uint8_t num_bytes = 0;
+
+    do
+    {
+    	uint8_t digit = length % 128;
+    	length /= 128;
+    	if (length > 0)
+    	{
+    		digit |= 0x80;
+    	}
+    	buf[num_bytes++] = digit;
+    } while (length > 0 && num_bytes < 4);
+
+    return num_bytes;
+}
+
 /**
 * Parse packet buffer for message id.
 *
@@ -312,9 +493,9 @@ uint16_t mqtt_parse_pub_topic (const uint8_t* buf, uint8_t* topic)
 *
 *  Not called directly - called by mqtt_parse_pub_msg
 */
-uint16_t mqtt_parse_pub_msg_ptr (const uint8_t* buf, const uint8_t **msg_ptr)
+uint32_t mqtt_parse_pub_msg_ptr (const uint8_t* buf, const uint8_t **msg_ptr)
 {
-    uint16_t len = 0;
+    uint32_t len = 0;
 
     if (MQTTParseMessageType(buf) == MQTT_MSG_PUBLISH)
     {
@@ -360,11 +541,11 @@ uint16_t mqtt_parse_pub_msg_ptr (const uint8_t* buf, const uint8_t **msg_ptr)
 *
 * /return size in bytes of topic (0 = no publish message in buffer)
 */
-uint16_t mqtt_parse_publish_msg (const uint8_t* buf, uint8_t* msg)
+uint32_t mqtt_parse_publish_msg (const uint8_t* buf, uint8_t* msg)
 {
     const uint8_t* ptr;
 
-    uint16_t msg_len = mqtt_parse_pub_msg_ptr(buf, &ptr);
+    uint32_t msg_len = mqtt_parse_pub_msg_ptr(buf, &ptr);
 
     if(msg_len != 0 && ptr != NULL)
     {
@@ -403,29 +584,42 @@ void mqtt_dns_resolved_addr_handler (const struct fnet_dns_resolved_addr *addr_l
 *
 * \returns  none
 */
-void mqtt_task_keepalive ( mqttBrokerCtx_t* brokerCtx )
+void mqtt_task_keepalive ( mqttBrokerCtx_t* broker )
 {
-	static uint64_t OSTime = 0L;
-	static uint64_t KeepAliveDelay = 0L;
+	uint64_t now = time_get_ticks(NULL);
 
-	if ( (brokerCtx->status & MQTT_KEEP_ALIVE_ENABLED) )
+	if ( broker->transport == MQTT_TRANSPORT_SN )
+	{
+		mqtt_sn_task_keepalive ( broker );
+	}
+	else if ( ! ( broker->status & MQTT_STATUS_SESSION_ACTIVE ) )
 	{
-		OSTime = time_get_ticks(NULL);
-		if ( KeepAliveDelay == 0L )
+		/**
+		* No CONNACK from the server
+		*/
+		if ( now - broker->stateTime > MQTT_CONNECT_TIMEOUT * CFG_SYSTICK_FREQ )
 		{
-			KeepAliveDelay = OSTime + ((brokerCtx->alive * 1000)*CFG_SYSTICK_FREQ + 500)/1000;
+			mqtt_task_lost ( broker );
 		}
-		if ( OSTime > KeepAliveDelay )
+	}
+	else if ( broker->pingSent != 0 )
+	{
+		/**
+		* No PINGRESP from the server
+		*/
+		if ( now - broker->pingSent > MQTT_PING_TIMEOUT * CFG_SYSTICK_FREQ )
 		{
-		    uint8_t packet[2] =
-		    {
-		    	MQTT_MSG_PINGREQ, // Message Type, DUP flag, QoS level, Retain
-				0x00              // Remaining length
-		    };
-		    mqtt_send_packet ( brokerCtx, packet, sizeof(packet), 0L );
-			KeepAliveDelay = 0L;
+			mqtt_task_lost ( broker );
 		}
 	}
+	else if ( (broker->status & MQTT_KEEP_ALIVE_ENABLED) &&
+			  now - broker->lastSent >= (uint64_t)broker->alive * CFG_SYSTICK_FREQ )
+	{
+	    if ( mqtt_send_pingreq ( broker ) > 0 )
+	    {
+	    	broker->pingSent = now | 1;
+	    }
+	}
 }
 
 /**
@@ -445,6 +639,18 @@ void mqtt_service_task ( void* instance )
 	{
 		mqttBrokerCtx_t* brokerCtx = (mqttBrokerCtx_t*)instance;
 
+		/**
+		* A sender cut a packet short
+		*/
+		if ( brokerCtx->txLost )
+		{
+			brokerCtx->txLost = false;
+			if ( brokerCtx->state == MQTT_STATE_ONLINE || brokerCtx->state == MQTT_STATE_CONNECT )
+			{
+				mqtt_task_lost ( brokerCtx );
+			}
+		}
+
 		switch (brokerCtx->state)
 		{
 			case MQTT_STATE_CONNECT:
@@ -452,11 +658,17 @@ void mqtt_service_task ( void* instance )
 				break;
 			case MQTT_STATE_ONLINE:
 				mqtt_task_online ( brokerCtx );
+				mqtt_task_retransmit ( brokerCtx );
+				mqtt_task_drain ( brokerCtx );
+				mqtt_task_flush ( brokerCtx );
 				mqtt_task_keepalive ( brokerCtx );
 				break;
 			case MQTT_STATE_DISCONNECT:
 				mqtt_task_disconnect ( brokerCtx );
 				break;
+			case MQTT_STATE_BACKOFF:
+				mqtt_task_backoff ( brokerCtx );
+				break;
 			case MQTT_STATE_IDLE:
 			default:
 				break;
@@ -465,6 +677,141 @@ void mqtt_service_task ( void* instance )
 	return;
 }
 
+/**
+* Start the worker task of a broker
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	true if the worker task is running.
+*/
+bool mqtt_worker_start ( mqttBrokerCtx_t* broker )
+{
+	if ( event_create ( &broker->wake, "MQTT_WAKE", false, false ) == SYSTEM_STATUS_SUCCESS )
+	{
+		if ( thread_create ( &broker->worker,
+							 MQTT_WORKER_STACK_SIZE,
+							 DEFAULT_QUANTUM,
+							 MQTT_WORKER_PRIORITY,
+							 0,
+							 mqtt_worker_task,
+							 (uint32_t)(uintptr_t)broker ) == SYSTEM_STATUS_SUCCESS )
+		{
+			thread_start ( &broker->worker );
+			return true;
+		}
+		event_destroy ( &broker->wake );
+	}
+	return false;
+}
+
+/**
+* Stop the worker task of a broker
+*
+* Waits for the worker task to finish the service task pass it is running,
+* so the broker context can be released afterwards.
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_worker_stop ( mqttBrokerCtx_t* broker )
+{
+	broker->workerStop = true;
+	event_signal ( &broker->wake );
+	while ( ! broker->workerStopped )
+	{
+		time_delay ( MQTT_WORKER_RX_POLL );
+	}
+	thread_destroy ( &broker->worker );
+	event_destroy ( &broker->wake );
+}
+
+/**
+* Run the worker task of a broker now
+*
+* Called when a publish is queued or coalesced and when the broker state is
+* changed from outside the service task.  Nothing to do with the system
+* management task, it runs on its own period.
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_worker_wake ( mqttBrokerCtx_t* broker )
+{
+	if ( MQTT_WORKER_THREAD )
+	{
+		event_signal ( &broker->wake );
+	}
+}
+
+/**
+* Time the worker task can sleep before the service task must run again
+*
+* While a socket is open the socket is read every MQTT_WORKER_RX_POLL, the
+* keep-alive, retransmit and coalescing deadlines are all coarser than
+* that.  Waiting to reconnect sleeps out the reconnect delay and an idle
+* broker sleeps until it is woken.  The event wait hands the timeout to
+* the kernel as is, so it is counted in ticks.
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	Timeout in ticks, EVENT_WAIT_INFINITE to wait for a wake up.
+*/
+uint32_t mqtt_worker_timeout ( mqttBrokerCtx_t* broker )
+{
+	uint32_t poll = ( MQTT_WORKER_RX_POLL * CFG_SYSTICK_FREQ + 999 ) / 1000;
+	uint64_t elapsed;
+
+	switch ( broker->state )
+	{
+		case MQTT_STATE_IDLE:
+			return EVENT_WAIT_INFINITE;
+		case MQTT_STATE_BACKOFF:
+			elapsed = time_get_ticks(NULL) - broker->stateTime;
+			if ( elapsed < broker->reconnectDelay )
+			{
+				return (uint32_t)( broker->reconnectDelay - elapsed );
+			}
+			break;
+		default:
+			break;
+	}
+	return ( poll != 0 ) ? poll : 1;
+}
+
+/**
+* MQTT worker task
+*
+* Runs the service task of one broker when MQTT_WORKER_THREAD is set.
+* Between passes the task sleeps until woken or until the next deadline,
+* so received packets are handled within MQTT_WORKER_RX_POLL instead of the
+* system management period.
+*
+* \param    instance		Pointer to the broker context
+*
+* \returns  none
+*/
+void mqtt_worker_task ( void* instance )
+{
+	mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)instance;
+
+	while ( ! broker->workerStop )
+	{
+		mqtt_service_task ( broker );
+		event_wait_single ( &broker->wake, mqtt_worker_timeout ( broker ) );
+	}
+
+	/**
+	* Wait here to be destroyed
+	*/
+	broker->workerStopped = true;
+	for ( ;; )
+	{
+		thread_suspend ( &broker->worker );
+	}
+}
+
 /**
 * Initialize the MQTT service.
 *
@@ -478,7 +825,7 @@ service_status_t mqtt_core_init (service_ctx_t* ctx)
 {
 	service_manager_vtable_t* service_manager = system_get_service_manager();
 	ctx->ctx = service_manager->getservice(SRV_FNET_NETWORK);
-	if ( ctx->ctx != NULL)
+	if ( ctx->ctx != NULL && critical_section_create (&mqtt_cs) == SYSTEM_STATUS_SUCCESS )
 	{
 		ctx->state = SERVICE_START_PENDING;
 		return SERVICE_STATUS_SUCCESS;
@@ -608,6 +955,42 @@ mqtt_core_ioctl (service_ctx_t* ctx, uint32_t code, void* input_buffer, uint32_t
 		case IOCTL_MQTT_DEINITIALIZE:
 			status = mqtt_core_deinitialize(ctx, input_buffer, input_size);
 			break;
+		case IOCTL_MQTT_PUBLISH_EX:
+			status = mqtt_core_publish_ex(ctx, input_buffer, input_size);
+			break;
+		case IOCTL_MQTT_SET_INFLIGHT_WINDOW:
+			status = mqtt_core_set_inflight_window(ctx, input_buffer, input_size);
+			break;
+		case IOCTL_MQTT_SET_OFFLINE_QUEUE:
+			status = mqtt_core_set_offline_queue(ctx, input_buffer, input_size);
+			break;
+		case IOCTL_MQTT_SET_RECONNECT:
+			status = mqtt_core_set_reconnect(ctx, input_buffer, input_size);
+			break;
+		case IOCTL_MQTT_ADD_TOPIC_HANDLER:
+			status = mqtt_core_add_topic_handler(ctx, input_buffer, input_size);
+			break;
+		case IOCTL_MQTT_REMOVE_TOPIC_HANDLER:
+			status = mqtt_core_remove_topic_handler(ctx, input_buffer, input_size);
+			break;
+		case IOCTL_MQTT_GET_STATISTICS:
+			status = mqtt_core_get_statistics(ctx, input_buffer, input_size, output_buffer, output_size, bytes_transferred);
+			break;
+		case IOCTL_MQTT_RESET_STATISTICS:
+			status = mqtt_core_reset_statistics(ctx, input_buffer, input_size);
+			break;
+		case IOCTL_MQTT_SET_COALESCING:
+			status = mqtt_core_set_coalescing(ctx, input_buffer, input_size);
+			break;
+		case IOCTL_MQTT_FLUSH:
+			status = mqtt_core_flush(ctx, input_buffer, input_size);
+			break;
+		case IOCTL_MQTT_SET_TRANSPORT:
+			status = mqtt_core_set_transport(ctx, input_buffer, input_size);
+			break;
+		case IOCTL_MQTT_REGISTER_TOPIC:
+			status = mqtt_core_register_topic(ctx, input_buffer, input_size);
+			break;
 		default:
 			break;
 	}
@@ -764,6 +1147,11 @@ mqtt_core_initialize (service_ctx_t* ctx, void* input_buffer, uint32_t input_siz
 				if ( brokerCtx != NULL )
 				{
 					memset ( brokerCtx, 0, sizeof(mqttBrokerCtx_t) );
+					if ( critical_section_create ( &brokerCtx->txLock ) != SYSTEM_STATUS_SUCCESS )
+					{
+						free ( brokerCtx );
+						return SERVICE_FAILURE_INITIALIZATION;
+					}
 
 					/**
 					 * Set up message memory Buffer
@@ -784,6 +1172,9 @@ mqtt_core_initialize (service_ctx_t* ctx, void* input_buffer, uint32_t input_siz
 					brokerCtx->alive 		 = 60;	// Default keep-alive time
 					brokerCtx->seq   		 = 1;	// Sequence number
 					brokerCtx->clean_session = 1;	// Discard previous session
+					brokerCtx->inflightWindow = MQTT_INFLIGHT_WINDOW;
+					brokerCtx->reconnectMax   = MQTT_RECONNECT_DELAY_MAX;
+					brokerCtx->statisticsTime = time_get_ticks(NULL);
 
 					/**
 					 * Set up client id
@@ -798,10 +1189,25 @@ mqtt_core_initialize (service_ctx_t* ctx, void* input_buffer, uint32_t input_siz
 					brokerCtx->socket.fnet_socket = init_params->socket.fnet_socket;
 
 					/**
-					 * Register the system management task
+					 * Start the worker task, or register the system management task
 					 */
 					brokerCtx->state = MQTT_STATE_IDLE;
-		            system_management_func_attach (ctx->name, brokerCtx, mqtt_service_task);
+					if ( MQTT_WORKER_THREAD )
+					{
+						if ( ! mqtt_worker_start ( brokerCtx ) )
+						{
+							critical_section_destroy ( &brokerCtx->txLock );
+							free ( brokerCtx->varHeader );
+							free ( brokerCtx->recvBuffer );
+							free ( brokerCtx->buffer );
+							free ( brokerCtx );
+							return SERVICE_FAILURE_INITIALIZATION;
+						}
+					}
+					else
+					{
+						system_management_func_attach (ctx->name, brokerCtx, mqtt_service_task);
+					}
 
 					/**
 					 * Return the broker context
@@ -888,6 +1294,7 @@ service_status_t mqtt_core_set_connection (service_ctx_t* ctx, void* input_buffe
 				broker->cbs.svcMqttEvent 	= connection_params->cbs.svcMqttEvent;
 				broker->cbs.svcMqttRecv  	= connection_params->cbs.svcMqttRecv;
 				broker->cbs.svcMqttDisconn 	= connection_params->cbs.svcMqttDisconn;
+				broker->cbs.svcMqttDelivered = connection_params->cbs.svcMqttDelivered;
 
 				if ( broker->addrType == MQTT_ADDR_IP )
 				{
@@ -1027,7 +1434,8 @@ service_status_t mqtt_core_connect_ex (service_ctx_t* ctx, void* input_buffer, u
 			{
 				mqtt_connect_parms_t* connect_params = (mqtt_connect_parms_t*)input_buffer;
 				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)connect_params->broker;
-				broker->state = MQTT_STATE_CONNECT;
+				broker->reconnectDelay = broker->reconnectMin * CFG_SYSTICK_FREQ;
+				mqtt_task_start ( broker );
 				return SERVICE_STATUS_SUCCESS;
 			}
 			return SERVICE_FAILURE_INVALID_PARAMETER;
@@ -1092,7 +1500,9 @@ service_status_t mqtt_core_disconnect_ex (service_ctx_t* ctx, void* input_buffer
 			{
 				mqtt_disconnect_parms_t* disconnect_params = (mqtt_disconnect_parms_t*)input_buffer;
 				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)disconnect_params->broker;
-				broker->state = MQTT_STATE_DISCONNECT;
+				broker->substate = MQTT_DISCONNECT_USER;
+				broker->state    = MQTT_STATE_DISCONNECT;
+				mqtt_worker_wake ( broker );
 				return SERVICE_STATUS_SUCCESS;
 			}
 			return SERVICE_FAILURE_INVALID_PARAMETER;
@@ -1123,13 +1533,15 @@ service_status_t mqtt_core_publish (service_ctx_t* ctx, void* input_buffer, uint
 			if ( input_buffer != NULL && input_size == sizeof(mqtt_publish_parms_t) )
 			{
 				mqtt_publish_parms_t* publish_params = (mqtt_publish_parms_t*)input_buffer;
-				uint32_t result = mqtt_publish_with_qos ( publish_params->broker,
-														  publish_params->topic,
-														  publish_params->msg,
-														  publish_params->retain,
-														  MQTT_QOS0,
-														  NULL );
-				return ( (result) ? SERVICE_STATUS_SUCCESS : SERVICE_FAILURE_GENERAL );
+				mqtt_iovec_t payload = { publish_params->msg, strlen(publish_params->msg) };
+				return mqtt_publish_or_queue ( publish_params->broker,
+											   publish_params->topic,
+											   strlen(publish_params->topic),
+											   &payload,
+											   1,
+											   publish_params->retain,
+											   MQTT_QOS0,
+											   NULL );
 			}
 			return SERVICE_FAILURE_INVALID_PARAMETER;
 		}
@@ -1159,13 +1571,18 @@ service_status_t mqtt_core_publish_with_qus (service_ctx_t* ctx, void* input_buf
 			if ( input_buffer != NULL && input_size == sizeof(mqtt_publish_qos_parms_t) )
 			{
 				mqtt_publish_qos_parms_t* publish_qos_params = (mqtt_publish_qos_parms_t*)input_buffer;
-				uint32_t result = mqtt_publish_with_qos ( publish_qos_params->broker,
-														  publish_qos_params->topic,
-														  publish_qos_params->msg,
-														  publish_qos_params->retain,
-														  publish_qos_params->qos,
-														  &publish_qos_params->messageId );
-				return ( (result) ? SERVICE_STATUS_SUCCESS : SERVICE_FAILURE_GENERAL );
+				mqtt_iovec_t payload = { publish_qos_params->msg, strlen(publish_qos_params->msg) };
+				if ( publish_qos_params->broker == NULL || ! mqtt_qos_valid ( publish_qos_params->broker, publish_qos_params->qos ) )
+					return SERVICE_FAILURE_INVALID_PARAMETER;
+
+				return mqtt_publish_or_queue ( publish_qos_params->broker,
+											   publish_qos_params->topic,
+											   strlen(publish_qos_params->topic),
+											   &payload,
+											   1,
+											   publish_qos_params->retain,
+											   publish_qos_params->qos,
+											   &publish_qos_params->messageId );
 			}
 			return SERVICE_FAILURE_INVALID_PARAMETER;
 		}
@@ -1195,6 +1612,9 @@ service_status_t mqtt_core_publish_rel (service_ctx_t* ctx, void* input_buffer,
 			if ( input_buffer != NULL && input_size == sizeof(mqtt_publish_rel_parms_t) )
 			{
 				mqtt_publish_rel_parms_t* publish_rel_params = (mqtt_publish_rel_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)publish_rel_params->broker;
+				if ( broker != NULL && broker->transport == MQTT_TRANSPORT_SN )
+					return SERVICE_FAILURE_INVALID_PARAMETER;	// No QoS 2 with MQTT-SN
 			    uint8_t packet[] =
 			    {
 			    	MQTT_MSG_PUBREL | MQTT_QOS1_FLAG, 		// Message Type, DUP flag, QoS level, Retain
@@ -1235,6 +1655,9 @@ service_status_t mqtt_core_publish_ack (service_ctx_t* ctx, void* input_buffer,
 			if ( input_buffer != NULL && input_size == sizeof(mqtt_publish_ack_parms_t) )
 			{
 				mqtt_publish_ack_parms_t* publish_ack_params = (mqtt_publish_ack_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)publish_ack_params->broker;
+				if ( broker != NULL && broker->transport == MQTT_TRANSPORT_SN )
+					return SERVICE_STATUS_SUCCESS;	// Acknowledged by the service on receipt
 			    uint8_t packet[] =
 			    {
 			    	MQTT_MSG_PUBACK, 						// Message Type, DUP flag, QoS level, Retain
@@ -1275,6 +1698,9 @@ service_status_t mqtt_core_publish_complete (service_ctx_t* ctx, void* input_buf
 			if ( input_buffer != NULL && input_size == sizeof(mqtt_publish_comp_parms_t) )
 			{
 				mqtt_publish_comp_parms_t* publish_comp_params = (mqtt_publish_comp_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)publish_comp_params->broker;
+				if ( broker != NULL && broker->transport == MQTT_TRANSPORT_SN )
+					return SERVICE_FAILURE_INVALID_PARAMETER;	// No QoS 2 with MQTT-SN
 			    uint8_t packet[] =
 			    {
 			    	MQTT_MSG_PUBCOMP, 						// Message Type, DUP flag, QoS level, Retain
@@ -1383,13 +1809,13 @@ service_status_t mqtt_core_ping_req (service_ctx_t* ctx, void* input_buffer, uin
 			if ( input_buffer != NULL && input_size == sizeof(mqtt_ping_req_parms_t) )
 			{
 				mqtt_ping_req_parms_t* ping_params = (mqtt_ping_req_parms_t*)input_buffer;
-			    uint8_t packet[2] =
+			    mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)ping_params->broker;
+			    if ( mqtt_send_pingreq ( broker ) > 0 )
 			    {
-			    	MQTT_MSG_PINGREQ, // Message Type, DUP flag, QoS level, Retain
-					0x00              // Remaining length
-			    };
-			    if ( mqtt_send_packet ( ping_params->broker, packet, sizeof(packet), 0L ) )
+			    	if ( broker->pingSent == 0 )
+			    		broker->pingSent = time_get_ticks(NULL) | 1;
 			    	return SERVICE_STATUS_SUCCESS;
+			    }
 			    else
 			    	return SERVICE_FAILURE_GENERAL;
 			}
@@ -1425,13 +1851,24 @@ service_status_t mqtt_core_deinitialize (service_ctx_t* ctx, void* input_buffer,
 				if ( deinit_params->broker != NULL )
 				{
 					/**
-					* Deregister the system management task
+					* Stop the worker task, or deregister the system management task
 					*/
-		            system_management_func_detach (mqtt_service_task);
+		            if ( MQTT_WORKER_THREAD )
+		            	mqtt_worker_stop (broker);
+		            else
+		            	system_management_instance_detach (broker);
 
 					/**
 					* Release memory buffers
 					*/
+		            for ( uint32_t index = 0; index < MQTT_INFLIGHT_WINDOW; index++ )
+		            {
+		            	mqtt_inflight_release ( &broker->inflight[index] );
+		            }
+		            mqtt_queue_reset ( &broker->queue );
+		            mqtt_topic_trie_free ( &broker->topics );
+		            free ( broker->coalesce );
+		            critical_section_destroy ( &broker->txLock );
 		            free ( broker->varHeader );
 		            free ( broker->recvBuffer );
 		            free ( broker->buffer );
@@ -1451,619 +1888,2777 @@ service_status_t mqtt_core_deinitialize (service_ctx_t* ctx, void* input_buffer,
 }
 
 /**
-* Connect to the broker.
+* Publish a scatter list to the MQTT broker
 *
-* \param 	broker         Pointer to the broker context
+* \param    ctx				Pointer to the service context
+* \param    input_buffer	Pointer to publish parameters
+* \param	input_size		Size of publish parameters
 *
-* \returns	Number of bytes received.
+* \returns  SERVICE_STATUS_SUCCESS if character is available.
+* 			SERVICE_FAILURE_INVALID_PARAMETER if parameters are incorrect
+* 			SERVICE_FAILURE_OFFLINE if service is not running
+*           SERVICE_FAILURE_GENERAL on service context error
 */
-uint32_t mqtt_connect (mqttBrokerCtx_t* broker)
+service_status_t mqtt_core_publish_ex (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
 {
-    uint8_t flags = 0x00;
-
-    uint16_t clientidlen = strlen(broker->clientid);
-    uint16_t usernamelen = strlen(broker->username);
-    uint16_t passwordlen = strlen(broker->password);
-    uint16_t payload_len = clientidlen + 2;
-
-    /**
-    * Prepare flags
-    */
-    if (usernamelen)
-    {
-    	payload_len += usernamelen + 2;
-    	flags |= MQTT_USERNAME_FLAG;
-    }
-    if (passwordlen)
-    {
-    	payload_len += passwordlen + 2;
-    	flags |= MQTT_PASSWORD_FLAG;
-    }
-    if (broker->clean_session || clientidlen == 0 )
-    {
-    	flags |= MQTT_CLEAN_SESSION;
-    }
-
-    /**
-    * Variable header
-    */
-    uint8_t var_header[] =
-    {
-    	0x00,0x04,'M','Q','T','T',  // Protocol name: MQTT (MQTT 3.1.1)
-		0x04,                       // Protocol version
-		flags,                      // Connect flags
-		broker->alive >> 8, broker->alive & 0xFF, // Keep alive
-    };
-
-//    uint8 var_header[] =
-//    {
-//	0x00,0x06,0x4d,0x51,0x49,0x73,0x64,0x70,  // Protocol name: MQIsdp
-//	0x03,           // Protocol version
-//	flags,          // Connect flags
-//	broker->alive >> 8, broker->alive & 0xFF, // Keep alive
-//    };
-
-    /**
-    * Fixed header
-    */
-    uint8_t fixed_header[3];              // Allocating space for the maximum size fixed header
-    uint8_t fixedHeaderSize = 2;          // Default size = one byte Message Type + one byte Remaining Length
-    uint8_t remainLen = sizeof(var_header)+payload_len;
-    fixed_header[0] = MQTT_MSG_CONNECT; // Message type
-
-    /**
-    * Remaining length
-    */
-    if (remainLen <= 127)
-    {
-        fixed_header[1] = remainLen;
-    }
-    else
-    {
-        fixedHeaderSize++;              // add an additional byte for Remaining Length
-        // first byte is remainder (mod) of 128, then set the MSB to indicate more bytes
-        fixed_header[1] = remainLen % 128;
-        fixed_header[1] = fixed_header[1] | 0x80;
-        // second byte is number of 128s
-        fixed_header[2] = remainLen / 128;
-    }
-
-    uint16_t offset = 0;
-    uint16_t packetsize = fixedHeaderSize + sizeof(var_header) + payload_len;
-    uint8_t* packet = broker->buffer;
-    memset(packet, 0, packetsize);
-    memcpy(packet, fixed_header, fixedHeaderSize);
-    offset += fixedHeaderSize;
-    memcpy(packet+offset, var_header, sizeof(var_header));
-    offset += sizeof(var_header);
-    // Client ID - UTF encoded
-    packet[offset++] = clientidlen >> 8;
-    packet[offset++] = clientidlen & 0xFF;
-    memcpy(packet+offset, broker->clientid, clientidlen);
-    offset += clientidlen;
-
-    if (usernamelen)
-    {
-    	// Username - UTF encoded
-    	packet[offset++] = usernamelen >> 8;
-    	packet[offset++] = usernamelen & 0xFF;
-    	memcpy(packet+offset, broker->username, usernamelen);
-    	offset += usernamelen;
-    }
-
-    if (passwordlen)
-    {
-    	// Password - UTF encoded
-    	packet[offset++] = passwordlen >> 8;
-    	packet[offset++] = passwordlen & 0xFF;
-    	memcpy(packet+offset, broker->password, passwordlen);
-    	offset += passwordlen;
-    }
-
-    /**
-    * Send the packet
-    */
-    return mqtt_send_packet ( broker, packet, packetsize, 0L );
+	if ( ctx != NULL )
+	{
+		if ( ctx->state == SERVICE_RUNNING )
+		{
+			if ( input_buffer != NULL && input_size == sizeof(mqtt_publish_ex_parms_t) )
+			{
+				mqtt_publish_ex_parms_t* publish_ex_params = (mqtt_publish_ex_parms_t*)input_buffer;
+				if ( publish_ex_params->broker != NULL &&
+					 mqtt_qos_valid ( publish_ex_params->broker, publish_ex_params->qos ) &&
+					 publish_ex_params->payloadCount <= MQTT_MAX_PAYLOAD_SEGMENTS &&
+					 (publish_ex_params->payload != NULL || publish_ex_params->payloadCount == 0) &&
+					 (publish_ex_params->topic != NULL || publish_ex_params->topicLength == 0) )
+				{
+					return mqtt_publish_or_queue ( publish_ex_params->broker,
+												   publish_ex_params->topic,
+												   publish_ex_params->topicLength,
+												   publish_ex_params->payload,
+												   publish_ex_params->payloadCount,
+												   publish_ex_params->retain,
+												   publish_ex_params->qos,
+												   &publish_ex_params->messageId );
+				}
+			}
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+		}
+		return SERVICE_FAILURE_OFFLINE;
+	}
+	return SERVICE_FAILURE_GENERAL;
 }
 
 /**
-* Publish a message on a topic with QoS.
+* Set the MQTT inflight window size
+*
+* \param    ctx				Pointer to the service context
+* \param    input_buffer	Pointer to inflight window parameters
+* \param	input_size		Size of inflight window parameters
+*
+* \returns  SERVICE_STATUS_SUCCESS if character is available.
+* 			SERVICE_FAILURE_INVALID_PARAMETER if parameters are incorrect
+* 			SERVICE_FAILURE_OFFLINE if service is not running
+*           SERVICE_FAILURE_GENERAL on service context error
+*/
+service_status_t mqtt_core_set_inflight_window (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
+{
+	if ( ctx != NULL )
+	{
+		if ( ctx->state == SERVICE_RUNNING )
+		{
+			if ( input_buffer != NULL && input_size == sizeof(mqtt_inflight_parms_t) )
+			{
+				mqtt_inflight_parms_t* inflight_params = (mqtt_inflight_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)inflight_params->broker;
+				if ( broker != NULL && inflight_params->window >= 1 && inflight_params->window <= MQTT_INFLIGHT_WINDOW )
+				{
+					/**
+					* Publishes already in flight above a smaller window are still completed
+					*/
+					broker->inflightWindow = inflight_params->window;
+					return SERVICE_STATUS_SUCCESS;
+				}
+			}
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+		}
+		return SERVICE_FAILURE_OFFLINE;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Configure the MQTT offline publish queue
+*
+* \param    ctx				Pointer to the service context
+* \param    input_buffer	Pointer to offline queue parameters
+* \param	input_size		Size of offline queue parameters
+*
+* \returns  SERVICE_STATUS_SUCCESS if character is available.
+* 			SERVICE_FAILURE_INVALID_PARAMETER if parameters are incorrect
+* 			SERVICE_FAILURE_OFFLINE if service is not running
+*           SERVICE_FAILURE_GENERAL on service context error
+*/
+service_status_t mqtt_core_set_offline_queue (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
+{
+	if ( ctx != NULL )
+	{
+		if ( ctx->state == SERVICE_RUNNING )
+		{
+			if ( input_buffer != NULL && input_size == sizeof(mqtt_offline_queue_parms_t) )
+			{
+				mqtt_offline_queue_parms_t* queue_params = (mqtt_offline_queue_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)queue_params->broker;
+				if ( broker != NULL && queue_params->dropPolicy <= MQTT_DROP_LOWEST_QOS )
+				{
+					critical_section_acquire (&mqtt_cs);
+					bool result = mqtt_queue_configure ( &broker->queue, queue_params, &mqtt_cs );
+					critical_section_release (&mqtt_cs);
+					return ( (result) ? SERVICE_STATUS_SUCCESS : SERVICE_FAILURE_GENERAL );
+				}
+			}
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+		}
+		return SERVICE_FAILURE_OFFLINE;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Set the MQTT reconnect backoff
+*
+* \param    ctx				Pointer to the service context
+* \param    input_buffer	Pointer to reconnect parameters
+* \param	input_size		Size of reconnect parameters
+*
+* \returns  SERVICE_STATUS_SUCCESS if character is available.
+* 			SERVICE_FAILURE_INVALID_PARAMETER if parameters are incorrect
+* 			SERVICE_FAILURE_OFFLINE if service is not running
+*           SERVICE_FAILURE_GENERAL on service context error
+*/
+service_status_t mqtt_core_set_reconnect (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
+{
+	if ( ctx != NULL )
+	{
+		if ( ctx->state == SERVICE_RUNNING )
+		{
+			if ( input_buffer != NULL && input_size == sizeof(mqtt_reconnect_parms_t) )
+			{
+				mqtt_reconnect_parms_t* reconnect_params = (mqtt_reconnect_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)reconnect_params->broker;
+				uint16_t maxDelay = ( reconnect_params->maxDelay != 0 ) ? reconnect_params->maxDelay : MQTT_RECONNECT_DELAY_MAX;
+				if ( broker != NULL && reconnect_params->minDelay <= maxDelay )
+				{
+					broker->reconnectMin   = reconnect_params->minDelay;
+					broker->reconnectMax   = maxDelay;
+					broker->reconnectDelay = broker->reconnectMin * CFG_SYSTICK_FREQ;
+					return SERVICE_STATUS_SUCCESS;
+				}
+			}
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+		}
+		return SERVICE_FAILURE_OFFLINE;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Add a handler for received publishes on a topic filter
+*
+* \param    ctx				Pointer to the service context
+* \param    input_buffer	Pointer to topic handler parameters
+* \param	input_size		Size of topic handler parameters
+*
+* \returns  SERVICE_STATUS_SUCCESS if character is available.
+* 			SERVICE_FAILURE_INVALID_PARAMETER if parameters are incorrect
+* 			SERVICE_FAILURE_OFFLINE if service is not running
+*           SERVICE_FAILURE_GENERAL on service context error
+*/
+service_status_t mqtt_core_add_topic_handler (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
+{
+	if ( ctx != NULL )
+	{
+		if ( ctx->state == SERVICE_RUNNING )
+		{
+			if ( input_buffer != NULL && input_size == sizeof(mqtt_topic_handler_parms_t) )
+			{
+				mqtt_topic_handler_parms_t* handler_params = (mqtt_topic_handler_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)handler_params->broker;
+				if ( broker != NULL )
+				{
+					critical_section_acquire (&mqtt_cs);
+					bool result = mqtt_topic_trie_add ( &broker->topics, handler_params->filter, handler_params->handler, handler_params->handlerCtx );
+					critical_section_release (&mqtt_cs);
+					if ( result )
+						return SERVICE_STATUS_SUCCESS;
+				}
+			}
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+		}
+		return SERVICE_FAILURE_OFFLINE;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Remove a handler for received publishes on a topic filter
+*
+* \param    ctx				Pointer to the service context
+* \param    input_buffer	Pointer to topic handler parameters
+* \param	input_size		Size of topic handler parameters
+*
+* \returns  SERVICE_STATUS_SUCCESS if character is available.
+* 			SERVICE_FAILURE_INVALID_PARAMETER if parameters are incorrect
+* 			SERVICE_FAILURE_OFFLINE if service is not running
+*           SERVICE_FAILURE_GENERAL on service context error
+*/
+service_status_t mqtt_core_remove_topic_handler (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
+{
+	if ( ctx != NULL )
+	{
+		if ( ctx->state == SERVICE_RUNNING )
+		{
+			if ( input_buffer != NULL && input_size == sizeof(mqtt_topic_handler_parms_t) )
+			{
+				mqtt_topic_handler_parms_t* handler_params = (mqtt_topic_handler_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)handler_params->broker;
+				if ( broker != NULL )
+				{
+					critical_section_acquire (&mqtt_cs);
+					bool result = mqtt_topic_trie_remove ( &broker->topics, handler_params->filter, handler_params->handler, handler_params->handlerCtx );
+					critical_section_release (&mqtt_cs);
+					if ( result )
+						return SERVICE_STATUS_SUCCESS;
+				}
+			}
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+		}
+		return SERVICE_FAILURE_OFFLINE;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Retrieve the MQTT broker statistics
+*
+* \param    ctx					Pointer to the service context
+* \param    input_buffer		Pointer to statistics parameters
+* \param	input_size			Size of statistics parameters
+* \param	output_buffer		Pointer to a mqtt_statistics_t structure
+* \param	output_size			Size of the output buffer
+* \param	bytes_transferred	Pointer to the number of bytes transferred
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+* 			SERVICE_FAILURE_INVALID_PARAMETER if parameters are incorrect
+* 			SERVICE_FAILURE_OFFLINE if service is not running
+*           SERVICE_FAILURE_GENERAL on service context error
+*/
+service_status_t mqtt_core_get_statistics (service_ctx_t* ctx, void* input_buffer, uint32_t input_size, void* output_buffer, uint32_t output_size, uint32_t* bytes_transferred)
+{
+	if ( ctx != NULL )
+	{
+		if ( ctx->state == SERVICE_RUNNING )
+		{
+			if ( input_buffer != NULL && input_size == sizeof(mqtt_statistics_parms_t) && output_buffer != NULL && output_size >= sizeof(mqtt_statistics_t) )
+			{
+				mqtt_statistics_parms_t* statistics_params = (mqtt_statistics_parms_t*)input_buffer;
+				mqtt_statistics_t* statistics = (mqtt_statistics_t*)output_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)statistics_params->broker;
+				if ( broker != NULL )
+				{
+					critical_section_acquire (&mqtt_cs);
+					*statistics = broker->statistics;
+					statistics->ticks         = (uint32_t)( time_get_ticks(NULL) - broker->statisticsTime );
+					statistics->queued        = broker->queue.queued;
+					statistics->queue_dropped = broker->queue.dropped;
+					statistics->queue_spilled = broker->queue.spilled;
+					statistics->queue_bytes   = broker->queue.ramBytes;
+					critical_section_release (&mqtt_cs);
+
+					if ( bytes_transferred )
+						*bytes_transferred = sizeof(mqtt_statistics_t);
+					return SERVICE_STATUS_SUCCESS;
+				}
+			}
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+		}
+		return SERVICE_FAILURE_OFFLINE;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Reset the MQTT broker statistics
+*
+* \param    ctx				Pointer to the service context
+* \param    input_buffer	Pointer to statistics parameters
+* \param	input_size		Size of statistics parameters
+*
+* \returns  SERVICE_STATUS_SUCCESS if successful.
+* 			SERVICE_FAILURE_INVALID_PARAMETER if parameters are incorrect
+* 			SERVICE_FAILURE_OFFLINE if service is not running
+*           SERVICE_FAILURE_GENERAL on service context error
+*/
+service_status_t mqtt_core_reset_statistics (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
+{
+	if ( ctx != NULL )
+	{
+		if ( ctx->state == SERVICE_RUNNING )
+		{
+			if ( input_buffer != NULL && input_size == sizeof(mqtt_statistics_parms_t) )
+			{
+				mqtt_statistics_parms_t* statistics_params = (mqtt_statistics_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)statistics_params->broker;
+				if ( broker != NULL )
+				{
+					critical_section_acquire (&mqtt_cs);
+					memset ( &broker->statistics, 0, sizeof(mqtt_statistics_t) );
+					broker->statisticsTime = time_get_ticks(NULL);
+					broker->queue.queued   = 0;
+					broker->queue.dropped  = 0;
+					broker->queue.spilled  = 0;
+					critical_section_release (&mqtt_cs);
+					return SERVICE_STATUS_SUCCESS;
+				}
+			}
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+		}
+		return SERVICE_FAILURE_OFFLINE;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Configure MQTT publish coalescing
+*
+* \param    ctx				Pointer to the service context
+* \param    input_buffer	Pointer to coalescing parameters
+* \param	input_size		Size of coalescing parameters
+*
+* \returns  SERVICE_STATUS_SUCCESS if character is available.
+* 			SERVICE_FAILURE_INVALID_PARAMETER if parameters are incorrect
+* 			SERVICE_FAILURE_OFFLINE if service is not running
+*           SERVICE_FAILURE_GENERAL on service context error
+*/
+service_status_t mqtt_core_set_coalescing (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
+{
+	if ( ctx != NULL )
+	{
+		if ( ctx->state == SERVICE_RUNNING )
+		{
+			if ( input_buffer != NULL && input_size == sizeof(mqtt_coalesce_parms_t) )
+			{
+				mqtt_coalesce_parms_t* coalesce_params = (mqtt_coalesce_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)coalesce_params->broker;
+				uint16_t maxDelay = ( coalesce_params->maxDelay != 0 ) ? coalesce_params->maxDelay : MQTT_COALESCE_DELAY;
+				if ( broker != NULL && coalesce_params->threshold <= MQTT_COALESCE_SIZE_MAX )
+				{
+					uint8_t* buffer = NULL;
+					if ( coalesce_params->threshold != 0 && ( buffer = malloc ( coalesce_params->threshold ) ) == NULL )
+						return SERVICE_FAILURE_GENERAL;
+
+					/**
+					* Publishes packed under the old setting are sent first
+					*/
+					mqtt_tx_acquire ( broker );
+					mqtt_coalesce_flush ( broker );
+					free ( broker->coalesce );
+					broker->coalesce      = buffer;
+					broker->coalesceSize  = coalesce_params->threshold;
+					broker->coalesceDelay = ( (uint32_t)maxDelay * CFG_SYSTICK_FREQ + 999 ) / 1000;
+					mqtt_tx_release ( broker );
+					return SERVICE_STATUS_SUCCESS;
+				}
+			}
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+		}
+		return SERVICE_FAILURE_OFFLINE;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Send the coalesced MQTT publishes now
+*
+* \param    ctx				Pointer to the service context
+* \param    input_buffer	Pointer to flush parameters
+* \param	input_size		Size of flush parameters
+*
+* \returns  SERVICE_STATUS_SUCCESS if character is available.
+* 			SERVICE_FAILURE_INVALID_PARAMETER if parameters are incorrect
+* 			SERVICE_FAILURE_OFFLINE if service is not running
+*           SERVICE_FAILURE_GENERAL on service context error
+*/
+service_status_t mqtt_core_flush (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
+{
+	if ( ctx != NULL )
+	{
+		if ( ctx->state == SERVICE_RUNNING )
+		{
+			if ( input_buffer != NULL && input_size == sizeof(mqtt_flush_parms_t) )
+			{
+				mqtt_flush_parms_t* flush_params = (mqtt_flush_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)flush_params->broker;
+				if ( broker != NULL )
+				{
+					mqtt_tx_acquire ( broker );
+					int32_t result = mqtt_coalesce_flush ( broker );
+					mqtt_tx_release ( broker );
+					return ( (result != FNET_ERR) ? SERVICE_STATUS_SUCCESS : SERVICE_FAILURE_GENERAL );
+				}
+			}
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+		}
+		return SERVICE_FAILURE_OFFLINE;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Select the MQTT transport
+*
+* \param    ctx				Pointer to the service context
+* \param    input_buffer	Pointer to transport parameters
+* \param	input_size		Size of transport parameters
+*
+* \returns  SERVICE_STATUS_SUCCESS if character is available.
+* 			SERVICE_FAILURE_INVALID_PARAMETER if parameters are incorrect
+* 			SERVICE_FAILURE_OFFLINE if service is not running
+*           SERVICE_FAILURE_GENERAL on service context error
+*/
+service_status_t mqtt_core_set_transport (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
+{
+	if ( ctx != NULL )
+	{
+		if ( ctx->state == SERVICE_RUNNING )
+		{
+			if ( input_buffer != NULL && input_size == sizeof(mqtt_transport_parms_t) )
+			{
+				mqtt_transport_parms_t* transport_params = (mqtt_transport_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)transport_params->broker;
+				if ( broker != NULL && broker->state == MQTT_STATE_IDLE && transport_params->transport <= MQTT_TRANSPORT_SN )
+				{
+					broker->transport     = transport_params->transport;
+					broker->sleepDuration = transport_params->sleepDuration;
+					return SERVICE_STATUS_SUCCESS;
+				}
+			}
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+		}
+		return SERVICE_FAILURE_OFFLINE;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Register a MQTT-SN predefined topic id
+*
+* \param    ctx				Pointer to the service context
+* \param    input_buffer	Pointer to topic registration parameters
+* \param	input_size		Size of topic registration parameters
+*
+* \returns  SERVICE_STATUS_SUCCESS if character is available.
+* 			SERVICE_FAILURE_INVALID_PARAMETER if parameters are incorrect
+* 			SERVICE_FAILURE_OFFLINE if service is not running
+*           SERVICE_FAILURE_GENERAL on service context error
+*/
+service_status_t mqtt_core_register_topic (service_ctx_t* ctx, void* input_buffer, uint32_t input_size)
+{
+	if ( ctx != NULL )
+	{
+		if ( ctx->state == SERVICE_RUNNING )
+		{
+			if ( input_buffer != NULL && input_size == sizeof(mqtt_register_topic_parms_t) )
+			{
+				mqtt_register_topic_parms_t* register_params = (mqtt_register_topic_parms_t*)input_buffer;
+				mqttBrokerCtx_t* broker = (mqttBrokerCtx_t*)register_params->broker;
+				if ( broker != NULL && register_params->topic != NULL && register_params->topicId != 0 )
+				{
+					critical_section_acquire (&mqtt_cs);
+					mqtt_sn_topic_t* entry = mqtt_sn_topic_add ( broker->snTopics, register_params->topic, strlen(register_params->topic),
+																 MQTT_SN_TOPIC_PREDEFINED, register_params->topicId );
+					critical_section_release (&mqtt_cs);
+					if ( entry != NULL )
+						return SERVICE_STATUS_SUCCESS;
+				}
+			}
+			return SERVICE_FAILURE_INVALID_PARAMETER;
+		}
+		return SERVICE_FAILURE_OFFLINE;
+	}
+	return SERVICE_FAILURE_GENERAL;
+}
+
+/**
+* Connect to the broker.
+*
+* \param 	broker         Pointer to the broker context
+*
+* \returns	Number of bytes received.
+*/
+uint32_t mqtt_connect (mqttBrokerCtx_t* broker)
+{
+    uint8_t flags = 0x00;
+
+    if ( broker->transport == MQTT_TRANSPORT_SN )
+    {
+    	return mqtt_sn_connect ( broker );
+    }
+
+    uint16_t clientidlen = strlen(broker->clientid);
+    uint16_t usernamelen = strlen(broker->username);
+    uint16_t passwordlen = strlen(broker->password);
+    uint16_t payload_len = clientidlen + 2;
+
+    /**
+    * Prepare flags
+    */
+    if (usernamelen)
+    {
+    	payload_len += usernamelen + 2;
+    	flags |= MQTT_USERNAME_FLAG;
+    }
+    if (passwordlen)
+    {
+    	payload_len += passwordlen + 2;
+    	flags |= MQTT_PASSWORD_FLAG;
+    }
+    if (broker->clean_session || clientidlen == 0 )
+    {
+    	flags |= MQTT_CLEAN_SESSION;
+    }
+
+    /**
+    * Variable header
+    */
+    uint8_t var_header[] =
+    {
+    	0x00,0x04,'M','Q','T','T',  // Protocol name: MQTT (MQTT 3.1.1)
+		0x04,                       // Protocol version
+		flags,                      // Connect flags
+		broker->alive >> 8, broker->alive & 0xFF, // Keep alive
+    };
+
+//    uint8 var_header[] =
+//    {
+//	0x00,0x06,0x4d,0x51,0x49,0x73,0x64,0x70,  // Protocol name: MQIsdp
+//	0x03,           // Protocol version
+//	flags,          // Connect flags
+//	broker->alive >> 8, broker->alive & 0xFF, // Keep alive
+//    };
+
+    /**
+    * Fixed header
+    */
+    uint8_t fixed_header[5];              // Allocating space for the maximum size fixed header
+    uint32_t remainLen = sizeof(var_header)+payload_len;
+    fixed_header[0] = MQTT_MSG_CONNECT; // Message type
+
+    /**
+    * Remaining length
+    */
+    uint8_t fixedHeaderSize = 1 + mqtt_encode_rem_len ( &fixed_header[1], remainLen );
+
+    uint16_t offset = 0;
+    uint16_t packetsize = fixedHeaderSize + sizeof(var_header) + payload_len;
+    uint8_t* packet = broker->buffer;
+    memset(packet, 0, packetsize);
+    memcpy(packet, fixed_header, fixedHeaderSize);
+    offset += fixedHeaderSize;
+    memcpy(packet+offset, var_header, sizeof(var_header));
+    offset += sizeof(var_header);
+    // Client ID - UTF encoded
+    packet[offset++] = clientidlen >> 8;
+    packet[offset++] = clientidlen & 0xFF;
+    memcpy(packet+offset, broker->clientid, clientidlen);
+    offset += clientidlen;
+
+    if (usernamelen)
+    {
+    	// Username - UTF encoded
+    	packet[offset++] = usernamelen >> 8;
+    	packet[offset++] = usernamelen & 0xFF;
+    	memcpy(packet+offset, broker->username, usernamelen);
+    	offset += usernamelen;
+    }
+
+    if (passwordlen)
+    {
+    	// Password - UTF encoded
+    	packet[offset++] = passwordlen >> 8;
+    	packet[offset++] = passwordlen & 0xFF;
+    	memcpy(packet+offset, broker->password, passwordlen);
+    	offset += passwordlen;
+    }
+
+    /**
+    * Send the packet
+    */
+    return mqtt_send_packet ( broker, packet, packetsize, 0L );
+}
+
+/**
+* Check the quality of service of a publish against the broker transport.
+* QoS -1 only exists in MQTT-SN.
+*
+* \param 	broker         Pointer to the broker context
+* \param 	qos            Quality of Service
+*
+* \returns	true if the broker can publish at the quality of service.
+*/
+bool mqtt_qos_valid ( mqttBrokerCtx_t* broker, uint8_t qos )
+{
+	return qos <= MQTT_QOS2 || ( qos == MQTT_QOS_MINUS1 && broker->transport == MQTT_TRANSPORT_SN );
+}
+
+/**
+* Publish a scatter list, or queue it while the session is down.
+*
+* Once anything is queued later publishes queue behind it, so the broker
+* sees them in order.  A queued publish gets its message id when it is
+* drained, so 0 is returned as the message id.  MQTT-SN QoS -1 publishes
+* need no session and are never queued.
+*
+* \param 	broker         Pointer to the broker context
+* \param 	topic          Pointer to the topic name, not NUL terminated.
+* \param 	topic_len      Length of the topic name.
+* \param 	payload        Pointer to the payload segments.
+* \param 	payload_count  Number of payload segments (up to MQTT_MAX_PAYLOAD_SEGMENTS).
+* \param 	retain         Enable or disable the Retain flag (values: 0 or 1).
+* \param 	qos            Quality of Service (values: 0, 1 or 2)
+* \param 	message_id     Variable that will store the Message ID, if the pointer is not NULL.
+*
+* \returns	SERVICE_STATUS_SUCCESS if sent or queued.
+* 			SERVICE_FAILURE_UNAVAILABLE if the inflight window or the queue is full.
+*           SERVICE_FAILURE_GENERAL if unable to send.
+*/
+service_status_t mqtt_publish_or_queue (mqttBrokerCtx_t* broker, const char* topic, uint16_t topic_len, const mqtt_iovec_t* payload, uint32_t payload_count, uint8_t retain, uint8_t qos, uint16_t* message_id)
+{
+	bool window_full;
+	bool queue  = false;
+	bool queued = false;
+
+	if ( broker == NULL )
+	{
+		return SERVICE_FAILURE_GENERAL;
+	}
+
+	critical_section_acquire (&mqtt_cs);
+	window_full = ( (qos == MQTT_QOS1 || qos == MQTT_QOS2) && mqtt_inflight_used ( broker ) >= broker->inflightWindow );
+	if ( qos != MQTT_QOS_MINUS1 && mqtt_queue_enabled ( &broker->queue ) &&
+		 ( ! ( broker->status & MQTT_STATUS_SESSION_ACTIVE ) || window_full || ! mqtt_queue_empty ( &broker->queue ) ) )
+	{
+		queue  = true;
+		queued = mqtt_queue_push ( &broker->queue, topic, topic_len, payload, payload_count, qos, retain );
+		if ( broker->queue.ramBytes > broker->statistics.queue_bytes_max )
+			broker->statistics.queue_bytes_max = broker->queue.ramBytes;
+	}
+	if ( ( queue && ! queued ) || ( ! queue && window_full ) )
+		broker->statistics.publish_failures++;
+	critical_section_release (&mqtt_cs);
+
+	if ( queue )
+	{
+		if ( queued )
+			mqtt_worker_wake ( broker );
+		if ( message_id )
+			*message_id = 0;
+		return ( (queued) ? SERVICE_STATUS_SUCCESS : SERVICE_FAILURE_UNAVAILABLE );
+	}
+	if ( window_full )
+	{
+		return SERVICE_FAILURE_UNAVAILABLE;
+	}
+
+	uint32_t result = mqtt_publish_segments ( broker, topic, topic_len, payload, payload_count, retain, qos, message_id );
+	if ( result == 0 )
+	{
+		critical_section_acquire (&mqtt_cs);
+		broker->statistics.publish_failures++;
+		critical_section_release (&mqtt_cs);
+	}
+	return ( (result) ? SERVICE_STATUS_SUCCESS : SERVICE_FAILURE_GENERAL );
+}
+
+/**
+* Publish a scatter list on a topic with QoS.
+*
+* The fixed header, topic length and message id are built on the stack and
+* sent together with the topic and payload segments, in order, straight from
+* the caller's memory.  Nothing is staged in the broker message buffer.
+*
+* \param 	broker         Pointer to the broker context
+* \param 	topic          Pointer to the topic name, not NUL terminated.
+* \param 	topic_len      Length of the topic name.
+* \param 	payload        Pointer to the payload segments.
+* \param 	payload_count  Number of payload segments (up to MQTT_MAX_PAYLOAD_SEGMENTS).
+* \param 	retain         Enable or disable the Retain flag (values: 0 or 1).
+* \param 	qos            Quality of Service (values: 0, 1 or 2)
+* \param 	message_id     Variable that will store the Message ID, if the pointer is not NULL.
+*
+* \returns	Number of bytes sent, 0 if unsuccessful.
+*/
+uint32_t mqtt_publish_segments (mqttBrokerCtx_t* broker, const char* topic, uint16_t topic_len, const mqtt_iovec_t* payload, uint32_t payload_count, uint8_t retain, uint8_t qos, uint16_t* message_id)
+{
+	mqtt_iovec_t segments[MQTT_MAX_PAYLOAD_SEGMENTS + 3];	// Header, topic, message id and payload
+	uint8_t  header[1 + 4 + 2];								// Type, remaining length and topic size
+	uint8_t  msg_id[2];
+	uint32_t msglen = 0;
+	uint32_t count  = 0;
+	uint32_t length = 0;
+	mqttInflight_t* entry = NULL;
+
+	if ( payload_count > MQTT_MAX_PAYLOAD_SEGMENTS )
+	{
+		return 0;
+	}
+	for ( uint32_t index = 0; index < payload_count; index++ )
+	{
+		if ( payload[index].length > MQTT_MAX_REMAINING_LENGTH - msglen )
+		{
+			return 0;
+		}
+		msglen += payload[index].length;
+	}
+
+	if ( broker->transport == MQTT_TRANSPORT_SN )
+	{
+		length = mqtt_sn_publish ( broker, topic, topic_len, payload, payload_count, msglen, retain, qos, message_id );
+		if ( length != 0 )
+		{
+			mqtt_count_publish ( broker, qos, msglen );
+		}
+		return length;
+	}
+	if ( qos > MQTT_QOS2 )
+	{
+		return 0;
+	}
+
+    uint8_t qos_flag = MQTT_QOS0_FLAG;
+    uint8_t qos_size = 0; // No QoS included
+    if ( qos == MQTT_QOS1 )
+    {
+    	qos_size = 2; // 2 bytes for QoS
+    	qos_flag = MQTT_QOS1_FLAG;
+    }
+    else if ( qos == MQTT_QOS2 )
+    {
+    	qos_size = 2; // 2 bytes for QoS
+    	qos_flag = MQTT_QOS2_FLAG;
+    }
+
+    /**
+    * Remaining length is the variable header (topic size, topic and message id) plus the payload
+    */
+    if ( msglen > MQTT_MAX_REMAINING_LENGTH - (2 + topic_len + qos_size) )
+    {
+    	return 0;
+    }
+    uint32_t remainLen = 2 + topic_len + qos_size + msglen;
+
+    /**
+    * Fixed header and topic size
+    */
+    header[0] = MQTT_MSG_PUBLISH | qos_flag; // Message type, DUP flag, Qos level, Retain
+    if ( retain )
+    {
+        header[0] |= MQTT_RETAIN_FLAG;
+    }
+    uint8_t offset = 1 + mqtt_encode_rem_len ( &header[1], remainLen );
+    header[offset++] = topic_len >> 8;
+    header[offset++] = topic_len & 0xFF;
+    segments[count].base     = header;
+    segments[count++].length = offset;
+
+    if ( topic_len )
+    {
+    	segments[count].base     = topic;
+    	segments[count++].length = topic_len;
+    }
+
+    if ( qos_size )
+    {
+    	/**
+    	* QoS 1 and 2 publishes are kept for retransmission, take an inflight entry and packet id
+    	*/
+    	entry = mqtt_inflight_alloc ( broker, offset + remainLen - 2 );
+    	if ( entry == NULL )
+    	{
+    		return 0;
+    	}
+    	msg_id[0] = entry->messageId >> 8;
+    	msg_id[1] = entry->messageId & 0xFF;
+    	segments[count].base     = msg_id;
+    	segments[count++].length = sizeof(msg_id);
+    	if ( message_id )
+    	{
+    		*message_id = entry->messageId;	// Returning message id
+    	}
+    }
+
+    for ( uint32_t index = 0; index < payload_count; index++ )
+    {
+    	if ( payload[index].length )
+    	{
+    		segments[count++] = payload[index];
+    	}
+    }
+
+    if ( entry != NULL )
+    {
+    	/**
+    	* Gather the packet into the inflight copy and send it from there
+    	*/
+    	for ( uint32_t index = 0; index < count; index++ )
+    	{
+    		memcpy ( entry->packet + length, segments[index].base, segments[index].length );
+    		length += segments[index].length;
+    	}
+    	length = mqtt_inflight_send ( broker, entry, qos );
+    }
+    else
+    {
+    	/**
+    	* Send the packet
+    	*/
+    	int32_t result = mqtt_send_publish ( broker, segments, count );
+    	length = ( result > 0 ) ? (uint32_t)result : 0;
+    }
+
+    if ( length != 0 )
+    {
+    	mqtt_count_publish ( broker, qos, msglen );
+    }
+    return length;
+}
+
+/**
+* Count a publish sent.
+* MQTT-SN QoS -1 publishes are counted as QoS 0.
+*
+* \param 	broker         Pointer to the broker context
+* \param 	qos            Quality of Service
+* \param 	msglen         Size of the payload
+*
+* \returns	none
+*/
+void mqtt_count_publish (mqttBrokerCtx_t* broker, uint8_t qos, uint32_t msglen)
+{
+	critical_section_acquire (&mqtt_cs);
+	broker->statistics.published[( qos <= MQTT_QOS2 ) ? qos : MQTT_QOS0]++;
+	broker->statistics.published_bytes += msglen;
+	critical_section_release (&mqtt_cs);
+}
+
+/**
+* Subscribe to or un-subscribe from a topic.
+*
+* \param 	broker         Pointer to the broker context
+* \param 	topic          Pointer to the topic name.
+* \param	qos			   Quality of service (used for subscribe - 0, 1, or 2)
+* \param 	message_id     Variable that will store the Message ID, if the pointer is not NULL.
+*
+* \returns	Number of bytes sent.
+*/
+uint32_t mqtt_subscribe_unsubscribe (mqttBrokerCtx_t* broker, uint8_t subUnsub, const char* topic, uint8_t qos, uint16_t* message_id)
+{
+    uint16_t topiclen = strlen(topic);
+
+    if ( broker->transport == MQTT_TRANSPORT_SN )
+    {
+    	return mqtt_sn_subscribe_unsubscribe ( broker, subUnsub, topic, qos, message_id );
+    }
+
+    /**
+    * Variable header
+    */
+    uint8_t var_header[2]; // Message ID
+    critical_section_acquire (&mqtt_cs);
+    uint16_t id = mqtt_next_packet_id ( broker );
+    critical_section_release (&mqtt_cs);
+    var_header[0] = id >> 8;
+    var_header[1] = id & 0xFF;
+    if (message_id)
+    {
+    	*message_id = id;               // Returning message id
+    }
+
+    /**
+    * utf topic
+    */
+    uint16_t utftopicsize = (topiclen + ((subUnsub == MQTT_MSG_SUBSCRIBE) ? 3 : 2));   // Topic size (2 bytes) + QoS byte if subscribe, otherwise topic size
+    uint8_t* utf_topic = broker->varHeader;
+    memset(utf_topic, 0, utftopicsize);
+    utf_topic[0] = topiclen >> 8;
+    utf_topic[1] = topiclen & 0xFF;
+    memcpy(utf_topic+2, topic, topiclen);
+    if ( subUnsub == MQTT_MSG_SUBSCRIBE )
+    {
+    	// Add QoS bytes if subscribe
+        utf_topic[2+topiclen] = qos;
+    }
+
+    /**
+    * Fixed header
+    */
+    uint8_t fixed_header[] =
+    {
+    	subUnsub | MQTT_QOS1_FLAG, // Message Type, DUP flag, QoS level, Retain
+		sizeof(var_header) + utftopicsize
+    };
+
+    uint16_t packetsize = sizeof(var_header)+sizeof(fixed_header)+utftopicsize;
+    uint8_t* packet = broker->buffer;
+    memset(packet, 0, packetsize);
+    memcpy(packet, fixed_header, sizeof(fixed_header));
+    memcpy(packet+sizeof(fixed_header), var_header, sizeof(var_header));
+    memcpy(packet+sizeof(fixed_header)+sizeof(var_header), utf_topic, utftopicsize);
+
+    /**
+    * Send the packet
+    */
+    return mqtt_send_packet ( broker, packet, packetsize, 0L );
+}
+
+/**
+* Disconnect from the MQTT broker
+*
+* \param 	broker         Pointer to the broker context
+*
+* \returns	Number of bytes sent.
+*/
+uint32_t mqtt_disconnect (mqttBrokerCtx_t* broker )
+{
+	if ( broker != NULL )
+	{
+	    uint8_t packet[2] =
+	    {
+	    	MQTT_MSG_DISCONNECT,    // Message Type, DUP flag, QoS level, Retain
+			0x00                    // Remaining length
+	    };
+	    if ( broker->transport == MQTT_TRANSPORT_SN )
+	    {
+	    	mqtt_sn_encode_header ( packet, 0, MQTT_SN_MSG_DISCONNECT );
+	    }
+	    return mqtt_send_packet ( broker, packet, sizeof(packet), 0L );
+	}
+	return 0L;
+}
+
+/**
+* Connect to the MQTT-SN gateway, or wake a sleeping client.
+*
+* \param 	broker         Pointer to the broker context
+*
+* \returns	Number of bytes sent, 0 if unsuccessful.
+*/
+uint32_t mqtt_sn_connect (mqttBrokerCtx_t* broker)
+{
+	uint32_t clientidlen = strlen(broker->clientid);
+	uint8_t* packet      = broker->buffer;
+
+	if ( clientidlen + 8 > broker->bufferSize )
+	{
+		return 0;
+	}
+
+	uint32_t offset = mqtt_sn_encode_header ( packet, 4 + clientidlen, MQTT_SN_MSG_CONNECT );
+	packet[offset++] = (broker->clean_session) ? MQTT_SN_FLAG_CLEAN_SESSION : 0x00;	// Flags
+	packet[offset++] = MQTT_SN_PROTOCOL_ID;											// Protocol id
+	packet[offset++] = broker->alive >> 8;											// Keep alive
+	packet[offset++] = broker->alive & 0xFF;
+	memcpy ( packet + offset, broker->clientid, clientidlen );						// Client id
+	offset += clientidlen;
+
+	int32_t result = mqtt_send_packet ( broker, packet, offset, 0L );
+	if ( result <= 0 )
+	{
+		return 0;
+	}
+	broker->stateTime = time_get_ticks(NULL);
+	broker->snState   = MQTT_SN_CONNECTING;
+	return (uint32_t)result;
+}
+
+/**
+* Publish a scatter list to the MQTT-SN gateway.
+*
+* The topic is sent as its predefined or registered topic id, or as a short
+* topic name.  QoS -1 needs no session and only takes predefined and short
+* topics.  A QoS 1 publish is gathered into its inflight entry, others into
+* a temporary copy, as each packet is one datagram.
+*
+* \param 	broker         Pointer to the broker context
+* \param 	topic          Pointer to the topic name, not NUL terminated.
+* \param 	topic_len      Length of the topic name.
+* \param 	payload        Pointer to the payload segments.
+* \param 	payload_count  Number of payload segments.
+* \param 	msglen         Size of the payload.
+* \param 	retain         Enable or disable the Retain flag (values: 0 or 1).
+* \param 	qos            Quality of Service (values: 0, 1 or MQTT_QOS_MINUS1)
+* \param 	message_id     Variable that will store the Message ID, if the pointer is not NULL.
+*
+* \returns	Number of bytes sent, 0 if unsuccessful.
+*/
+uint32_t mqtt_sn_publish (mqttBrokerCtx_t* broker, const char* topic, uint16_t topic_len, const mqtt_iovec_t* payload, uint32_t payload_count, uint32_t msglen, uint8_t retain, uint8_t qos, uint16_t* message_id)
+{
+	mqttInflight_t* entry = NULL;
+	uint8_t* packet;
+	uint8_t  type;
+	uint16_t id;
+	uint16_t msgId = 0;
+	bool resolved;
+
+	if ( qos == MQTT_QOS2 || qos > MQTT_QOS_MINUS1 )
+	{
+		return 0;
+	}
+
+	critical_section_acquire (&mqtt_cs);
+	resolved = mqtt_sn_topic_resolve ( broker->snTopics, topic, topic_len, &type, &id );
+	critical_section_release (&mqtt_cs);
+
+	if ( ! resolved || ( qos == MQTT_QOS_MINUS1 && type == MQTT_SN_TOPIC_NORMAL ) )
+	{
+		return 0;
+	}
+	if ( qos != MQTT_QOS_MINUS1 && ! (broker->status & MQTT_STATUS_SESSION_ACTIVE) )
+	{
+		return 0;
+	}
+	if ( msglen > MQTT_SN_MAX_PACKET - 9 )
+	{
+		return 0;
+	}
+
+	/**
+	* Flags, topic id and message id come before the payload
+	*/
+	uint32_t size  = 5 + msglen;
+	uint32_t total = size + ( ( size + 2 <= 0xFF ) ? 2 : 4 );
+	if ( qos == MQTT_QOS1 )
+	{
+		entry = mqtt_inflight_alloc ( broker, total );
+		if ( entry == NULL )
+		{
+			return 0;
+		}
+		packet = entry->packet;
+		msgId  = entry->messageId;
+		if ( message_id )
+		{
+			*message_id = msgId;
+		}
+	}
+	else
+	{
+		packet = (uint8_t*) malloc ( total );
+		if ( packet == NULL )
+		{
+			return 0;
+		}
+	}
+
+	uint32_t offset = mqtt_sn_encode_header ( packet, size, MQTT_SN_MSG_PUBLISH );
+	packet[offset]   = type | ( (retain) ? MQTT_SN_FLAG_RETAIN : 0x00 );
+	packet[offset++] |= ( qos == MQTT_QOS1 ) ? MQTT_SN_FLAG_QOS1 : ( qos == MQTT_QOS_MINUS1 ) ? MQTT_SN_FLAG_QOS_MINUS1 : MQTT_SN_FLAG_QOS0;
+	packet[offset++] = id >> 8;
+	packet[offset++] = id & 0xFF;
+	packet[offset++] = msgId >> 8;
+	packet[offset++] = msgId & 0xFF;
+	for ( uint32_t index = 0; index < payload_count; index++ )
+	{
+		memcpy ( packet + offset, payload[index].base, payload[index].length );
+		offset += payload[index].length;
+	}
+
+	if ( entry != NULL )
+	{
+		return mqtt_inflight_send ( broker, entry, qos );
+	}
+	int32_t result = mqtt_send_packet ( broker, packet, total, 0L );
+	free ( packet );
+	return ( result > 0 ) ? (uint32_t)result : 0;
+}
+
+/**
+* Subscribe to or un-subscribe from a topic on the MQTT-SN gateway.
+*
+* A topic without an id is sent by name.  Unless it holds wildcards its
+* entry in the topic table takes the topic id from the SUBACK, topics that
+* match a wildcard are registered by the gateway before their publishes.
+*
+* \param 	broker         Pointer to the broker context
+* \param 	subUnsub       MQTT_MSG_SUBSCRIBE or MQTT_MSG_UNSUBSCRIBE
+* \param 	topic          Pointer to the topic name.
+* \param	qos			   Quality of service (used for subscribe - 0 or 1)
+* \param 	message_id     Variable that will store the Message ID, if the pointer is not NULL.
+*
+* \returns	Number of bytes sent, 0 if unsuccessful.
+*/
+uint32_t mqtt_sn_subscribe_unsubscribe (mqttBrokerCtx_t* broker, uint8_t subUnsub, const char* topic, uint8_t qos, uint16_t* message_id)
+{
+	uint32_t topiclen = strlen(topic);
+	uint8_t* packet   = broker->buffer;
+	uint8_t  type     = MQTT_SN_TOPIC_NORMAL;
+	uint16_t topicId  = 0;
+	bool resolved;
+
+	if ( subUnsub == MQTT_MSG_SUBSCRIBE && qos > MQTT_QOS1 )
+	{
+		return 0;
+	}
+
+	critical_section_acquire (&mqtt_cs);
+	uint16_t id = mqtt_next_packet_id ( broker );
+	resolved = mqtt_sn_topic_resolve ( broker->snTopics, topic, topiclen, &type, &topicId );
+	if ( ! resolved && subUnsub == MQTT_MSG_SUBSCRIBE && strpbrk ( topic, "+#" ) == NULL )
+	{
+		mqtt_sn_topic_t* entry = mqtt_sn_topic_add ( broker->snTopics, topic, topiclen, MQTT_SN_TOPIC_NORMAL, 0 );
+		if ( entry != NULL )
+		{
+			entry->pending = id;
+		}
+	}
+	critical_section_release (&mqtt_cs);
+
+	if ( message_id )
+	{
+		*message_id = id;               // Returning message id
+	}
+
+	uint32_t size = 3 + ( (resolved) ? 2 : topiclen );
+	if ( size + 4 > broker->bufferSize )
+	{
+		return 0;
+	}
+
+	uint32_t offset = mqtt_sn_encode_header ( packet, size, (subUnsub == MQTT_MSG_SUBSCRIBE) ? MQTT_SN_MSG_SUBSCRIBE : MQTT_SN_MSG_UNSUBSCRIBE );
+	packet[offset++] = ( (resolved) ? type : MQTT_SN_TOPIC_NORMAL ) | ( (qos == MQTT_QOS1) ? MQTT_SN_FLAG_QOS1 : MQTT_SN_FLAG_QOS0 );
+	packet[offset++] = id >> 8;
+	packet[offset++] = id & 0xFF;
+	if ( resolved )
+	{
+		packet[offset++] = topicId >> 8;
+		packet[offset++] = topicId & 0xFF;
+	}
+	else
+	{
+		memcpy ( packet + offset, topic, topiclen );
+		offset += topiclen;
+	}
+
+	int32_t result = mqtt_send_packet ( broker, packet, offset, 0L );
+	return ( result > 0 ) ? (uint32_t)result : 0;
+}
+
+/**
+* Send a ping request to the server.
+* A sleeping MQTT-SN client names itself, so the gateway sends the publishes it holds.
 *
 * \param 	broker         Pointer to the broker context
-* \param 	topic          Pointer to the topic name.
-* \param 	msg            Pointer to the message.
-* \param 	retain         Enable or disable the Retain flag (values: 0 or 1).
-* \param 	qos            Quality of Service (values: 0, 1 or 2)
-* \param 	message_id     Variable that will store the Message ID, if the pointer is not NULL.
 *
-* \returns	Number of bytes sent.
+* \returns	Number of bytes sent.
+*/
+int32_t mqtt_send_pingreq (mqttBrokerCtx_t* broker)
+{
+    uint8_t packet[2] =
+    {
+    	MQTT_MSG_PINGREQ, // Message Type, DUP flag, QoS level, Retain
+		0x00              // Remaining length
+    };
+
+    if ( broker->transport == MQTT_TRANSPORT_SN )
+    {
+    	if ( broker->snState == MQTT_SN_ASLEEP )
+    	{
+    		uint32_t clientidlen = strlen(broker->clientid);
+    		if ( clientidlen + 4 > broker->bufferSize )
+    		{
+    			return FNET_ERR;
+    		}
+    		uint32_t offset = mqtt_sn_encode_header ( broker->buffer, clientidlen, MQTT_SN_MSG_PINGREQ );
+    		memcpy ( broker->buffer + offset, broker->clientid, clientidlen );
+    		return mqtt_send_packet ( broker, broker->buffer, offset + clientidlen, 0L );
+    	}
+    	mqtt_sn_encode_header ( packet, 0, MQTT_SN_MSG_PINGREQ );
+    }
+    return mqtt_send_packet ( broker, packet, sizeof(packet), 0L );
+}
+
+/**
+* Send a MQTT-SN PUBACK or REGACK.
+*
+* \param 	broker         Pointer to the broker context
+* \param 	msgType        MQTT_SN_MSG_PUBACK or MQTT_SN_MSG_REGACK
+* \param 	topicId        Topic id
+* \param 	messageId      Message id
+* \param 	returnCode     MQTT_SN_RC_xxx
+*
+* \returns	Number of bytes sent.
+*/
+int32_t mqtt_sn_send_ack (mqttBrokerCtx_t* broker, uint8_t msgType, uint16_t topicId, uint16_t messageId, uint8_t returnCode)
+{
+	uint8_t packet[] =
+	{
+		0x07,									// Length
+		msgType,								// Message type
+		topicId >> 8, topicId & 0xFF,			// Topic id
+		messageId >> 8, messageId & 0xFF,		// Message id
+		returnCode								// Return code
+	};
+	return mqtt_send_packet ( broker, packet, sizeof(packet), 0L );
+}
+
+/**
+* Transmit a MQTT packet over the transport
+* Coalesced publishes are sent first so the packet keeps its place in the stream.
+*
+* \param	broker			Pointer to the broker context
+* \param	packet			Pointer to the packet to send
+* \param	size			Size of the packet to send
+* \param	timeout			Send timeout value
+*
+* \returns	Number of bytes sent.
+*/
+int32_t mqtt_send_packet ( mqttBrokerCtx_t* broker, uint8_t* packet, uint32_t size, uint32_t timeout )
+{
+	int32_t result = FNET_ERR;
+	(void) timeout;	// not used
+
+	mqtt_tx_acquire ( broker );
+	if ( broker->netsrv != NULL && mqtt_coalesce_flush ( broker ) != FNET_ERR )
+	{
+		uint32_t bytes_transferred = 0L;
+		send_parms_t parms = { broker->socket.fnet_socket, packet, size, 0 };
+		if ( broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_SEND,
+				                   	     &parms,
+										 sizeof(send_parms_t),
+										 NULL,
+										 0L,
+										 &bytes_transferred ) == SERVICE_STATUS_SUCCESS )
+		{
+			broker->lastSent = time_get_ticks(NULL);
+			result = bytes_transferred;
+		}
+	}
+	mqtt_tx_release ( broker );
+
+	return result;
+}
+
+/**
+* Take the transmit stream of a broker
+*
+* The owner writes the socket and the coalescing buffer, so the packets of
+* two senders never mix.  The transmit lock is only held to change the
+* owner, the owner waits for send buffer space without it and the brokers
+* do not wait on each other.
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_tx_acquire ( mqttBrokerCtx_t* broker )
+{
+	critical_section_acquire ( &broker->txLock );
+	while ( broker->txBusy )
+	{
+		critical_section_release ( &broker->txLock );
+		time_delay (1);
+		critical_section_acquire ( &broker->txLock );
+	}
+	broker->txBusy = true;
+	critical_section_release ( &broker->txLock );
+}
+
+/**
+* Give back the transmit stream of a broker
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_tx_release ( mqttBrokerCtx_t* broker )
+{
+	critical_section_acquire ( &broker->txLock );
+	broker->txBusy = false;
+	critical_section_release ( &broker->txLock );
+}
+
+/**
+* Transmit a MQTT packet held in a scatter list over the transport
+*
+* Each segment is handed to the socket in turn.  The stack may take part of
+* a segment when its send buffer is full, the rest is retried after a short
+* delay.  A packet that is cut short leaves the stream out of sync, so
+* nothing more is sent and the service task is asked to drop the session.
+* The sender may be a publisher's thread, so the state machine is left to
+* the service task.  The caller owns the transmit stream.
+*
+* \param	broker			Pointer to the broker context
+* \param	segments		Pointer to the packet segments
+* \param	count			Number of packet segments
+* \param	timeout			Send timeout value
+*
+* \returns	Number of bytes sent.
+*/
+int32_t mqtt_send_segments ( mqttBrokerCtx_t* broker, const mqtt_iovec_t* segments, uint32_t count, uint32_t timeout )
+{
+	int32_t total = 0;
+	(void) timeout;	// not used
+	if ( broker->txLost )
+	{
+		return FNET_ERR;
+	}
+	if ( broker->netsrv != NULL )
+	{
+		for ( uint32_t index = 0; index < count; index++ )
+		{
+			const uint8_t* data = (const uint8_t*)segments[index].base;
+			uint32_t remaining  = segments[index].length;
+			uint32_t retries    = 0;
+
+			while ( remaining != 0 )
+			{
+				uint32_t bytes_transferred = 0L;
+				send_parms_t parms = { broker->socket.fnet_socket, (uint8_t*)data, remaining, 0 };
+				if ( broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_SEND,
+						                   	     &parms,
+												 sizeof(send_parms_t),
+												 NULL,
+												 0L,
+												 &bytes_transferred ) != SERVICE_STATUS_SUCCESS ||
+					 (bytes_transferred == 0 && ++retries > MQTT_SEND_RETRIES) )
+				{
+					if ( total != 0 )
+					{
+						broker->txLost = true;
+						mqtt_worker_wake ( broker );
+					}
+					return FNET_ERR;
+				}
+				if ( bytes_transferred == 0 )
+				{
+					time_delay (10);	// Let the stack drain the send buffer
+					continue;
+				}
+				data      += bytes_transferred;
+				remaining -= bytes_transferred;
+				total     += bytes_transferred;
+				retries    = 0;
+			}
+		}
+		broker->lastSent = time_get_ticks(NULL);
+		return total;
+	}
+	return FNET_ERR;
+}
+
+/**
+* Transmit a MQTT PUBLISH packet held in a scatter list
+*
+* With coalescing on, a publish that fits the coalescing buffer is copied
+* there and goes out in one socket send with the publishes around it.  A
+* larger publish sends the waiting ones first and then goes out on its own.
+* MQTT-SN publishes are datagrams of their own and are never coalesced.
+*
+* \param	broker			Pointer to the broker context
+* \param	segments		Pointer to the packet segments
+* \param	count			Number of packet segments
+*
+* \returns	Number of bytes sent or packed.
+*/
+int32_t mqtt_send_publish ( mqttBrokerCtx_t* broker, const mqtt_iovec_t* segments, uint32_t count )
+{
+	uint32_t size  = 0;
+	int32_t result = 0;
+
+	for ( uint32_t index = 0; index < count; index++ )
+	{
+		size += segments[index].length;
+	}
+
+	mqtt_tx_acquire ( broker );
+	if ( broker->coalesce != NULL && size <= broker->coalesceSize && (broker->status & MQTT_STATUS_SESSION_ACTIVE) && broker->transport == MQTT_TRANSPORT_TCP )
+	{
+		if ( broker->coalesceUsed + size > broker->coalesceSize )
+		{
+			result = mqtt_coalesce_flush ( broker );
+		}
+		if ( result != FNET_ERR )
+		{
+			if ( broker->coalesceUsed == 0 )
+			{
+				broker->coalesceTime = time_get_ticks(NULL);
+				mqtt_worker_wake ( broker );
+			}
+			for ( uint32_t index = 0; index < count; index++ )
+			{
+				memcpy ( broker->coalesce + broker->coalesceUsed, segments[index].base, segments[index].length );
+				broker->coalesceUsed += segments[index].length;
+			}
+			result = size;
+			if ( broker->coalesceUsed == broker->coalesceSize && mqtt_coalesce_flush ( broker ) == FNET_ERR )
+			{
+				result = FNET_ERR;
+			}
+		}
+	}
+	else
+	{
+		result = mqtt_coalesce_flush ( broker );
+		if ( result != FNET_ERR )
+		{
+			result = mqtt_send_segments ( broker, segments, count, 0L );
+		}
+	}
+	mqtt_tx_release ( broker );
+
+	return result;
+}
+
+/**
+* Send the coalesced publishes, the caller owns the transmit stream
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	Number of bytes sent, FNET_ERR if the send failed.
+*/
+int32_t mqtt_coalesce_flush ( mqttBrokerCtx_t* broker )
+{
+	mqtt_iovec_t segment;
+
+	if ( broker->coalesceUsed == 0 )
+	{
+		return 0;
+	}
+	segment.base   = broker->coalesce;
+	segment.length = broker->coalesceUsed;
+	broker->coalesceUsed = 0;
+	return mqtt_send_segments ( broker, &segment, 1, 0L );
+}
+
+/**
+* Receive from the transport into the receive memory
+*
+* Whatever the socket holds, up to the free space after the unparsed bytes,
+* is read with a single receive.  A partial packet left from the previous
+* read is first moved to the start of the receive memory, so every packet is
+* contiguous when it is handed to the parser.
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	Number of bytes received, FNET_ERR if the connection is lost.
+*/
+int32_t mqtt_recv_fill ( mqttBrokerCtx_t* broker )
+{
+	if ( broker->netsrv != NULL )
+	{
+		uint32_t bytes_transferred = 0L;
+
+		if ( broker->rxStart != 0 )
+		{
+			memmove ( broker->recvBuffer, broker->recvBuffer + broker->rxStart, broker->rxEnd - broker->rxStart );
+			broker->rxEnd  -= broker->rxStart;
+			broker->rxStart = 0;
+		}
+		if ( broker->rxEnd == broker->bufferSize )
+		{
+			return 0;
+		}
+
+		recv_parms_t parms =
+		{
+			.socket = broker->socket.fnet_socket,
+			.buffer = broker->recvBuffer + broker->rxEnd,
+			.length = broker->bufferSize - broker->rxEnd,
+			.flags  = 0
+		};
+		if ( broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_RECV,
+				                   	     &parms,
+										 sizeof(recv_parms_t),
+										 NULL,
+										 0L,
+										 &bytes_transferred ) == SERVICE_STATUS_SUCCESS )
+		{
+			broker->rxEnd += bytes_transferred;
+			return bytes_transferred;
+		}
+	}
+	return FNET_ERR;
+}
+
+/**
+* Parse the next complete packet from the receive memory
+*
+* The parser resumes where the previous call stopped.  A packet whose fixed
+* header or body has not fully arrived is left for the next read, a packet
+* larger than the receive memory is skipped as its bytes arrive.
+*
+* \param	broker			Pointer to the broker context
+* \param	packet			Pointer to storage for the packet pointer
+*
+* \returns	Size of the packet, 0 if no complete packet is available,
+* 			FNET_ERR on a malformed remaining length.
+*/
+int32_t mqtt_recv_next ( mqttBrokerCtx_t* broker, const uint8_t** packet )
+{
+	for (;;)
+	{
+		const uint8_t* buf = broker->recvBuffer + broker->rxStart;
+		uint32_t available = broker->rxEnd - broker->rxStart;
+
+		/**
+		* Drop the rest of an oversized packet
+		*/
+		if ( broker->rxDiscard != 0 )
+		{
+			uint32_t length = ( broker->rxDiscard < available ) ? broker->rxDiscard : available;
+			broker->rxStart   += length;
+			broker->rxDiscard -= length;
+			if ( broker->rxDiscard != 0 )
+				return 0;
+			continue;
+		}
+
+		/**
+		* Decode the fixed header once enough of it has arrived
+		*/
+		if ( broker->rxPacketSize == 0 )
+		{
+			uint32_t multiplier = 1;
+			uint32_t remainingLength = 0L;
+			uint32_t index = 1;
+
+			for (;;)
+			{
+				if ( index >= available )
+					return 0;
+				remainingLength += (uint32_t)( buf[index] & 0x7F ) * multiplier;
+				if ( (buf[index++] & 0x80) == 0 )
+					break;
+				multiplier *= 128;
+				if ( index > 4 )
+					return FNET_ERR;
+			}
+			broker->rxPacketSize = index + remainingLength;
+
+			if ( broker->rxPacketSize > broker->bufferSize )
+			{
+				broker->rxDiscard    = broker->rxPacketSize;
+				broker->rxPacketSize = 0;
+				continue;
+			}
+		}
+
+		if ( available < broker->rxPacketSize )
+			return 0;
+
+		int32_t size = broker->rxPacketSize;
+		*packet = buf;
+		broker->rxStart     += size;
+		broker->rxPacketSize = 0;
+		return size;
+	}
+}
+
+/**
+* Discard the received bytes and the parser state
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_recv_reset ( mqttBrokerCtx_t* broker )
+{
+	broker->rxStart      = 0;
+	broker->rxEnd        = 0;
+	broker->rxPacketSize = 0;
+	broker->rxDiscard    = 0;
+}
+
+/**
+* Increment the message sequence number
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	new message sequence number
+*/
+uint16_t mqtt_increment_sequence ( mqttBrokerCtx_t* broker )
+{
+	broker->seq = ( broker->seq >= 65535 ) ? 1 : (broker->seq+1);
+	return broker->seq;
+}
+
+/**
+* Take the next free packet id
+*
+* Packet ids still held by an inflight publish are skipped.
+* The caller holds the MQTT critical section.
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	packet id
+*/
+uint16_t mqtt_next_packet_id ( mqttBrokerCtx_t* broker )
+{
+	uint16_t id = mqtt_increment_sequence ( broker );
+	for ( uint32_t index = 0; index < MQTT_INFLIGHT_WINDOW; index++ )
+	{
+		if ( broker->inflight[index].state != MQTT_INFLIGHT_FREE && broker->inflight[index].messageId == id )
+		{
+			id    = mqtt_increment_sequence ( broker );
+			index = (uint32_t)-1;	// Start over with the new id
+		}
+	}
+	return id;
+}
+
+/**
+* Count the inflight entries in use, the caller holds the MQTT lock
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	Number of QoS 1 and 2 publishes awaiting acknowledgement
+*/
+uint32_t mqtt_inflight_used ( mqttBrokerCtx_t* broker )
+{
+	uint32_t used = 0;
+
+	for ( uint32_t index = 0; index < MQTT_INFLIGHT_WINDOW; index++ )
+	{
+		if ( broker->inflight[index].state != MQTT_INFLIGHT_FREE )
+			used++;
+	}
+	return used;
+}
+
+/**
+* Reserve an inflight entry for a QoS 1 or 2 publish
+*
+* \param	broker			Pointer to the broker context
+* \param	size			Size of the publish packet
+*
+* \returns	Pointer to the inflight entry, NULL if the window is full
 */
-uint32_t mqtt_publish_with_qos (mqttBrokerCtx_t* broker, const char* topic, const char* msg, uint8_t retain, uint8_t qos, uint16_t* message_id)
+mqttInflight_t* mqtt_inflight_alloc ( mqttBrokerCtx_t* broker, uint32_t size )
 {
-    uint16_t topiclen = strlen(topic);
-    uint16_t msglen   = strlen(msg);
+	mqttInflight_t* entry = NULL;
+	uint32_t used  = 0;
+	uint32_t bytes = size;
 
-    uint8_t qos_flag = MQTT_QOS0_FLAG;
-    uint8_t qos_size = 0; // No QoS included
-    if ( qos == MQTT_QOS1 )
-    {
-    	qos_size = 2; // 2 bytes for QoS
-    	qos_flag = MQTT_QOS1_FLAG;
-    }
-    else if ( qos == MQTT_QOS2 )
-    {
-    	qos_size = 2; // 2 bytes for QoS
-    	qos_flag = MQTT_QOS2_FLAG;
-    }
+	critical_section_acquire (&mqtt_cs);
+	for ( uint32_t index = 0; index < MQTT_INFLIGHT_WINDOW; index++ )
+	{
+		if ( broker->inflight[index].state != MQTT_INFLIGHT_FREE )
+		{
+			used++;
+			bytes += broker->inflight[index].size;
+		}
+		else if ( entry == NULL )
+		{
+			entry = &broker->inflight[index];
+		}
+	}
+	if ( entry != NULL && used < broker->inflightWindow )
+	{
+		entry->packet = (uint8_t*) malloc ( size );
+		if ( entry->packet != NULL )
+		{
+			entry->size      = size;
+			entry->retries   = 0;
+			entry->messageId = mqtt_next_packet_id ( broker );
+			entry->state     = MQTT_INFLIGHT_RESERVED;
+			if ( used + 1 > broker->statistics.inflight_max )
+				broker->statistics.inflight_max = used + 1;
+			if ( bytes > broker->statistics.inflight_bytes_max )
+				broker->statistics.inflight_bytes_max = bytes;
+		}
+		else
+		{
+			entry = NULL;
+		}
+	}
+	else
+	{
+		entry = NULL;
+	}
+	critical_section_release (&mqtt_cs);
 
-    /**
-    * Variable header
-    */
-    uint16_t varheadersize = topiclen+2+qos_size; // Topic size (2 bytes), utf-encoded topic
-    uint8_t* var_header = broker->varHeader;
-    memset (var_header, 0, varheadersize);
-    var_header[0] = topiclen >> 8;
-    var_header[1] = topiclen&0xFF;
-    memcpy ( var_header+2, topic, topiclen );
-    if ( qos_size )
-    {
-    	var_header[topiclen+2] = broker->seq>>8;
-    	var_header[topiclen+3] = broker->seq&0xFF;
-    	if ( message_id )
-    	{
-    		*message_id = broker->seq;	// Returning message id
-    	}
-    }
+	return entry;
+}
 
-    /**
-    * Fixed header
-    * The remaining length is one byte for messages up to 127 bytes, then two bytes after that
-    * Actually, it can be up to 4 bytes but making the assumption the embedded device will only
-    * need up to two bytes of length (handles up to 16,383 sized message)
-    */
-    uint8_t fixed_header[3];              // Allocating space for the maximum size fixed header
-    uint8_t fixedHeaderSize = 2;          // Default size = one byte Message Type + one byte Remaining Length
-    uint8_t remainLen = varheadersize + msglen;
-    fixed_header[0] = MQTT_MSG_PUBLISH | qos_flag; // Message type, DUP flag, Qos level, Retain
-    if ( retain )
-    {
-        fixed_header[0] |= MQTT_RETAIN_FLAG;
-    }
+/**
+* Send a reserved inflight publish for the first time
+*
+* \param	broker			Pointer to the broker context
+* \param	entry			Pointer to the inflight entry
+* \param	qos				Quality of service (1 or 2)
+*
+* \returns	Number of bytes sent, 0 if unsuccessful.
+*/
+uint32_t mqtt_inflight_send ( mqttBrokerCtx_t* broker, mqttInflight_t* entry, uint8_t qos )
+{
+	critical_section_acquire (&mqtt_cs);
+	entry->state    = ( qos == MQTT_QOS1 ) ? MQTT_INFLIGHT_WAIT_PUBACK : MQTT_INFLIGHT_WAIT_PUBREC;
+	entry->interval = MQTT_RETRY_INTERVAL * CFG_SYSTICK_FREQ;
+	entry->sentTime = time_get_ticks(NULL);
+	entry->firstSent = entry->sentTime;
+	critical_section_release (&mqtt_cs);
 
-    /**
-    * Remaining length
-    */
-    if ( remainLen <= 127 )
-    {
-        fixed_header[1] = remainLen;
-    }
-    else
+	mqtt_iovec_t segment = { entry->packet, entry->size };
+	int32_t result = mqtt_send_publish ( broker, &segment, 1 );
+	if ( result <= 0 )
+	{
+		/**
+		* The caller sees the failure, so the publish is not retried
+		*/
+		critical_section_acquire (&mqtt_cs);
+		mqtt_inflight_release ( entry );
+		critical_section_release (&mqtt_cs);
+		return 0;
+	}
+	return (uint32_t)result;
+}
+
+/**
+* Release an inflight entry
+*
+* \param	entry			Pointer to the inflight entry
+*
+* \returns	none
+*/
+void mqtt_inflight_release ( mqttInflight_t* entry )
+{
+	if ( entry->packet != NULL )
+	{
+		free ( entry->packet );
+		entry->packet = NULL;
+	}
+	entry->size  = 0;
+	entry->state = MQTT_INFLIGHT_FREE;
+}
+
+/**
+* Record the delivery latency of an acknowledged publish and release its
+* inflight entry, the caller holds the MQTT lock
+*
+* \param	broker			Pointer to the broker context
+* \param	entry			Pointer to the inflight entry
+* \param	now				Tick count of the acknowledgement
+*
+* \returns	none
+*/
+void mqtt_inflight_delivered ( mqttBrokerCtx_t* broker, mqttInflight_t* entry, uint64_t now )
+{
+	mqtt_statistics_t* statistics = &broker->statistics;
+	uint32_t latency = (uint32_t)( now - entry->firstSent );
+	uint32_t bucket  = 0;
+
+	while ( bucket < MQTT_LATENCY_BUCKETS - 1 && latency >= (1UL << bucket) )
+		bucket++;
+
+	statistics->delivered++;
+	statistics->latency[bucket]++;
+	statistics->latency_total += latency;
+	if ( latency > statistics->latency_max )
+		statistics->latency_max = latency;
+
+	mqtt_inflight_release ( entry );
+}
+
+/**
+* Match an acknowledgement from the server against the inflight publishes
+*
+* \param	broker			Pointer to the broker context
+* \param	msgType			MQTT_MSG_PUBACK, MQTT_MSG_PUBREC or MQTT_MSG_PUBCOMP
+* \param	messageId		Packet id of the acknowledgement
+*
+* \returns	none
+*/
+void mqtt_inflight_ack ( mqttBrokerCtx_t* broker, uint8_t msgType, uint16_t messageId )
+{
+	bool delivered = false;
+	uint64_t now   = time_get_ticks(NULL);
+
+	critical_section_acquire (&mqtt_cs);
+	for ( uint32_t index = 0; index < MQTT_INFLIGHT_WINDOW; index++ )
+	{
+		mqttInflight_t* entry = &broker->inflight[index];
+		if ( entry->state == MQTT_INFLIGHT_FREE || entry->state == MQTT_INFLIGHT_RESERVED || entry->messageId != messageId )
+			continue;
+
+		if ( msgType == MQTT_MSG_PUBACK && entry->state == MQTT_INFLIGHT_WAIT_PUBACK )
+		{
+			mqtt_inflight_delivered ( broker, entry, now );
+			delivered = true;
+		}
+		else if ( msgType == MQTT_MSG_PUBREC && (entry->state == MQTT_INFLIGHT_WAIT_PUBREC || entry->state == MQTT_INFLIGHT_WAIT_PUBCOMP) )
+		{
+			/**
+			* The server owns the message now, only the release is retransmitted
+			*/
+			free ( entry->packet );
+			entry->packet   = NULL;
+			entry->size     = 0;
+			entry->state    = MQTT_INFLIGHT_WAIT_PUBCOMP;
+			entry->retries  = 0;
+			entry->interval = MQTT_RETRY_INTERVAL * CFG_SYSTICK_FREQ;
+			entry->sentTime = now;
+		}
+		else if ( msgType == MQTT_MSG_PUBCOMP && entry->state == MQTT_INFLIGHT_WAIT_PUBCOMP )
+		{
+			mqtt_inflight_delivered ( broker, entry, now );
+			delivered = true;
+		}
+		break;
+	}
+	critical_section_release (&mqtt_cs);
+
+	/**
+	* A PUBREC is always answered, even for a publish that is no longer tracked
+	*/
+	if ( msgType == MQTT_MSG_PUBREC )
+	{
+		mqtt_send_pubrel ( broker, messageId );
+	}
+
+	if ( delivered && broker->cbs.svcMqttDelivered )
+	{
+		(*broker->cbs.svcMqttDelivered)( broker, messageId, MQTT_DELIVERY_COMPLETE );
+	}
+}
+
+/**
+* Restart the inflight publishes after a new connection
+*
+* With a clean session the server has dropped the session state, so the
+* publishes are abandoned.  Otherwise they are all due for retransmission.
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_inflight_restart ( mqttBrokerCtx_t* broker )
+{
+	uint16_t failed[MQTT_INFLIGHT_WINDOW];
+	uint32_t count = 0;
+	uint64_t now   = time_get_ticks(NULL);
+
+	critical_section_acquire (&mqtt_cs);
+	for ( uint32_t index = 0; index < MQTT_INFLIGHT_WINDOW; index++ )
+	{
+		mqttInflight_t* entry = &broker->inflight[index];
+		if ( entry->state == MQTT_INFLIGHT_FREE || entry->state == MQTT_INFLIGHT_RESERVED )
+			continue;
+
+		if ( broker->clean_session )
+		{
+			failed[count++] = entry->messageId;
+			broker->statistics.abandoned++;
+			mqtt_inflight_release ( entry );
+		}
+		else
+		{
+			entry->interval = MQTT_RETRY_INTERVAL * CFG_SYSTICK_FREQ;
+			entry->sentTime = now - entry->interval;
+		}
+	}
+	critical_section_release (&mqtt_cs);
+
+	for ( uint32_t index = 0; index < count && broker->cbs.svcMqttDelivered; index++ )
+	{
+		(*broker->cbs.svcMqttDelivered)( broker, failed[index], MQTT_DELIVERY_FAILED );
+	}
+}
+
+/**
+* Send a publish release to the server
+*
+* \param	broker			Pointer to the broker context
+* \param	messageId		Packet id of the publish
+*
+* \returns	Number of bytes sent.
+*/
+int32_t mqtt_send_pubrel ( mqttBrokerCtx_t* broker, uint16_t messageId )
+{
+    uint8_t packet[] =
     {
-        fixedHeaderSize++;              // add an additional byte for Remaining Length
-        // first byte is remainder (mod) of 128, then set the MSB to indicate more bytes
-        fixed_header[1] = remainLen % 128;
-        fixed_header[1] = fixed_header[1] | 0x80;
-        // second byte is number of 128s
-        fixed_header[2] = remainLen / 128;
-    }
+    	MQTT_MSG_PUBREL | MQTT_QOS1_FLAG, 		// Message Type, DUP flag, QoS level, Retain
+		0x02,                             		// Remaining length
+		messageId >> 8,
+		messageId & 0xFF
+    };
+    return mqtt_send_packet ( broker, packet, sizeof(packet), 0L );
+}
 
-    uint16_t packetsize = fixedHeaderSize + varheadersize + msglen;
-    uint8_t* packet = broker->buffer;
-    memset (packet, 0, packetsize);
-    memcpy (packet, fixed_header, fixedHeaderSize);
-    memcpy (packet + fixedHeaderSize, var_header, varheadersize);
-    memcpy (packet + fixedHeaderSize + varheadersize, msg, msglen);
+/**
+* Resolve a server address
+*
+* Use DNS lookup to resolve a server host name to an IP address
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_resolve_hostname ( mqttBrokerCtx_t* broker )
+{
+	dns_init_parms_t dns_params =
+	{
+		.addr_family = AF_INET,
+		.host_name   = broker->serverAddr,
+		.callback    = mqtt_dns_resolved_addr_handler,
+		.param       = (uint32_t)broker,
+	};
+	memset ( &dns_params.dns_server_addr, 0, sizeof(struct sockaddr) );
+	broker->netsrv->iocontrol ( IOCTL_FNET_STACK_DNS_INIT,
+	                    	    &dns_params,
+								sizeof(dns_init_parms_t),
+								NULL,
+								0L,
+								NULL );
+}
+
+/**
+* Open the network socket and start the TCP connection
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	true if the connection is under way
+*/
+bool mqtt_socket_open ( mqttBrokerCtx_t* broker )
+{
+	socket_parms_t socket_parms = { AF_INET, (broker->transport == MQTT_TRANSPORT_SN) ? SOCK_DGRAM : SOCK_STREAM, IPPROTO_IP };
+	uint32_t bytes_returned     = 0L;
+	broker->socket.fnet_socket  = FNET_ERR;
+	service_status_t result = broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET,
+			                                              &socket_parms,
+													      sizeof(socket_parms_t),
+													      &broker->socket,
+													      sizeof(socket_desc_t),
+													      &bytes_returned );
+	if ( (result == SERVICE_STATUS_SUCCESS) && (bytes_returned == sizeof(socket_desc_t)) )
+	{
+		/**
+		* The socket does not block, the connection completes in the background
+		*/
+		connect_parms_t connect_parms = { broker->socket.fnet_socket, &broker->resolvedServerAddr, sizeof(struct sockaddr) };
+		return ( broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_CONNECT,
+				                             &connect_parms,
+								             sizeof(connect_parms_t),
+								             NULL,
+								             0L,
+								             NULL ) == SERVICE_STATUS_SUCCESS );
+	}
+	return false;
+}
+
+/**
+* Read the TCP connection state of the network socket
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	SS_UNCONNECTED, SS_CONNECTING or SS_CONNECTED
+*/
+uint32_t mqtt_socket_state ( mqttBrokerCtx_t* broker )
+{
+	fnet_socket_state_t state  = SS_UNCONNECTED;
+	fnet_size_t         length = sizeof(state);
+	getopt_parms_t getopt_parms = { broker->socket.fnet_socket, SOL_SOCKET, SO_STATE, &state, &length };
+	if ( broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_GETOPT,
+			                         &getopt_parms,
+							         sizeof(getopt_parms_t),
+							         NULL,
+							         0L,
+							         NULL ) != SERVICE_STATUS_SUCCESS )
+	{
+		return SS_UNCONNECTED;
+	}
+	return state;
+}
+
+/**
+* Destroy the network socket
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_socket_close ( mqttBrokerCtx_t* broker )
+{
+	if ( broker->netsrv != NULL && broker->socket.fnet_socket != FNET_ERR )
+	{
+		close_parms_t close_parms = { broker->socket.fnet_socket };
+		broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_CLOSE,
+	  	                   	   	    &close_parms,
+									sizeof(close_parms_t),
+									NULL,
+									0L,
+									NULL );
+	}
+	broker->socket.fnet_socket = FNET_ERR;
+
+	/**
+	* Coalesced publishes die with the stream
+	*/
+	mqtt_tx_acquire ( broker );
+	broker->coalesceUsed = 0;
+	mqtt_tx_release ( broker );
+}
+
+/**
+* Start connecting to the broker
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_task_start ( mqttBrokerCtx_t* broker )
+{
+	broker->txLost    = false;
+	broker->stateTime = time_get_ticks(NULL);
+	broker->substate  = MQTT_CONNECT_START;
+	broker->state     = MQTT_STATE_CONNECT;
+	mqtt_worker_wake ( broker );
+}
+
+/**
+* MQTT service task connect state handler
+*
+* Task routine called when in the connect state to run the connection
+* process.  Every step returns at once, the wait for the server address and
+* the TCP connection is spread over task runs so a slow or dead server does
+* not hold up the other brokers.
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_task_connect ( mqttBrokerCtx_t* broker )
+{
+	uint64_t now  = time_get_ticks(NULL);
+	bool expired  = ( now - broker->stateTime > MQTT_CONNECT_TIMEOUT * CFG_SYSTICK_FREQ );
+
+	if ( broker->netsrv != NULL )
+	{
+		switch ( broker->substate )
+		{
+			case MQTT_CONNECT_START:
+				if ( ! (broker->status & MQTT_STATUS_ADDR_RESOLVED) )
+				{
+					if ( ! expired )
+						return;
+					break;
+				}
+
+				/**
+				* Create the network socket and connect to the server
+				*/
+				if ( mqtt_socket_open ( broker ) )
+				{
+					broker->substate = MQTT_CONNECT_WAIT;
+					return;
+				}
+				break;
+			case MQTT_CONNECT_WAIT:
+			{
+				uint32_t state = mqtt_socket_state ( broker );
+				if ( state == SS_CONNECTING && ! expired )
+					return;
+				if ( state == SS_CONNECTED )
+				{
+					/**
+					* Issue the MQTT connect command
+					*/
+					mqtt_recv_reset ( broker );
+					if ( mqtt_connect ( broker ) > 0 )
+					{
+						/**
+						* Move to the online state and wait for the CONNACK
+						*/
+						broker->stateTime = now;
+						broker->pingSent  = 0L;
+						broker->state = MQTT_STATE_ONLINE;
+					    broker->status |= MQTT_STATUS_ONLINE;
+					    broker->status |= (broker->alive) ? MQTT_KEEP_ALIVE_ENABLED : 0;
+					    mqtt_inflight_restart ( broker );
+					    return;
+					}
+				}
+			}
+				break;
+			default:
+				break;
+		}
+	}
 
-    /**
-    * Send the packet
-    */
-    return mqtt_send_packet ( broker, packet, packetsize, 0L );
+	/*
+	* Encountered a problem, notify client and go to idle state or retry later
+	*/
+	mqtt_socket_close ( broker );
+	if ( broker->cbs.svcMqttEvent )
+	{
+		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_ERROR, NULL, 0 );
+	}
+	mqtt_task_reconnect ( broker );
 }
 
 /**
-* Subscribe to or un-subscribe from a topic.
+* MQTT service task online state handler
 *
-* \param 	broker         Pointer to the broker context
-* \param 	topic          Pointer to the topic name.
-* \param	qos			   Quality of service (used for subscribe - 0, 1, or 2)
-* \param 	message_id     Variable that will store the Message ID, if the pointer is not NULL.
+* Task routine called when in the online state to handle incoming messages
 *
-* \returns	Number of bytes sent.
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
 */
-uint32_t mqtt_subscribe_unsubscribe (mqttBrokerCtx_t* broker, uint8_t subUnsub, const char* topic, uint8_t qos, uint16_t* message_id)
+void mqtt_task_online ( mqttBrokerCtx_t* broker )
 {
-    uint16_t topiclen = strlen(topic);
-
-    /**
-    * Variable header
-    */
-    uint8_t var_header[2]; // Message ID
-    var_header[0] = broker->seq >> 8;
-    var_header[1] = broker->seq & 0xFF;
-    if (message_id)
-    {
-    	*message_id = broker->seq;      // Returning message id
-    }
+	const uint8_t* packet = NULL;
+	int32_t size;
 
-    /**
-    * utf topic
-    */
-    uint16_t utftopicsize = (topiclen + ((subUnsub == MQTT_MSG_SUBSCRIBE) ? 3 : 2));   // Topic size (2 bytes) + QoS byte if subscribe, otherwise topic size
-    uint8_t* utf_topic = broker->varHeader;
-    memset(utf_topic, 0, utftopicsize);
-    utf_topic[0] = topiclen >> 8;
-    utf_topic[1] = topiclen & 0xFF;
-    memcpy(utf_topic+2, topic, topiclen);
-    if ( subUnsub == MQTT_MSG_SUBSCRIBE )
-    {
-    	// Add QoS bytes if subscribe
-        utf_topic[2+topiclen] = qos;
-    }
+	if ( broker->transport == MQTT_TRANSPORT_SN )
+	{
+		mqtt_sn_task_online ( broker );
+		return;
+	}
 
-    /**
-    * Fixed header
-    */
-    uint8_t fixed_header[] =
-    {
-    	subUnsub | MQTT_QOS1_FLAG, // Message Type, DUP flag, QoS level, Retain
-		sizeof(var_header) + utftopicsize
-    };
+	size = mqtt_recv_fill ( broker );
 
-    uint16_t packetsize = sizeof(var_header)+sizeof(fixed_header)+utftopicsize;
-    uint8_t* packet = broker->buffer;
-    memset(packet, 0, packetsize);
-    memcpy(packet, fixed_header, sizeof(fixed_header));
-    memcpy(packet+sizeof(fixed_header), var_header, sizeof(var_header));
-    memcpy(packet+sizeof(fixed_header)+sizeof(var_header), utf_topic, utftopicsize);
+	/**
+	* Hand every complete packet of this read to the dispatcher
+	*/
+	while ( broker->state == MQTT_STATE_ONLINE )
+	{
+		int32_t length = mqtt_recv_next ( broker, &packet );
+		if ( length == 0 )
+			break;
+		if ( length == FNET_ERR )
+		{
+			size = FNET_ERR;
+			break;
+		}
+		mqtt_task_dispatch ( broker, packet );
+	}
 
-    /**
-    * Send the packet
-    */
-    return mqtt_send_packet ( broker, packet, packetsize, 0L );
+	if (size == FNET_ERR )
+	{
+		/**
+		* Connection lost
+		*/
+		mqtt_task_lost ( broker );
+	}
 }
 
 /**
-* Disconnect from the MQTT broker
+* MQTT service task packet dispatcher
 *
-* \param 	broker         Pointer to the broker context
+* Handles one complete packet received from the server
 *
-* \returns	Number of bytes sent.
+* \param	broker			Pointer to the broker context
+* \param	packet			Pointer to the packet
+*
+* \returns	none
 */
-uint32_t mqtt_disconnect (mqttBrokerCtx_t* broker )
+void mqtt_task_dispatch ( mqttBrokerCtx_t* broker, const uint8_t* packet )
 {
-	if ( broker != NULL )
-	{
-	    uint8_t packet[2] =
-	    {
-	    	MQTT_MSG_DISCONNECT,    // Message Type, DUP flag, QoS level, Retain
-			0x00                    // Remaining length
-	    };
-	    return mqtt_send_packet ( broker, packet, sizeof(packet), 0L );
-	}
-	return 0L;
+        uint8_t msgType = MQTTParseMessageType(packet);
+        switch ( msgType )
+        {
+            case MQTT_MSG_ERROR:
+            	if ( broker->cbs.svcMqttEvent )
+            	{
+            		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_ERROR, NULL, 0 );
+            	}
+            	mqtt_task_lost ( broker );
+                break;
+            case MQTT_MSG_CONNACK:
+            {
+                mqttConnAck_t* ack = (mqttConnAck_t*)packet;
+                if ( ack->returnCode == MQTT_CONNACK_ACCEPTED )
+                {
+				    broker->status |= MQTT_STATUS_SESSION_ACTIVE;
+				    broker->reconnectDelay = broker->reconnectMin * CFG_SYSTICK_FREQ;
+				    critical_section_acquire (&mqtt_cs);
+				    broker->statistics.sessions++;
+				    critical_section_release (&mqtt_cs);
+	            	if ( broker->cbs.svcMqttEvent )
+	            	{
+	            		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_CONNACK, ack, sizeof(mqttConnAck_t) );
+	            	}
+                }
+                else
+                {
+                	mqtt_task_lost ( broker );
+                }
+            }
+                break;
+            case MQTT_MSG_PUBLISH:
+            {
+        		const uint8_t* message = NULL;
+        		const uint8_t* topic   = NULL;
+        		uint8_t rlb            = mqtt_num_rem_len_bytes (packet);
+        		uint32_t remaining     = mqtt_parse_rem_len (packet);
+
+        		/**
+        		* A publish whose topic and packet id do not fit its remaining
+        		* length is malformed and dropped
+        		*/
+        		if ( remaining < 2 ||
+        			 remaining < 2 + (uint32_t)( ( packet[1+rlb] << 8 ) | packet[1+rlb+1] ) + ( MQTTParseMessageQos(packet) ? 2 : 0 ) )
+        		{
+        			break;
+        		}
+
+        		uint32_t message_len   = (uint32_t) mqtt_parse_pub_msg_ptr (packet, &message);
+        		uint32_t topic_len     = (uint32_t) mqtt_parse_pub_topic_ptr (packet, &topic);
+        		uint16_t message_id	   = mqtt_parse_msg_id (packet);
+        		uint8_t dup            = MQTTParseMessageDuplicate(packet);
+        		uint8_t qos            = MQTTParseMessageQos(packet);
+        		uint8_t retain         = MQTTParseMessageRetain(packet);
+        		mqtt_task_deliver ( broker, (const char*)topic, topic_len, (const char*)message, message_len, dup, qos, retain, message_id );
+            }
+            	break;
+            case MQTT_MSG_PUBACK:
+            	mqtt_inflight_ack ( broker, MQTT_MSG_PUBACK, mqtt_parse_msg_id (packet) );
+            	if ( broker->cbs.svcMqttEvent )
+            	{
+            		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_PUBACK, NULL, 0 );
+            	}
+                break;
+            case MQTT_MSG_PUBCOMP:
+            	mqtt_inflight_ack ( broker, MQTT_MSG_PUBCOMP, mqtt_parse_msg_id (packet) );
+            	if ( broker->cbs.svcMqttEvent )
+            	{
+            		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_PUBCOMP, NULL, 0 );
+            	}
+                break;
+            case MQTT_MSG_SUBACK:
+            	if ( broker->cbs.svcMqttEvent )
+            	{
+            		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_SUBACK, NULL, 0 );
+            	}
+                break;
+            case MQTT_MSG_UNSUBACK:
+            	if ( broker->cbs.svcMqttEvent )
+            	{
+            		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_UNSUBACK, NULL, 0 );
+            	}
+                break;
+            case MQTT_MSG_PUBREC:
+            	mqtt_inflight_ack ( broker, MQTT_MSG_PUBREC, mqtt_parse_msg_id (packet) );
+                break;
+            case MQTT_MSG_PINGRESP:
+            	broker->pingSent = 0L;
+            	break;
+            default:
+                break;
+        }
 }
 
 /**
-* Transmit a MQTT packet over the transport
+* Hand a received publish to the topic handlers it matches, or to
+* svcMqttRecv if it matches none.
 *
 * \param	broker			Pointer to the broker context
-* \param	packet			Pointer to the packet to send
-* \param	size			Size of the packet to send
-* \param	timeout			Send timeout value
+* \param	topic			Pointer to the topic, not NUL terminated
+* \param	topic_len		Size of the topic
+* \param	message			Pointer to the payload
+* \param	message_len		Size of the payload
+* \param	dup				Duplicate flag
+* \param	qos				Quality of service
+* \param	retain			Retain flag
+* \param	message_id		Message id
 *
-* \returns	Number of bytes sent.
+* \returns	none
 */
-int32_t mqtt_send_packet ( mqttBrokerCtx_t* broker, uint8_t* packet, uint32_t size, uint32_t timeout )
+void mqtt_task_deliver ( mqttBrokerCtx_t* broker, const char* topic, uint32_t topic_len, const char* message, uint32_t message_len, uint8_t dup, uint8_t qos, uint8_t retain, uint16_t message_id )
 {
-	(void) timeout;	// not used
-	if ( broker->netsrv != NULL )
+	mqtt_topic_matches_t* matches = &broker->topicMatches;
+
+	/**
+	* The handlers are copied under the lock and run outside it, so they can publish
+	*/
+	critical_section_acquire (&mqtt_cs);
+	mqtt_topic_trie_match ( broker->topics, topic, topic_len, matches );
+	broker->statistics.received++;
+	broker->statistics.received_bytes    += message_len;
+	broker->statistics.handler_overflows += matches->dropped;
+	critical_section_release (&mqtt_cs);
+
+	for ( uint32_t index = 0; index < matches->count; index++ )
 	{
-		uint32_t bytes_transferred = 0L;
-		send_parms_t parms = { broker->socket.fnet_socket, packet, size, 0 };
-		if ( broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_SEND,
-				                   	     &parms,
-										 sizeof(send_parms_t),
-										 NULL,
-										 0L,
-										 &bytes_transferred ) == SERVICE_STATUS_SUCCESS )
-		{
-			return bytes_transferred;
-		}
+		(*matches->match[index].handler)( matches->match[index].handlerCtx, broker, topic, topic_len, message, message_len, dup, qos, retain, message_id );
+	}
+	if ( matches->count == 0 && broker->cbs.svcMqttRecv )
+	{
+		(*broker->cbs.svcMqttRecv)( broker, topic, topic_len, message, message_len, dup, qos, retain, message_id );
 	}
-	return FNET_ERR;
 }
 
 /**
-* Receive a MQTT packet from the transport
+* MQTT service task retransmit handler
+*
+* Task routine called in the online state to retransmit the inflight
+* publishes and releases that have not been acknowledged.  The interval
+* doubles after every retransmit up to MQTT_RETRY_INTERVAL_MAX, a publish is
+* abandoned after MQTT_MAX_RETRIES retransmits.
+*
+* The due entries are collected under the MQTT lock and sent after it is
+* released, the sends block on the transport.  A publish packet is taken
+* from its entry while it is sent, an acknowledgement arriving meanwhile
+* releases the entry and the packet is freed here instead.
 *
 * \param	broker			Pointer to the broker context
-* \param	packet			Pointer to the memory buffer for the received packet
-* \param	size			Size of the memory buffer
-* \param	timeout			Receive timeout value
 *
-* \returns	Number of bytes received.
+* \returns	none
 */
-int32_t mqtt_recv_packet ( mqttBrokerCtx_t* broker, uint8_t* packet, uint32_t size, uint32_t timeout )
+void mqtt_task_retransmit ( mqttBrokerCtx_t* broker )
 {
-	int32_t result = FNET_ERR;
-	(void) timeout;	// not used
-	if ( broker->netsrv != NULL )
+	uint16_t failed[MQTT_INFLIGHT_WINDOW];
+	uint32_t count = 0;
+	mqttInflight_t* due[MQTT_INFLIGHT_WINDOW];
+	uint16_t dueId[MQTT_INFLIGHT_WINDOW];
+	uint8_t* duePacket[MQTT_INFLIGHT_WINDOW];
+	uint32_t dueSize[MQTT_INFLIGHT_WINDOW];
+	uint32_t dueCount = 0;
+	uint64_t now   = time_get_ticks(NULL);
+
+	/**
+	* Nothing is retransmitted before CONNACK, the inflight entries are made
+	* due when the transport connects
+	*/
+	if ( ! ( broker->status & MQTT_STATUS_SESSION_ACTIVE ) )
+		return;
+
+	critical_section_acquire (&mqtt_cs);
+	for ( uint32_t index = 0; index < MQTT_INFLIGHT_WINDOW; index++ )
 	{
-		uint32_t bytes_read = 0;
-		uint32_t bytes_transferred = 0L;
+		mqttInflight_t* entry = &broker->inflight[index];
+		if ( entry->state == MQTT_INFLIGHT_FREE || entry->state == MQTT_INFLIGHT_RESERVED )
+			continue;
+		if ( now - entry->sentTime < entry->interval )
+			continue;
 
-		/**
-		* Let's retrieve the fixed header first
-		*/
-		recv_parms_t parms =
+		if ( entry->retries >= MQTT_MAX_RETRIES )
 		{
-			.socket = broker->socket.fnet_socket,
-			.buffer = packet,
-			.length = 1,
-			.flags  = 0
-		};
-		if ( broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_RECV,
-				                   	     &parms,
-										 sizeof(recv_parms_t),
-										 NULL,
-										 0L,
-										 &bytes_transferred ) == SERVICE_STATUS_SUCCESS )
+			failed[count++] = entry->messageId;
+			broker->statistics.abandoned++;
+			mqtt_inflight_release ( entry );
+			continue;
+		}
+
+		due[dueCount]       = entry;
+		dueId[dueCount]     = entry->messageId;
+		duePacket[dueCount] = NULL;
+		if ( entry->state != MQTT_INFLIGHT_WAIT_PUBCOMP )
 		{
-			if ( bytes_transferred )
-			{
-				/**
-				* Read and decode the remaining length field
-				*/
-				uint32_t multiplier = 1;
-				uint32_t remainingLength = 0L;
+			if ( broker->transport == MQTT_TRANSPORT_SN )
+				mqtt_sn_set_dup ( entry->packet );
+			else
+				entry->packet[0] |= MQTT_DUP_FLAG;
+			duePacket[dueCount] = entry->packet;
+			dueSize[dueCount]   = entry->size;
+			entry->packet       = NULL;
+		}
+		dueCount++;
+		entry->retries++;
+		entry->sentTime = now;
+		broker->statistics.retransmits++;
+		entry->interval = ( entry->interval * 2 < MQTT_RETRY_INTERVAL_MAX * CFG_SYSTICK_FREQ ) ? entry->interval * 2 : MQTT_RETRY_INTERVAL_MAX * CFG_SYSTICK_FREQ;
+	}
+	critical_section_release (&mqtt_cs);
 
-				do
-				{
-					bytes_read += bytes_transferred;
-					parms.buffer = packet + bytes_read;
-					bytes_transferred = 0L;
-					broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_RECV,
-					                    	    &parms,
-												sizeof(recv_parms_t),
-												NULL,
-												0L,
-												&bytes_transferred );
-					if (bytes_transferred == 0)
-						return 0;
-
-					remainingLength += (uint32_t)( packet[bytes_read] & 0x7F ) * multiplier;
-					multiplier *= 128;
-					if ( multiplier > (128L*128L*128L) )
-						return 0;
-				} while ( (packet[bytes_read] & 0x80) != 0 );
+	for ( uint32_t index = 0; index < dueCount; index++ )
+	{
+		mqttInflight_t* entry = due[index];
 
-				/**
-				* Now let's retrieve the rest of the packet
-				*/
-				bytes_read   += bytes_transferred;
-				parms.buffer = packet + bytes_read;
-				parms.length = remainingLength;
-				if ( broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_RECV,
-						                   	     &parms,
-												 sizeof(recv_parms_t),
-												 NULL,
-												 0L,
-												 &bytes_transferred ) == SERVICE_STATUS_SUCCESS )
-				{
-					result = ( bytes_transferred && (parms.length == bytes_transferred) ) ? (bytes_read + bytes_transferred) : 0;
-				}
-			}
-			else
-			{
-				result = bytes_transferred;
-			}
+		if ( duePacket[index] == NULL )
+		{
+			mqtt_send_pubrel ( broker, dueId[index] );
+			continue;
+		}
+
+		mqtt_send_packet ( broker, duePacket[index], dueSize[index], 0L );
+
+		/**
+		* Give the packet back unless the entry was acknowledged or released
+		* while it was sent
+		*/
+		critical_section_acquire (&mqtt_cs);
+		if ( entry->packet == NULL && entry->messageId == dueId[index] &&
+			 ( entry->state == MQTT_INFLIGHT_WAIT_PUBACK || entry->state == MQTT_INFLIGHT_WAIT_PUBREC ) )
+		{
+			entry->packet    = duePacket[index];
+			duePacket[index] = NULL;
 		}
+		critical_section_release (&mqtt_cs);
+		if ( duePacket[index] != NULL )
+			free ( duePacket[index] );
+	}
+
+	for ( uint32_t index = 0; index < count && broker->cbs.svcMqttDelivered; index++ )
+	{
+		(*broker->cbs.svcMqttDelivered)( broker, failed[index], MQTT_DELIVERY_FAILED );
 	}
-	return result;
 }
 
 /**
-* Increment the message sequence number
+* MQTT service task offline queue drain
+*
+* Sends up to the drain rate of queued publishes once the session is active.
+* Draining stops while the inflight window is full, so queued QoS 1 and 2
+* publishes keep their order.
 *
 * \param	broker			Pointer to the broker context
 *
-* \returns	new message sequence number
+* \returns	none
 */
-uint16_t mqtt_increment_sequence ( mqttBrokerCtx_t* broker )
+void mqtt_task_drain ( mqttBrokerCtx_t* broker )
 {
-	broker->seq = ( broker->seq >= 65535 ) ? 1 : (broker->seq+1);
-	return broker->seq;
+	mqtt_queue_entry_t* entry;
+	mqtt_iovec_t payload;
+	uint32_t result;
+
+	for ( uint32_t count = 0; count < broker->queue.drainRate; count++ )
+	{
+		if ( broker->state != MQTT_STATE_ONLINE || ! ( broker->status & MQTT_STATUS_SESSION_ACTIVE ) )
+			break;
+
+		critical_section_acquire (&mqtt_cs);
+		entry = ( mqtt_inflight_used ( broker ) < broker->inflightWindow ) ? mqtt_queue_pop ( &broker->queue ) : NULL;
+		critical_section_release (&mqtt_cs);
+		if ( entry == NULL )
+			break;
+
+		payload.base   = &entry->data[entry->topicLength];
+		payload.length = entry->length - entry->topicLength;
+		result = mqtt_publish_segments ( broker, (const char*)entry->data, entry->topicLength, &payload, 1, entry->retain, entry->qos, NULL );
+
+		critical_section_acquire (&mqtt_cs);
+		mqtt_queue_complete ( &broker->queue, entry, ( result != 0 ) );
+		critical_section_release (&mqtt_cs);
+		if ( result == 0 )
+			break;
+	}
 }
 
 /**
-* Resolve a server address
+* MQTT service task coalescing timer
 *
-* Use DNS lookup to resolve a server host name to an IP address
+* Sends the coalesced publishes once the oldest has waited the maximum delay.
 *
 * \param	broker			Pointer to the broker context
 *
 * \returns	none
 */
-void mqtt_resolve_hostname ( mqttBrokerCtx_t* broker )
+void mqtt_task_flush ( mqttBrokerCtx_t* broker )
 {
-	dns_init_parms_t dns_params =
+	mqtt_tx_acquire ( broker );
+	if ( broker->coalesceUsed != 0 && time_get_ticks(NULL) - broker->coalesceTime >= broker->coalesceDelay )
 	{
-		.addr_family = AF_INET,
-		.host_name   = broker->serverAddr,
-		.callback    = mqtt_dns_resolved_addr_handler,
-		.param       = (uint32_t)broker,
-	};
-	memset ( &dns_params.dns_server_addr, 0, sizeof(struct sockaddr) );
-	broker->netsrv->iocontrol ( IOCTL_FNET_STACK_DNS_INIT,
-	                    	    &dns_params,
-								sizeof(dns_init_parms_t),
-								NULL,
-								0L,
-								NULL );
+		mqtt_coalesce_flush ( broker );
+	}
+	mqtt_tx_release ( broker );
 }
 
 /**
-* MQTT service task connect state handler
+* MQTT-SN service task online state handler
 *
-* Task routine called when in the connect state to run the connection process
+* Each datagram read from the socket holds one packet.
 *
 * \param	broker			Pointer to the broker context
 *
 * \returns	none
 */
-void mqtt_task_connect ( mqttBrokerCtx_t* broker )
+void mqtt_sn_task_online ( mqttBrokerCtx_t* broker )
 {
-	if ( broker->netsrv != NULL )
+	while ( broker->state == MQTT_STATE_ONLINE && broker->netsrv != NULL )
 	{
-		/**
-		* Create the network socket
-		*/
-		socket_parms_t socket_parms = { AF_INET, SOCK_STREAM, IPPROTO_IP };
-		uint32_t bytes_returned     = 0L;
-		broker->socket.fnet_socket  = FNET_ERR;
-		service_status_t result = broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET,
-				                                              &socket_parms,
-														      sizeof(socket_parms_t),
-														      &broker->socket,
-														      sizeof(socket_desc_t),
-														      &bytes_returned );
-		if ( (result == SERVICE_STATUS_SUCCESS) && (bytes_returned == sizeof(socket_desc_t)) )
+		uint32_t bytes_transferred = 0L;
+		recv_parms_t parms =
+		{
+			.socket = broker->socket.fnet_socket,
+			.buffer = broker->recvBuffer,
+			.length = broker->bufferSize,
+			.flags  = 0
+		};
+		if ( broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_RECV,
+				                   	     &parms,
+										 sizeof(recv_parms_t),
+										 NULL,
+										 0L,
+										 &bytes_transferred ) != SERVICE_STATUS_SUCCESS )
 		{
 			/**
-			* Connect to the server
+			* Connection lost
 			*/
-			connect_parms_t connect_parms = { broker->socket.fnet_socket, &broker->resolvedServerAddr, sizeof(struct sockaddr) };
-			if ( broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_CONNECT,
-					                         &connect_parms,
-									         sizeof(connect_parms_t),
-									         NULL,
-									         0L,
-									         NULL ) == SERVICE_STATUS_SUCCESS )
-			{
-				/**
-				* Issue the MQTT connect command
-				*/
-				time_delay (1000);
-				if ( mqtt_connect ( broker ) > 0 )
-				{
-					/**
-					* Move to the online state
-					*/
-					broker->state = MQTT_STATE_ONLINE;
-				    broker->status |= MQTT_STATUS_ONLINE;
-				    broker->status |= (broker->alive) ? MQTT_KEEP_ALIVE_ENABLED : 0;
-				    return;
-				}
-			}
+			mqtt_task_lost ( broker );
+			break;
 		}
+		if ( bytes_transferred == 0 )
+		{
+			break;
+		}
+		mqtt_sn_task_dispatch ( broker, broker->recvBuffer, bytes_transferred );
 	}
-
-	/*
-	* Encountered a problem, notify client and go to idle state
-	*/
-	if ( broker->cbs.svcMqttEvent )
-	{
-		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_ERROR, NULL, 0 );
-	}
-	broker->state = MQTT_STATE_IDLE;
 }
 
 /**
-* MQTT service task online state handler
+* MQTT-SN service task packet dispatcher
 *
-* Task routine called when in the online state to handle incoming messages
+* Handles one datagram received from the gateway, a datagram whose length
+* does not match its header is dropped.
 *
 * \param	broker			Pointer to the broker context
+* \param	packet			Pointer to the datagram
+* \param	size			Size of the datagram
 *
 * \returns	none
 */
-void mqtt_task_online ( mqttBrokerCtx_t* broker )
+void mqtt_sn_task_dispatch ( mqttBrokerCtx_t* broker, const uint8_t* packet, uint32_t size )
 {
-	int size =  mqtt_recv_packet ( broker, broker->recvBuffer, broker->bufferSize, 0 );
-	if ( size > 0 )
+	uint8_t  msgType = 0;
+	uint32_t offset  = mqtt_sn_parse_header ( packet, size, &msgType );
+	const uint8_t* body = packet + offset;
+	uint32_t length  = size - offset;
+
+	if ( offset == 0 )
 	{
-        uint8_t msgType = MQTTParseMessageType(broker->recvBuffer);
-        switch ( msgType )
-        {
-            case MQTT_MSG_ERROR:
-            	if ( broker->cbs.svcMqttEvent )
-            	{
-            		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_ERROR, NULL, 0 );
-            	}
-            	broker->state = MQTT_STATE_DISCONNECT;
-                break;
-            case MQTT_MSG_CONNACK:
-            {
-                mqttConnAck_t* ack = (mqttConnAck_t*)broker->recvBuffer;
-                if ( ack->returnCode == MQTT_CONNACK_ACCEPTED )
-                {
+		return;
+	}
+
+	switch ( msgType )
+	{
+		case MQTT_SN_MSG_CONNACK:
+			if ( length >= 1 )
+			{
+				mqttConnAck_t ack = { MQTT_MSG_CONNACK, 2, 0, (body[0] == MQTT_SN_RC_ACCEPTED) ? MQTT_CONNACK_ACCEPTED : MQTT_CONNACK_REFUSED_SERVER };
+				if ( ack.returnCode == MQTT_CONNACK_ACCEPTED )
+				{
 				    broker->status |= MQTT_STATUS_SESSION_ACTIVE;
+				    broker->reconnectDelay = broker->reconnectMin * CFG_SYSTICK_FREQ;
+				    broker->snState = MQTT_SN_ACTIVE;
+				    critical_section_acquire (&mqtt_cs);
+				    broker->statistics.sessions++;
+				    critical_section_release (&mqtt_cs);
 	            	if ( broker->cbs.svcMqttEvent )
 	            	{
-	            		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_CONNACK, ack, sizeof(mqttConnAck_t) );
+	            		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_CONNACK, &ack, sizeof(mqttConnAck_t) );
 	            	}
-                }
-                else
-                {
-                	broker->state = MQTT_STATE_DISCONNECT;
-                }
-            }
-                break;
-            case MQTT_MSG_PUBLISH:
-            	if ( broker->cbs.svcMqttRecv )
-            	{
-            		const uint8_t* message = NULL;
-            		const uint8_t* topic   = NULL;
-            		uint32_t message_len   = (uint32_t) mqtt_parse_pub_msg_ptr (broker->recvBuffer, &message);
-            		uint32_t topic_len     = (uint32_t) mqtt_parse_pub_topic_ptr (broker->recvBuffer, &topic);
-            		uint16_t message_id	   = mqtt_parse_msg_id (broker->recvBuffer);
-            		uint8_t dup            = MQTTParseMessageDuplicate(broker->recvBuffer);
-            		uint8_t qos            = MQTTParseMessageQos(broker->recvBuffer);
-            		uint8_t retain         = MQTTParseMessageRetain(broker->recvBuffer);
-            		(*broker->cbs.svcMqttRecv)( broker, (const char*)topic, topic_len, (const char*)message, message_len, dup, qos, retain, message_id );
-            	}
-            	break;
-            case MQTT_MSG_PUBACK:
-            	mqtt_increment_sequence(broker);
+				}
+				else
+				{
+					mqtt_task_lost ( broker );
+				}
+			}
+			break;
+		case MQTT_SN_MSG_REGISTER:
+			if ( length >= 5 )
+			{
+				/**
+				* Topic id, message id and the topic name of a publish matching a wildcard subscription
+				*/
+				uint16_t topicId   = (body[0] << 8) | body[1];
+				uint16_t messageId = (body[2] << 8) | body[3];
+				critical_section_acquire (&mqtt_cs);
+				mqtt_sn_topic_t* entry = mqtt_sn_topic_add ( broker->snTopics, (const char*)&body[4], length - 4, MQTT_SN_TOPIC_NORMAL, topicId );
+				critical_section_release (&mqtt_cs);
+				mqtt_sn_send_ack ( broker, MQTT_SN_MSG_REGACK, topicId, messageId, (entry != NULL) ? MQTT_SN_RC_ACCEPTED : MQTT_SN_RC_CONGESTION );
+			}
+			break;
+		case MQTT_SN_MSG_PUBLISH:
+			if ( length >= 5 )
+			{
+				char     name[MQTT_SN_TOPIC_LENGTH];
+				const char* topic  = name;
+				uint32_t topic_len = 0;
+				uint8_t  flags     = body[0];
+				uint16_t topicId   = (body[1] << 8) | body[2];
+				uint16_t messageId = (body[3] << 8) | body[4];
+				uint8_t  qos       = ( (flags & MQTT_SN_FLAG_QOS_MASK) == MQTT_SN_FLAG_QOS_MINUS1 ) ? MQTT_QOS_MINUS1 : (flags & MQTT_SN_FLAG_QOS_MASK) >> 5;
+
+				if ( (flags & MQTT_SN_FLAG_TOPIC_MASK) == MQTT_SN_TOPIC_SHORT )
+				{
+					topic     = (const char*)&body[1];
+					topic_len = 2;
+				}
+				else
+				{
+					/**
+					* The name is copied, the table may change while the handlers run
+					*/
+					critical_section_acquire (&mqtt_cs);
+					mqtt_sn_topic_t* entry = mqtt_sn_topic_by_id ( broker->snTopics, flags & MQTT_SN_FLAG_TOPIC_MASK, topicId );
+					if ( entry != NULL )
+					{
+						memcpy ( name, entry->name, entry->length );
+						topic_len = entry->length;
+					}
+					critical_section_release (&mqtt_cs);
+				}
+
+				if ( topic_len != 0 )
+				{
+					mqtt_task_deliver ( broker, topic, topic_len, (const char*)&body[5], length - 5,
+										(flags & MQTT_SN_FLAG_DUP) ? 1 : 0, qos, (flags & MQTT_SN_FLAG_RETAIN) ? 1 : 0, messageId );
+				}
+				if ( qos == MQTT_QOS1 )
+				{
+					mqtt_sn_send_ack ( broker, MQTT_SN_MSG_PUBACK, topicId, messageId, (topic_len != 0) ? MQTT_SN_RC_ACCEPTED : MQTT_SN_RC_INVALID_TOPIC );
+				}
+			}
+			break;
+		case MQTT_SN_MSG_PUBACK:
+			if ( length >= 5 )
+			{
+				/**
+				* A rejected publish is not retried either, the gateway has answered for it
+				*/
+				mqtt_inflight_ack ( broker, MQTT_MSG_PUBACK, (body[2] << 8) | body[3] );
             	if ( broker->cbs.svcMqttEvent )
             	{
             		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_PUBACK, NULL, 0 );
             	}
-                break;
-            case MQTT_MSG_PUBCOMP:
-            	mqtt_increment_sequence(broker);
-            	if ( broker->cbs.svcMqttEvent )
-            	{
-            		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_PUBCOMP, NULL, 0 );
-            	}
-                break;
-            case MQTT_MSG_SUBACK:
-            	mqtt_increment_sequence(broker);
+			}
+			break;
+		case MQTT_SN_MSG_SUBACK:
+			if ( length >= 6 )
+			{
+				uint16_t topicId   = (body[1] << 8) | body[2];
+				uint16_t messageId = (body[3] << 8) | body[4];
+				critical_section_acquire (&mqtt_cs);
+				mqtt_sn_topic_t* entry = mqtt_sn_topic_by_pending ( broker->snTopics, messageId );
+				if ( entry != NULL )
+				{
+					if ( body[5] == MQTT_SN_RC_ACCEPTED && topicId != 0 )
+						entry->id = topicId;
+					else
+						entry->length = 0;
+				}
+				critical_section_release (&mqtt_cs);
             	if ( broker->cbs.svcMqttEvent )
             	{
             		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_SUBACK, NULL, 0 );
             	}
-                break;
-            case MQTT_MSG_UNSUBACK:
-            	mqtt_increment_sequence(broker);
-            	if ( broker->cbs.svcMqttEvent )
-            	{
-            		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_UNSUBACK, NULL, 0 );
-            	}
-                break;
-            case MQTT_MSG_PUBREC:
-            case MQTT_MSG_PINGRESP:
-            default:
-                break;
-        }
+			}
+			break;
+		case MQTT_SN_MSG_UNSUBACK:
+        	if ( broker->cbs.svcMqttEvent )
+        	{
+        		(*broker->cbs.svcMqttEvent)( broker, MQTT_CL_EVT_UNSUBACK, NULL, 0 );
+        	}
+			break;
+		case MQTT_SN_MSG_PINGREQ:
+		{
+			uint8_t response[2];
+			mqtt_sn_encode_header ( response, 0, MQTT_SN_MSG_PINGRESP );
+			mqtt_send_packet ( broker, response, sizeof(response), 0L );
+		}
+			break;
+		case MQTT_SN_MSG_PINGRESP:
+			broker->pingSent = 0L;
+			if ( broker->snState == MQTT_SN_AWAKE )
+			{
+				/**
+				* The gateway has sent the publishes it held, back to sleep
+				*/
+				broker->stateTime = time_get_ticks(NULL);
+				broker->snState   = MQTT_SN_ASLEEP;
+			}
+			break;
+		case MQTT_SN_MSG_DISCONNECT:
+			/**
+			* While asleep this answers the sleep request, otherwise the gateway dropped the session
+			*/
+			if ( broker->snState == MQTT_SN_ACTIVE || broker->snState == MQTT_SN_CONNECTING )
+			{
+				mqtt_task_lost ( broker );
+			}
+			break;
+		default:
+			break;
 	}
-	if (size == FNET_ERR )
+}
+
+/**
+* MQTT-SN connection keep-alive task handler
+*
+* An active client pings the gateway like a MQTT client.  A client with a
+* sleep duration goes to sleep when it has nothing to send, wakes with a
+* PINGREQ before the duration runs out to collect the publishes the gateway
+* held, and reconnects to send publishes waiting in the offline queue.
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns  none
+*/
+void mqtt_sn_task_keepalive ( mqttBrokerCtx_t* broker )
+{
+	uint64_t now = time_get_ticks(NULL);
+	bool idle;
+
+	switch ( broker->snState )
 	{
-		/**
-		* Connection lost
-		*/
-	    broker->status &= ~MQTT_STATUS_SESSION_ACTIVE;
-    	broker->state = MQTT_STATE_DISCONNECT;
+		case MQTT_SN_CONNECTING:
+			/**
+			* No CONNACK from the gateway
+			*/
+			if ( now - broker->stateTime > MQTT_CONNECT_TIMEOUT * CFG_SYSTICK_FREQ )
+			{
+				mqtt_task_lost ( broker );
+			}
+			break;
+		case MQTT_SN_ACTIVE:
+			if ( broker->pingSent != 0 )
+			{
+				/**
+				* No PINGRESP from the gateway
+				*/
+				if ( now - broker->pingSent > MQTT_PING_TIMEOUT * CFG_SYSTICK_FREQ )
+				{
+					mqtt_task_lost ( broker );
+				}
+				break;
+			}
+			if ( broker->sleepDuration != 0 )
+			{
+				critical_section_acquire (&mqtt_cs);
+				idle = mqtt_queue_empty ( &broker->queue ) && mqtt_inflight_used ( broker ) == 0;
+				critical_section_release (&mqtt_cs);
+				if ( idle && now - broker->lastSent >= MQTT_SN_AWAKE_TIME * CFG_SYSTICK_FREQ )
+				{
+					uint8_t packet[4];
+					uint32_t offset = mqtt_sn_encode_header ( packet, 2, MQTT_SN_MSG_DISCONNECT );
+					packet[offset++] = broker->sleepDuration >> 8;
+					packet[offset++] = broker->sleepDuration & 0xFF;
+					if ( mqtt_send_packet ( broker, packet, offset, 0L ) == (int32_t)offset )
+					{
+						broker->status   &= ~MQTT_STATUS_SESSION_ACTIVE;
+						broker->stateTime = now;
+						broker->snState   = MQTT_SN_ASLEEP;
+					}
+					break;
+				}
+			}
+			if ( (broker->status & MQTT_KEEP_ALIVE_ENABLED) &&
+				 now - broker->lastSent >= (uint64_t)broker->alive * CFG_SYSTICK_FREQ )
+			{
+				if ( mqtt_send_pingreq ( broker ) > 0 )
+				{
+					broker->pingSent = now | 1;
+				}
+			}
+			break;
+		case MQTT_SN_ASLEEP:
+			critical_section_acquire (&mqtt_cs);
+			idle = mqtt_queue_empty ( &broker->queue );
+			critical_section_release (&mqtt_cs);
+			if ( ! idle )
+			{
+				mqtt_sn_connect ( broker );
+			}
+			else if ( now - broker->stateTime >= (uint64_t)broker->sleepDuration * CFG_SYSTICK_FREQ * 3 / 4 )
+			{
+				if ( mqtt_send_pingreq ( broker ) > 0 )
+				{
+					broker->pingSent = now | 1;
+					broker->snState  = MQTT_SN_AWAKE;
+				}
+			}
+			break;
+		case MQTT_SN_AWAKE:
+			if ( now - broker->pingSent > MQTT_PING_TIMEOUT * CFG_SYSTICK_FREQ )
+			{
+				mqtt_task_lost ( broker );
+			}
+			break;
+		default:
+			break;
 	}
 }
 
@@ -2109,14 +4704,7 @@ void mqtt_task_disconnect ( mqttBrokerCtx_t* broker )
 	/**
 	* Destroy the network socket
 	*/
-	close_parms_t close_parms = { broker->socket.fnet_socket };
-	broker->netsrv->iocontrol ( IOCTL_FNET_STACK_SOCKET_CLOSE,
-  	                   	   	    &close_parms,
-								sizeof(close_parms_t),
-								NULL,
-								0L,
-								NULL );
-	broker->socket.fnet_socket = FNET_ERR;
+	mqtt_socket_close ( broker );
 
 	/**
 	* Notify client and transition to the idle state
@@ -2125,5 +4713,79 @@ void mqtt_task_disconnect ( mqttBrokerCtx_t* broker )
 	{
 		(*broker->cbs.svcMqttDisconn)( broker );
 	}
-	broker->state = MQTT_STATE_IDLE;
+	if ( broker->substate == MQTT_DISCONNECT_LOST )
+	{
+		critical_section_acquire (&mqtt_cs);
+		broker->statistics.connection_losses++;
+		critical_section_release (&mqtt_cs);
+		mqtt_task_reconnect ( broker );
+	}
+	else
+	{
+		broker->state = MQTT_STATE_IDLE;
+	}
+}
+
+/**
+* Drop a lost connection
+*
+* The disconnect state closes the socket and then reconnects if enabled.
+* The session is marked inactive first, so no DISCONNECT is sent on a broken
+* stream.
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_task_lost ( mqttBrokerCtx_t* broker )
+{
+	broker->status  &= ~MQTT_STATUS_SESSION_ACTIVE;
+	broker->substate = MQTT_DISCONNECT_LOST;
+	broker->state    = MQTT_STATE_DISCONNECT;
+}
+
+/**
+* Wait out the reconnect delay, or go idle if reconnecting is disabled
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_task_reconnect ( mqttBrokerCtx_t* broker )
+{
+	if ( broker->reconnectMin != 0 )
+	{
+		broker->stateTime = time_get_ticks(NULL);
+		broker->state     = MQTT_STATE_BACKOFF;
+	}
+	else
+	{
+		broker->state = MQTT_STATE_IDLE;
+	}
+}
+
+/**
+* MQTT service task backoff state handler
+*
+* Task routine called while waiting to reconnect.  The delay doubles after
+* every attempt up to the reconnect limit and goes back to the first delay
+* once the server accepts the connection.
+*
+* \param	broker			Pointer to the broker context
+*
+* \returns	none
+*/
+void mqtt_task_backoff ( mqttBrokerCtx_t* broker )
+{
+	uint32_t limit = broker->reconnectMax * CFG_SYSTICK_FREQ;
+
+	if ( time_get_ticks(NULL) - broker->stateTime >= broker->reconnectDelay )
+	{
+		broker->reconnectDelay = ( broker->reconnectDelay * 2 < limit ) ? broker->reconnectDelay * 2 : limit;
+		if ( broker->addrType == MQTT_ADDR_HOSTNAME && ! (broker->status & MQTT_STATUS_ADDR_RESOLVED) )
+		{
+			mqtt_resolve_hostname ( broker );
+		}
+		mqtt_task_start ( broker );
+	}
 }
@@ -0,0 +1,205 @@
+
+/**
+* mqtt_sn.c
+*
+* \copyright
+* Copyright 2017 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the MQTT-SN packet encoding and topic table.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "mqtt_sn.h"
+
+/**
+* Write a packet header.
+*
+* \param    packet		Pointer to the packet
+* \param	length		Size of the packet body after the message type
+* \param	type		Message type
+*
+* \returns  Size of the header, the body starts there.
+*/
+uint32_t mqtt_sn_encode_header ( uint8_t* packet, uint32_t length, uint8_t type )
+{
+	if ( length + 2 <= 0xFF )
+	{
+		packet[0] = (uint8_t)( length + 2 );
+		packet[1] = type;
+		return 2;
+	}
+	packet[0] = 0x01;
+	packet[1] = (uint8_t)( ( length + 4 ) >> 8 );
+	packet[2] = (uint8_t)( ( length + 4 ) & 0xFF );
+	packet[3] = type;
+	return 4;
+}
+
+/**
+* Check a received packet header.
+*
+* \param    packet		Pointer to the datagram
+* \param	size		Size of the datagram
+* \param	type		Pointer to storage for the message type
+*
+* \returns  Size of the header, 0 if the length does not match the datagram.
+*/
+uint32_t mqtt_sn_parse_header ( const uint8_t* packet, uint32_t size, uint8_t* type )
+{
+	if ( size >= 2 && packet[0] != 0x01 && packet[0] == size )
+	{
+		*type = packet[1];
+		return 2;
+	}
+	if ( size >= 4 && packet[0] == 0x01 && ( ( (uint32_t)packet[1] << 8 ) | packet[2] ) == size )
+	{
+		*type = packet[3];
+		return 4;
+	}
+	return 0;
+}
+
+/**
+* Set the DUP flag of a PUBLISH packet.
+*
+* \param    packet		Pointer to the packet
+*
+* \returns  None
+*/
+void mqtt_sn_set_dup ( uint8_t* packet )
+{
+	packet[( packet[0] == 0x01 ) ? 4 : 2] |= MQTT_SN_FLAG_DUP;
+}
+
+/**
+* Find the topic table entry of a topic name.
+*
+* \param    table		Pointer to the topic table
+* \param	name		Pointer to the topic name
+* \param	length		Size of the topic name
+*
+* \returns  Pointer to the entry, NULL if the topic is not in the table.
+*/
+mqtt_sn_topic_t* mqtt_sn_topic_by_name ( mqtt_sn_topic_t* table, const char* name, uint32_t length )
+{
+	for ( uint32_t index = 0; index < MQTT_SN_MAX_TOPICS; index++ )
+	{
+		if ( table[index].length != 0 && table[index].length == length && memcmp ( table[index].name, name, length ) == 0 )
+			return &table[index];
+	}
+	return NULL;
+}
+
+/**
+* Find the topic table entry of a topic id.
+*
+* \param    table		Pointer to the topic table
+* \param	type		MQTT_SN_TOPIC_NORMAL or MQTT_SN_TOPIC_PREDEFINED
+* \param	id			Topic id
+*
+* \returns  Pointer to the entry, NULL if the topic id is not in the table.
+*/
+mqtt_sn_topic_t* mqtt_sn_topic_by_id ( mqtt_sn_topic_t* table, uint8_t type, uint16_t id )
+{
+	for ( uint32_t index = 0; index < MQTT_SN_MAX_TOPICS; index++ )
+	{
+		if ( table[index].length != 0 && table[index].id != 0 && table[index].id == id && table[index].type == type )
+			return &table[index];
+	}
+	return NULL;
+}
+
+/**
+* Find the topic table entry waiting for a SUBACK.
+*
+* \param    table		Pointer to the topic table
+* \param	messageId	Message id of the SUBSCRIBE
+*
+* \returns  Pointer to the entry, NULL if none is waiting.
+*/
+mqtt_sn_topic_t* mqtt_sn_topic_by_pending ( mqtt_sn_topic_t* table, uint16_t messageId )
+{
+	for ( uint32_t index = 0; index < MQTT_SN_MAX_TOPICS; index++ )
+	{
+		if ( table[index].length != 0 && table[index].id == 0 && table[index].pending == messageId )
+			return &table[index];
+	}
+	return NULL;
+}
+
+/**
+* Add a topic to the table, or update the entry of the topic name.
+*
+* \param    table		Pointer to the topic table
+* \param	name		Pointer to the topic name
+* \param	length		Size of the topic name
+* \param	type		MQTT_SN_TOPIC_NORMAL or MQTT_SN_TOPIC_PREDEFINED
+* \param	id			Topic id, 0 if not yet known
+*
+* \returns  Pointer to the entry, NULL if the name is too long or the table is full.
+*/
+mqtt_sn_topic_t* mqtt_sn_topic_add ( mqtt_sn_topic_t* table, const char* name, uint32_t length, uint8_t type, uint16_t id )
+{
+	mqtt_sn_topic_t* entry = mqtt_sn_topic_by_name ( table, name, length );
+
+	if ( length == 0 || length > MQTT_SN_TOPIC_LENGTH )
+		return NULL;
+
+	for ( uint32_t index = 0; entry == NULL && index < MQTT_SN_MAX_TOPICS; index++ )
+	{
+		if ( table[index].length == 0 )
+			entry = &table[index];
+	}
+
+	if ( entry != NULL )
+	{
+		/*
+		 * A predefined id is not replaced by one the gateway hands out
+		 */
+		if ( entry->length != 0 && entry->type == MQTT_SN_TOPIC_PREDEFINED && type == MQTT_SN_TOPIC_NORMAL )
+			return entry;
+
+		memcpy ( entry->name, name, length );
+		entry->length  = (uint8_t)length;
+		entry->type    = type;
+		entry->id      = id;
+		entry->pending = 0;
+	}
+	return entry;
+}
+
+/**
+* Find the topic id to publish or subscribe with.
+* Topics in the table use their id, other two character topics are sent as
+* short topic names.
+*
+* \param    table		Pointer to the topic table
+* \param	name		Pointer to the topic name
+* \param	length		Size of the topic name
+* \param	type		Pointer to storage for the topic id type
+* \param	id			Pointer to storage for the topic id
+*
+* \returns  true if the topic has an id.
+*/
+bool mqtt_sn_topic_resolve ( mqtt_sn_topic_t* table, const char* name, uint32_t length, uint8_t* type, uint16_t* id )
+{
+	mqtt_sn_topic_t* entry = mqtt_sn_topic_by_name ( table, name, length );
+
+	if ( entry != NULL && entry->id != 0 )
+	{
+		*type = entry->type;
+		*id   = entry->id;
+		return true;
+	}
+	if ( length == 2 )
+	{
+		*type = MQTT_SN_TOPIC_SHORT;
+		*id   = (uint16_t)( ( (uint8_t)name[0] << 8 ) | (uint8_t)name[1] );
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,183 @@
+
+/**
+* mqtt_sn.h
+*
+* \copyright
+* Copyright 2017 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the MQTT-SN packet encoding and topic table.
+*
+* MQTT-SN (version 1.2) packets are carried one per UDP datagram.  A packet
+* starts with a one byte length, or 0x01 followed by a two byte length when
+* it is longer than 255 bytes, then the message type.  Topics are named by
+* 16 bit topic ids, either predefined with the gateway, registered by the
+* gateway or two character short topic names.  The topic table does no
+* locking, the MQTT core serializes every call.
+*/
+
+#ifndef SRC_SERVICES_MQTT_MQTT_SN_H_
+#define SRC_SERVICES_MQTT_MQTT_SN_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <aef/embedded/service/mqtt/mqtt_service.h>
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+/**
+* MQTT-SN message types
+*/
+#define MQTT_SN_MSG_CONNECT			0x04	// Client request to connect to the gateway
+#define MQTT_SN_MSG_CONNACK			0x05	// Connect acknowledgement
+#define MQTT_SN_MSG_REGISTER		0x0A	// Topic id registration
+#define MQTT_SN_MSG_REGACK			0x0B	// Registration acknowledgement
+#define MQTT_SN_MSG_PUBLISH			0x0C	// Publish message
+#define MQTT_SN_MSG_PUBACK			0x0D	// Publish acknowledgement
+#define MQTT_SN_MSG_SUBSCRIBE		0x12	// Client subscribe request
+#define MQTT_SN_MSG_SUBACK			0x13	// Subscribe acknowledgement
+#define MQTT_SN_MSG_UNSUBSCRIBE		0x14	// Client unsubscribe request
+#define MQTT_SN_MSG_UNSUBACK		0x15	// Unsubscribe acknowledgement
+#define MQTT_SN_MSG_PINGREQ			0x16	// Ping request
+#define MQTT_SN_MSG_PINGRESP		0x17	// Ping response
+#define MQTT_SN_MSG_DISCONNECT		0x18	// Disconnect, or go to sleep with a duration
+
+/**
+* MQTT-SN flags
+*/
+#define MQTT_SN_FLAG_DUP			0x80	// Duplicate delivery
+#define MQTT_SN_FLAG_QOS_MASK		0x60	// Quality of service
+#define MQTT_SN_FLAG_QOS0			0x00
+#define MQTT_SN_FLAG_QOS1			0x20
+#define MQTT_SN_FLAG_QOS2			0x40
+#define MQTT_SN_FLAG_QOS_MINUS1		0x60
+#define MQTT_SN_FLAG_RETAIN			0x10	// Retain flag
+#define MQTT_SN_FLAG_CLEAN_SESSION	0x04	// Clean session flag
+#define MQTT_SN_FLAG_TOPIC_MASK		0x03	// Topic id type
+
+#define MQTT_SN_TOPIC_NORMAL		0x00	// Topic id registered by the gateway, or a topic name in SUBSCRIBE
+#define MQTT_SN_TOPIC_PREDEFINED	0x01	// Topic id predefined with the gateway
+#define MQTT_SN_TOPIC_SHORT			0x02	// Two character topic name
+
+#define MQTT_SN_PROTOCOL_ID			0x01	// MQTT-SN version 1.2
+
+/**
+* MQTT-SN return codes
+*/
+#define MQTT_SN_RC_ACCEPTED			0x00	// Accepted
+#define MQTT_SN_RC_CONGESTION		0x01	// Rejected, congestion
+#define MQTT_SN_RC_INVALID_TOPIC	0x02	// Rejected, invalid topic id
+#define MQTT_SN_RC_NOT_SUPPORTED	0x03	// Rejected, not supported
+
+/**
+* MQTT-SN topic table entry structure definition
+*/
+typedef struct _mqtt_sn_topic_def
+{
+	uint16_t	 id;						// Topic id, 0 while a subscribe is pending
+	uint16_t	 pending;					// Message id of the pending subscribe
+	uint8_t		 type;						// MQTT_SN_TOPIC_NORMAL or MQTT_SN_TOPIC_PREDEFINED
+	uint8_t		 length;					// Size of the topic name, 0 if the entry is free
+	char		 name[MQTT_SN_TOPIC_LENGTH];	// Topic name, not NUL terminated
+} mqtt_sn_topic_t;
+
+/**
+* Write a packet header.
+*
+* \param    packet		Pointer to the packet
+* \param	length		Size of the packet body after the message type
+* \param	type		Message type
+*
+* \returns  Size of the header, the body starts there.
+*/
+uint32_t mqtt_sn_encode_header ( uint8_t* packet, uint32_t length, uint8_t type );
+
+/**
+* Check a received packet header.
+*
+* \param    packet		Pointer to the datagram
+* \param	size		Size of the datagram
+* \param	type		Pointer to storage for the message type
+*
+* \returns  Size of the header, 0 if the length does not match the datagram.
+*/
+uint32_t mqtt_sn_parse_header ( const uint8_t* packet, uint32_t size, uint8_t* type );
+
+/**
+* Set the DUP flag of a PUBLISH packet.
+*
+* \param    packet		Pointer to the packet
+*
+* \returns  None
+*/
+void mqtt_sn_set_dup ( uint8_t* packet );
+
+/**
+* Find the topic table entry of a topic name.
+*
+* \param    table		Pointer to the topic table
+* \param	name		Pointer to the topic name
+* \param	length		Size of the topic name
+*
+* \returns  Pointer to the entry, NULL if the topic is not in the table.
+*/
+mqtt_sn_topic_t* mqtt_sn_topic_by_name ( mqtt_sn_topic_t* table, const char* name, uint32_t length );
+
+/**
+* Find the topic table entry of a topic id.
+*
+* \param    table		Pointer to the topic table
+* \param	type		MQTT_SN_TOPIC_NORMAL or MQTT_SN_TOPIC_PREDEFINED
+* \param	id			Topic id
+*
+* \returns  Pointer to the entry, NULL if the topic id is not in the table.
+*/
+mqtt_sn_topic_t* mqtt_sn_topic_by_id ( mqtt_sn_topic_t* table, uint8_t type, uint16_t id );
+
+/**
+* Find the topic table entry waiting for a SUBACK.
+*
+* \param    table		Pointer to the topic table
+* \param	messageId	Message id of the SUBSCRIBE
+*
+* \returns  Pointer to the entry, NULL if none is waiting.
+*/
+mqtt_sn_topic_t* mqtt_sn_topic_by_pending ( mqtt_sn_topic_t* table, uint16_t messageId );
+
+/**
+* Add a topic to the table, or update the entry of the topic name.
+*
+* \param    table		Pointer to the topic table
+* \param	name		Pointer to the topic name
+* \param	length		Size of the topic name
+* \param	type		MQTT_SN_TOPIC_NORMAL or MQTT_SN_TOPIC_PREDEFINED
+* \param	id			Topic id, 0 if not yet known
+*
+* \returns  Pointer to the entry, NULL if the name is too long or the table is full.
+*/
+mqtt_sn_topic_t* mqtt_sn_topic_add ( mqtt_sn_topic_t* table, const char* name, uint32_t length, uint8_t type, uint16_t id );
+
+/**
+* Find the topic id to publish or subscribe with.
+* Topics in the table use their id, other two character topics are sent as
+* short topic names.
+*
+* \param    table		Pointer to the topic table
+* \param	name		Pointer to the topic name
+* \param	length		Size of the topic name
+* \param	type		Pointer to storage for the topic id type
+* \param	id			Pointer to storage for the topic id
+*
+* \returns  true if the topic has an id.
+*/
+bool mqtt_sn_topic_resolve ( mqtt_sn_topic_t* table, const char* name, uint32_t length, uint8_t* type, uint16_t* id );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* SRC_SERVICES_MQTT_MQTT_SN_H_ */
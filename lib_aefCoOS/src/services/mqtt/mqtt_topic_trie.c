@@ -0,0 +1,373 @@
+
+/**
+* mqtt_topic_trie.c
+*
+* \copyright
+* Copyright 2017 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Implementation of the MQTT topic filter trie.
+*
+* A topic level is matched against the literal level of the same name, the
+* '+' level and the '#' level of the current node.  A '#' level also
+* matches its parent level, so "a/#" matches "a".
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_topic_trie.h"
+
+/**
+* Allocate a topic filter level.
+*
+* \param    level		Pointer to the level name
+* \param	length		Size of the level name
+*
+* \returns  Pointer to the level, NULL if out of memory.
+*/
+static mqtt_topic_node_t* mqtt_topic_node_alloc ( const char* level, uint16_t length )
+{
+	mqtt_topic_node_t* node = malloc ( sizeof(mqtt_topic_node_t) + length );
+
+	if ( node != NULL )
+	{
+		memset ( node, 0, sizeof(mqtt_topic_node_t) );
+		memcpy ( node->level, level, length );
+		node->length = length;
+	}
+	return node;
+}
+
+/**
+* Find the link to a level below a node.
+*
+* \param    node		Pointer to the parent level
+* \param	level		Pointer to the level name
+* \param	length		Size of the level name
+*
+* \returns  Pointer to the link to the level, the link is NULL if the level does not exist.
+*/
+static mqtt_topic_node_t** mqtt_topic_node_link ( mqtt_topic_node_t* node, const char* level, uint16_t length )
+{
+	mqtt_topic_node_t** link;
+
+	if ( length == 1 && level[0] == '+' )
+		return &node->plus;
+	if ( length == 1 && level[0] == '#' )
+		return &node->hash;
+
+	for ( link = &node->children; *link != NULL; link = &(*link)->sibling )
+	{
+		if ( (*link)->length == length && memcmp ( (*link)->level, level, length ) == 0 )
+			break;
+	}
+	return link;
+}
+
+/**
+* Check if a level has no handlers and no levels below it.
+*
+* \param    node		Pointer to the level
+*
+* \returns  true if the level can be released.
+*/
+static bool mqtt_topic_node_unused ( const mqtt_topic_node_t* node )
+{
+	return ( node->handlers == NULL && node->children == NULL && node->plus == NULL && node->hash == NULL );
+}
+
+/**
+* Check a topic filter.
+* Wildcards must fill a whole level and '#' must be the last level.
+*
+* \param    filter		Pointer to the NUL terminated topic filter
+*
+* \returns  true if the filter is valid.
+*/
+static bool mqtt_topic_filter_valid ( const char* filter )
+{
+	uint32_t length = strlen ( filter );
+
+	if ( length == 0 || length > UINT16_MAX )
+		return false;
+
+	for ( uint32_t index = 0; index < length; index++ )
+	{
+		if ( filter[index] == '+' || filter[index] == '#' )
+		{
+			if ( index > 0 && filter[index - 1] != '/' )
+				return false;
+			if ( index + 1 < length && ( filter[index] == '#' || filter[index + 1] != '/' ) )
+				return false;
+		}
+	}
+	return true;
+}
+
+/**
+* Add a found handler to the match result.
+*
+* \param    entry		Pointer to the first handler of a filter
+* \param	matches		Pointer to the match result
+*
+* \returns  None
+*/
+static void mqtt_topic_collect ( const mqtt_topic_entry_t* entry, mqtt_topic_matches_t* matches )
+{
+	for ( ; entry != NULL; entry = entry->next )
+	{
+		if ( matches->count < MQTT_MAX_TOPIC_MATCHES )
+			matches->match[matches->count++] = *entry;
+		else
+			matches->dropped++;
+	}
+}
+
+/**
+* Match the remaining levels of a topic below a node.
+*
+* \param    node		Pointer to the level matched so far
+* \param	topic		Pointer to the next topic level
+* \param	length		Size of the rest of the topic
+* \param	first		true for the first topic level
+* \param	matches		Pointer to the match result
+*
+* \returns  None
+*/
+static void mqtt_topic_match_level ( const mqtt_topic_node_t* node, const char* topic, uint32_t length, bool first, mqtt_topic_matches_t* matches )
+{
+	const char* separator = memchr ( topic, '/', length );
+	uint32_t level  = ( separator != NULL ) ? (uint32_t)(separator - topic) : length;
+	bool wildcards  = ! ( first && length != 0 && topic[0] == '$' );
+	const mqtt_topic_node_t* next[2] = { NULL, NULL };
+
+	/*
+	 * '#' takes this level and every level after it
+	 */
+	if ( wildcards && node->hash != NULL )
+		mqtt_topic_collect ( node->hash->handlers, matches );
+
+	for ( const mqtt_topic_node_t* child = node->children; child != NULL; child = child->sibling )
+	{
+		if ( child->length == level && memcmp ( child->level, topic, level ) == 0 )
+		{
+			next[0] = child;
+			break;
+		}
+	}
+	if ( wildcards )
+		next[1] = node->plus;
+
+	for ( uint32_t index = 0; index < 2; index++ )
+	{
+		if ( next[index] == NULL )
+			continue;
+
+		if ( separator != NULL )
+		{
+			mqtt_topic_match_level ( next[index], separator + 1, length - level - 1, false, matches );
+		}
+		else
+		{
+			mqtt_topic_collect ( next[index]->handlers, matches );
+			if ( next[index]->hash != NULL )
+				mqtt_topic_collect ( next[index]->hash->handlers, matches );
+		}
+	}
+}
+
+/**
+* Remove a handler below a node.
+*
+* \param    node		Pointer to the level matched so far
+* \param	filter		Pointer to the next filter level
+* \param	handler		Handler routine
+* \param	handlerCtx	Handler context
+*
+* \returns  true if the handler was found.
+*/
+static bool mqtt_topic_remove_level ( mqtt_topic_node_t* node, const char* filter, mqtt_topic_handler_t handler, void* handlerCtx )
+{
+	const char* separator = strchr ( filter, '/' );
+	uint16_t level = ( separator != NULL ) ? (uint16_t)(separator - filter) : (uint16_t)strlen ( filter );
+	mqtt_topic_node_t** link = mqtt_topic_node_link ( node, filter, level );
+	mqtt_topic_node_t* child = *link;
+	bool found = false;
+
+	if ( child == NULL )
+		return false;
+
+	if ( separator != NULL )
+	{
+		found = mqtt_topic_remove_level ( child, separator + 1, handler, handlerCtx );
+	}
+	else
+	{
+		for ( mqtt_topic_entry_t** entry = &child->handlers; *entry != NULL; entry = &(*entry)->next )
+		{
+			if ( (*entry)->handler == handler && (*entry)->handlerCtx == handlerCtx )
+			{
+				mqtt_topic_entry_t* release = *entry;
+				*entry = release->next;
+				free ( release );
+				found = true;
+				break;
+			}
+		}
+	}
+
+	if ( mqtt_topic_node_unused ( child ) )
+	{
+		*link = child->sibling;
+		free ( child );
+	}
+	return found;
+}
+
+/**
+* Release a level and every level below it.
+*
+* \param    node		Pointer to the level
+*
+* \returns  None
+*/
+static void mqtt_topic_free_level ( mqtt_topic_node_t* node )
+{
+	mqtt_topic_node_t* sibling;
+	mqtt_topic_entry_t* entry;
+
+	while ( node != NULL )
+	{
+		mqtt_topic_free_level ( node->children );
+		mqtt_topic_free_level ( node->plus );
+		mqtt_topic_free_level ( node->hash );
+		while ( node->handlers != NULL )
+		{
+			entry = node->handlers;
+			node->handlers = entry->next;
+			free ( entry );
+		}
+		sibling = node->sibling;
+		free ( node );
+		node = sibling;
+	}
+}
+
+/**
+* Add a handler for a topic filter.
+*
+* \param    root		Pointer to the trie root pointer
+* \param	filter		Pointer to the NUL terminated topic filter
+* \param	handler		Handler routine
+* \param	handlerCtx	Handler context
+*
+* \returns  true if successful, false if the filter is invalid or out of memory.
+*/
+bool mqtt_topic_trie_add ( mqtt_topic_node_t** root, const char* filter, mqtt_topic_handler_t handler, void* handlerCtx )
+{
+	mqtt_topic_node_t* node;
+	mqtt_topic_entry_t* entry;
+	const char* separator;
+	uint16_t level;
+
+	if ( filter == NULL || handler == NULL || ! mqtt_topic_filter_valid ( filter ) )
+		return false;
+
+	if ( *root == NULL && ( *root = mqtt_topic_node_alloc ( "", 0 ) ) == NULL )
+		return false;
+
+	/*
+	 * Levels already created are left in place if memory runs out, they are
+	 * released with the trie
+	 */
+	node = *root;
+	for ( ;; )
+	{
+		separator = strchr ( filter, '/' );
+		level     = ( separator != NULL ) ? (uint16_t)(separator - filter) : (uint16_t)strlen ( filter );
+
+		mqtt_topic_node_t** link = mqtt_topic_node_link ( node, filter, level );
+		if ( *link == NULL && ( *link = mqtt_topic_node_alloc ( filter, level ) ) == NULL )
+			return false;
+		node = *link;
+
+		if ( separator == NULL )
+			break;
+		filter = separator + 1;
+	}
+
+	entry = malloc ( sizeof(mqtt_topic_entry_t) );
+	if ( entry == NULL )
+		return false;
+
+	entry->handler    = handler;
+	entry->handlerCtx = handlerCtx;
+	entry->next       = node->handlers;
+	node->handlers    = entry;
+	return true;
+}
+
+/**
+* Remove a handler for a topic filter.
+* Levels left without handlers or children are released.
+*
+* \param    root		Pointer to the trie root pointer
+* \param	filter		Pointer to the NUL terminated topic filter
+* \param	handler		Handler routine
+* \param	handlerCtx	Handler context
+*
+* \returns  true if the handler was found.
+*/
+bool mqtt_topic_trie_remove ( mqtt_topic_node_t** root, const char* filter, mqtt_topic_handler_t handler, void* handlerCtx )
+{
+	bool found;
+
+	if ( *root == NULL || filter == NULL || ! mqtt_topic_filter_valid ( filter ) )
+		return false;
+
+	found = mqtt_topic_remove_level ( *root, filter, handler, handlerCtx );
+	if ( mqtt_topic_node_unused ( *root ) )
+	{
+		free ( *root );
+		*root = NULL;
+	}
+	return found;
+}
+
+/**
+* Find the handlers whose filters match a topic.
+* Topics starting with '$' are not matched by a leading wildcard.
+*
+* \param    root		Pointer to the trie root
+* \param	topic		Pointer to the topic, not NUL terminated
+* \param	length		Size of the topic
+* \param	matches		Pointer to storage for the handlers found
+*
+* \returns  Number of handlers found.
+*/
+uint32_t mqtt_topic_trie_match ( const mqtt_topic_node_t* root, const char* topic, uint32_t length, mqtt_topic_matches_t* matches )
+{
+	matches->count   = 0;
+	matches->dropped = 0;
+
+	if ( root != NULL && topic != NULL )
+		mqtt_topic_match_level ( root, topic, length, true, matches );
+
+	return matches->count;
+}
+
+/**
+* Release the trie.
+*
+* \param    root		Pointer to the trie root pointer
+*
+* \returns  None
+*/
+void mqtt_topic_trie_free ( mqtt_topic_node_t** root )
+{
+	mqtt_topic_free_level ( *root );
+	*root = NULL;
+}
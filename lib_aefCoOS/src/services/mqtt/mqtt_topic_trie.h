@@ -0,0 +1,115 @@
+
+/**
+* mqtt_topic_trie.h
+*
+* \copyright
+* Copyright 2017 Advanced Embedded Frameworks, LLC. All Rights Reserved.
+*
+* \author
+* Albert E. Warren Jr. (warrendev@outlook.com)
+*
+* \brief  Definition of the MQTT topic filter trie.
+*
+* Topic filters are stored one level per node, with the '+' and '#' levels
+* kept apart from the literal levels, so matching a topic visits each of
+* its levels once per matching branch instead of comparing every filter.
+* The trie does no locking, the MQTT core serializes every call.
+*/
+
+#ifndef SRC_SERVICES_MQTT_MQTT_TOPIC_TRIE_H_
+#define SRC_SERVICES_MQTT_MQTT_TOPIC_TRIE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <aef/embedded/service/mqtt/mqtt_service.h>
+
+# ifdef   __cplusplus
+extern "C" {
+# endif
+
+/**
+* Topic handler registration structure definition
+*/
+typedef struct _mqtt_topic_entry_def
+{
+	struct _mqtt_topic_entry_def* next;		// Next handler of the filter
+	mqtt_topic_handler_t handler;			// Handler routine
+	void*		 handlerCtx;				// Handler context
+} mqtt_topic_entry_t;
+
+/**
+* Topic filter level structure definition
+*/
+typedef struct _mqtt_topic_node_def
+{
+	struct _mqtt_topic_node_def* sibling;	// Next literal level under the same parent
+	struct _mqtt_topic_node_def* children;	// Literal levels below this one
+	struct _mqtt_topic_node_def* plus;		// '+' level below this one
+	struct _mqtt_topic_node_def* hash;		// '#' level below this one
+	mqtt_topic_entry_t* handlers;			// Handlers of the filter ending here
+	uint16_t	 length;					// Size of the level name
+	char		 level[];					// Level name, not NUL terminated
+} mqtt_topic_node_t;
+
+/**
+* Topic match result structure definition
+*/
+typedef struct _mqtt_topic_matches_def
+{
+	uint32_t	 count;						// Handlers found
+	uint32_t	 dropped;					// Handlers over MQTT_MAX_TOPIC_MATCHES
+	mqtt_topic_entry_t match[MQTT_MAX_TOPIC_MATCHES];	// Copies of the handlers found
+} mqtt_topic_matches_t;
+
+/**
+* Add a handler for a topic filter.
+*
+* \param    root		Pointer to the trie root pointer
+* \param	filter		Pointer to the NUL terminated topic filter
+* \param	handler		Handler routine
+* \param	handlerCtx	Handler context
+*
+* \returns  true if successful, false if the filter is invalid or out of memory.
+*/
+bool mqtt_topic_trie_add ( mqtt_topic_node_t** root, const char* filter, mqtt_topic_handler_t handler, void* handlerCtx );
+
+/**
+* Remove a handler for a topic filter.
+* Levels left without handlers or children are released.
+*
+* \param    root		Pointer to the trie root pointer
+* \param	filter		Pointer to the NUL terminated topic filter
+* \param	handler		Handler routine
+* \param	handlerCtx	Handler context
+*
+* \returns  true if the handler was found.
+*/
+bool mqtt_topic_trie_remove ( mqtt_topic_node_t** root, const char* filter, mqtt_topic_handler_t handler, void* handlerCtx );
+
+/**
+* Find the handlers whose filters match a topic.
+* Topics starting with '$' are not matched by a leading wildcard.
+*
+* \param    root		Pointer to the trie root
+* \param	topic		Pointer to the topic, not NUL terminated
+* \param	length		Size of the topic
+* \param	matches		Pointer to storage for the handlers found
+*
+* \returns  Number of handlers found.
+*/
+uint32_t mqtt_topic_trie_match ( const mqtt_topic_node_t* root, const char* topic, uint32_t length, mqtt_topic_matches_t* matches );
+
+/**
+* Release the trie.
+*
+* \param    root		Pointer to the trie root pointer
+*
+* \returns  None
+*/
+void mqtt_topic_trie_free ( mqtt_topic_node_t** root );
+
+# ifdef   __cplusplus
+} /* extern "C" */
+# endif
+
+#endif /* SRC_SERVICES_MQTT_MQTT_TOPIC_TRIE_H_ */
@@ -141,6 +141,42 @@ system_status_t system_management_func_detach (system_management_func_t func)
 	return SYSTEM_FAILURE_INVALID_PARAMETER;
 }
 
+/**
+* Detach the system management function of an instance
+* Used when one function is attached once per instance.
+*
+* \param	instance	System management function instance data
+*
+* \returns  SYSTEM_STATUS_SUCCESS if successful.
+*           SYSTEM_FAILURE_GENERAL if no function of the instance is attached.
+*           SYSTEM_FAILURE_INVALID_PARAMETER if the instance is NULL.
+*/
+system_status_t system_management_instance_detach (void* instance)
+{
+	if ( instance != NULL )
+	{
+		critical_section_acquire ( &sm_thread_cs );
+		sys_management_func_ctrl_t* func_entry = func_table;
+		for ( uint32_t index = 0; index < MAX_SYS_MANAGEMENT_FUNCS; func_entry++, index++ )
+		{
+			if ( func_entry->instance == instance )
+			{
+				func_entry->name           = NULL;
+				func_entry->instance       = NULL;
+				func_entry->func	       = NULL;
+				func_entry->interval 	   = 0;
+				func_entry->interval_count = 0;
+				func_entry->state          = SMF_STATE_DISABLED;
+				critical_section_release ( &sm_thread_cs );
+				return SYSTEM_STATUS_SUCCESS;
+			}
+		}
+		critical_section_release ( &sm_thread_cs );
+		return SYSTEM_FAILURE_GENERAL;
+	}
+	return SYSTEM_FAILURE_INVALID_PARAMETER;
+}
+
 /**
 * System management thread task
 *